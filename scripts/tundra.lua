@@ -3,9 +3,9 @@ require "strict"
 local boot    = require "tundra.boot"
 
 local actions = {
-  ['generate-dag'] = function(build_script, json_file)
+  ['generate-dag'] = function(build_script, json_file, dag_file)
     assert(build_script, "need a build script name")
-    boot.generate_dag_data(build_script, json_file)
+    boot.generate_dag_data(build_script, json_file, dag_file)
   end,
 
   ['generate-ide-files'] = function(build_script, ide_script)
@@ -7,6 +7,7 @@ local dirwalk  = require "tundra.dirwalk"
 local platform = require "tundra.platform"
 local native   = require "tundra.native"
 local njson    = require "tundra.native.json"
+local ndag     = require "tundra.native.dag"
 local path     = require "tundra.path"
 
 local dag_dag_magic = 0x15890105
@@ -120,6 +121,13 @@ local function save_scanners(w, scanners)
       w:write_string(path)
     end
     w:end_array()
+    if s.Kind == 'cpp-pp' then
+      w:begin_array('Defines')
+      for _, def in util.nil_ipairs(s.Defines) do
+        w:write_string(def)
+      end
+      w:end_array()
+    end
     -- Serialize specialized state for generic scanners
     if s.Kind == 'generic' then
       w:write_bool(s.RequireWhitespace, 'RequireWhitespace')
@@ -199,6 +207,14 @@ local function save_nodes(w, nodes, pass_to_index, scanner_to_index)
       w:write_number(scanner_to_index[node.scanner], "ScannerIndex")
     end
 
+    if node.depfile then
+      w:write_string(node.depfile, "DepFile")
+    end
+
+    if node.depfile_format then
+      w:write_string(node.depfile_format, "DepFileFormat")
+    end
+
     if node.overwrite_outputs then
       w:write_bool(true, "OverwriteOutputs")
     end
@@ -211,6 +227,10 @@ local function save_nodes(w, nodes, pass_to_index, scanner_to_index)
       w:write_bool(true, "Expensive")
     end
 
+    if node.trace_file_access then
+      w:write_bool(true, "TraceFileAccess")
+    end
+
     w:end_object()
   end
   w:end_array()
@@ -344,7 +364,9 @@ local function check_deps(nodes)
   end
 end
 
-function save_dag_data(bindings, default_variant, default_subvariant, content_digest_exts, misc_options, json_file)
+-- With a dag_file, the DAG is compiled to it directly rather than written to
+-- json_file for tundra to compile.
+function save_dag_data(bindings, default_variant, default_subvariant, content_digest_exts, misc_options, json_file, dag_file)
 
   -- Call builtin function to get at accessed file table
   local accessed_lua_files = util.table_keys(get_accessed_files())
@@ -372,7 +394,12 @@ function save_dag_data(bindings, default_variant, default_subvariant, content_di
   -- Find scanners
   local scanners, scanner_to_index = get_scanners(nodes)
 
-  local w = njson.new(json_file)
+  local w
+  if dag_file then
+    w = ndag.new(dag_file)
+  else
+    w = njson.new(json_file)
+  end
 
   w:begin_object()
   save_configs(w, bindings, default_variant, default_subvariant)
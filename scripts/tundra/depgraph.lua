@@ -94,6 +94,7 @@ function make_node(data_)
     outputs           = outputs_sorted,
     is_precious       = data_.Precious,
     expensive         = data_.Expensive,
+    trace_file_access = data_.TraceFileAccess,
     overwrite_outputs = overwrite,
     src_env           = env_,
     env               = env_.external_vars,
@@ -114,6 +115,14 @@ function make_node(data_)
     params.preaction = env_:interpolate(data_.PreAction, expand_env)
   end
 
+  if data_.DepFile then
+    params.depfile = path.normalize(env_:interpolate(data_.DepFile, expand_env_pretty))
+  end
+
+  if data_.DepFileFormat then
+    params.depfile_format = data_.DepFileFormat
+  end
+
   params.annotation = env_:interpolate(data_.Label or "?", expand_env_pretty)
 
   local result = setmetatable(params, _node_mt)
@@ -7,6 +7,7 @@ local _scanner_mt = {}
 setmetatable(_scanner_mt, { __index = _scanner_mt })
 
 local cpp_scanner_cache = {}
+local cpp_pp_scanner_cache = {}
 local generic_scanner_cache = {}
 
 function make_cpp_scanner(paths)
@@ -20,6 +21,19 @@ function make_cpp_scanner(paths)
   return cpp_scanner_cache[key]
 end
 
+-- A C/C++ scanner that evaluates simple preprocessor conditionals using the
+-- given defines ("NAME", "NAME=VALUE" or "!NAME" for known undefined names).
+function make_cpp_pp_scanner(paths, defines)
+  local key = table.concat(paths, '\0') .. '\001' .. table.concat(defines, '\0')
+
+  if not cpp_pp_scanner_cache[key] then
+    local data = { Kind = 'cpp-pp', Paths = paths, Defines = defines }
+    cpp_pp_scanner_cache[key] = setmetatable(data, _scanner_mt)
+  end
+
+  return cpp_pp_scanner_cache[key]
+end
+
 function make_generic_scanner(data)
   data.Kind = 'generic'
   local mashup = { }
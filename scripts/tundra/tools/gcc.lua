@@ -21,6 +21,8 @@ function apply(env, options)
     ["_PCH_WRITES_OBJ"] = "0",
     ["_USE_PCH_OPT"] = "-include $(_PCH_INCLUDE_PATH)",
     ["_USE_PCH"] = "",
+    ["_DEPFILE_FORMAT"] = "make",
+    ["_DEPFILE_OPT"] = "-MD -MF $(@:a.d)",
     ["CCCOM"] = "$(CC) $(_OS_CCOPTS) -c $(CPPDEFS:p-D) $(CPPPATH:f:p-I) $(CCOPTS) $(CCOPTS_$(CURRENT_VARIANT:u)) $(_USE_PCH) -o $(@) $(<)",
     ["CXXCOM"] = "$(CXX) $(_OS_CXXOPTS) -c $(CPPDEFS:p-D) $(CPPPATH:f:p-I) $(CXXOPTS) $(CXXOPTS_$(CURRENT_VARIANT:u)) $(_USE_PCH) -o $(@) $(<)",
     ["PCHCOMPILE_CC"] = "$(CC) $(_OS_CCOPTS) -x c-header -c $(CPPDEFS:p-D) $(CPPPATH:f:p-I) $(CCOPTS) $(CCOPTS_$(CURRENT_VARIANT:u)) -o $(@) $(<)",
@@ -11,6 +11,20 @@ local scanner_cache = {}
 
 function get_cpp_scanner(env, fn)
   local paths = util.map(env:get_list("CPPPATH"), function (v) return env:interpolate(v) end)
+  if env:get("CPPSCANNER_PREPROCESS", "") ~= "" then
+    -- The toolset lists the define variables its compile commands pass, so the
+    -- scanner sees the same defines as the compiler. CPPSCANNER_DEFS come last
+    -- and are taken on trust.
+    local defines = {}
+    local keys = util.map(env:get_list("_CPPDEFS_VARS"), function (v) return env:interpolate(v) end)
+    keys[#keys + 1] = "CPPSCANNER_DEFS"
+    for _, key in ipairs(keys) do
+      for _, v in ipairs(env:get_list(key, {})) do
+        defines[#defines + 1] = env:interpolate(v)
+      end
+    end
+    return scanner.make_cpp_pp_scanner(paths, defines)
+  end
   return scanner.make_cpp_scanner(paths)
 end
 
@@ -50,6 +64,21 @@ local function generic_cpp_setup(env)
       
     end
 
+    -- Let the compiler report the headers it read instead of scanning for
+    -- them, if the toolset knows how.
+    -- CPPDEPFILE=trace records every file the compiler opens instead; it is
+    -- an error on platforms that can't trace.
+    local depfile, depfile_format, trace_file_access = nil, nil, nil
+    if env:get('CPPDEPFILE', '') == 'trace' and not is_pch_source then
+      trace_file_access = true
+    elseif env:get('CPPDEPFILE', '') ~= '' and env:get('_DEPFILE_FORMAT', '') ~= '' and not is_pch_source then
+      depfile_format = env:get('_DEPFILE_FORMAT')
+      if depfile_format == 'make' then
+        depfile = object_fn .. '.d'
+      end
+      action = action .. ' $(_DEPFILE_OPT)'
+    end
+
     local custom_label = env:get('_CUSTOM_LABEL', 0)
 
     return depgraph.make_node {
@@ -60,7 +89,10 @@ local function generic_cpp_setup(env)
       InputFiles     = { fn },
       OutputFiles    = output_files,
       ImplicitInputs = implicit_inputs,
-      Scanner        = get_cpp_scanner(env, fn),
+      Scanner        = not (depfile_format or trace_file_access) and get_cpp_scanner(env, fn) or nil,
+      DepFile        = depfile,
+      DepFileFormat  = depfile_format,
+      TraceFileAccess = trace_file_access,
     }
   end
 
@@ -92,6 +124,7 @@ function apply(_outer_env, options)
     ["SHLIBSUFFIX"] = "$(HOSTSHLIBSUFFIX)",
     ["CPPPATH"] = "",
     ["CPPDEFS"] = "",
+    ["_CPPDEFS_VARS"] = { "CPPDEFS" },
     ["LIBS"] = "",
     ["LIBPATH"] = "$(OBJECTDIR)",
     ["CCOPTS"] = "",
@@ -106,5 +139,6 @@ function apply(_outer_env, options)
     ["CXXOPTS_PRODUCTION"] = "",
     ["CXXOPTS_RELEASE"] = "",
     ["SHLIBLINKSUFFIX"] = "",
+    ["CPPDEPFILE"] = "",
   }
 end
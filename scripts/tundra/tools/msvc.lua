@@ -20,11 +20,14 @@ function apply(env, options)
     ["LD"] = "link",
     ["CPPDEFS"] = "_WIN32",
     ["_CPPDEFS"] = "$(CPPDEFS:p/D) $(CPPDEFS_$(CURRENT_VARIANT:u):p/D)",
+    ["_CPPDEFS_VARS"] = { "CPPDEFS", "CPPDEFS_$(CURRENT_VARIANT:u)" },
     ["_PCH_SUPPORTED"] = "1",
     ["_PCH_SUFFIX"] = ".pch",
     ["_PCH_WRITES_OBJ"] = "1",
     ["_USE_PCH_OPT"] = "/Fp$(_PCH_FILE:b) /Yu$(_PCH_HEADER)",
     ["_USE_PCH"] = "",
+    ["_DEPFILE_FORMAT"] = "msvc",
+    ["_DEPFILE_OPT"] = "/showIncludes",
     ["_USE_PDB_CC_OPT"] = "/Zi /Fd$(_PDB_CC_FILE:b)",
     ["_USE_PDB_LINK_OPT"] = "/DEBUG /PDB:$(_PDB_LINK_FILE)",
     ["_USE_PDB_CC"] = "",
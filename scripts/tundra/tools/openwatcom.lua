@@ -44,6 +44,7 @@ function apply(env, options)
     ["CPPDEFS"] = "_WIN32",
     ["CCOPTS"] = "-wx -we",
     ["_CPPDEFS"] = "$(CPPDEFS:p-d) $(CPPDEFS_$(CURRENT_VARIANT:u):p-d)",
+    ["_CPPDEFS_VARS"] = { "CPPDEFS", "CPPDEFS_$(CURRENT_VARIANT:u)" },
     ["_USE_PCH_OPT"] = "",
     ["_USE_PCH"] = "",
     ["_CCCOM"] = "$(CC) /c @RESPONSE|@|$(_CPPDEFS) $(CPPPATH:b:p-i) $(CCOPTS) $(CCOPTS_$(CURRENT_VARIANT:u)) $(_USE_PCH) -fo=$(@:b) $(<:b)",
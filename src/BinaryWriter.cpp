@@ -9,6 +9,9 @@ struct BinarySegment
 {
   int                  m_Index;
   int64_t              m_GlobalOffset;
+  // Set once the contents have been appended to another segment.
+  int                  m_MergedInto;
+  size_t               m_MergedOffset;
   MemAllocHeap*        m_Heap;
   Buffer<uint8_t>      m_Bytes;
   Buffer<BinaryFixup>  m_Fixups;
@@ -29,6 +32,8 @@ static void BinarySegmentInit(BinarySegment* self, int index, MemAllocHeap* heap
 {
   self->m_Index        = index;
   self->m_GlobalOffset = -1;
+  self->m_MergedInto   = -1;
+  self->m_MergedOffset = 0;
   self->m_Heap         = heap;
   BufferInitWithCapacity(&self->m_Bytes, heap, 128 * 1024);
   BufferInitWithCapacity(&self->m_Fixups, heap, 4096);
@@ -62,6 +67,46 @@ void BinarySegmentWrite(BinarySegment* seg, const void* data, size_t len)
   BufferAppend(&seg->m_Bytes, seg->m_Heap, (const uint8_t*) data, len);
 }
 
+uint32_t BinarySegmentWriteDeferredPointer(BinarySegment* seg)
+{
+  BinaryLocator nowhere = { -1, 0 };
+  uint32_t handle = (uint32_t) seg->m_Fixups.m_Size;
+  BinarySegmentWritePointer(seg, nowhere);
+  return handle;
+}
+
+void BinarySegmentSetPointer(BinarySegment* seg, uint32_t handle, BinaryLocator locator)
+{
+  CHECK(handle < seg->m_Fixups.m_Size);
+  seg->m_Fixups[handle].m_Target = locator;
+}
+
+void BinarySegmentAppend(BinarySegment* self, BinarySegment* src)
+{
+  CHECK(self != src);
+  CHECK(-1 == self->m_MergedInto && -1 == src->m_MergedInto);
+
+  size_t base = self->m_Bytes.m_Size;
+
+  BufferAppend(&self->m_Bytes, self->m_Heap, src->m_Bytes.m_Storage, src->m_Bytes.m_Size);
+
+  BinaryFixup* fixups = BufferAlloc(&self->m_Fixups, self->m_Heap, src->m_Fixups.m_Size);
+  for (size_t i = 0, count = src->m_Fixups.m_Size; i < count; ++i)
+  {
+    fixups[i] = src->m_Fixups[i];
+    fixups[i].m_PointerOffset += base;
+  }
+
+  src->m_MergedInto   = self->m_Index;
+  src->m_MergedOffset = base;
+
+  // The copy is all that's needed from here on.
+  BufferDestroy(&src->m_Fixups, src->m_Heap);
+  BufferDestroy(&src->m_Bytes, src->m_Heap);
+  BufferInit(&src->m_Fixups);
+  BufferInit(&src->m_Bytes);
+}
+
 void BinarySegmentWritePointer(BinarySegment* seg, BinaryLocator locator)
 {
   BinaryFixup* fixup = BufferAlloc(&seg->m_Fixups, seg->m_Heap, 1);
@@ -78,10 +123,20 @@ static void BinarySegmentFixupPointers(BinarySegment* self, BinarySegment** segs
 
   for (auto const& fixup : self->m_Fixups)
   {
-    int64_t  target_seg_base = segs[fixup.m_Target.m_SegIndex]->m_GlobalOffset;
+    if (fixup.m_Target.m_SegIndex < 0)
+      Croak("deferred pointer was never set");
+
+    // Follow the target to wherever its segment was appended.
+    const BinarySegment* target_seg = segs[fixup.m_Target.m_SegIndex];
+    int64_t  target_offset   = int64_t(fixup.m_Target.m_Offset);
+    while (target_seg->m_MergedInto >= 0)
+    {
+      target_offset += int64_t(target_seg->m_MergedOffset);
+      target_seg     = segs[target_seg->m_MergedInto];
+    }
 
     int64_t  source_pos      = my_seg_base + fixup.m_PointerOffset;
-    int64_t  dest_pos        = target_seg_base + fixup.m_Target.m_Offset;
+    int64_t  dest_pos        = target_seg->m_GlobalOffset + target_offset;
 
     int64_t  delta           = dest_pos - source_pos;
     int32_t  delta32         = int32_t(delta);
@@ -173,6 +228,26 @@ bool BinaryWriterFlush(BinaryWriter* self, const char* out_fn)
   return success;
 }
 
+void BinaryWriterFlushToBuffer(BinaryWriter* self, Buffer<uint8_t>* out, MemAllocHeap* heap)
+{
+  BinaryWriterFinalize(self);
+
+  for (BinarySegment* seg : self->m_Segments)
+    BufferAppend(out, heap, seg->m_Bytes.m_Storage, seg->m_Bytes.m_Size);
+}
+
+void BinaryWriterReset(BinaryWriter* self)
+{
+  for (BinarySegment* seg : self->m_Segments)
+  {
+    seg->m_GlobalOffset = -1;
+    seg->m_MergedInto   = -1;
+    seg->m_MergedOffset = 0;
+    BufferClear(&seg->m_Bytes);
+    BufferClear(&seg->m_Fixups);
+  }
+}
+
 BinarySegment* BinaryWriterAddSegment(BinaryWriter* self)
 {
   BinarySegment* seg = (BinarySegment*) HeapAllocate(self->m_Heap, sizeof(BinarySegment));
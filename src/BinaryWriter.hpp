@@ -35,6 +35,18 @@ void* BinarySegmentAlloc(BinarySegment* seg, size_t len);
 void BinarySegmentWrite(BinarySegment* seg, const void* data, size_t len);
 void BinarySegmentWritePointer(BinarySegment* seg, BinaryLocator locator);
 
+// Writes a pointer whose target isn't known yet and returns a handle to set it
+// with. Every deferred pointer must be set before the writer is flushed.
+uint32_t BinarySegmentWriteDeferredPointer(BinarySegment* seg);
+void BinarySegmentSetPointer(BinarySegment* seg, uint32_t handle, BinaryLocator locator);
+
+// Moves the contents of src to the end of seg, so segments can be filled
+// independently (say, by different threads) and concatenated in a fixed order.
+// Locators into src remain valid and refer to the copy; handles to deferred
+// pointers in src do not. The contents of src must not need more alignment
+// than the end of seg has.
+void BinarySegmentAppend(BinarySegment* seg, BinarySegment* src);
+
 inline void BinarySegmentWriteUint8(BinarySegment* seg, uint8_t v)
 {
   BinarySegmentWrite(seg, &v, sizeof v);
@@ -84,6 +96,12 @@ BinarySegment* BinaryWriterAddSegment(BinaryWriter* w);
 
 bool BinaryWriterFlush(BinaryWriter* w, const char* out_fn);
 
+// Like BinaryWriterFlush(), but appends the data to out.
+void BinaryWriterFlushToBuffer(BinaryWriter* w, Buffer<uint8_t>* out, MemAllocHeap* heap);
+
+// Empties all segments so the writer can be used again, keeping their memory.
+void BinaryWriterReset(BinaryWriter* w);
+
 }
 
 #endif
@@ -17,12 +17,19 @@
 #include "NodeResultPrinting.hpp"
 #include "OutputValidation.hpp"
 #include "DigestCache.hpp"
+#include "DigestPrefetch.hpp"
 #include "SharedResources.hpp"
 #include "HumanActivityDetection.hpp"
+#include "DepFile.hpp"
 #include <stdarg.h>
+#include <algorithm>
 
 #include <stdio.h>
 
+#if ENABLED(USE_FILE_TRACING)
+#include <unistd.h>
+#endif
+
 namespace t2
 {
   namespace BuildResult
@@ -40,6 +47,7 @@ namespace t2
   {
     HeapInit(&self->m_LocalHeap);
     LinearAllocInit(&self->m_ScratchAlloc, &self->m_LocalHeap, scratch_size, "thread-local scratch");
+    BufferInit(&self->m_ScanReadBuffer);
     self->m_ThreadIndex = index;
     self->m_Queue       = queue;
     self->m_ProfilerThreadId = profiler_thread_id;
@@ -47,6 +55,7 @@ namespace t2
 
   static void ThreadStateDestroy(ThreadState* self)
   {
+    BufferDestroy(&self->m_ScanReadBuffer, &self->m_LocalHeap);
     LinearAllocDestroy(&self->m_ScratchAlloc);
     HeapDestroy(&self->m_LocalHeap);
   }
@@ -191,25 +200,25 @@ namespace t2
     return BuildProgress::kUnblocked;
   }
 
-  static bool OutputFilesDiffer(const NodeData* node_data, const NodeStateData* prev_state)
+  static bool OutputFilesDiffer(const DagPathList& outputs, const NodeStateData* prev_state)
   {
-    int file_count = node_data->m_OutputFiles.GetCount();
+    int file_count = outputs.GetCount();
 
     if (file_count != prev_state->m_OutputFiles.GetCount())
       return true;
 
     for (int i = 0; i < file_count; ++i)
     {
-      if (0 != strcmp(node_data->m_OutputFiles[i].m_Filename, prev_state->m_OutputFiles[i]))
+      if (0 != strcmp(outputs[i].m_Filename, prev_state->m_OutputFiles[i]))
         return true;
     }
 
     return false;
   }
 
-  static bool OutputFilesMissing(StatCache* stat_cache, const NodeData* node)
+  static bool OutputFilesMissing(StatCache* stat_cache, const DagPathList& outputs)
   {
-    for (const FrozenFileAndHash& f : node->m_OutputFiles)
+    for (const FrozenFileAndHash& f : outputs)
     {
       FileInfo i = StatCacheStat(stat_cache, f.m_Filename, f.m_FilenameHash);
 
@@ -318,9 +327,10 @@ namespace t2
       }
   }
 
-  static void ReportChangedInputFiles(JsonWriter* msg, const FrozenArray<NodeInputFileData>& files, const char* dependencyType, DigestCache* digest_cache, StatCache* stat_cache, const uint32_t sha_extension_hashes[], uint32_t sha_extension_hash_count, bool force_use_timestamp)
+  template <typename TFileList>
+  static void ReportChangedInputFiles(JsonWriter* msg, const TFileList& files, const char* dependencyType, DigestCache* digest_cache, StatCache* stat_cache, const uint32_t sha_extension_hashes[], uint32_t sha_extension_hash_count, bool force_use_timestamp)
   {
-    for (const NodeInputFileData& input : files)
+    for (const auto& input : files)
     {
       uint32_t filenameHash = Djb2HashPath(input.m_Filename);
 
@@ -391,14 +401,16 @@ namespace t2
       }
     }
 
-    bool explicitInputFilesListChanged = node_data->m_InputFiles.GetCount() != prev_state->m_InputFiles.GetCount();
-    for (int32_t i = 0; i < node_data->m_InputFiles.GetCount() && !explicitInputFilesListChanged; ++i)
+    DagPathList inputs(thread_state->m_Queue->m_Config.m_Paths, node_data->m_InputFiles);
+    bool explicitInputFilesListChanged = inputs.GetCount() != prev_state->m_InputFiles.GetCount();
+    for (int32_t i = 0; i < inputs.GetCount() && !explicitInputFilesListChanged; ++i)
     {
-      const char* filename = node_data->m_InputFiles[i].m_Filename;
+      const char* filename = inputs[i].m_Filename;
       const char* oldFilename = prev_state->m_InputFiles[i].m_Filename;
       explicitInputFilesListChanged |= (strcmp(filename, oldFilename) != 0);
     }
     bool force_use_timestamp = node->m_Flags & NodeData::kFlagBanContentDigestForInputs;
+    StateImplicitInputs implicit_inputs(thread_state->m_Queue->m_Config.m_ImplicitFiles, prev_state);
     if (explicitInputFilesListChanged)
     {
       JsonWriteStartObject(msg);
@@ -408,7 +420,7 @@ namespace t2
 
       JsonWriteKeyName(msg, "value");
       JsonWriteStartArray(msg);
-      for (const FrozenFileAndHash& input : node_data->m_InputFiles)
+      for (const FrozenFileAndHash& input : inputs)
         JsonWriteValueString(msg, input.m_Filename);
       JsonWriteEndArray(msg);
 
@@ -428,14 +440,14 @@ namespace t2
       // command that is different may be in response file(s).
       for (const NodeInputFileData& oldInput : prev_state->m_InputFiles)
       {
-        const FrozenFileAndHash* newInput;
-        for (newInput = node_data->m_InputFiles.begin(); newInput != node_data->m_InputFiles.end(); ++newInput)
+        DagPathList::Iterator newInput = inputs.begin();
+        for (; newInput != inputs.end(); ++newInput)
         {
           if (strcmp(newInput->m_Filename, oldInput.m_Filename) == 0)
             break;
         }
 
-        if (newInput == node_data->m_InputFiles.end())
+        if (newInput == inputs.end())
           continue;
 
         CheckAndReportChangedInputFile(msg,
@@ -457,12 +469,17 @@ namespace t2
 
     ReportChangedInputFiles(msg, prev_state->m_InputFiles, "explicit", digest_cache, stat_cache, sha_extension_hashes, sha_extension_hash_count, force_use_timestamp);
 
-    if (node_data->m_Scanner)
+    if (node_data->m_Flags & NodeData::kFlagHasDepFile)
+    {
+      // The implicit inputs are whatever the dependency file reported last time.
+      ReportChangedInputFiles(msg, implicit_inputs, "implicit", digest_cache, stat_cache, sha_extension_hashes, sha_extension_hash_count, force_use_timestamp);
+    }
+    else if (node_data->m_Scanner)
     {
       HashTable<bool, kFlagPathStrings> implicitDependencies;
       HashTableInit(&implicitDependencies, &thread_state->m_LocalHeap);
 
-      for (const FrozenFileAndHash& input : node_data->m_InputFiles)
+      for (const FrozenFileAndHash& input : inputs)
       {
         // Roll back scratch allocator between scans
         MemAllocLinearScope alloc_scope(&thread_state->m_ScratchAlloc);
@@ -473,6 +490,7 @@ namespace t2
         scan_input.m_ScratchHeap = &thread_state->m_LocalHeap;
         scan_input.m_FileName = input.m_Filename;
         scan_input.m_ScanCache = scan_cache;
+        scan_input.m_ReadBuffer = &thread_state->m_ScanReadBuffer;
 
         ScanOutput scan_output;
 
@@ -487,12 +505,12 @@ namespace t2
         }
       }
 
-      bool implicitFilesListChanged = implicitDependencies.m_RecordCount != prev_state->m_ImplicitInputFiles.GetCount();
+      bool implicitFilesListChanged = implicitDependencies.m_RecordCount != implicit_inputs.GetCount();
       if (!implicitFilesListChanged)
       {
-        for (const NodeInputFileData& implicitInput : prev_state->m_ImplicitInputFiles)
+        for (const StateFileData& implicitInput : implicit_inputs)
         {
-          bool* visited = HashTableLookup(&implicitDependencies, Djb2HashPath(implicitInput.m_Filename), implicitInput.m_Filename);
+          bool* visited = HashTableLookup(&implicitDependencies, implicitInput.m_FilenameHash, implicitInput.m_Filename);
           if (!visited)
           {
             implicitFilesListChanged = true;
@@ -525,7 +543,7 @@ namespace t2
 
         JsonWriteKeyName(msg, "oldvalue");
         JsonWriteStartArray(msg);
-        for (const NodeInputFileData& input : prev_state->m_ImplicitInputFiles)
+        for (const StateFileData& input : implicit_inputs)
           JsonWriteValueString(msg, input.m_Filename);
         JsonWriteEndArray(msg);
 
@@ -539,24 +557,17 @@ namespace t2
       if (implicitFilesListChanged)
         return;
 
-      ReportChangedInputFiles(msg, prev_state->m_ImplicitInputFiles, "implicit", digest_cache, stat_cache, sha_extension_hashes, sha_extension_hash_count, force_use_timestamp);
+      ReportChangedInputFiles(msg, implicit_inputs, "implicit", digest_cache, stat_cache, sha_extension_hashes, sha_extension_hash_count, force_use_timestamp);
     }
   }
 
-  static BuildProgress::Enum CheckInputSignature(BuildQueue* queue, ThreadState* thread_state, NodeState* node, Mutex* queue_lock)
+  static void ComputeInputSignature(BuildQueue* queue, ThreadState* thread_state, NodeState* node)
   {
-    CHECK(AllDependenciesReady(queue, node));
-
-    MutexUnlock(queue_lock);
     const NodeData* node_data = node->m_MmapData;
-
-    ProfilerScope prof_scope("CheckInputSignature", thread_state->m_ProfilerThreadId, node_data->m_Annotation);
-
     const BuildQueueConfig& config = queue->m_Config;
     StatCache* stat_cache = config.m_StatCache;
     DigestCache* digest_cache = config.m_DigestCache;
 
-
     HashState sighash;
     FILE* debug_log = (FILE*) queue->m_Config.m_FileSigningLog;
 
@@ -603,7 +614,7 @@ namespace t2
     // Roll back scratch allocator after all file scans
     MemAllocLinearScope alloc_scope(&thread_state->m_ScratchAlloc);
 
-    for (const FrozenFileAndHash& input : node_data->m_InputFiles)
+    for (const FrozenFileAndHash& input : DagPathList(config.m_Paths, node_data->m_InputFiles))
     {
       // Add path and timestamp of every direct input file.
       HashAddPath(&sighash, input.m_Filename);
@@ -611,6 +622,7 @@ namespace t2
         &sighash,
         stat_cache,
         digest_cache,
+        config.m_HelperPool,
         input.m_Filename,
         input.m_FilenameHash,
         config.m_ShaDigestExtensions,
@@ -625,6 +637,7 @@ namespace t2
         scan_input.m_ScratchHeap   = &thread_state->m_LocalHeap;
         scan_input.m_FileName      = input.m_Filename;
         scan_input.m_ScanCache     = queue->m_Config.m_ScanCache;
+        scan_input.m_ReadBuffer    = &thread_state->m_ScanReadBuffer;
 
         ScanOutput scan_output;
 
@@ -640,27 +653,49 @@ namespace t2
       }
     }
 
+    auto add_implicit_input = [&](uint32_t hash, const char* filename)
+    {
+      HashAddPath(&sighash, filename);
+      ComputeFileSignature(
+        &sighash,
+        stat_cache,
+        digest_cache,
+        config.m_HelperPool,
+        filename,
+        hash,
+        config.m_ShaDigestExtensions,
+        config.m_ShaDigestExtensionCount,
+        force_use_timestamp
+      );
+    };
+
     if (scanner)
     {
       // Add path and timestamp of every indirect input file (#includes).
       // This will walk all the implicit dependencies in hash order.
       HashSetWalk(&implicitDeps, [&](uint32_t, uint32_t hash, const char* filename)
       {
-        HashAddPath(&sighash, filename);
-        ComputeFileSignature(
-          &sighash,
-          stat_cache,
-          digest_cache,
-          filename,
-          hash,
-          config.m_ShaDigestExtensions,
-          config.m_ShaDigestExtensionCount,
-          force_use_timestamp
-        );
+        add_implicit_input(hash, filename);
       });
 
       HashSetDestroy(&implicitDeps);
     }
+    else if (node_data->m_Flags & NodeData::kFlagHasDepFile)
+    {
+      // Use the dependency file we read after running the action if there is
+      // one, otherwise the one recorded by the previous build. Both are
+      // deduplicated and sorted by hash and name, so the signature is stable.
+      if (node->m_ImplicitDeps)
+      {
+        for (int32_t i = 0; i < node->m_ImplicitDepCount; ++i)
+          add_implicit_input(Djb2HashPath(node->m_ImplicitDeps[i]), node->m_ImplicitDeps[i]);
+      }
+      else if (const NodeStateData* prev_state = node->m_MmapState)
+      {
+        for (const StateFileData& input : StateImplicitInputs(config.m_ImplicitFiles, prev_state))
+          add_implicit_input(input.m_FilenameHash, input.m_Filename);
+      }
+    }
 
     for (const FrozenString& input : node_data->m_AllowedOutputSubstrings)
       HashAddString(&sighash, (const char*)input);
@@ -678,6 +713,22 @@ namespace t2
       fprintf(debug_log, "  => %s\n", sig);
       MutexUnlock(queue->m_Config.m_FileSigningLogMutex);
     }
+  }
+
+  static BuildProgress::Enum CheckInputSignature(BuildQueue* queue, ThreadState* thread_state, NodeState* node, Mutex* queue_lock)
+  {
+    CHECK(AllDependenciesReady(queue, node));
+
+    MutexUnlock(queue_lock);
+    const NodeData* node_data = node->m_MmapData;
+
+    ProfilerScope prof_scope("CheckInputSignature", thread_state->m_ProfilerThreadId, node_data->m_Annotation);
+
+    const BuildQueueConfig& config = queue->m_Config;
+    StatCache* stat_cache = config.m_StatCache;
+    DigestCache* digest_cache = config.m_DigestCache;
+
+    ComputeInputSignature(queue, thread_state, node);
 
     // Figure out if we need to rebuild this node.
     const NodeStateData* prev_state = node->m_MmapState;
@@ -780,13 +831,13 @@ namespace t2
 
       next_state = BuildProgress::kRunAction;
     }
-    else if (OutputFilesDiffer(node_data, prev_state))
+    else if (OutputFilesDiffer(DagPathList(config.m_Paths, node_data->m_OutputFiles), prev_state))
     {
       // The output files are different - need to rebuild.
       Log(kSpam, "T=%d: building %s - output files have changed", thread_state->m_ThreadIndex, node_data->m_Annotation.Get());
       next_state = BuildProgress::kRunAction;
     }
-    else if (OutputFilesMissing(stat_cache, node_data))
+    else if (OutputFilesMissing(stat_cache, DagPathList(config.m_Paths, node_data->m_OutputFiles)))
     {
       // One or more output files are missing - need to rebuild.
       Log(kSpam, "T=%d: building %s - output files are missing", thread_state->m_ThreadIndex, node_data->m_Annotation.Get());
@@ -810,7 +861,7 @@ namespace t2
 
         JsonWriteKeyName(&msg, "files");
         JsonWriteStartArray(&msg);
-        for (auto& f : node_data->m_OutputFiles)
+        for (const FrozenFileAndHash& f : DagPathList(config.m_Paths, node_data->m_OutputFiles))
         {
           FileInfo i = StatCacheStat(stat_cache, f.m_Filename, f.m_FilenameHash);
           if (!i.Exists())
@@ -838,6 +889,29 @@ namespace t2
     return next_state;
   }
 
+  // Counts the node off against the caches it could have added to, and lets
+  // the config know when a cache won't change any more.
+  static void SignatureChecked(BuildQueue* queue, const NodeState* node, Mutex* queue_lock)
+  {
+    BuildCacheSettledFn settled = queue->m_Config.m_CacheSettled;
+
+    if (!settled)
+      return;
+
+    bool scans_done   = node->m_MmapData->m_Scanner && 0 == --queue->m_UnscannedNodeCount;
+    bool digests_done = 0 == --queue->m_UnsignedNodeCount;
+
+    if (!scans_done && !digests_done)
+      return;
+
+    MutexUnlock(queue_lock);
+    if (scans_done)
+      settled(queue->m_Config.m_CacheSettledContext, BuildCache::kScanCache);
+    if (digests_done)
+      settled(queue->m_Config.m_CacheSettledContext, BuildCache::kDigestCache);
+    MutexLock(queue_lock);
+  }
+
   struct SlowCallbackData
   {
     Mutex* queue_lock;
@@ -889,6 +963,264 @@ namespace t2
     return result;
   }
 
+  // Reads a file the action wrote into the thread's scan buffer, then deletes
+  // it so a stale one is never mistaken for the output of a later run.
+  static bool ReadAndRemoveActionFile(ThreadState* thread_state, const char* filename)
+  {
+    FILE* f = fopen(filename, "rb");
+    if (!f)
+      return false;
+
+    Buffer<char>* buffer = &thread_state->m_ScanReadBuffer;
+    BufferClear(buffer);
+
+    char chunk[4096];
+    while (size_t nbytes = fread(chunk, 1, sizeof chunk, f))
+      BufferAppend(buffer, &thread_state->m_LocalHeap, chunk, nbytes);
+
+    fclose(f);
+    remove(filename);
+    return true;
+  }
+
+  // Returns false if the action didn't write the file.
+  static bool ReadDepFile(ThreadState* thread_state, const char* filename, bool msvc_format, const DepFileEntry** deps_out)
+  {
+    if (!ReadAndRemoveActionFile(thread_state, filename))
+    {
+      Log(kWarning, "dependency file %s was not written; the node will run again next build", filename);
+      return false;
+    }
+
+    Buffer<char>* buffer = &thread_state->m_ScanReadBuffer;
+    if (msvc_format)
+      *deps_out = ParseMsvcIncludes(buffer->m_Storage, buffer->m_Size, &thread_state->m_ScratchAlloc);
+    else
+      *deps_out = ParseMakeDepFile(buffer->m_Storage, buffer->m_Size, &thread_state->m_ScratchAlloc);
+    return true;
+  }
+
+  // Replaces the node's implicit inputs with the ones the action reported.
+  // Paths are cleaned up like DAG paths, deduplicated and sorted by hash and
+  // name, the order the state file keeps them in; the node's own inputs are
+  // dropped since they are hashed anyway.
+  static void StoreImplicitDeps(BuildQueue* queue, ThreadState* thread_state, NodeState* node, const DepFileEntry* deps)
+  {
+    const NodeData* node_data = node->m_MmapData;
+    MemAllocLinear* scratch = &thread_state->m_ScratchAlloc;
+
+    HashSet<kFlagPathStrings> seen;
+    HashSetInit(&seen, &thread_state->m_LocalHeap);
+    HashTablePrepareBulkInsert(&seen, node_data->m_InputFiles.GetCount());
+
+    for (const FrozenFileAndHash& input : DagPathList(queue->m_Config.m_Paths, node_data->m_InputFiles))
+      HashSetInsert(&seen, input.m_FilenameHash, input.m_Filename);
+
+    int32_t dep_count = 0;
+    for (const DepFileEntry* dep = deps; dep; dep = dep->m_Next)
+      ++dep_count;
+
+    FileAndHash* files = LinearAllocateArray<FileAndHash>(scratch, dep_count);
+    int32_t count = 0;
+    size_t string_bytes = 0;
+
+    for (const DepFileEntry* dep = deps; dep; dep = dep->m_Next)
+    {
+      PathBuffer pathbuf;
+      PathInit(&pathbuf, dep->m_Path);
+
+      char cleaned_path[kMaxPathLength];
+      PathFormat(cleaned_path, &pathbuf);
+
+      uint32_t hash = Djb2HashPath(cleaned_path);
+      if (HashSetLookup(&seen, hash, cleaned_path))
+        continue;
+
+      FileAndHash& file = files[count++];
+      file.m_Filename = StrDup(scratch, cleaned_path);
+      file.m_FilenameHash = hash;
+      HashSetInsert(&seen, hash, file.m_Filename);
+      string_bytes += strlen(cleaned_path) + 1;
+    }
+
+    HashSetDestroy(&seen);
+
+    std::sort(files, files + count, [](const FileAndHash& l, const FileAndHash& r) {
+      if (l.m_FilenameHash != r.m_FilenameHash)
+        return l.m_FilenameHash < r.m_FilenameHash;
+      return strcmp(l.m_Filename, r.m_Filename) < 0;
+    });
+
+    // Pointers and string data share one block so the node state owns a single allocation.
+    MemAllocHeap* heap = queue->m_Config.m_Heap;
+    const char** paths = (const char**) HeapAllocate(heap, sizeof(const char*) * count + string_bytes);
+    char* strings = (char*) (paths + count);
+
+    for (int32_t i = 0; i < count; ++i)
+    {
+      size_t len = strlen(files[i].m_Filename) + 1;
+      memcpy(strings, files[i].m_Filename, len);
+      paths[i] = strings;
+      strings += len;
+    }
+
+    HeapFree(heap, node->m_ImplicitDeps);
+    node->m_ImplicitDeps = paths;
+    node->m_ImplicitDepCount = count;
+  }
+
+#if ENABLED(USE_FILE_TRACING)
+  // The shim is installed next to the tundra2 executable.
+  static const char* GetTraceShimPath()
+  {
+    static char s_ShimPath[kMaxPathLength];
+    // Function-local static initialization is thread safe; build threads can race here.
+    static const bool s_Initialized = []() {
+      strncpy(s_ShimPath, GetExePath(), sizeof s_ShimPath - 1);
+      char* slash = strrchr(s_ShimPath, '/');
+      char* name = slash ? slash + 1 : s_ShimPath;
+      strncpy(name, "t2-trace.so", size_t(s_ShimPath + sizeof s_ShimPath - 1 - name));
+      return true;
+    }();
+    (void) s_Initialized;
+    return s_ShimPath;
+  }
+
+  // Appends the trace variables to the node's environment. LD_PRELOAD keeps
+  // whatever the user already had preloaded.
+  static int SetupFileTraceEnv(EnvVariable* env_vars, int env_count, const char* trace_file, char* preload, size_t preload_size)
+  {
+    const char* shim = GetTraceShimPath();
+    const char* old_preload = getenv("LD_PRELOAD");
+    for (int i = 0; i < env_count; ++i)
+    {
+      if (0 == strcmp(env_vars[i].m_Name, "LD_PRELOAD"))
+        old_preload = env_vars[i].m_Value;
+    }
+
+    if (old_preload && old_preload[0])
+      snprintf(preload, preload_size, "%s:%s", shim, old_preload);
+    else
+      snprintf(preload, preload_size, "%s", shim);
+
+    env_vars[env_count].m_Name  = "TUNDRA_TRACE_FILE";
+    env_vars[env_count].m_Value = trace_file;
+    env_vars[env_count + 1].m_Name  = "LD_PRELOAD";
+    env_vars[env_count + 1].m_Value = preload;
+    return env_count + 2;
+  }
+
+  static bool IsNodeOutput(const FrozenFileAndHash* paths, const NodeData* node_data, uint32_t hash, const char* path)
+  {
+    for (const FrozenFileAndHash& output : DagPathList(paths, node_data->m_OutputFiles))
+      if (output.m_FilenameHash == hash && 0 == strcmp(output.m_Filename, path))
+        return true;
+    for (const FrozenFileAndHash& output : DagPathList(paths, node_data->m_AuxOutputFiles))
+      if (output.m_FilenameHash == hash && 0 == strcmp(output.m_Filename, path))
+        return true;
+    return false;
+  }
+
+  // Turns absolute paths under the build root into the relative form used in
+  // the DAG, and cleans them up the same way.
+  static const char* MakeTracePathRelative(MemAllocLinear* scratch, const char* path, const char* cwd, size_t cwd_len)
+  {
+    if (0 == strncmp(path, cwd, cwd_len) && path[cwd_len] == '/')
+      path += cwd_len + 1;
+
+    PathBuffer pathbuf;
+    PathInit(&pathbuf, path);
+    char cleaned_path[kMaxPathLength];
+    PathFormat(cleaned_path, &pathbuf);
+    return StrDup(scratch, cleaned_path);
+  }
+
+  // Returns the files a traced action read, followed by the paths it looked
+  // for without finding them. Directories, files read that no longer exist and
+  // the node's own outputs are dropped. Files the action wrote in the build
+  // root without declaring them as outputs are reported.
+  // Returns false if nothing was traced.
+  static bool ReadFileTrace(ThreadState* thread_state, const NodeData* node_data, const char* trace_file, const DepFileEntry** deps_out)
+  {
+    if (!ReadAndRemoveActionFile(thread_state, trace_file))
+    {
+      Log(kWarning, "%s: no file accesses were traced; statically linked tools can't be traced", node_data->m_Annotation.Get());
+      return false;
+    }
+
+    BuildQueue* queue = thread_state->m_Queue;
+    MemAllocLinear* scratch = &thread_state->m_ScratchAlloc;
+    Buffer<char>* buffer = &thread_state->m_ScanReadBuffer;
+
+    char cwd[kMaxPathLength];
+    GetCwd(cwd, sizeof cwd);
+    size_t cwd_len = strlen(cwd);
+
+    DepFileEntry* writes = nullptr;
+    DepFileEntry* misses = nullptr;
+    DepFileEntry* reads = ParseFileTrace(buffer->m_Storage, buffer->m_Size, scratch, &writes, &misses);
+
+    for (const DepFileEntry* entry = writes; entry; entry = entry->m_Next)
+    {
+      if (entry->m_Path[0] == '/' && 0 != strncmp(entry->m_Path, cwd, cwd_len))
+        continue;
+
+      const char* path = MakeTracePathRelative(scratch, entry->m_Path, cwd, cwd_len);
+      uint32_t hash = Djb2HashPath(path);
+      if (IsNodeOutput(queue->m_Config.m_Paths, node_data, hash, path))
+        continue;
+
+      FileInfo info = StatCacheStat(queue->m_Config.m_StatCache, path, hash);
+      if (info.IsFile())
+        Log(kWarning, "%s: action wrote undeclared output %s", node_data->m_Annotation.Get(), path);
+    }
+
+    DepFileEntry* head = nullptr;
+    DepFileEntry** tail = &head;
+    for (DepFileEntry* entry = reads; entry; entry = entry->m_Next)
+    {
+      const char* path = MakeTracePathRelative(scratch, entry->m_Path, cwd, cwd_len);
+      uint32_t hash = Djb2HashPath(path);
+      if (IsNodeOutput(queue->m_Config.m_Paths, node_data, hash, path))
+        continue;
+
+      FileInfo info = StatCacheStat(queue->m_Config.m_StatCache, path, hash);
+      if (!info.IsFile())
+        continue;
+
+      DepFileEntry* dep = LinearAllocate<DepFileEntry>(scratch);
+      dep->m_Path = path;
+      dep->m_Next = nullptr;
+      *tail = dep;
+      tail = &dep->m_Next;
+    }
+
+    // Paths a search didn't find are kept as inputs that don't exist, so the
+    // action runs again when one of them appears, e.g. a header or library
+    // added to an earlier -I or -L directory.
+    for (DepFileEntry* entry = misses; entry; entry = entry->m_Next)
+    {
+      const char* path = MakeTracePathRelative(scratch, entry->m_Path, cwd, cwd_len);
+      uint32_t hash = Djb2HashPath(path);
+      if (IsNodeOutput(queue->m_Config.m_Paths, node_data, hash, path))
+        continue;
+
+      FileInfo info = StatCacheStat(queue->m_Config.m_StatCache, path, hash);
+      if (info.Exists())
+        continue;
+
+      DepFileEntry* dep = LinearAllocate<DepFileEntry>(scratch);
+      dep->m_Path = path;
+      dep->m_Next = nullptr;
+      *tail = dep;
+      tail = &dep->m_Next;
+    }
+
+    *deps_out = head;
+    return true;
+  }
+#endif
+
   static BuildProgress::Enum RunAction(BuildQueue* queue, ThreadState* thread_state, NodeState* node, Mutex* queue_lock)
   {
     const NodeData    *node_data    = node->m_MmapData;
@@ -896,6 +1228,7 @@ namespace t2
     const bool        dry_run       = (queue->m_Config.m_Flags & BuildQueueConfig::kFlagDryRun) != 0;
     const char        *cmd_line     = node_data->m_Action;
     const char        *pre_cmd_line = node_data->m_PreAction;
+    const DagPathList outputs(queue->m_Config.m_Paths, node_data->m_OutputFiles);
 
     if (!isWriteFileAction && (!cmd_line || cmd_line[0] == '\0'))
     {
@@ -916,6 +1249,10 @@ namespace t2
       }
     }
 
+    // Actions get the CPU and disk from here on.
+    if (queue->m_Config.m_DigestPrefetch)
+      DigestPrefetchYield(queue->m_Config.m_DigestPrefetch);
+
     MutexUnlock(queue_lock);
 
     StatCache         *stat_cache   = queue->m_Config.m_StatCache;
@@ -958,11 +1295,11 @@ namespace t2
           return true;
       };
 
-      for (const FrozenFileAndHash& output_file : node_data->m_OutputFiles)
+      for (const FrozenFileAndHash& output_file : outputs)
         if (!EnsureParentDirExistsFor(output_file))
           return BuildProgress::kFailed;
 
-      for (const FrozenFileAndHash& output_file : node_data->m_AuxOutputFiles)
+      for (const FrozenFileAndHash& output_file : DagPathList(queue->m_Config.m_Paths, node_data->m_AuxOutputFiles))
         if (!EnsureParentDirExistsFor(output_file))
           return BuildProgress::kFailed;
     }
@@ -972,7 +1309,7 @@ namespace t2
     // See if we need to remove the output files before running anything.
     if (0 == (node_data->m_Flags & NodeData::kFlagOverwriteOutputs) && !dry_run)
     {
-      for (const FrozenFileAndHash& output : node_data->m_OutputFiles)
+      for (const FrozenFileAndHash& output : outputs)
       {
         Log(kDebug, "Removing output file %s before running action", output.m_Filename.Get());
         remove(output.m_Filename);
@@ -980,6 +1317,29 @@ namespace t2
       }
     }
 
+    // Never pick up a dependency file left behind by an earlier, interrupted run.
+    if (node_data->m_DepFile && !dry_run)
+      remove(node_data->m_DepFile);
+
+    // Traced actions get their own environment with the shim preloaded.
+    int                action_env_count = env_count;
+    EnvVariable*       action_env_vars  = env_vars;
+#if ENABLED(USE_FILE_TRACING)
+    const bool         trace_files = (node_data->m_Flags & NodeData::kFlagTraceFileAccess) && !dry_run;
+    char               trace_file[kMaxPathLength];
+    char               trace_preload[kMaxPathLength * 2];
+    if (trace_files)
+    {
+      const char* tmpdir = getenv("TMPDIR");
+      snprintf(trace_file, sizeof trace_file, "%s/t2-trace-%d-%d", tmpdir && tmpdir[0] ? tmpdir : "/tmp", (int) getpid(), job_id);
+      remove(trace_file);
+
+      action_env_vars = (EnvVariable*) alloca((env_count + 2) * sizeof(EnvVariable));
+      memcpy(action_env_vars, env_vars, env_count * sizeof(EnvVariable));
+      action_env_count = SetupFileTraceEnv(action_env_vars, env_count, trace_file, trace_preload, sizeof trace_preload);
+    }
+#endif
+
     uint64_t time_of_start = TimerGet();
 
     SlowCallbackData slowCallbackData;
@@ -990,6 +1350,8 @@ namespace t2
 
     size_t n_outputs = (size_t)node_data->m_OutputFiles.GetCount();
 
+    MemAllocLinearScope alloc_scope(&thread_state->m_ScratchAlloc);
+
     bool* untouched_outputs = (bool*)LinearAllocate(&thread_state->m_ScratchAlloc, n_outputs, (size_t)sizeof(bool));
     memset(untouched_outputs, 0, n_outputs * sizeof(bool));
 
@@ -1007,6 +1369,7 @@ namespace t2
     }
 
     ValidationResult passedOutputValidation = ValidationResult::Pass;
+    DepFileEntry* msvc_includes = nullptr;
     if (0 == result.m_ReturnCode)
     {
       Log(kSpam, "Launching process");
@@ -1021,16 +1384,27 @@ namespace t2
         if (!allowUnwrittenOutputFiles)
           for (int i = 0; i < n_outputs; i++)
           {
-            FileInfo info = GetFileInfo(node_data->m_OutputFiles[i].m_Filename);
-            pre_timestamps[i] = info.m_Timestamp;
+            FileInfo info = GetFileInfo(outputs[i].m_Filename);
+            pre_timestamps[i] = info.m_MtimeNs;
           }
 
         if (isWriteFileAction)
-          result = WriteTextFile(node_data->m_Action, node_data->m_OutputFiles[0].m_Filename, thread_state->m_Queue->m_Config.m_Heap);
+          result = WriteTextFile(node_data->m_Action, outputs[0].m_Filename, thread_state->m_Queue->m_Config.m_Heap);
         else
         {
           last_cmd_line = cmd_line;
-          result = ExecuteProcess(cmd_line, env_count, env_vars, thread_state->m_Queue->m_Config.m_Heap, job_id, false, SlowCallback, &slowCallbackData);
+          result = ExecuteProcess(cmd_line, action_env_count, action_env_vars, thread_state->m_Queue->m_Config.m_Heap, job_id, false, SlowCallback, &slowCallbackData);
+
+          // /showIncludes lines are dependency information, not output to show or validate.
+          OutputBufferData* output = &result.m_OutputBuffer;
+          if ((node_data->m_Flags & NodeData::kFlagDepFileMsvc) && !node_data->m_DepFile && output->buffer)
+          {
+            msvc_includes = ParseMsvcIncludes(output->buffer, output->cursor, &thread_state->m_ScratchAlloc);
+            output->cursor = (int) StripMsvcIncludes(output->buffer, output->cursor);
+            if (size_t(output->cursor) < output->buffer_size)
+              output->buffer[output->cursor] = 0;
+          }
+
           passedOutputValidation = ValidateExecResultAgainstAllowedOutput(&result, node_data);
         }
 
@@ -1038,8 +1412,8 @@ namespace t2
         {
           for (int i = 0; i < n_outputs; i++)
           {
-            FileInfo info = GetFileInfo(node_data->m_OutputFiles[i].m_Filename);
-            bool untouched = pre_timestamps[i] == info.m_Timestamp;
+            FileInfo info = GetFileInfo(outputs[i].m_Filename);
+            bool untouched = pre_timestamps[i] == info.m_MtimeNs;
             untouched_outputs[i] = untouched;
             if (untouched)
               passedOutputValidation = ValidationResult::UnwrittenOutputFileFail;
@@ -1051,11 +1425,45 @@ namespace t2
       }
     }
 
-    for (const FrozenFileAndHash& output : node_data->m_OutputFiles)
+    for (const FrozenFileAndHash& output : outputs)
     {
       StatCacheMarkDirty(stat_cache, output.m_Filename, output.m_FilenameHash);
     }
 
+    if ((node_data->m_Flags & NodeData::kFlagHasDepFile) && !dry_run &&
+        0 == result.m_ReturnCode && passedOutputValidation < ValidationResult::UnexpectedConsoleOutputFail)
+    {
+      const bool msvc_format = 0 != (node_data->m_Flags & NodeData::kFlagDepFileMsvc);
+      const DepFileEntry* deps = msvc_includes;
+      bool have_deps = true;
+      if (node_data->m_DepFile)
+        have_deps = ReadDepFile(thread_state, node_data->m_DepFile, msvc_format, &deps);
+#if ENABLED(USE_FILE_TRACING)
+      if (trace_files)
+        have_deps = ReadFileTrace(thread_state, node_data, trace_file, &deps);
+#endif
+      if (have_deps)
+      {
+        StoreImplicitDeps(queue, thread_state, node, deps);
+
+        // The signature computed before the build used the previous build's
+        // dependencies. Recompute it so the next build compares like with like.
+        ComputeInputSignature(queue, thread_state, node);
+      }
+      else
+      {
+        // Nothing says which files the action read. The previous build's
+        // implicit inputs are kept, and a signature no build computes makes
+        // sure the action runs again.
+        memset(&node->m_InputSignature, 0, sizeof node->m_InputSignature);
+      }
+    }
+
+#if ENABLED(USE_FILE_TRACING)
+    if (trace_files)
+      remove(trace_file);
+#endif
+
     MutexLock(queue_lock);
     PrintNodeResult(&result, node_data, last_cmd_line, thread_state->m_Queue, echo_cmdline, time_of_start, passedOutputValidation, untouched_outputs);
     ExecResultFreeMemory(&result);
@@ -1076,7 +1484,7 @@ namespace t2
       if (0 == (NodeData::kFlagPreciousOutputs & node_data->m_Flags) &&
         !(0 == result.m_ReturnCode && passedOutputValidation == ValidationResult::UnwrittenOutputFileFail))
       {
-        for (const FrozenFileAndHash& output : node_data->m_OutputFiles)
+        for (const FrozenFileAndHash& output : outputs)
         {
           Log(kDebug, "Removing output file %s from failed build", output.m_Filename.Get());
           remove(output.m_Filename);
@@ -1171,6 +1579,7 @@ namespace t2
 
         case BuildProgress::kUnblocked:
           node->m_Progress = CheckInputSignature(queue, thread_state, node, queue_lock);
+          SignatureChecked(queue, node, queue_lock);
           break;
 
         case BuildProgress::kRunAction:
@@ -1193,6 +1602,14 @@ namespace t2
             // anything is waiting.
             UnparkExpensiveNode(queue);
           }
+
+          if (queue->m_Config.m_NodeFinished)
+          {
+            node->m_BuildResult = BuildProgress::kSucceeded == node->m_Progress ? 0 : 1;
+            MutexUnlock(queue_lock);
+            queue->m_Config.m_NodeFinished(queue->m_Config.m_NodeFinishedContext, node);
+            MutexLock(queue_lock);
+          }
           break;
 
         case BuildProgress::kUpToDate:
@@ -1379,12 +1796,20 @@ namespace t2
     queue->m_PendingNodeCount   = 0;
     queue->m_FailedNodeCount    = 0;
     queue->m_ProcessedNodeCount = 0;
+    queue->m_UnscannedNodeCount = 0;
+    queue->m_UnsignedNodeCount  = config->m_MaxNodes;
     queue->m_MainThreadWantsToCleanUp = false;
     queue->m_BuildFinishedConditionalVariableSignaled = false;
     queue->m_ExpensiveRunning   = 0;
     queue->m_ExpensiveWaitCount = 0;
     queue->m_ExpensiveWaitList  = HeapAllocateArray<NodeState*>(heap, capacity);
     queue->m_SharedResourcesCreated = HeapAllocateArrayZeroed<uint32_t>(heap, config->m_SharedResourcesCount);
+
+    for (int i = 0; i < config->m_MaxNodes; ++i)
+    {
+      if (config->m_NodeState[i].m_MmapData->m_Scanner)
+        queue->m_UnscannedNodeCount++;
+    }
     MutexInit(&queue->m_SharedResourcesLock);
     
  
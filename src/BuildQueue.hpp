@@ -9,15 +9,38 @@
 #include "MemAllocHeap.hpp"
 #include "JsonWriter.hpp"
 #include "DagData.hpp"
+#include "Buffer.hpp"
 
 namespace t2
 {
   struct MemAllocHeap;
   struct NodeState;
   struct NodeData;
+  struct FrozenFileAndHash;
+  struct StateFileData;
   struct ScanCache;
   struct StatCache;
   struct DigestCache;
+  struct HelperPool;
+  struct DigestPrefetch;
+
+  // Called on a build thread, without the queue lock, when a node has run its
+  // action and its m_BuildResult is set.
+  typedef void (*BuildNodeFinishedFn)(void* context, const NodeState* node);
+
+  namespace BuildCache
+  {
+    enum Enum
+    {
+      kScanCache   = 0,
+      kDigestCache = 1
+    };
+  }
+
+  // Called on a build thread, without the queue lock, once every node that
+  // uses the cache has checked its input signature, so the build won't add
+  // anything more to it. Not called if the build stops before that.
+  typedef void (*BuildCacheSettledFn)(void* context, BuildCache::Enum cache);
 
   enum
   {
@@ -43,12 +66,16 @@ namespace t2
     int             m_ThreadCount;
     int             m_ThrottleInactivityPeriod;
     const NodeData *m_NodeData;
+    const FrozenFileAndHash* m_Paths;
     NodeState      *m_NodeState;
+    const StateFileData* m_ImplicitFiles;
     int             m_MaxNodes;
     const int32_t  *m_NodeRemappingTable;
     ScanCache      *m_ScanCache;
     StatCache      *m_StatCache;
     DigestCache    *m_DigestCache;
+    HelperPool     *m_HelperPool;
+    DigestPrefetch *m_DigestPrefetch;
     int             m_ShaDigestExtensionCount;
     const uint32_t* m_ShaDigestExtensions;
     void*           m_FileSigningLog;
@@ -58,6 +85,10 @@ namespace t2
     int             m_SharedResourcesCount;
     bool            m_ThrottleOnHumanActivity;
     int             m_ThrottledThreadsAmount;
+    BuildNodeFinishedFn m_NodeFinished;
+    void*           m_NodeFinishedContext;
+    BuildCacheSettledFn m_CacheSettled;
+    void*           m_CacheSettledContext;
   };
 
   struct BuildQueue;
@@ -66,6 +97,7 @@ namespace t2
   {
     MemAllocHeap      m_LocalHeap;
     MemAllocLinear    m_ScratchAlloc;
+    Buffer<char>      m_ScanReadBuffer;
     int               m_ThreadIndex;
     int               m_ProfilerThreadId;
     BuildQueue*       m_Queue;
@@ -89,6 +121,9 @@ namespace t2
     int32_t            m_FailedNodeCount;
     uint32_t            m_ProcessedNodeCount;
     int32_t            m_CurrentPassIndex;
+    // Nodes in all passes that have yet to check their input signature.
+    int32_t            m_UnscannedNodeCount;
+    int32_t            m_UnsignedNodeCount;
     ThreadId           m_Threads[kMaxBuildThreads];
     ThreadState        m_ThreadState[kMaxBuildThreads];
     int32_t            m_ExpensiveRunning;
@@ -31,6 +31,11 @@
 #include <ctype.h>
 #endif
 
+#if ENABLED(USE_AVX2) && defined(_MSC_VER)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
 #if defined(TUNDRA_APPLE)
 #include <mach-o/dyld.h>
 #endif
@@ -445,6 +450,33 @@ int CountTrailingZeroes(uint32_t v)
   return bit_index;
 }
 
+bool CpuHasAvx2()
+{
+#if ENABLED(USE_AVX2) && defined(_MSC_VER)
+  static const bool s_HasAvx2 = []() -> bool
+  {
+    int regs[4];
+    __cpuid(regs, 0);
+    if (regs[0] < 7)
+      return false;
+    __cpuid(regs, 1);
+    // Require OSXSAVE + AVX, then check that the OS saves YMM state.
+    if ((regs[2] & (1 << 27)) == 0 || (regs[2] & (1 << 28)) == 0)
+      return false;
+    if ((_xgetbv(0) & 6) != 6)
+      return false;
+    __cpuidex(regs, 7, 0);
+    return 0 != (regs[1] & (1 << 5));
+  }();
+  return s_HasAvx2;
+#elif ENABLED(USE_AVX2)
+  static const bool s_HasAvx2 = 0 != __builtin_cpu_supports("avx2");
+  return s_HasAvx2;
+#else
+  return false;
+#endif
+}
+
 bool RemoveFileOrDir(const char* path)
 {
 #if defined(TUNDRA_UNIX)
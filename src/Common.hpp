@@ -151,6 +151,9 @@ int GetCpuCount();
 
 int CountTrailingZeroes(uint32_t word);
 
+// Returns true if the CPU and OS support AVX2 code paths.
+bool CpuHasAvx2();
+
 #if ENABLED(USE_LITTLE_ENDIAN)
 
 inline uint32_t LoadBigEndian32(uint32_t v)
@@ -10,8 +10,12 @@
 
 // Set up build features
 
+// Exactly one hash backend must be enabled. BLAKE3 is SIMD accelerated and can
+// digest large files on several threads, but is slower than the fast hash on
+// the short inputs that make up most signatures.
 #define USE_SHA1_HASH NO
 #define USE_FAST_HASH YES
+#define USE_BLAKE3_HASH NO
 
 #if defined(_DEBUG)
 #define CHECKED_BUILD YES
@@ -42,6 +46,27 @@
 #error add endian detection here
 #endif
 
+// SIMD code paths. SSE2 is always available on x86-64 and is used statically;
+// AVX2 paths are compiled in where the compiler can target them per-function
+// and are selected at runtime with CpuHasAvx2().
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2 YES
+#else
+#define USE_SSE2 NO
+#endif
+
+#if ENABLED(USE_SSE2) && (defined(_MSC_VER) || (defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))))
+#define USE_AVX2 YES
+#else
+#define USE_AVX2 NO
+#endif
+
+#if defined(__GNUC__)
+#define TARGET_AVX2 __attribute__((target("avx2")))
+#else
+#define TARGET_AVX2
+#endif
+
 #if defined(__APPLE__)
 #define TUNDRA_UNIX 1
 #define TUNDRA_APPLE 1
@@ -117,4 +142,11 @@
 #define USE_VALGRIND NO
 #endif
 
+// Actions marked TraceFileAccess run under the t2-trace.so LD_PRELOAD shim.
+#if defined(TUNDRA_LINUX)
+#define USE_FILE_TRACING YES
+#else
+#define USE_FILE_TRACING NO
+#endif
+
 #endif
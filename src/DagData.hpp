@@ -13,8 +13,9 @@ namespace ScannerType
 {
   enum Enum
   {
-    kCpp     = 0,
-    kGeneric = 1
+    kCpp             = 0,
+    kGeneric         = 1,
+    kCppPreprocessor = 2
   };
 }
 
@@ -46,6 +47,13 @@ struct GenericScannerData : ScannerData
   FrozenArray<KeywordData> m_Keywords;
 };
 
+// C/C++ scanner that evaluates simple conditionals. Each define is "NAME",
+// "NAME=VALUE" or "!NAME" for a name known to be undefined.
+struct CppPreprocessorScannerData : ScannerData
+{
+  FrozenArray<FrozenString> m_Defines;
+};
+
 struct NamedNodeData
 {
   FrozenString m_Name;
@@ -62,14 +70,29 @@ struct BuildTupleData
   FrozenArray<NamedNodeData> m_NamedNodes;
 };
 
+// A frontend file. Only a file whose timestamp moved has its contents
+// digested and compared, so touching or checking out an unchanged file
+// doesn't rerun the frontend. A zero timestamp means the file was modified
+// too close to DAG generation to be trusted, and is always compared.
 struct DagFileSignature
 {
   FrozenString      m_Path;
   uint8_t           m_Padding[4];
   uint64_t          m_Timestamp;
+  HashDigest        m_Digest;
 };
 static_assert(offsetof(DagFileSignature, m_Timestamp) == 8, "struct layout");
-static_assert(sizeof(DagFileSignature) == 16, "struct layout");
+static_assert(offsetof(DagFileSignature, m_Digest) == 16, "struct layout");
+
+// A directory visited by a glob. Its listing only needs to be checked again
+// if the mtime changed; zero means it must always be checked.
+struct DagGlobDirectory
+{
+  uint64_t          m_MtimeNs;
+  FrozenString      m_Path;
+  HashDigest        m_Digest;
+};
+static_assert(sizeof(DagGlobDirectory) == 32, "struct layout");
 
 struct DagGlobSignature
 {
@@ -77,8 +100,9 @@ struct DagGlobSignature
   FrozenString      m_Filter;
   HashDigest        m_Digest;
   uint32_t          m_Recurse;
+  FrozenArray<DagGlobDirectory> m_Directories;
 };
-static_assert(sizeof(HashDigest) + sizeof(FrozenString) + sizeof(FrozenString) + sizeof(uint32_t) == sizeof(DagGlobSignature), "struct layout");
+static_assert(sizeof(HashDigest) + sizeof(FrozenString) + sizeof(FrozenString) + sizeof(uint32_t) + sizeof(FrozenArray<DagGlobDirectory>) == sizeof(DagGlobSignature), "struct layout");
 
 struct EnvVarData
 {
@@ -86,6 +110,52 @@ struct EnvVarData
   FrozenString m_Value;
 };
 
+// Files of a node, as indices into DagData::m_Paths. Indexing and iterating
+// give the paths themselves.
+class DagPathList
+{
+public:
+  class Iterator
+  {
+  public:
+    Iterator(const FrozenFileAndHash* paths, const uint32_t* pos) : m_Paths(paths), m_Pos(pos) {}
+
+    const FrozenFileAndHash& operator*() const { return m_Paths[*m_Pos]; }
+    const FrozenFileAndHash* operator->() const { return &m_Paths[*m_Pos]; }
+    Iterator& operator++() { ++m_Pos; return *this; }
+    bool operator==(const Iterator& other) const { return m_Pos == other.m_Pos; }
+    bool operator!=(const Iterator& other) const { return m_Pos != other.m_Pos; }
+
+  private:
+    const FrozenFileAndHash* m_Paths;
+    const uint32_t*          m_Pos;
+  };
+
+  DagPathList(const FrozenFileAndHash* paths, const FrozenArray<uint32_t>& ids)
+    : m_Paths(paths), m_Ids(ids.GetArray()), m_Count(ids.GetCount())
+  {
+  }
+
+  int32_t GetCount() const { return m_Count; }
+
+  // Index of the path in DagData::m_Paths. Equal paths have equal ids.
+  uint32_t GetId(int32_t index) const
+  {
+    CHECK(uint32_t(index) < uint32_t(m_Count));
+    return m_Ids[index];
+  }
+
+  const FrozenFileAndHash& operator[](int32_t index) const { return m_Paths[GetId(index)]; }
+
+  Iterator begin() const { return Iterator(m_Paths, m_Ids); }
+  Iterator end() const { return Iterator(m_Paths, m_Ids + m_Count); }
+
+private:
+  const FrozenFileAndHash* m_Paths;
+  const uint32_t*          m_Ids;
+  int32_t                  m_Count;
+};
+
 struct NodeData
 {
   enum
@@ -108,7 +178,20 @@ struct NodeData
     
     kFlagIsWriteTextFileAction = 1 << 4,
     kFlagAllowUnwrittenOutputFiles = 1 << 5,
-    kFlagBanContentDigestForInputs = 1 << 6
+    kFlagBanContentDigestForInputs = 1 << 6,
+
+    // Implicit inputs come from a dependency file written by the action
+    // rather than from the include scanner. See m_DepFile.
+    kFlagHasDepFile         = 1 << 7,
+
+    // The dependency file uses /showIncludes lines instead of make syntax. If
+    // m_DepFile is null the lines are taken from the action's output.
+    kFlagDepFileMsvc        = 1 << 8,
+
+    // Run the action under the file access tracer; every file it opens or
+    // stats becomes an implicit input. Always set together with
+    // kFlagHasDepFile, with a null m_DepFile.
+    kFlagTraceFileAccess    = 1 << 9
   };
 
   FrozenString                    m_Action;
@@ -117,13 +200,15 @@ struct NodeData
   int32_t                         m_PassIndex;
   FrozenArray<int32_t>            m_Dependencies;
   FrozenArray<int32_t>            m_BackLinks;
-  FrozenArray<FrozenFileAndHash>  m_InputFiles;
-  FrozenArray<FrozenFileAndHash>  m_OutputFiles;
-  FrozenArray<FrozenFileAndHash>  m_AuxOutputFiles;
-  FrozenArray<FrozenFileAndHash>  m_FrontendResponseFiles;
+  // Indices into DagData::m_Paths, see DagPathList.
+  FrozenArray<uint32_t>           m_InputFiles;
+  FrozenArray<uint32_t>           m_OutputFiles;
+  FrozenArray<uint32_t>           m_AuxOutputFiles;
+  FrozenArray<uint32_t>           m_FrontendResponseFiles;
   FrozenArray<FrozenString>       m_AllowedOutputSubstrings;
   FrozenArray<EnvVarData>         m_EnvVars;
   FrozenPtr<ScannerData>          m_Scanner;
+  FrozenString                    m_DepFile;
   FrozenArray<int32_t>            m_SharedResources;
   uint32_t                        m_Flags;
   uint32_t                        m_OriginalIndex;
@@ -144,7 +229,7 @@ struct SharedResourceData
 
 struct DagData
 {
-  static const uint32_t         MagicNumber   = 0x2B89014f ^ kTundraHashMagic;
+  static const uint32_t         MagicNumber   = 0x2B890162 ^ kTundraHashMagic;
 
   uint32_t                      m_MagicNumber;
 
@@ -154,6 +239,10 @@ struct DagData
   FrozenPtr<HashDigest>         m_NodeGuids;
   FrozenPtr<NodeData>           m_NodeData;
 
+  // Every file named by a node, once, with its hash. Nodes refer to them by
+  // index.
+  FrozenArray<FrozenFileAndHash> m_Paths;
+
   FrozenArray<PassData>         m_Passes;
 
   FrozenArray<SharedResourceData> m_SharedResources;
@@ -10,10 +10,14 @@
 #include "DagData.hpp"
 #include "HashTable.hpp"
 #include "FileSign.hpp"
+#include "MemoryMappedFile.hpp"
+#include "HelperPool.hpp"
+#include "Atomic.hpp"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <time.h>
 #include <algorithm>
 
 #ifdef _MSC_VER
@@ -86,41 +90,6 @@ static int64_t FindIntValue(const JsonObjectValue* obj, const char* key, int64_t
   return (int64_t) static_cast<const JsonNumberValue*>(node)->m_Number;
 }
 
-static bool WriteFileArray(
-    BinarySegment* seg,
-    BinarySegment* ptr_seg,
-    BinarySegment* str_seg,
-    const JsonArrayValue* files)
-{
-  if (!files || 0 == files->m_Count)
-  {
-    BinarySegmentWriteInt32(seg, 0);
-    BinarySegmentWriteNullPointer(seg);
-    return true;
-  }
-
-  BinarySegmentWriteInt32(seg, (int) files->m_Count);
-  BinarySegmentWritePointer(seg, BinarySegmentPosition(ptr_seg));
-
-  for (size_t i = 0, count = files->m_Count; i < count; ++i)
-  {
-    const JsonStringValue *path = files->m_Values[i]->AsString();
-    if (!path)
-      return false;
-
-    PathBuffer pathbuf;
-    PathInit(&pathbuf, path->m_String);
-
-    char cleaned_path[kMaxPathLength];
-    PathFormat(cleaned_path, &pathbuf);
-
-    WriteStringPtr(ptr_seg, str_seg, cleaned_path);
-    BinarySegmentWriteUint32(ptr_seg, Djb2HashPath(cleaned_path));
-  }
-
-  return true;
-}
-
 static bool EmptyArray(const JsonArrayValue* a)
 {
   return nullptr == a || a->m_Count == 0;
@@ -142,7 +111,9 @@ struct CommonStringRecord
   BinaryLocator m_Pointer;
 };
 
-void WriteCommonStringPtr(BinarySegment* segment, BinarySegment* str_seg, const char* ptr, HashTable<CommonStringRecord, 0>* table, MemAllocLinear* scratch)
+// New strings are copied to `string_alloc` for the table to keep, as node
+// strings only live until the next node is read.
+void WriteCommonStringPtr(BinarySegment* segment, BinarySegment* str_seg, const char* ptr, HashTable<CommonStringRecord, 0>* table, MemAllocLinear* string_alloc)
 {
   uint32_t hash = Djb2Hash(ptr);
   CommonStringRecord* r;
@@ -150,7 +121,7 @@ void WriteCommonStringPtr(BinarySegment* segment, BinarySegment* str_seg, const
   {
     CommonStringRecord r;
     r.m_Pointer = BinarySegmentPosition(str_seg);
-    HashTableInsert(table, hash, ptr, r);
+    HashTableInsert(table, hash, StrDup(string_alloc, ptr), r);
     BinarySegmentWriteStringData(str_seg, ptr);
     BinarySegmentWritePointer(segment, r.m_Pointer);
   }
@@ -177,237 +148,914 @@ static uint32_t GetNodeFlag(const JsonObjectValue* node, const char* name, uint3
   return GetNodeFlagBool(node, name, defaultValue) ? value : 0;
 }
 
-static bool WriteNodes(
-    const JsonArrayValue* nodes,
-    BinarySegment* main_seg,
-    BinarySegment* node_data_seg,
-    BinarySegment* array2_seg,
-    BinarySegment* str_seg,
-    BinarySegment* writetextfile_payloads_seg,
-    BinaryLocator scanner_ptrs[],
-    MemAllocHeap* heap,
-    HashTable<CommonStringRecord, kFlagCaseSensitive>* shared_strings,
-    MemAllocLinear* scratch,
-    const TempNodeGuid* order,
-    const int32_t* remap_table)
+static bool ComputeNodeGuid(const JsonObjectValue* nobj, HashDigest* guid_out)
 {
-  BinarySegmentWritePointer(main_seg, BinarySegmentPosition(node_data_seg));  // m_NodeData
-
-  MemAllocLinearScope scratch_scope(scratch);
-
-  size_t node_count = nodes->m_Count;
+  HashState h;
+  HashInit(&h);
 
-  struct BacklinkRec
+  const JsonArrayValue *outputs    = FindArrayValue(nobj, "Outputs");
+  bool didHashAnyOutputs = false;
+  if (outputs)
   {
-    Buffer<int32_t> m_Links;
-  };
-
-  BacklinkRec* links = HeapAllocateArrayZeroed<BacklinkRec>(heap, node_count);
+    for (size_t fi = 0, fi_count = outputs->m_Count; fi < fi_count; ++fi)
+    {
+      if (const JsonStringValue* str = outputs->m_Values[fi]->AsString())
+      {
+        HashAddString(&h, str->m_String);
+        didHashAnyOutputs = true;
+      }
+    }
+  }
 
-  for (size_t i = 0; i < node_count; ++i)
+  if (didHashAnyOutputs)
   {
-    const JsonObjectValue* node = nodes->m_Values[i]->AsObject();
-    if (!node)
-      return false;
+      HashAddString(&h, "salt for outputs");
+  }
+  else
+  {
+    // For nodes with no outputs, preserve the legacy behaviour
 
-    const JsonArrayValue *deps          = FindArrayValue(node, "Deps");
+    const char           *action     = FindStringValue(nobj, "Action");
+    const JsonArrayValue *inputs     = FindArrayValue(nobj, "Inputs");
 
-    if (EmptyArray(deps))
-      continue;
+    if (action && action[0])
+      HashAddString(&h, action);
 
-    for (size_t di = 0, count = deps->m_Count; di < count; ++di)
+    if (inputs)
     {
-      if (const JsonNumberValue* dep_index_n = deps->m_Values[di]->AsNumber())
+      for (size_t fi = 0, fi_count = inputs->m_Count; fi < fi_count; ++fi)
       {
-        int32_t dep_index = (int) dep_index_n->m_Number;
-        if (dep_index < 0 || dep_index >= (int) node_count)
-          return false;
-
-        BufferAppendOne(&links[dep_index].m_Links, heap, int32_t(i));
+        if (const JsonStringValue* str = inputs->m_Values[fi]->AsString())
+        {
+          HashAddString(&h, str->m_String);
+        }
       }
-      else
-      {
+    }
+
+    const char *annotation = FindStringValue(nobj, "Annotation");
+
+    if (annotation)
+      HashAddString(&h, annotation);
+
+    if ((!action || action[0] == '\0') && !inputs && !annotation)
+    {
         return false;
-      }
     }
+
+    HashAddString(&h, "salt for legacy");
   }
 
-  uint32_t* reverse_remap = (uint32_t*)HeapAllocate(heap, node_count * sizeof(uint32_t));
-  for (uint32_t i = 0; i < node_count; ++i)
+  HashFinalize(&h, guid_out);
+  return true;
+}
+
+// Re-parses single nodes from their text. Each thread writing nodes has one.
+struct DagNodeReader
+{
+  MemAllocLinear        m_Alloc;
+  JsonBuilder           m_Builder;
+  const JsonValue      *m_Node;
+};
+
+static void DagNodeReaderInit(DagNodeReader* self, MemAllocHeap* heap)
+{
+  LinearAllocInit(&self->m_Alloc, heap, MB(64), "json node alloc");
+  JsonBuilderInit(&self->m_Builder, heap, &self->m_Alloc);
+  self->m_Node = nullptr;
+}
+
+static void DagNodeReaderDestroy(DagNodeReader* self)
+{
+  JsonBuilderDestroy(&self->m_Builder);
+  LinearAllocDestroy(&self->m_Alloc);
+}
+
+// The frontend JSON is streamed rather than parsed up front. Nodes are written
+// in GUID order and refer to each other by their position in that order, so no
+// node can be written before every GUID is known. The first pass keeps only
+// what that takes: each node's GUID, its dependency edges and where its text
+// is. Everything outside the node array is small and is kept as a tree. When
+// the nodes are written, each one is parsed again from its text, so only one
+// node per thread is held in memory at a time.
+//
+// The document is either JSON text or a recording of its events, as written
+// by the Lua frontend when it compiles the DAG itself.
+typedef bool (*DagEventSource)(const char* data, size_t size, MemAllocHeap* heap, void* user_data, JsonEventCallback callback, char (&error_message)[1024]);
+
+struct DagJsonReader
+{
+  MemAllocHeap         *m_Heap;
+  const char           *m_Json;
+  DagEventSource        m_Source;
+  MemAllocLinear        m_RootAlloc;
+  JsonBuilder           m_RootBuilder;
+  DagNodeReader         m_NodeReader;
+  const JsonValue      *m_Root;
+  bool                  m_NodesNext;
+  bool                  m_InNodes;
+  bool                  m_Rejected;
+  size_t                m_NodeBegin;
+
+  // Indexed by node in document order, except m_Guids which is sorted once
+  // the document has been read.
+  Buffer<TempNodeGuid>  m_Guids;
+  Buffer<size_t>        m_NodeTextBegin;
+  Buffer<size_t>        m_NodeTextEnd;
+
+  // (dependency, dependent) pairs in document order.
+  Buffer<int32_t>       m_DepEdges;
+};
+
+static void DagJsonReaderInit(DagJsonReader* self, MemAllocHeap* heap, const char* json, DagEventSource source)
+{
+  self->m_Heap   = heap;
+  self->m_Json   = json;
+  self->m_Source = source;
+  LinearAllocInit(&self->m_RootAlloc, heap, MB(256), "json alloc");
+  JsonBuilderInit(&self->m_RootBuilder, heap, &self->m_RootAlloc);
+  DagNodeReaderInit(&self->m_NodeReader, heap);
+  self->m_Root      = nullptr;
+  self->m_NodesNext = false;
+  self->m_InNodes   = false;
+  self->m_Rejected  = false;
+  self->m_NodeBegin = 0;
+  BufferInit(&self->m_Guids);
+  BufferInit(&self->m_NodeTextBegin);
+  BufferInit(&self->m_NodeTextEnd);
+  BufferInit(&self->m_DepEdges);
+}
+
+static void DagJsonReaderDestroy(DagJsonReader* self)
+{
+  MemAllocHeap* heap = self->m_Heap;
+  BufferDestroy(&self->m_DepEdges, heap);
+  BufferDestroy(&self->m_NodeTextEnd, heap);
+  BufferDestroy(&self->m_NodeTextBegin, heap);
+  BufferDestroy(&self->m_Guids, heap);
+  DagNodeReaderDestroy(&self->m_NodeReader);
+  JsonBuilderDestroy(&self->m_RootBuilder);
+  LinearAllocDestroy(&self->m_RootAlloc);
+}
+
+static bool IndexNode(DagJsonReader* self, const JsonValue* value, size_t text_end)
+{
+  MemAllocHeap* heap = self->m_Heap;
+
+  const JsonObjectValue* node = value->AsObject();
+  if (!node)
+    return false;
+
+  int32_t index = (int32_t) self->m_Guids.m_Size;
+
+  TempNodeGuid* guid = BufferAlloc(&self->m_Guids, heap, 1);
+  guid->m_Node = index;
+
+  if (!ComputeNodeGuid(node, &guid->m_Digest))
+    return false;
+
+  if (const JsonArrayValue* deps = FindArrayValue(node, "Deps"))
   {
-    reverse_remap[remap_table[i]] = i;
+    for (size_t di = 0, count = deps->m_Count; di < count; ++di)
+    {
+      const JsonNumberValue* dep_index = deps->m_Values[di]->AsNumber();
+      if (!dep_index)
+        return false;
+
+      BufferAppendOne(&self->m_DepEdges, heap, (int32_t) dep_index->m_Number);
+      BufferAppendOne(&self->m_DepEdges, heap, index);
+    }
   }
 
-  for (size_t ni = 0; ni < node_count; ++ni)
-  {
-    const int32_t i = order[ni].m_Node;
-    const JsonObjectValue* node = nodes->m_Values[i]->AsObject();
-
-    const char           *action        = FindStringValue(node, "Action");
-    const char           *annotation    = FindStringValue(node, "Annotation");
-    const char           *preaction     = FindStringValue(node, "PreAction");
-    const int             pass_index    = (int) FindIntValue(node, "PassIndex", 0);
-    const JsonArrayValue *deps          = FindArrayValue(node, "Deps");
-    const JsonArrayValue *inputs        = FindArrayValue(node, "Inputs");
-    const JsonArrayValue *outputs       = FindArrayValue(node, "Outputs");
-    const JsonArrayValue *aux_outputs   = FindArrayValue(node, "AuxOutputs");
-    const JsonArrayValue *env_vars      = FindArrayValue(node, "Env");
-    const int             scanner_index = (int) FindIntValue(node, "ScannerIndex", -1);
-    const JsonArrayValue *shared_resources = FindArrayValue(node, "SharedResources");
-    const JsonArrayValue *frontend_rsps = FindArrayValue(node, "FrontendResponseFiles");
-    const JsonArrayValue *allowedOutputSubstrings = FindArrayValue(node, "AllowedOutputSubstrings");
-    const char          *writetextfile_payload = FindStringValue(node, "WriteTextFilePayload");
-
-    if (writetextfile_payload == nullptr)
-      WriteStringPtr(node_data_seg, str_seg, action);
-    else
-      WriteStringPtr(node_data_seg, writetextfile_payloads_seg, writetextfile_payload);
+  BufferAppendOne(&self->m_NodeTextBegin, heap, self->m_NodeBegin);
+  BufferAppendOne(&self->m_NodeTextEnd, heap, text_end);
+  return true;
+}
+
+static bool DagJsonIndexCallback(void* user_data, const JsonEvent& event)
+{
+  DagJsonReader* self = static_cast<DagJsonReader*>(user_data);
 
-    WriteStringPtr(node_data_seg, str_seg, preaction);
-    WriteCommonStringPtr(node_data_seg, str_seg, annotation, shared_strings, scratch);
-    BinarySegmentWriteInt32(node_data_seg, pass_index);
+  if (self->m_InNodes && event.m_Depth >= 2)
+  {
+    if (2 == event.m_Depth && kJsonEventEndObject != event.m_Type && kJsonEventEndArray != event.m_Type)
+      self->m_NodeBegin = event.m_Offset;
 
-    if (deps)
+    DagNodeReader* node_reader = &self->m_NodeReader;
+    const JsonValue* node = JsonBuilderAdd(&node_reader->m_Builder, event);
+    if (!node)
+      return true;
+
+    bool success = IndexNode(self, node, event.m_Offset + 1);
+    LinearAllocReset(&node_reader->m_Alloc);
+    self->m_Rejected = !success;
+    return success;
+  }
+
+  // Everything but the node array's elements goes into the root tree, which
+  // ends up with an empty "Nodes" array.
+  if (1 == event.m_Depth)
+  {
+    if (kJsonEventKey == event.m_Type)
+      self->m_NodesNext = 0 == strcmp(event.m_String, "Nodes");
+    else if (kJsonEventBeginArray == event.m_Type)
+      self->m_InNodes = self->m_NodesNext;
+    else if (kJsonEventEndArray == event.m_Type)
+      self->m_InNodes = false;
+  }
+
+  if (const JsonValue* root = JsonBuilderAdd(&self->m_RootBuilder, event))
+    self->m_Root = root;
+
+  return true;
+}
+
+static bool DagJsonNodeCallback(void* user_data, const JsonEvent& event)
+{
+  DagNodeReader* self = static_cast<DagNodeReader*>(user_data);
+
+  if (const JsonValue* node = JsonBuilderAdd(&self->m_Builder, event))
+    self->m_Node = node;
+
+  return true;
+}
+
+// Parses node `index` (in document order) again from its text. The result is
+// valid until the next call with the same node reader.
+static const JsonObjectValue* DagJsonReadNode(const DagJsonReader* self, DagNodeReader* node_reader, int32_t index)
+{
+  LinearAllocReset(&node_reader->m_Alloc);
+
+  size_t begin = self->m_NodeTextBegin[index];
+  size_t end   = self->m_NodeTextEnd[index];
+
+  char error_msg[1024];
+  if (!self->m_Source(self->m_Json + begin, end - begin, self->m_Heap, node_reader, DagJsonNodeCallback, error_msg))
+    Croak("couldn't parse node %d again: %s", index, error_msg);
+
+  return node_reader->m_Node->AsObject();
+}
+
+// Nodes are written in chunks of consecutive GUIDs, by as many threads as the
+// helper pool has. Each chunk has its own segments, which are appended to the
+// output segments in order once all chunks are done, so the result doesn't
+// depend on how the work was split. The first chunk writes straight into the
+// output segments.
+//
+// Strings shared between nodes are deduplicated across the whole DAG. A chunk
+// only collects them, in order of first use, and leaves deferred pointers to
+// them. They're written to a segment of their own as the chunks are merged.
+//
+// File paths are collected the same way, and become DagData::m_Paths. The
+// node's file arrays are deferred too, as the indices in them are only known
+// once the chunks before have been merged.
+struct DagCommonStringRef
+{
+  BinarySegment *m_Seg;
+  uint32_t       m_Pointer;
+  uint32_t       m_String;
+};
+
+struct DagPathArrayRef
+{
+  uint32_t       m_Pointer;
+  uint32_t       m_Count;
+};
+
+struct DagNodeChunk
+{
+  size_t                             m_Begin;
+  size_t                             m_End;
+  BinarySegment                     *m_NodeDataSeg;
+  BinarySegment                     *m_ArraySeg;
+  BinarySegment                     *m_StrSeg;
+  BinarySegment                     *m_PayloadSeg;
+  MemAllocLinear                     m_StringAlloc;
+  HashTable<uint32_t, kFlagCaseSensitive> m_CommonStringIndex;
+  Buffer<const char*>                m_CommonStrings;
+  Buffer<DagCommonStringRef>         m_CommonStringRefs;
+  HashTable<uint32_t, kFlagCaseSensitive> m_PathIndex;
+  Buffer<const char*>                m_Paths;
+  Buffer<uint32_t>                   m_PathHashes;
+  Buffer<uint32_t>                   m_PathRefs;     // Chunk path indices of all file arrays, in order.
+  Buffer<DagPathArrayRef>            m_PathArrays;
+};
+
+struct DagNodeWriter
+{
+  enum
+  {
+    kMinChunkSize    = 1024,
+    kChunksPerThread = 4
+  };
+
+  const DagJsonReader *m_Reader;
+  MemAllocHeap        *m_Heap;
+  const int32_t       *m_RemapTable;
+  const uint32_t      *m_ReverseRemap;
+  const uint32_t      *m_LinkStart;
+  const int32_t       *m_Links;
+  const BinaryLocator *m_ScannerPtrs;
+  DagNodeReader       *m_NodeReaders;
+  DagNodeChunk        *m_Chunks;
+  uint32_t             m_ChunkCount;
+  uint32_t             m_NextChunk;
+  volatile bool        m_Failed;
+};
+
+static void DagNodeChunkInit(DagNodeChunk* self, const DagJsonReader* reader, MemAllocHeap* heap, size_t begin, size_t end)
+{
+  self->m_Begin = begin;
+  self->m_End   = end;
+
+  // No string in the chunk's nodes takes up more than its JSON text, so this
+  // is enough for them all. Only what gets used is ever touched.
+  size_t text_size = 0;
+  for (size_t ni = begin; ni < end; ++ni)
+  {
+    int32_t i = reader->m_Guids[ni].m_Node;
+    text_size += reader->m_NodeTextEnd[i] - reader->m_NodeTextBegin[i];
+  }
+
+  LinearAllocInit(&self->m_StringAlloc, heap, text_size + 16, "node chunk strings");
+  HashTableInit(&self->m_CommonStringIndex, heap);
+  BufferInit(&self->m_CommonStrings);
+  BufferInit(&self->m_CommonStringRefs);
+  HashTableInit(&self->m_PathIndex, heap);
+  BufferInit(&self->m_Paths);
+  BufferInit(&self->m_PathHashes);
+  BufferInit(&self->m_PathRefs);
+  BufferInit(&self->m_PathArrays);
+}
+
+static void DagNodeChunkDestroy(DagNodeChunk* self, MemAllocHeap* heap)
+{
+  BufferDestroy(&self->m_PathArrays, heap);
+  BufferDestroy(&self->m_PathRefs, heap);
+  BufferDestroy(&self->m_PathHashes, heap);
+  BufferDestroy(&self->m_Paths, heap);
+  HashTableDestroy(&self->m_PathIndex);
+  BufferDestroy(&self->m_CommonStringRefs, heap);
+  BufferDestroy(&self->m_CommonStrings, heap);
+  HashTableDestroy(&self->m_CommonStringIndex);
+  LinearAllocDestroy(&self->m_StringAlloc);
+}
+
+static void WriteChunkCommonStringPtr(DagNodeChunk* chunk, BinarySegment* seg, const char* ptr)
+{
+  MemAllocHeap* heap = chunk->m_CommonStringIndex.m_Heap;
+
+  uint32_t hash = Djb2Hash(ptr);
+  uint32_t index;
+  if (const uint32_t* r = HashTableLookup(&chunk->m_CommonStringIndex, hash, ptr))
+  {
+    index = *r;
+  }
+  else
+  {
+    index = (uint32_t) chunk->m_CommonStrings.m_Size;
+    const char* copy = StrDup(&chunk->m_StringAlloc, ptr);
+    HashTableInsert(&chunk->m_CommonStringIndex, hash, copy, index);
+    BufferAppendOne(&chunk->m_CommonStrings, heap, copy);
+  }
+
+  DagCommonStringRef ref;
+  ref.m_Seg     = seg;
+  ref.m_Pointer = BinarySegmentWriteDeferredPointer(seg);
+  ref.m_String  = index;
+  BufferAppendOne(&chunk->m_CommonStringRefs, heap, ref);
+}
+
+static bool WriteChunkFileArray(DagNodeChunk* chunk, const JsonArrayValue* files)
+{
+  BinarySegment* seg  = chunk->m_NodeDataSeg;
+  MemAllocHeap*  heap = chunk->m_PathIndex.m_Heap;
+
+  if (!files || 0 == files->m_Count)
+  {
+    BinarySegmentWriteInt32(seg, 0);
+    BinarySegmentWriteNullPointer(seg);
+    return true;
+  }
+
+  DagPathArrayRef ref;
+  ref.m_Count = uint32_t(files->m_Count);
+  BinarySegmentWriteInt32(seg, int(files->m_Count));
+  ref.m_Pointer = BinarySegmentWriteDeferredPointer(seg);
+  BufferAppendOne(&chunk->m_PathArrays, heap, ref);
+
+  for (size_t i = 0, count = files->m_Count; i < count; ++i)
+  {
+    const JsonStringValue *path = files->m_Values[i]->AsString();
+    if (!path)
+      return false;
+
+    PathBuffer pathbuf;
+    PathInit(&pathbuf, path->m_String);
+
+    char cleaned_path[kMaxPathLength];
+    PathFormat(cleaned_path, &pathbuf);
+
+    uint32_t hash = Djb2HashPath(cleaned_path);
+    uint32_t index;
+    if (const uint32_t* r = HashTableLookup(&chunk->m_PathIndex, hash, cleaned_path))
     {
-      BinarySegmentAlign(array2_seg, 4);
-      BinarySegmentWriteInt32(node_data_seg, (int) deps->m_Count);
-      BinarySegmentWritePointer(node_data_seg, BinarySegmentPosition(array2_seg));
-      for (size_t i = 0, count = deps->m_Count; i < count; ++i)
-      {
-        if (const JsonNumberValue* dep_index = deps->m_Values[i]->AsNumber())
-        {
-          int index = (int) dep_index->m_Number;
-          int remapped_index = remap_table[index];
-          BinarySegmentWriteInt32(array2_seg, remapped_index);
-        }
-        else
-        {
-          return false;
-        }
-      }
+      index = *r;
     }
     else
     {
-      BinarySegmentWriteInt32(node_data_seg, 0);
-      BinarySegmentWriteNullPointer(node_data_seg);
+      index = (uint32_t) chunk->m_Paths.m_Size;
+      const char* copy = StrDup(&chunk->m_StringAlloc, cleaned_path);
+      HashTableInsert(&chunk->m_PathIndex, hash, copy, index);
+      BufferAppendOne(&chunk->m_Paths, heap, copy);
+      BufferAppendOne(&chunk->m_PathHashes, heap, hash);
     }
 
-    const Buffer<int32_t>& backlinks = links[i].m_Links;
-    if (backlinks.m_Size > 0)
+    BufferAppendOne(&chunk->m_PathRefs, heap, index);
+  }
+
+  return true;
+}
+
+// Writes the node at position `ni` in GUID order.
+static bool WriteNode(DagNodeWriter* self, DagNodeChunk* chunk, DagNodeReader* node_reader, size_t ni)
+{
+  const DagJsonReader* reader = self->m_Reader;
+
+  const int32_t i = reader->m_Guids[ni].m_Node;
+  const JsonObjectValue* node = DagJsonReadNode(reader, node_reader, i);
+
+  const char           *action        = FindStringValue(node, "Action");
+  const char           *annotation    = FindStringValue(node, "Annotation");
+  const char           *preaction     = FindStringValue(node, "PreAction");
+  const int             pass_index    = (int) FindIntValue(node, "PassIndex", 0);
+  const JsonArrayValue *deps          = FindArrayValue(node, "Deps");
+  const JsonArrayValue *inputs        = FindArrayValue(node, "Inputs");
+  const JsonArrayValue *outputs       = FindArrayValue(node, "Outputs");
+  const JsonArrayValue *aux_outputs   = FindArrayValue(node, "AuxOutputs");
+  const JsonArrayValue *env_vars      = FindArrayValue(node, "Env");
+  const int             scanner_index = (int) FindIntValue(node, "ScannerIndex", -1);
+  const JsonArrayValue *shared_resources = FindArrayValue(node, "SharedResources");
+  const JsonArrayValue *frontend_rsps = FindArrayValue(node, "FrontendResponseFiles");
+  const JsonArrayValue *allowedOutputSubstrings = FindArrayValue(node, "AllowedOutputSubstrings");
+  const char          *writetextfile_payload = FindStringValue(node, "WriteTextFilePayload");
+  const char           *depfile       = FindStringValue(node, "DepFile");
+  const char           *depfile_format = FindStringValue(node, "DepFileFormat");
+
+  bool depfile_msvc = false;
+  if (depfile_format)
+  {
+    if (0 == strcmp(depfile_format, "msvc"))
+      depfile_msvc = true;
+    else if (0 != strcmp(depfile_format, "make"))
+    {
+      Log(kError, "%s: unknown DepFileFormat '%s'", annotation, depfile_format);
+      return false;
+    }
+  }
+
+  bool trace_file_access = GetNodeFlagBool(node, "TraceFileAccess");
+  if (trace_file_access && (depfile || depfile_format))
+  {
+    Log(kError, "%s: TraceFileAccess can't be combined with DepFile", annotation);
+    return false;
+  }
+
+  // The node has no scanner or depfile either, so without tracing it would
+  // never notice changes to the files it reads.
+  if (trace_file_access && DISABLED(USE_FILE_TRACING))
+  {
+    Log(kError, "%s: TraceFileAccess is not supported on this platform", annotation);
+    return false;
+  }
+
+  const bool has_depfile = depfile || depfile_msvc || trace_file_access;
+
+  if (writetextfile_payload == nullptr)
+    WriteStringPtr(chunk->m_NodeDataSeg, chunk->m_StrSeg, action);
+  else
+    WriteStringPtr(chunk->m_NodeDataSeg, chunk->m_PayloadSeg, writetextfile_payload);
+
+  WriteStringPtr(chunk->m_NodeDataSeg, chunk->m_StrSeg, preaction);
+  WriteChunkCommonStringPtr(chunk, chunk->m_NodeDataSeg, annotation);
+  BinarySegmentWriteInt32(chunk->m_NodeDataSeg, pass_index);
+
+  if (deps)
+  {
+    BinarySegmentAlign(chunk->m_ArraySeg, 4);
+    BinarySegmentWriteInt32(chunk->m_NodeDataSeg, (int) deps->m_Count);
+    BinarySegmentWritePointer(chunk->m_NodeDataSeg, BinarySegmentPosition(chunk->m_ArraySeg));
+    for (size_t i = 0, count = deps->m_Count; i < count; ++i)
     {
-      BinarySegmentWriteInt32(node_data_seg, (int) backlinks.m_Size);
-      BinarySegmentWritePointer(node_data_seg, BinarySegmentPosition(array2_seg));
-      for (int32_t index : backlinks)
+      if (const JsonNumberValue* dep_index = deps->m_Values[i]->AsNumber())
+      {
+        int index = (int) dep_index->m_Number;
+        int remapped_index = self->m_RemapTable[index];
+        BinarySegmentWriteInt32(chunk->m_ArraySeg, remapped_index);
+      }
+      else
       {
-        BinarySegmentWriteInt32(array2_seg, remap_table[index]);
+        return false;
       }
     }
-    else
+  }
+  else
+  {
+    BinarySegmentWriteInt32(chunk->m_NodeDataSeg, 0);
+    BinarySegmentWriteNullPointer(chunk->m_NodeDataSeg);
+  }
+
+  const uint32_t backlink_count = self->m_LinkStart[i + 1] - self->m_LinkStart[i];
+  if (backlink_count > 0)
+  {
+    BinarySegmentWriteInt32(chunk->m_NodeDataSeg, (int) backlink_count);
+    BinarySegmentWritePointer(chunk->m_NodeDataSeg, BinarySegmentPosition(chunk->m_ArraySeg));
+    for (uint32_t li = self->m_LinkStart[i], end = self->m_LinkStart[i + 1]; li < end; ++li)
     {
-      BinarySegmentWriteInt32(node_data_seg, 0);
-      BinarySegmentWriteNullPointer(node_data_seg);
+      BinarySegmentWriteInt32(chunk->m_ArraySeg, self->m_RemapTable[self->m_Links[li]]);
     }
+  }
+  else
+  {
+    BinarySegmentWriteInt32(chunk->m_NodeDataSeg, 0);
+    BinarySegmentWriteNullPointer(chunk->m_NodeDataSeg);
+  }
 
-    WriteFileArray(node_data_seg, array2_seg, str_seg, inputs);
-    WriteFileArray(node_data_seg, array2_seg, str_seg, outputs);
-    WriteFileArray(node_data_seg, array2_seg, str_seg, aux_outputs);
-    WriteFileArray(node_data_seg, array2_seg, str_seg, frontend_rsps);
+  if (!WriteChunkFileArray(chunk, inputs) ||
+      !WriteChunkFileArray(chunk, outputs) ||
+      !WriteChunkFileArray(chunk, aux_outputs) ||
+      !WriteChunkFileArray(chunk, frontend_rsps))
+  {
+    Log(kError, "%s: file names must be strings", annotation);
+    return false;
+  }
 
-    if (allowedOutputSubstrings)
-    {
-      int count = allowedOutputSubstrings->m_Count;
-      BinarySegmentWriteInt32(node_data_seg, count);
-      BinarySegmentAlign(array2_seg, 4);
-      BinarySegmentWritePointer(node_data_seg, BinarySegmentPosition(array2_seg));
-      for (int i=0; i!=count; i++)
-        WriteCommonStringPtr(array2_seg, str_seg, allowedOutputSubstrings->m_Values[i]->AsString()->m_String, shared_strings, scratch);
-    } else
+  if (allowedOutputSubstrings)
+  {
+    int count = allowedOutputSubstrings->m_Count;
+    BinarySegmentWriteInt32(chunk->m_NodeDataSeg, count);
+    BinarySegmentAlign(chunk->m_ArraySeg, 4);
+    BinarySegmentWritePointer(chunk->m_NodeDataSeg, BinarySegmentPosition(chunk->m_ArraySeg));
+    for (int i=0; i!=count; i++)
+      WriteChunkCommonStringPtr(chunk, chunk->m_ArraySeg, allowedOutputSubstrings->m_Values[i]->AsString()->m_String);
+  } else
+  {
+    BinarySegmentWriteInt32(chunk->m_NodeDataSeg, 0);
+    BinarySegmentWriteNullPointer(chunk->m_NodeDataSeg);
+  }
+
+  // Environment variables
+  if (env_vars && env_vars->m_Count > 0)
+  {
+    BinarySegmentAlign(chunk->m_ArraySeg, 4);
+    BinarySegmentWriteInt32(chunk->m_NodeDataSeg, (int) env_vars->m_Count);
+    BinarySegmentWritePointer(chunk->m_NodeDataSeg, BinarySegmentPosition(chunk->m_ArraySeg));
+    for (size_t i = 0, count = env_vars->m_Count; i < count; ++i)
     {
-      BinarySegmentWriteInt32(node_data_seg, 0);
-      BinarySegmentWriteNullPointer(node_data_seg);
+      const char* key = FindStringValue(env_vars->m_Values[i], "Key");
+      const char* value = FindStringValue(env_vars->m_Values[i], "Value");
+
+      if (!key || !value)
+        return false;
+
+      WriteChunkCommonStringPtr(chunk, chunk->m_ArraySeg, key);
+      WriteChunkCommonStringPtr(chunk, chunk->m_ArraySeg, value);
     }
+  }
+  else
+  {
+    BinarySegmentWriteInt32(chunk->m_NodeDataSeg, 0);
+    BinarySegmentWriteNullPointer(chunk->m_NodeDataSeg);
+  }
 
-    // Environment variables
-    if (env_vars && env_vars->m_Count > 0)
-    {
-      BinarySegmentAlign(array2_seg, 4);
-      BinarySegmentWriteInt32(node_data_seg, (int) env_vars->m_Count);
-      BinarySegmentWritePointer(node_data_seg, BinarySegmentPosition(array2_seg));
-      for (size_t i = 0, count = env_vars->m_Count; i < count; ++i)
-      {
-        const char* key = FindStringValue(env_vars->m_Values[i], "Key");
-        const char* value = FindStringValue(env_vars->m_Values[i], "Value");
+  // Nodes with a dependency file get their implicit inputs from the tool, so
+  // they are never scanned.
+  if (-1 != scanner_index && !has_depfile)
+  {
+    BinarySegmentWritePointer(chunk->m_NodeDataSeg, self->m_ScannerPtrs[scanner_index]);
+  }
+  else
+  {
+    BinarySegmentWriteNullPointer(chunk->m_NodeDataSeg);
+  }
 
-        if (!key || !value)
-          return false;
+  if (depfile)
+  {
+    PathBuffer pathbuf;
+    PathInit(&pathbuf, depfile);
+
+    char cleaned_path[kMaxPathLength];
+    PathFormat(cleaned_path, &pathbuf);
 
-        WriteCommonStringPtr(array2_seg, str_seg, key, shared_strings, scratch);
-        WriteCommonStringPtr(array2_seg, str_seg, value, shared_strings, scratch);
+    WriteStringPtr(chunk->m_NodeDataSeg, chunk->m_StrSeg, cleaned_path);
+  }
+  else
+  {
+    BinarySegmentWriteNullPointer(chunk->m_NodeDataSeg);
+  }
+
+  if (shared_resources && shared_resources->m_Count > 0)
+  {
+    BinarySegmentAlign(chunk->m_ArraySeg, 4);
+    BinarySegmentWriteInt32(chunk->m_NodeDataSeg, static_cast<int>(shared_resources->m_Count));
+    BinarySegmentWritePointer(chunk->m_NodeDataSeg, BinarySegmentPosition(chunk->m_ArraySeg));
+    for (size_t i = 0, count = shared_resources->m_Count; i < count; ++i)
+    {
+      if (const JsonNumberValue* res_index = shared_resources->m_Values[i]->AsNumber())
+      {
+        BinarySegmentWriteInt32(chunk->m_ArraySeg, static_cast<int>(res_index->m_Number));
+      }
+      else
+      {
+        return false;
       }
     }
-    else
+  }
+  else
+  {
+    BinarySegmentWriteInt32(chunk->m_NodeDataSeg, 0);
+    BinarySegmentWriteNullPointer(chunk->m_NodeDataSeg);
+  }
+
+  uint32_t flags = 0;
+
+  flags |= GetNodeFlag(node, "OverwriteOutputs", NodeData::kFlagOverwriteOutputs, true);
+  flags |= GetNodeFlag(node, "PreciousOutputs",  NodeData::kFlagPreciousOutputs);
+  flags |= GetNodeFlag(node, "Expensive",        NodeData::kFlagExpensive);
+  flags |= GetNodeFlag(node, "AllowUnexpectedOutput", NodeData::kFlagAllowUnexpectedOutput, false);
+  flags |= GetNodeFlag(node, "AllowUnwrittenOutputFiles", NodeData::kFlagAllowUnwrittenOutputFiles, false);
+  flags |= GetNodeFlag(node, "BanContentDigestForInputs", NodeData::kFlagBanContentDigestForInputs, false);
+
+  if (writetextfile_payload != nullptr)
+    flags |= NodeData::kFlagIsWriteTextFileAction;
+
+  if (has_depfile)
+    flags |= NodeData::kFlagHasDepFile;
+
+  if (depfile_msvc)
+    flags |= NodeData::kFlagDepFileMsvc;
+
+  if (trace_file_access)
+    flags |= NodeData::kFlagTraceFileAccess;
+  
+  BinarySegmentWriteUint32(chunk->m_NodeDataSeg, flags);
+  BinarySegmentWriteUint32(chunk->m_NodeDataSeg, self->m_ReverseRemap[ni]);
+
+  return true;
+}
+
+static void WriteNodeChunks(void* context, int thread_index)
+{
+  DagNodeWriter* self        = static_cast<DagNodeWriter*>(context);
+  DagNodeReader* node_reader = &self->m_NodeReaders[thread_index];
+
+  while (!self->m_Failed)
+  {
+    uint32_t index = AtomicIncrement(&self->m_NextChunk) - 1;
+    if (index >= self->m_ChunkCount)
+      break;
+
+    DagNodeChunk* chunk = &self->m_Chunks[index];
+
+    for (size_t ni = chunk->m_Begin; ni < chunk->m_End; ++ni)
     {
-      BinarySegmentWriteInt32(node_data_seg, 0);
-      BinarySegmentWriteNullPointer(node_data_seg);
+      if (!WriteNode(self, chunk, node_reader, ni))
+      {
+        self->m_Failed = true;
+        break;
+      }
     }
+  }
+}
+
+static bool WriteNodes(
+    DagJsonReader* reader,
+    BinaryWriter* writer,
+    BinarySegment* main_seg,
+    BinarySegment* node_data_seg,
+    BinarySegment* array2_seg,
+    BinarySegment* str_seg,
+    BinarySegment* writetextfile_payloads_seg,
+    BinaryLocator scanner_ptrs[],
+    MemAllocHeap* heap,
+    HashTable<CommonStringRecord, kFlagCaseSensitive>* shared_strings,
+    MemAllocLinear* string_alloc,
+    const int32_t* remap_table,
+    HelperPool* helpers)
+{
+  BinarySegmentWritePointer(main_seg, BinarySegmentPosition(node_data_seg));  // m_NodeData
+
+  size_t node_count = reader->m_Guids.m_Size;
+
+  // Gather the nodes depending on each node from the dependency edges. They
+  // end up in document order, like the edges.
+  const Buffer<int32_t>& edges = reader->m_DepEdges;
+  size_t edge_count = edges.m_Size / 2;
+
+  uint32_t* link_start = HeapAllocateArrayZeroed<uint32_t>(heap, node_count + 1);
+  uint32_t* link_fill  = HeapAllocateArray<uint32_t>(heap, node_count + 1);
+  int32_t*  links      = HeapAllocateArray<int32_t>(heap, edge_count + 1);
+
+  for (size_t e = 0; e < edge_count; ++e)
+  {
+    int32_t dep_index = edges[2 * e];
+    if (dep_index < 0 || dep_index >= (int) node_count)
+      return false;
+
+    ++link_start[dep_index + 1];
+  }
+
+  for (size_t i = 0; i < node_count; ++i)
+  {
+    link_start[i + 1] += link_start[i];
+  }
 
-    if (-1 != scanner_index)
+  memcpy(link_fill, link_start, sizeof(uint32_t) * (node_count + 1));
+
+  for (size_t e = 0; e < edge_count; ++e)
+  {
+    links[link_fill[edges[2 * e]]++] = edges[2 * e + 1];
+  }
+
+  HeapFree(heap, link_fill);
+
+  uint32_t* reverse_remap = (uint32_t*)HeapAllocate(heap, node_count * sizeof(uint32_t));
+  for (uint32_t i = 0; i < node_count; ++i)
+  {
+    reverse_remap[remap_table[i]] = i;
+  }
+
+  int thread_count = helpers ? helpers->m_MaxThreadCount + 1 : 1;
+
+  // Splitting only pays off if the chunks are written in parallel.
+  size_t max_chunk_count = thread_count > 1 ? size_t(thread_count) * DagNodeWriter::kChunksPerThread : 1;
+  size_t chunk_count     = node_count / DagNodeWriter::kMinChunkSize;
+  if (chunk_count > max_chunk_count)
+    chunk_count = max_chunk_count;
+  if (chunk_count < 1)
+    chunk_count = 1;
+  if (size_t(thread_count) > chunk_count)
+    thread_count = int(chunk_count);
+
+  BinarySegment* common_str_seg = BinaryWriterAddSegment(writer);
+  BinarySegment* path_seg       = BinaryWriterAddSegment(writer);
+  BinarySegment* path_str_seg   = BinaryWriterAddSegment(writer);
+  BinarySegment* path_index_seg = BinaryWriterAddSegment(writer);
+  BinaryLocator  paths_ptr      = BinarySegmentPosition(path_seg);
+
+  DagNodeWriter node_writer;
+  node_writer.m_Reader       = reader;
+  node_writer.m_Heap         = heap;
+  node_writer.m_RemapTable   = remap_table;
+  node_writer.m_ReverseRemap = reverse_remap;
+  node_writer.m_LinkStart    = link_start;
+  node_writer.m_Links        = links;
+  node_writer.m_ScannerPtrs  = scanner_ptrs;
+  node_writer.m_NodeReaders  = HeapAllocateArray<DagNodeReader>(heap, thread_count);
+  node_writer.m_Chunks       = HeapAllocateArray<DagNodeChunk>(heap, chunk_count);
+  node_writer.m_ChunkCount   = uint32_t(chunk_count);
+  node_writer.m_NextChunk    = 0;
+  node_writer.m_Failed       = false;
+
+  for (int i = 0; i < thread_count; ++i)
+    DagNodeReaderInit(&node_writer.m_NodeReaders[i], heap);
+
+  for (size_t ci = 0; ci < chunk_count; ++ci)
+  {
+    DagNodeChunk* chunk = &node_writer.m_Chunks[ci];
+    DagNodeChunkInit(chunk, reader, heap, ci * node_count / chunk_count, (ci + 1) * node_count / chunk_count);
+
+    if (0 == ci)
     {
-      BinarySegmentWritePointer(node_data_seg, scanner_ptrs[scanner_index]);
+      chunk->m_NodeDataSeg = node_data_seg;
+      chunk->m_ArraySeg    = array2_seg;
+      chunk->m_StrSeg      = str_seg;
+      chunk->m_PayloadSeg  = writetextfile_payloads_seg;
     }
     else
     {
-      BinarySegmentWriteNullPointer(node_data_seg);
+      chunk->m_NodeDataSeg = BinaryWriterAddSegment(writer);
+      chunk->m_ArraySeg    = BinaryWriterAddSegment(writer);
+      chunk->m_StrSeg      = BinaryWriterAddSegment(writer);
+      chunk->m_PayloadSeg  = BinaryWriterAddSegment(writer);
     }
+  }
 
-    if (shared_resources && shared_resources->m_Count > 0)
+  if (thread_count > 1)
+    HelperPoolRun(helpers, WriteNodeChunks, &node_writer, thread_count);
+  else
+    WriteNodeChunks(&node_writer, 0);
+
+  bool success = !node_writer.m_Failed;
+
+  Buffer<BinaryLocator> common_string_ptrs;
+  BufferInit(&common_string_ptrs);
+
+  // New paths are copied out of the chunk, so each chunk can be destroyed as
+  // soon as it's merged. They take no more than all the chunks' strings.
+  size_t path_text_size = 0;
+  for (size_t ci = 0; ci < chunk_count; ++ci)
+    path_text_size += node_writer.m_Chunks[ci].m_StringAlloc.m_Offset;
+
+  MemAllocLinear path_alloc;
+  LinearAllocInit(&path_alloc, heap, path_text_size + 16, "dag paths");
+
+  HashTable<uint32_t, kFlagCaseSensitive> path_table;
+  HashTableInit(&path_table, heap);
+  uint32_t path_count = 0;
+
+  Buffer<uint32_t> path_ids;
+  BufferInit(&path_ids);
+
+  for (size_t ci = 0; ci < chunk_count; ++ci)
+  {
+    DagNodeChunk* chunk = &node_writer.m_Chunks[ci];
+
+    if (success)
     {
-      BinarySegmentAlign(array2_seg, 4);
-      BinarySegmentWriteInt32(node_data_seg, static_cast<int>(shared_resources->m_Count));
-      BinarySegmentWritePointer(node_data_seg, BinarySegmentPosition(array2_seg));
-      for (size_t i = 0, count = shared_resources->m_Count; i < count; ++i)
+      BufferClear(&common_string_ptrs);
+
+      for (const char* str : chunk->m_CommonStrings)
       {
-        if (const JsonNumberValue* res_index = shared_resources->m_Values[i]->AsNumber())
+        uint32_t hash = Djb2Hash(str);
+        if (CommonStringRecord* r = HashTableLookup(shared_strings, hash, str))
         {
-          BinarySegmentWriteInt32(array2_seg, static_cast<int>(res_index->m_Number));
+          BufferAppendOne(&common_string_ptrs, heap, r->m_Pointer);
         }
         else
         {
-          return false;
+          CommonStringRecord record;
+          record.m_Pointer = BinarySegmentPosition(common_str_seg);
+          HashTableInsert(shared_strings, hash, StrDup(string_alloc, str), record);
+          BinarySegmentWriteStringData(common_str_seg, str);
+          BufferAppendOne(&common_string_ptrs, heap, record.m_Pointer);
         }
       }
-    }
-    else
-    {
-      BinarySegmentWriteInt32(node_data_seg, 0);
-      BinarySegmentWriteNullPointer(node_data_seg);
-    }
 
-    uint32_t flags = 0;
+      for (const DagCommonStringRef& ref : chunk->m_CommonStringRefs)
+        BinarySegmentSetPointer(ref.m_Seg, ref.m_Pointer, common_string_ptrs[ref.m_String]);
 
-    flags |= GetNodeFlag(node, "OverwriteOutputs", NodeData::kFlagOverwriteOutputs, true);
-    flags |= GetNodeFlag(node, "PreciousOutputs",  NodeData::kFlagPreciousOutputs);
-    flags |= GetNodeFlag(node, "Expensive",        NodeData::kFlagExpensive);
-    flags |= GetNodeFlag(node, "AllowUnexpectedOutput", NodeData::kFlagAllowUnexpectedOutput, false);
-    flags |= GetNodeFlag(node, "AllowUnwrittenOutputFiles", NodeData::kFlagAllowUnwrittenOutputFiles, false);
-    flags |= GetNodeFlag(node, "BanContentDigestForInputs", NodeData::kFlagBanContentDigestForInputs, false);
+      BufferClear(&path_ids);
 
-    if (writetextfile_payload != nullptr)
-      flags |= NodeData::kFlagIsWriteTextFileAction;
-    
-    BinarySegmentWriteUint32(node_data_seg, flags);
-    BinarySegmentWriteUint32(node_data_seg, reverse_remap[ni]);
-  }
+      for (size_t pi = 0, count = chunk->m_Paths.m_Size; pi < count; ++pi)
+      {
+        const char* path = chunk->m_Paths[pi];
+        uint32_t    hash = chunk->m_PathHashes[pi];
+        if (const uint32_t* id = HashTableLookup(&path_table, hash, path))
+        {
+          BufferAppendOne(&path_ids, heap, *id);
+        }
+        else
+        {
+          HashTableInsert(&path_table, hash, StrDup(&path_alloc, path), path_count);
+          WriteStringPtr(path_seg, path_str_seg, path);
+          BinarySegmentWriteUint32(path_seg, hash);
+          BufferAppendOne(&path_ids, heap, path_count++);
+        }
+      }
 
-  for (size_t i = 0; i < node_count; ++i)
-  {
-    BufferDestroy(&links[i].m_Links, heap);
+      const uint32_t* path_ref = chunk->m_PathRefs.m_Storage;
+      for (const DagPathArrayRef& ref : chunk->m_PathArrays)
+      {
+        BinarySegmentSetPointer(chunk->m_NodeDataSeg, ref.m_Pointer, BinarySegmentPosition(path_index_seg));
+        for (uint32_t i = 0; i < ref.m_Count; ++i)
+          BinarySegmentWriteUint32(path_index_seg, path_ids[*path_ref++]);
+      }
+
+      if (ci > 0)
+      {
+        BinarySegmentAlign(array2_seg, 4);
+        BinarySegmentAppend(node_data_seg, chunk->m_NodeDataSeg);
+        BinarySegmentAppend(array2_seg, chunk->m_ArraySeg);
+        BinarySegmentAppend(str_seg, chunk->m_StrSeg);
+        BinarySegmentAppend(writetextfile_payloads_seg, chunk->m_PayloadSeg);
+      }
+    }
+
+    DagNodeChunkDestroy(chunk, heap);
   }
 
+  // m_Paths
+  BinarySegmentWriteInt32(main_seg, int(path_count));
+  if (path_count > 0)
+    BinarySegmentWritePointer(main_seg, paths_ptr);
+  else
+    BinarySegmentWriteNullPointer(main_seg);
+
+  HashTableDestroy(&path_table);
+  LinearAllocDestroy(&path_alloc);
+  BufferDestroy(&path_ids, heap);
+  BufferDestroy(&common_string_ptrs, heap);
+
+  for (int i = 0; i < thread_count; ++i)
+    DagNodeReaderDestroy(&node_writer.m_NodeReaders[i]);
+
+  HeapFree(heap, node_writer.m_Chunks);
+  HeapFree(heap, node_writer.m_NodeReaders);
   HeapFree(heap, reverse_remap);
   HeapFree(heap, links);
+  HeapFree(heap, link_start);
 
-  return true;
+  return success;
 }
 
 static bool WriteStrHashArray(
@@ -468,7 +1116,7 @@ static bool GetBoolean(const JsonObjectValue* obj, const char* name)
   return false;
 }
 
-static bool WriteScanner(BinaryLocator* ptr_out, BinarySegment* seg, BinarySegment* array_seg, BinarySegment* str_seg, const JsonObjectValue* data, HashTable<CommonStringRecord, kFlagCaseSensitive>* shared_strings, MemAllocLinear* scratch)
+static bool WriteScanner(BinaryLocator* ptr_out, BinarySegment* seg, BinarySegment* array_seg, BinarySegment* str_seg, const JsonObjectValue* data, HashTable<CommonStringRecord, kFlagCaseSensitive>* shared_strings, MemAllocLinear* string_alloc)
 {
   if (!data)
     return false;
@@ -487,6 +1135,8 @@ static bool WriteScanner(BinaryLocator* ptr_out, BinarySegment* seg, BinarySegme
     type = ScannerType::kCpp;
   else if (0 == strcmp(kind, "generic"))
     type = ScannerType::kGeneric;
+  else if (0 == strcmp(kind, "cpp-pp"))
+    type = ScannerType::kCppPreprocessor;
   else
     return false;
 
@@ -502,7 +1152,7 @@ static bool WriteScanner(BinaryLocator* ptr_out, BinarySegment* seg, BinarySegme
     if (!path)
       return false;
     HashAddPath(&h, path);
-    WriteCommonStringPtr(array_seg, str_seg, path, shared_strings, scratch);
+    WriteCommonStringPtr(array_seg, str_seg, path, shared_strings, string_alloc);
   }
 
   void* digest_space = BinarySegmentAlloc(seg, sizeof(HashDigest));
@@ -560,80 +1210,40 @@ static bool WriteScanner(BinaryLocator* ptr_out, BinarySegment* seg, BinarySegme
     }
   }
 
-  HashFinalize(&h, static_cast<HashDigest*>(digest_space));
-
-  return true;
-}
-
-bool ComputeNodeGuids(const JsonArrayValue* nodes, int32_t* remap_table, TempNodeGuid* guid_table)
-{
-  size_t node_count = nodes->m_Count;
-  for (size_t i = 0; i < node_count; ++i)
+  if (ScannerType::kCppPreprocessor == type)
   {
-    const JsonObjectValue* nobj = nodes->m_Values[i]->AsObject();
-
-    if (!nobj)
-      return false;
+    const JsonArrayValue* defines = FindArrayValue(data, "Defines");
+    size_t define_count = defines ? defines->m_Count : 0;
 
-    guid_table[i].m_Node = (int) i;
-
-    HashState h;
-    HashInit(&h);
-
-    const JsonArrayValue *outputs    = FindArrayValue(nobj, "Outputs");
-    bool didHashAnyOutputs = false;
-    if (outputs)
+    BinarySegmentWriteInt32(seg, (int) define_count);
+    if (define_count > 0)
     {
-      for (size_t fi = 0, fi_count = outputs->m_Count; fi < fi_count; ++fi)
+      BinarySegmentAlign(array_seg, 4);
+      BinarySegmentWritePointer(seg, BinarySegmentPosition(array_seg));
+      for (size_t i = 0; i < define_count; ++i)
       {
-        if (const JsonStringValue* str = outputs->m_Values[fi]->AsString())
-        {
-          HashAddString(&h, str->m_String);
-          didHashAnyOutputs = true;
-        }
+        const char* define = defines->m_Values[i]->GetString();
+        if (!define)
+          return false;
+        HashAddString(&h, define);
+        WriteCommonStringPtr(array_seg, str_seg, define, shared_strings, string_alloc);
       }
     }
-
-    if (didHashAnyOutputs)
-    {
-        HashAddString(&h, "salt for outputs");
-    }
     else
     {
-      // For nodes with no outputs, preserve the legacy behaviour
-
-      const char           *action     = FindStringValue(nobj, "Action");
-      const JsonArrayValue *inputs     = FindArrayValue(nobj, "Inputs");
-
-      if (action && action[0])
-        HashAddString(&h, action);
-
-      if (inputs)
-      {
-        for (size_t fi = 0, fi_count = inputs->m_Count; fi < fi_count; ++fi)
-        {
-          if (const JsonStringValue* str = inputs->m_Values[fi]->AsString())
-          {
-            HashAddString(&h, str->m_String);
-          }
-        }
-      }
-
-      const char *annotation = FindStringValue(nobj, "Annotation");
-
-      if (annotation)
-        HashAddString(&h, annotation);
+      BinarySegmentWriteNullPointer(seg);
+    }
+  }
 
-      if ((!action || action[0] == '\0') && !inputs && !annotation)
-      {
-          return false;
-      }
+  HashFinalize(&h, static_cast<HashDigest*>(digest_space));
 
-      HashAddString(&h, "salt for legacy");
-    }
+  return true;
+}
 
-    HashFinalize(&h, &guid_table[i].m_Digest);
-  }
+static bool ComputeNodeGuids(DagJsonReader* reader, int32_t* remap_table)
+{
+  TempNodeGuid *guid_table = reader->m_Guids.m_Storage;
+  size_t        node_count = reader->m_Guids.m_Size;
 
   std::sort(guid_table, guid_table + node_count);
 
@@ -643,10 +1253,8 @@ bool ComputeNodeGuids(const JsonArrayValue* nodes, int32_t* remap_table, TempNod
     {
       int i0 = guid_table[i-1].m_Node;
       int i1 = guid_table[i].m_Node;
-      const JsonObjectValue* o0 = nodes->m_Values[i0]->AsObject();
-      const JsonObjectValue* o1 = nodes->m_Values[i1]->AsObject();
-      const char* anno0 = FindStringValue(o0, "Annotation");
-      const char* anno1 = FindStringValue(o1, "Annotation");
+      const char* anno0 = StrDup(&reader->m_RootAlloc, FindStringValue(DagJsonReadNode(reader, &reader->m_NodeReader, i0), "Annotation", ""));
+      const char* anno1 = FindStringValue(DagJsonReadNode(reader, &reader->m_NodeReader, i1), "Annotation", "");
       char digest[kDigestStringSize];
       DigestToString(digest, guid_table[i].m_Digest);
       Log(kError, "duplicate node guids: %s and %s share common GUID (%s)", anno0, anno1, digest);
@@ -739,7 +1347,7 @@ bool WriteSharedResources(const JsonArrayValue* resources, BinarySegment* main_s
 }
 
 
-static bool CompileDag(const JsonObjectValue* root, BinaryWriter* writer, MemAllocHeap* heap, MemAllocLinear* scratch)
+static bool CompileDag(DagJsonReader* reader, const JsonObjectValue* root, BinaryWriter* writer, MemAllocHeap* heap, MemAllocLinear* scratch, HelperPool* helpers)
 {
   HashTable<CommonStringRecord, kFlagCaseSensitive> shared_strings;
   HashTableInit(&shared_strings, heap);
@@ -759,6 +1367,12 @@ static bool CompileDag(const JsonObjectValue* root, BinaryWriter* writer, MemAll
   const JsonArrayValue  *shared_resources = FindArrayValue(root, "SharedResources");
   const char*           identifier     = FindStringValue(root, "Identifier", "default");
 
+  if (!nodes)
+  {
+    fprintf(stderr, "invalid Nodes data\n");
+    return false;
+  }
+
   if (EmptyArray(passes))
   {
     fprintf(stderr, "invalid Passes data\n");
@@ -773,7 +1387,7 @@ static bool CompileDag(const JsonObjectValue* root, BinaryWriter* writer, MemAll
     scanner_ptrs = (BinaryLocator*) alloca(sizeof(BinaryLocator) * scanners->m_Count);
     for (size_t i = 0, count = scanners->m_Count; i < count; ++i)
     {
-      if (!WriteScanner(&scanner_ptrs[i], aux_seg, aux2_seg, str_seg, scanners->m_Values[i]->AsObject(), &shared_strings, scratch))
+      if (!WriteScanner(&scanner_ptrs[i], aux_seg, aux2_seg, str_seg, scanners->m_Values[i]->AsObject(), &shared_strings, &reader->m_RootAlloc))
       {
         fprintf(stderr, "invalid scanner data\n");
         return false;
@@ -786,19 +1400,20 @@ static bool CompileDag(const JsonObjectValue* root, BinaryWriter* writer, MemAll
 
   BinarySegmentWriteUint32(main_seg, Djb2Hash(identifier));
 
-  // Compute node guids and index remapping table.
+  // Compute node guids and index remapping table. The nodes were read while
+  // streaming the document, the root only has an empty array for them.
   // FIXME: this just leaks
-  int32_t      *remap_table = HeapAllocateArray<int32_t>(heap, nodes->m_Count);
-  TempNodeGuid *guid_table  = HeapAllocateArray<TempNodeGuid>(heap, nodes->m_Count);
+  size_t        node_count  = reader->m_Guids.m_Size;
+  int32_t      *remap_table = HeapAllocateArray<int32_t>(heap, node_count);
 
-  if (!ComputeNodeGuids(nodes, remap_table, guid_table))
+  if (!ComputeNodeGuids(reader, remap_table))
     return false;
 
   // m_NodeCount
-  size_t node_count = nodes->m_Count;
   BinarySegmentWriteInt32(main_seg, int(node_count));
 
   // Write node guids
+  const TempNodeGuid* guid_table = reader->m_Guids.m_Storage;
   BinarySegmentWritePointer(main_seg, BinarySegmentPosition(node_guid_seg));  // m_NodeGuids
   for (size_t i = 0; i < node_count; ++i)
   {
@@ -806,7 +1421,7 @@ static bool CompileDag(const JsonObjectValue* root, BinaryWriter* writer, MemAll
   }
 
   // Write nodes.
-  if (!WriteNodes(nodes, main_seg, node_data_seg, aux_seg, str_seg, writetextfile_payloads_seg, scanner_ptrs, heap, &shared_strings, scratch, guid_table, remap_table))
+  if (!WriteNodes(reader, writer, main_seg, node_data_seg, aux_seg, str_seg, writetextfile_payloads_seg, scanner_ptrs, heap, &shared_strings, &reader->m_RootAlloc, remap_table, helpers))
     return false;
 
   // Write passes
@@ -945,8 +1560,13 @@ static bool CompileDag(const JsonObjectValue* root, BinaryWriter* writer, MemAll
 
   if (const JsonArrayValue* file_sigs = FindArrayValue(root, "FileSignatures"))
   {
+    // A file modified this recently could change again within the same
+    // timestamp, so its contents are always compared.
+    const uint64_t racy_cutoff = uint64_t(time(nullptr)) - 2;
+
     size_t count = file_sigs->m_Count;
     BinarySegmentWriteInt32(main_seg, (int) count);
+    BinarySegmentAlign(aux_seg, 8);
     BinarySegmentWritePointer(main_seg, BinarySegmentPosition(aux_seg));
     for (size_t i = 0; i < count; ++i)
     {
@@ -960,11 +1580,18 @@ static bool CompileDag(const JsonObjectValue* root, BinaryWriter* writer, MemAll
           return false;
         }
 
-        int64_t timestamp = GetFileInfo(path).m_Timestamp;
+        FileInfo   info = GetFileInfo(path);
+        HashDigest digest;
+        if (!info.Exists() || !DigestFile(nullptr, path, info, &digest))
+          memset(&digest, 0, sizeof digest);
+
         WriteStringPtr(aux_seg, str_seg, path);
         char padding[4] = { 0, 0, 0, 0 };
         BinarySegmentWrite(aux_seg, padding, 4);
-        BinarySegmentWriteUint64(aux_seg, uint64_t(timestamp));
+        uint64_t timestamp = info.m_Timestamp >= racy_cutoff ? 0 : info.m_Timestamp;
+        BinarySegmentWriteUint64(aux_seg, timestamp);
+        BinarySegmentWrite(aux_seg, (const char*) &digest, sizeof digest);
+        BinarySegmentAlign(aux_seg, 8);
       }
       else
       {
@@ -998,12 +1625,40 @@ static bool CompileDag(const JsonObjectValue* root, BinaryWriter* writer, MemAll
         const char* filter = FindStringValue(sig, "Filter");
         bool recurse = FindIntValue(sig, "Recurse", 0) == 1;
 
-        HashDigest digest = CalculateGlobSignatureFor(path, filter, recurse, heap, scratch);
+        // Record the directories visited so the check can skip listing the
+        // ones that haven't changed.
+        struct DirectoryWriter
+        {
+          BinarySegment* m_Seg;
+          BinarySegment* m_StrSeg;
+          int32_t        m_Count;
+
+          static void Callback(void* user_data, const char* path, uint64_t mtime_ns, const HashDigest& digest)
+          {
+            DirectoryWriter* self = (DirectoryWriter*) user_data;
+            BinarySegmentWriteUint64(self->m_Seg, mtime_ns);
+            WriteStringPtr(self->m_Seg, self->m_StrSeg, path);
+            BinarySegmentWrite(self->m_Seg, (const char*) &digest, sizeof digest);
+            BinarySegmentAlign(self->m_Seg, 8);
+            self->m_Count++;
+          }
+        };
+
+        BinarySegmentAlign(aux2_seg, 8);
+        BinaryLocator dirs_ptr = BinarySegmentPosition(aux2_seg);
+        DirectoryWriter dir_writer = { aux2_seg, str_seg, 0 };
+
+        HashDigest digest = CalculateGlobSignatureFor(path, filter, recurse, heap, scratch, &dir_writer, DirectoryWriter::Callback);
 
         WriteStringPtr(aux_seg, str_seg, path);
         WriteStringPtr(aux_seg, str_seg, filter);
         BinarySegmentWrite(aux_seg, (char*) &digest, sizeof digest);
         BinarySegmentWriteInt32(aux_seg, recurse ? 1 : 0);
+        BinarySegmentWriteInt32(aux_seg, dir_writer.m_Count);
+        if (dir_writer.m_Count > 0)
+          BinarySegmentWritePointer(aux_seg, dirs_ptr);
+        else
+          BinarySegmentWriteNullPointer(aux_seg);
       }
     }
   }
@@ -1067,26 +1722,25 @@ static bool CompileDag(const JsonObjectValue* root, BinaryWriter* writer, MemAll
   return true;
 }
 
-static bool CreateDagFromJsonData(char* json_memory, const char* dag_fn)
+static bool CreateDag(const char* json_data, size_t json_size, DagEventSource source, const char* dag_fn, HelperPool* helpers)
 {
   MemAllocHeap heap;
   HeapInit(&heap);
 
-  MemAllocLinear alloc;
   MemAllocLinear scratch;
 
-  LinearAllocInit(&alloc, &heap, MB(256), "json alloc");
   LinearAllocInit(&scratch, &heap, MB(64), "json scratch");
 
+  DagJsonReader reader;
+  DagJsonReaderInit(&reader, &heap, json_data, source);
+
   char error_msg[1024];
 
   bool result = false;
 
-  const JsonValue* value = JsonParse(json_memory, &alloc, &scratch, error_msg);
-
-  if (value)
+  if (source(json_data, json_size, &heap, &reader, DagJsonIndexCallback, error_msg))
   {
-    if (const JsonObjectValue* obj = value->AsObject())
+    if (const JsonObjectValue* obj = reader.m_Root->AsObject())
     {
       if (obj->m_Count == 0)
       {
@@ -1097,7 +1751,7 @@ static bool CreateDagFromJsonData(char* json_memory, const char* dag_fn)
       BinaryWriter writer;
       BinaryWriterInit(&writer, &heap);
 
-      result = CompileDag(obj, &writer, &heap, &scratch);
+      result = CompileDag(&reader, obj, &writer, &heap, &scratch, helpers);
 
       result = result && BinaryWriterFlush(&writer, dag_fn);
 
@@ -1108,13 +1762,13 @@ static bool CreateDagFromJsonData(char* json_memory, const char* dag_fn)
       Log(kError, "bad JSON structure");
     }
   }
-  else
+  else if (!reader.m_Rejected)
   {
-    Log(kError, "failed to parse JSON: %s", error_msg);
+    Log(kError, "failed to %s: %s", JsonEventReplay == source ? "replay DAG events" : "parse JSON", error_msg);
   }
 
+  DagJsonReaderDestroy(&reader);
   LinearAllocDestroy(&scratch);
-  LinearAllocDestroy(&alloc);
 
   HeapDestroy(&heap);
   return result;
@@ -1186,7 +1840,12 @@ static bool RunExternalTool(const char* options, ...)
   return true;
 }
 
-bool GenerateDag(const char* script_fn, const char* dag_fn)
+bool CompileDagFromEvents(const char* events, size_t size, const char* dag_fn, HelperPool* helpers)
+{
+  return CreateDag(events, size, JsonEventReplay, dag_fn, helpers);
+}
+
+bool GenerateDag(const char* script_fn, const char* dag_fn, HelperPool* helpers, bool via_json)
 {
   Log(kDebug, "regenerating DAG data");
 
@@ -1194,49 +1853,48 @@ bool GenerateDag(const char* script_fn, const char* dag_fn)
   snprintf(json_filename, sizeof json_filename, "%s.json", dag_fn);
   json_filename[sizeof(json_filename)- 1] = '\0';
 
-  // Nuke any old JSON data.
+  // Nuke any old data, so it's clear what the frontend produced.
   remove(json_filename);
+  remove(dag_fn);
 
-  // Run DAG generator.
-  if (!RunExternalTool("generate-dag %s %s", script_fn, json_filename))
+  // Run DAG generator. Unless JSON is asked for, t2-lua compiles the DAG and
+  // writes it itself. Frontends that don't know the last argument write JSON.
+  bool tool_ok = via_json ?
+    RunExternalTool("generate-dag %s %s", script_fn, json_filename) :
+    RunExternalTool("generate-dag %s %s %s", script_fn, json_filename, dag_fn);
+
+  if (!tool_ok)
     return false;
 
   FileInfo json_info = GetFileInfo(json_filename);
   if (!json_info.Exists())
   {
+    if (!via_json && GetFileInfo(dag_fn).Exists())
+    {
+      Log(kDebug, "frontend wrote %s directly", dag_fn);
+      return true;
+    }
+
     Log(kError, "build script didn't generate %s", json_filename);
     return false;
   }
 
-  size_t json_size = size_t(json_info.m_Size + 1);
-  char* json_memory = (char*) malloc(json_size);
-  if (!json_memory)
-    Croak("couldn't allocate memory for JSON buffer");
+  // Map the file rather than reading it in; it is parsed straight from the
+  // mapping.
+  MemoryMappedFile json_file;
+  MmapFileInit(&json_file);
+  MmapFileMap(&json_file, json_filename);
 
-  FILE* f = fopen(json_filename, "rb");
-  if (!f)
+  if (!MmapFileValid(&json_file))
   {
+    MmapFileDestroy(&json_file);
     Log(kError, "couldn't open %s for reading", json_filename);
     return false;
   }
 
-  size_t read_count = fread(json_memory, 1, json_size - 1, f);
-  if (json_size - 1 != read_count)
-  {
-    fclose(f);
-    free(json_memory);
-    Log(kError, "couldn't read JSON data (%d bytes read out of %d)",
-        json_filename, (int) read_count, (int) json_size);
-    return false;
-  }
-
-  fclose(f);
-
-  json_memory[json_size-1] = 0;
-
-  bool success = CreateDagFromJsonData(json_memory, dag_fn);
+  bool success = CreateDag((const char*) json_file.m_Address, json_file.m_Size, JsonSaxParse, dag_fn, helpers);
 
-  free(json_memory);
+  MmapFileDestroy(&json_file);
 
   return success;
 }
@@ -8,7 +8,18 @@ struct lua_State;
 namespace t2
 {
 
-bool GenerateDag(const char* build_file, const char* dag_fn);
+struct HelperPool;
+
+// Runs the frontend and compiles its output to a binary DAG. Nodes are written
+// on the helper pool if one is given. The frontend compiles the DAG itself
+// unless `via_json` is set, in which case it writes JSON next to the DAG file
+// for inspection.
+bool GenerateDag(const char* build_file, const char* dag_fn, HelperPool* helpers, bool via_json);
+
+// Compiles `size` bytes of the frontend's JSON events, as recorded by a
+// JsonEventRecorder, to a binary DAG. This is how the Lua frontend writes the
+// DAG directly.
+bool CompileDagFromEvents(const char* events, size_t size, const char* dag_fn, HelperPool* helpers);
 
 bool GenerateIdeIntegrationFiles(const char* build_file, int argc, const char** argv);
 
@@ -0,0 +1,290 @@
+#include "DepFile.hpp"
+#include "MemAllocLinear.hpp"
+#include "MemAllocHeap.hpp"
+#include "HashTable.hpp"
+
+#include <cstring>
+
+namespace t2
+{
+
+static const char kMsvcIncludePrefix[] = "Note: including file:";
+
+struct DepFileList
+{
+  DepFileEntry* m_Head = nullptr;
+  DepFileEntry* m_Tail = nullptr;
+
+  void Add(MemAllocLinear* alloc, const char* path)
+  {
+    DepFileEntry* entry = LinearAllocate<DepFileEntry>(alloc);
+    entry->m_Path = path;
+    entry->m_Next = nullptr;
+    if (m_Tail)
+      m_Tail->m_Next = entry;
+    else
+      m_Head = entry;
+    m_Tail = entry;
+  }
+};
+
+static bool IsBlank(char c)
+{
+  return c == ' ' || c == '\t';
+}
+
+static bool IsLineEnd(char c)
+{
+  return c == '\n' || c == '\r';
+}
+
+static bool IsTokenEnd(const char* p, const char* end)
+{
+  return p == end || IsBlank(*p) || IsLineEnd(*p);
+}
+
+// True if p points at a backslash-newline line continuation.
+static bool IsContinuation(const char* p, const char* end)
+{
+  return *p == '\\' && p + 1 < end && IsLineEnd(p[1]);
+}
+
+static const char* SkipContinuation(const char* p, const char* end)
+{
+  ++p;
+  if (*p == '\r' && p + 1 < end && p[1] == '\n')
+    ++p;
+  return p + 1;
+}
+
+static char* UnescapeMakeToken(MemAllocLinear* alloc, const char* start, const char* end)
+{
+  char* result = (char*) LinearAllocate(alloc, size_t(end - start) + 1, 1);
+  char* out = result;
+
+  for (const char* p = start; p < end; ++p)
+  {
+    if (p[0] == '\\' && p + 1 < end && (p[1] == ' ' || p[1] == '#'))
+      ++p;
+    else if (p[0] == '$' && p + 1 < end && p[1] == '$')
+      ++p;
+    *out++ = *p;
+  }
+
+  *out = '\0';
+  return result;
+}
+
+DepFileEntry* ParseMakeDepFile(const char* text, size_t len, MemAllocLinear* alloc)
+{
+  DepFileList list;
+  const char* p = text;
+  const char* end = text + len;
+  bool in_prerequisites = false;
+
+  while (p < end)
+  {
+    if (IsBlank(*p))
+    {
+      ++p;
+      continue;
+    }
+
+    if (IsContinuation(p, end))
+    {
+      p = SkipContinuation(p, end);
+      continue;
+    }
+
+    if (IsLineEnd(*p))
+    {
+      // A new line without a continuation starts a new rule.
+      in_prerequisites = false;
+      ++p;
+      continue;
+    }
+
+    if (*p == '#')
+    {
+      while (p < end && !IsLineEnd(*p))
+        ++p;
+      continue;
+    }
+
+    if (!in_prerequisites && *p == ':')
+    {
+      in_prerequisites = true;
+      ++p;
+      continue;
+    }
+
+    const char* start = p;
+    while (p < end && !IsBlank(*p) && !IsLineEnd(*p) && !IsContinuation(p, end))
+    {
+      // A colon ends the target list only when followed by whitespace, so
+      // that drive letters in Windows paths are kept intact.
+      if (!in_prerequisites && *p == ':' && IsTokenEnd(p + 1, end))
+        break;
+
+      if (p[0] == '\\' && p + 1 < end && (p[1] == ' ' || p[1] == '#'))
+        ++p;
+
+      ++p;
+    }
+
+    if (!in_prerequisites)
+      continue;
+
+    // Skip the order-only separator.
+    if (p - start == 1 && *start == '|')
+      continue;
+
+    list.Add(alloc, UnescapeMakeToken(alloc, start, p));
+  }
+
+  return list.m_Head;
+}
+
+static bool IsMsvcIncludeLine(const char* line, const char* line_end)
+{
+  size_t prefix_len = sizeof(kMsvcIncludePrefix) - 1;
+  return size_t(line_end - line) >= prefix_len && 0 == memcmp(line, kMsvcIncludePrefix, prefix_len);
+}
+
+static const char* FindLineEnd(const char* p, const char* end)
+{
+  const char* nl = (const char*) memchr(p, '\n', size_t(end - p));
+  return nl ? nl : end;
+}
+
+DepFileEntry* ParseMsvcIncludes(const char* text, size_t len, MemAllocLinear* alloc)
+{
+  DepFileList list;
+  const char* end = text + len;
+
+  for (const char* line = text; line < end; )
+  {
+    const char* line_end = FindLineEnd(line, end);
+
+    if (IsMsvcIncludeLine(line, line_end))
+    {
+      // The path is indented by include depth; strip that and any trailing CR.
+      const char* path = line + sizeof(kMsvcIncludePrefix) - 1;
+      const char* path_end = line_end;
+      while (path < path_end && IsBlank(*path))
+        ++path;
+      while (path_end > path && (IsBlank(path_end[-1]) || IsLineEnd(path_end[-1])))
+        --path_end;
+
+      if (path < path_end)
+        list.Add(alloc, StrDupN(alloc, path, size_t(path_end - path)));
+    }
+
+    line = line_end < end ? line_end + 1 : end;
+  }
+
+  return list.m_Head;
+}
+
+DepFileEntry* ParseFileTrace(const char* text, size_t len, MemAllocLinear* alloc, DepFileEntry** writes, DepFileEntry** misses)
+{
+  DepFileList reads, written, missed;
+  const char* end = text + len;
+
+  MemAllocHeap* heap = alloc->m_BackingHeap;
+  HashSet<kFlagPathStrings> seen_reads, seen_writes, seen_misses;
+  HashSetInit(&seen_reads, heap);
+  HashSetInit(&seen_writes, heap);
+  HashSetInit(&seen_misses, heap);
+
+  for (const char* line = text; line < end; )
+  {
+    const char* line_end = FindLineEnd(line, end);
+    const char* next = line_end < end ? line_end + 1 : end;
+
+    // A process killed mid-write can leave a partial last line; skip it.
+    if (line_end - line > 2 && line[1] == ' ' && (line[0] == 'r' || line[0] == 'w' || line[0] == 'n') && line_end < end)
+    {
+      const char* path = StrDupN(alloc, line + 2, size_t(line_end - line - 2));
+      uint32_t hash = Djb2HashPath(path);
+
+      if (line[0] == 'w')
+      {
+        if (!HashSetLookup(&seen_writes, hash, path))
+        {
+          HashSetInsert(&seen_writes, hash, path);
+          written.Add(alloc, path);
+        }
+      }
+      else if (line[0] == 'n')
+      {
+        if (!HashSetLookup(&seen_misses, hash, path))
+        {
+          HashSetInsert(&seen_misses, hash, path);
+          missed.Add(alloc, path);
+        }
+      }
+      else if (!HashSetLookup(&seen_reads, hash, path))
+      {
+        HashSetInsert(&seen_reads, hash, path);
+        reads.Add(alloc, path);
+      }
+    }
+
+    line = next;
+  }
+
+  // Files the action wrote itself are outputs or temporaries, not inputs.
+  DepFileEntry** link = &reads.m_Head;
+  while (DepFileEntry* entry = *link)
+  {
+    if (HashSetLookup(&seen_writes, Djb2HashPath(entry->m_Path), entry->m_Path))
+      *link = entry->m_Next;
+    else
+      link = &entry->m_Next;
+  }
+
+  // A path that was found after all, by this or a later process, is a read.
+  link = &missed.m_Head;
+  while (DepFileEntry* entry = *link)
+  {
+    uint32_t hash = Djb2HashPath(entry->m_Path);
+    if (HashSetLookup(&seen_reads, hash, entry->m_Path) || HashSetLookup(&seen_writes, hash, entry->m_Path))
+      *link = entry->m_Next;
+    else
+      link = &entry->m_Next;
+  }
+
+  HashSetDestroy(&seen_misses);
+  HashSetDestroy(&seen_writes);
+  HashSetDestroy(&seen_reads);
+
+  *writes = written.m_Head;
+  *misses = missed.m_Head;
+  return reads.m_Head;
+}
+
+size_t StripMsvcIncludes(char* text, size_t len)
+{
+  const char* end = text + len;
+  char* out = text;
+
+  for (const char* line = text; line < end; )
+  {
+    const char* line_end = FindLineEnd(line, end);
+    const char* next = line_end < end ? line_end + 1 : end;
+
+    if (!IsMsvcIncludeLine(line, line_end))
+    {
+      size_t line_len = size_t(next - line);
+      memmove(out, line, line_len);
+      out += line_len;
+    }
+
+    line = next;
+  }
+
+  return size_t(out - text);
+}
+
+}
@@ -0,0 +1,38 @@
+#ifndef DEPFILE_HPP
+#define DEPFILE_HPP
+
+#include "Common.hpp"
+
+namespace t2
+{
+
+struct MemAllocLinear;
+
+struct DepFileEntry
+{
+  const char   *m_Path;
+  DepFileEntry *m_Next;
+};
+
+// Returns the prerequisites of all rules in a make-style dependency file, in
+// file order. Targets are skipped. Escaped spaces, '#' and "$$" are unescaped;
+// other backslashes are kept so Windows paths survive.
+DepFileEntry* ParseMakeDepFile(const char* text, size_t len, MemAllocLinear* alloc);
+
+// Returns the paths of all /showIncludes lines in compiler output, in order.
+DepFileEntry* ParseMsvcIncludes(const char* text, size_t len, MemAllocLinear* alloc);
+
+// Parses the "r <path>" / "w <path>" / "n <path>" lines written by the
+// t2-trace.so shim. Returns the paths that were read in first-seen order,
+// without duplicates or paths that were also written. Written paths are
+// returned in *writes, and paths that were looked up but never found in
+// *misses.
+DepFileEntry* ParseFileTrace(const char* text, size_t len, MemAllocLinear* alloc, DepFileEntry** writes, DepFileEntry** misses);
+
+// Removes /showIncludes lines from compiler output in place so they are not
+// echoed or validated as unexpected output. Returns the new length.
+size_t StripMsvcIncludes(char* text, size_t len);
+
+}
+
+#endif
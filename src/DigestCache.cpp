@@ -1,6 +1,9 @@
 #include "DigestCache.hpp"
 #include "BinaryWriter.hpp"
 #include "Stats.hpp"
+#include "Buffer.hpp"
+#include "HelperPool.hpp"
+#include "Atomic.hpp"
 
 #include <algorithm>
 #include <time.h>
@@ -9,12 +12,16 @@
 namespace t2
 {
 
+// Throw out records that haven't been accessed in a week.
+static const uint64_t kRecordLifetime = 7 * 24 * 60 * 60;
+
 void DigestCacheInit(DigestCache* self, size_t heap_size, const char* filename)
 {
   ReadWriteLockInit(&self->m_Lock);
 
   self->m_Initialized = true;
   self->m_State = nullptr;
+  self->m_FrozenAccess = nullptr;
 
   HeapInit(&self->m_Heap);
   LinearAllocInit(&self->m_Allocator, &self->m_Heap, heap_size / 2, "digest allocator");
@@ -22,6 +29,11 @@ void DigestCacheInit(DigestCache* self, size_t heap_size, const char* filename)
   HashTableInit(&self->m_Table, &self->m_Heap);
 
   self->m_AccessTime = time(nullptr);
+  self->m_Generation = 0;
+
+  MutexInit(&self->m_InFlightLock);
+  CondInit(&self->m_InFlightDone);
+  self->m_InFlight = nullptr;
 
   MmapFileMap(&self->m_StateFile, filename);
   if (MmapFileValid(&self->m_StateFile))
@@ -29,26 +41,8 @@ void DigestCacheInit(DigestCache* self, size_t heap_size, const char* filename)
     const DigestCacheState* state = (const DigestCacheState*) self->m_StateFile.m_Address;
     if (DigestCacheState::MagicNumber == state->m_MagicNumber)
     {
-      const uint64_t time_now = time(nullptr);
-
-      // Throw out records that haven't been accessed in a week.
-      const uint64_t cutoff_time = time_now - 7 * 24 * 60 * 60;
-
       self->m_State = state;
-
-      //HashTablePrepareBulkInsert(&self->m_Table, state->m_Records.GetCount());
-
-      for (const FrozenDigestRecord& record : state->m_Records)
-      {
-        if (record.m_AccessTime < cutoff_time)
-          continue;
-
-        DigestCacheRecord r;
-        r.m_ContentDigest = record.m_ContentDigest;
-        r.m_Timestamp     = record.m_Timestamp;
-        r.m_AccessTime    = record.m_AccessTime;
-        HashTableInsert(&self->m_Table, record.m_FilenameHash, record.m_Filename.Get(), r);
-      }
+      self->m_FrozenAccess = HeapAllocateArrayZeroed<uint8_t>(&self->m_Heap, state->m_Records.GetCount());
       Log(kDebug, "digest cache initialized -- %d entries", state->m_Records.GetCount());
     }
     else
@@ -63,74 +57,296 @@ void DigestCacheDestroy(DigestCache* self)
   if (!self->m_Initialized)
     return;
   HashTableDestroy(&self->m_Table);
+  HeapFree(&self->m_Heap, self->m_FrozenAccess);
   MmapFileDestroy(&self->m_StateFile);
   LinearAllocDestroy(&self->m_Allocator);
   HeapDestroy(&self->m_Heap);
+  CondDestroy(&self->m_InFlightDone);
+  MutexDestroy(&self->m_InFlightLock);
   ReadWriteLockDestroy(&self->m_Lock);
 }
 
-bool DigestCacheSave(DigestCache* self, MemAllocHeap* serialization_heap, const char* filename, const char* tmp_filename)
+static int LookupFrozen(const DigestCacheState* state, const char* filename, uint32_t hash)
+{
+  if (!state)
+    return -1;
+
+  const uint32_t* hashes  = state->m_Hashes.GetArray();
+  const uint32_t* indices = state->m_RecordIndices.GetArray();
+  const uint32_t  mask    = uint32_t(state->m_Hashes.GetCount()) - 1;
+
+  for (uint32_t slot = hash & mask; indices[slot] != 0; slot = (slot + 1) & mask)
+  {
+    if (hashes[slot] != hash)
+      continue;
+
+    int index = int(indices[slot]) - 1;
+    const char* candidate = state->m_Records[index].m_Filename;
+
+#if ENABLED(TUNDRA_CASE_INSENSITIVE_FILESYSTEM)
+    if (0 == FastCompareNoCase(candidate, filename))
+#else
+    if (0 == strcmp(candidate, filename))
+#endif
+      return index;
+  }
+
+  return -1;
+}
+
+// Records are written in pieces on the helper pool. Each chunk takes a range
+// of the frozen records and a range of slots in the table of this session's
+// records, and writes them to its own segments. The probe table needs the
+// final record indices, so it is filled in as the chunks are joined.
+struct DigestCacheSaveChunk
+{
+  int32_t          m_FrozenBegin;
+  int32_t          m_FrozenEnd;
+  uint32_t         m_SlotBegin;
+  uint32_t         m_SlotEnd;
+  BinarySegment*   m_ArraySeg;
+  BinarySegment*   m_StringSeg;
+  Buffer<uint32_t> m_Hashes;    // Of the records written, in order
+};
+
+struct DigestCacheSaver
+{
+  enum
+  {
+    kMinChunkSize    = 1024,
+    kChunksPerThread = 4
+  };
+
+  DigestCache*          m_Cache;
+  MemAllocHeap*         m_Heap;
+  uint64_t              m_CutoffTime;
+  DigestCacheSaveChunk* m_Chunks;
+  uint32_t              m_ChunkCount;
+  uint32_t              m_NextChunk;
+};
+
+static void SaveDigestCacheChunk(const DigestCacheSaver* saver, DigestCacheSaveChunk* chunk)
+{
+  DigestCache*            self       = saver->m_Cache;
+  const DigestCacheState* state      = self->m_State;
+  BinarySegment*          array_seg  = chunk->m_ArraySeg;
+  BinarySegment*          string_seg = chunk->m_StringSeg;
+
+  auto save_record = [=](uint32_t hash, const char* path, const DigestFileStamp& stamp, uint64_t access_time, const HashDigest& digest)
+  {
+    BinarySegmentWriteUint64(array_seg, stamp.m_MtimeNs);
+    BinarySegmentWriteUint64(array_seg, stamp.m_CtimeNs);
+    BinarySegmentWriteUint64(array_seg, stamp.m_Size);
+    BinarySegmentWriteUint64(array_seg, stamp.m_Inode);
+    BinarySegmentWriteUint64(array_seg, stamp.m_Device);
+    BinarySegmentWriteUint64(array_seg, access_time);
+    BinarySegmentWriteUint32(array_seg, hash);
+    BinarySegmentWrite(array_seg, &digest, sizeof(digest));
+    BinarySegmentWritePointer(array_seg, BinarySegmentPosition(string_seg));
+    BinarySegmentWriteStringData(string_seg, path);
+#if ENABLED(USE_SHA1_HASH)
+    BinarySegmentWriteUint32(array_seg, 0); // m_Padding
+#endif
+
+    BufferAppendOne(&chunk->m_Hashes, saver->m_Heap, hash);
+  };
+
+  // Frozen records that are still live and haven't been replaced this session
+  // are carried over as they are.
+  for (int32_t i = chunk->m_FrozenBegin; i < chunk->m_FrozenEnd; ++i)
+  {
+    const FrozenDigestRecord& r = state->m_Records[i];
+
+    if (!self->m_FrozenAccess[i] && r.m_AccessTime < saver->m_CutoffTime)
+      continue;
+
+    if (HashTableLookup(&self->m_Table, r.m_FilenameHash, r.m_Filename.Get()))
+      continue;
+
+    uint64_t access_time = self->m_FrozenAccess[i] ? self->m_AccessTime : r.m_AccessTime;
+    save_record(r.m_FilenameHash, r.m_Filename, r.m_Stamp, access_time, r.m_ContentDigest);
+  }
+
+  HashTableWalkSlots(&self->m_Table, chunk->m_SlotBegin, chunk->m_SlotEnd, [=](uint32_t hash, const char* path, const DigestCacheRecord& r)
+  {
+    save_record(hash, path, r.m_Stamp, r.m_AccessTime, r.m_ContentDigest);
+  });
+}
+
+static void SaveDigestCacheChunks(void* context, int thread_index)
+{
+  DigestCacheSaver* saver = static_cast<DigestCacheSaver*>(context);
+
+  for (;;)
+  {
+    uint32_t index = AtomicIncrement(&saver->m_NextChunk) - 1;
+    if (index >= saver->m_ChunkCount)
+      break;
+
+    SaveDigestCacheChunk(saver, &saver->m_Chunks[index]);
+  }
+}
+
+uint32_t DigestCacheGeneration(DigestCache* self)
+{
+  ReadWriteLockRead(&self->m_Lock);
+  uint32_t result = self->m_Generation;
+  ReadWriteUnlockRead(&self->m_Lock);
+  return result;
+}
+
+bool DigestCacheWrite(DigestCache* self, MemAllocHeap* serialization_heap, const char* tmp_filename, HelperPool* helpers)
 {
   TimingScope timing_scope(nullptr, &g_Stats.m_DigestCacheSaveTimeCycles);
 
+  // Sets wait until the records have been serialized.
+  ReadWriteLockRead(&self->m_Lock);
+
+  const DigestCacheState* state = self->m_State;
+  const int32_t frozen_count = state ? state->m_Records.GetCount() : 0;
+  const uint32_t slot_count  = self->m_Table.m_TableSize;
+
   BinaryWriter writer;
   BinaryWriterInit(&writer, serialization_heap);
 
   BinarySegment *main_seg   = BinaryWriterAddSegment(&writer);
   BinarySegment *array_seg  = BinaryWriterAddSegment(&writer);
+  BinarySegment *table_seg  = BinaryWriterAddSegment(&writer);
   BinarySegment *string_seg = BinaryWriterAddSegment(&writer);
   BinaryLocator  array_ptr  = BinarySegmentPosition(array_seg);
 
-  auto save_record = [=](size_t index, uint32_t hash, const char* path, const DigestCacheRecord& r)
+  DigestCacheSaver saver;
+  saver.m_Cache      = self;
+  saver.m_Heap       = serialization_heap;
+  saver.m_CutoffTime = self->m_AccessTime - kRecordLifetime;
+  saver.m_NextChunk  = 0;
+
+  int thread_count = helpers ? helpers->m_MaxThreadCount + 1 : 1;
+
+  size_t chunk_count = (size_t(frozen_count) + self->m_Table.m_RecordCount) / DigestCacheSaver::kMinChunkSize;
+  if (chunk_count > size_t(thread_count) * DigestCacheSaver::kChunksPerThread)
+    chunk_count = size_t(thread_count) * DigestCacheSaver::kChunksPerThread;
+  if (chunk_count < 1)
+    chunk_count = 1;
+  if (size_t(thread_count) > chunk_count)
+    thread_count = int(chunk_count);
+
+  saver.m_ChunkCount = uint32_t(chunk_count);
+  saver.m_Chunks     = HeapAllocateArray<DigestCacheSaveChunk>(serialization_heap, chunk_count);
+
+  for (size_t ci = 0; ci < chunk_count; ++ci)
   {
-    BinarySegmentWriteUint64(array_seg, r.m_Timestamp);
-    BinarySegmentWriteUint64(array_seg, r.m_AccessTime);
-    BinarySegmentWriteUint32(array_seg, hash);
-    BinarySegmentWrite(array_seg, &r.m_ContentDigest, sizeof(r.m_ContentDigest));
-    BinarySegmentWritePointer(array_seg, BinarySegmentPosition(string_seg));
-    BinarySegmentWriteStringData(string_seg, path);
-    BinarySegmentWriteUint32(array_seg, 0); // m_Padding
-#if ENABLED(USE_FAST_HASH)
-    BinarySegmentWriteUint32(array_seg, 0); // m_Padding
-#endif
-  };
+    DigestCacheSaveChunk* chunk = &saver.m_Chunks[ci];
+    chunk->m_FrozenBegin = int32_t(ci * frozen_count / chunk_count);
+    chunk->m_FrozenEnd   = int32_t((ci + 1) * frozen_count / chunk_count);
+    chunk->m_SlotBegin   = uint32_t(ci * slot_count / chunk_count);
+    chunk->m_SlotEnd     = uint32_t((ci + 1) * slot_count / chunk_count);
+    chunk->m_ArraySeg    = 0 == ci ? array_seg : BinaryWriterAddSegment(&writer);
+    chunk->m_StringSeg   = 0 == ci ? string_seg : BinaryWriterAddSegment(&writer);
+    BufferInit(&chunk->m_Hashes);
+  }
+
+  if (thread_count > 1)
+    HelperPoolRun(helpers, SaveDigestCacheChunks, &saver, thread_count);
+  else
+    SaveDigestCacheChunks(&saver, 0);
 
-  HashTableWalk(&self->m_Table, save_record);
+  uint32_t record_count = 0;
+  for (size_t ci = 0; ci < chunk_count; ++ci)
+    record_count += uint32_t(saver.m_Chunks[ci].m_Hashes.m_Size);
+
+  // Keep the table at most half full so probe sequences stay short.
+  uint32_t table_size = 16;
+  while (table_size < 2 * record_count)
+    table_size *= 2;
+
+  uint32_t* hashes  = HeapAllocateArrayZeroed<uint32_t>(serialization_heap, table_size);
+  uint32_t* indices = HeapAllocateArrayZeroed<uint32_t>(serialization_heap, table_size);
+
+  uint32_t record_index = 0;
+
+  for (size_t ci = 0; ci < chunk_count; ++ci)
+  {
+    DigestCacheSaveChunk* chunk = &saver.m_Chunks[ci];
+
+    for (uint32_t hash : chunk->m_Hashes)
+    {
+      uint32_t slot = hash & (table_size - 1);
+      while (indices[slot] != 0)
+        slot = (slot + 1) & (table_size - 1);
+
+      hashes[slot]  = hash;
+      indices[slot] = ++record_index;
+    }
+
+    if (ci > 0)
+    {
+      BinarySegmentAppend(array_seg, chunk->m_ArraySeg);
+      BinarySegmentAppend(string_seg, chunk->m_StringSeg);
+    }
+
+    BufferDestroy(&chunk->m_Hashes, serialization_heap);
+  }
+
+  HeapFree(serialization_heap, saver.m_Chunks);
+
+  BinaryLocator hashes_ptr = BinarySegmentPosition(table_seg);
+  BinarySegmentWrite(table_seg, hashes, table_size * sizeof(uint32_t));
+  BinaryLocator indices_ptr = BinarySegmentPosition(table_seg);
+  BinarySegmentWrite(table_seg, indices, table_size * sizeof(uint32_t));
 
   BinarySegmentWriteUint32(main_seg, DigestCacheState::MagicNumber);
-  BinarySegmentWriteInt32(main_seg, (int) self->m_Table.m_RecordCount);
+  BinarySegmentWriteInt32(main_seg, (int) table_size);
+  BinarySegmentWritePointer(main_seg, hashes_ptr);
+  BinarySegmentWriteInt32(main_seg, (int) table_size);
+  BinarySegmentWritePointer(main_seg, indices_ptr);
+  BinarySegmentWriteInt32(main_seg, (int) record_count);
   BinarySegmentWritePointer(main_seg, array_ptr);
   BinarySegmentWriteUint32(main_seg, DigestCacheState::MagicNumber);
 
-  // Unmap old state to avoid sharing conflicts on Windows.
-  MmapFileUnmap(&self->m_StateFile);
-  self->m_State = nullptr;
+  HeapFree(serialization_heap, indices);
+  HeapFree(serialization_heap, hashes);
+
+  ReadWriteUnlockRead(&self->m_Lock);
 
   bool success = BinaryWriterFlush(&writer, tmp_filename);
 
-  if (success)
-  {
-    success = RenameFile(tmp_filename, filename);
-  }
-  else
-  {
+  if (!success)
     remove(tmp_filename);
-  }
 
   BinaryWriterDestroy(&writer);
 
   return success;
 }
 
-bool DigestCacheGet(DigestCache* self, const char* filename, uint32_t hash, uint64_t timestamp, HashDigest* digest_out)
+bool DigestCacheCommit(DigestCache* self, const char* filename, const char* tmp_filename)
+{
+  // Unmap old state to avoid sharing conflicts on Windows.
+  MmapFileUnmap(&self->m_StateFile);
+  self->m_State = nullptr;
+
+  return RenameFile(tmp_filename, filename);
+}
+
+bool DigestCacheSave(DigestCache* self, MemAllocHeap* serialization_heap, const char* filename, const char* tmp_filename, HelperPool* helpers)
+{
+  return DigestCacheWrite(self, serialization_heap, tmp_filename, helpers) &&
+         DigestCacheCommit(self, filename, tmp_filename);
+}
+
+bool DigestCacheGet(DigestCache* self, const char* filename, uint32_t hash, const FileInfo& info, HashDigest* digest_out)
 {
   bool result = false;
+  bool found  = false;
+
+  const DigestFileStamp stamp = DigestFileStampFromInfo(info);
 
   ReadWriteLockRead(&self->m_Lock);
 
   if (DigestCacheRecord* r = (DigestCacheRecord*) HashTableLookup(&self->m_Table, hash, filename))
   {
-    if (r->m_Timestamp == timestamp)
+    found = true;
+    if (r->m_Stamp == stamp)
     {
       // Technically violates r/w lock - doesn't matter
       r->m_AccessTime = self->m_AccessTime;
@@ -141,10 +357,32 @@ bool DigestCacheGet(DigestCache* self, const char* filename, uint32_t hash, uint
 
   ReadWriteUnlockRead(&self->m_Lock);
 
+  // Records from the previous session are only consulted if this session
+  // hasn't replaced them. They never change, so no lock is needed.
+  if (!found)
+  {
+    int index = LookupFrozen(self->m_State, filename, hash);
+    if (index >= 0)
+    {
+      const FrozenDigestRecord& r = self->m_State->m_Records[index];
+      if (r.m_Stamp == stamp)
+      {
+        // Racy, but every writer stores the same value.
+        if (!self->m_FrozenAccess[index])
+        {
+          self->m_FrozenAccess[index] = 1;
+          AtomicIncrement(&self->m_Generation);
+        }
+        *digest_out = r.m_ContentDigest;
+        result      = true;
+      }
+    }
+  }
+
   return result;
 }
 
-void DigestCacheSet(DigestCache* self, const char* filename, uint32_t hash, uint64_t timestamp, const HashDigest& digest)
+void DigestCacheSet(DigestCache* self, const char* filename, uint32_t hash, const FileInfo& info, const HashDigest& digest)
 {
   ReadWriteLockWrite(&self->m_Lock);
 
@@ -152,7 +390,7 @@ void DigestCacheSet(DigestCache* self, const char* filename, uint32_t hash, uint
 
   if (nullptr != (r = (DigestCacheRecord*) HashTableLookup(&self->m_Table, hash, filename)))
   {
-    r->m_Timestamp     = timestamp;
+    r->m_Stamp         = DigestFileStampFromInfo(info);
     r->m_ContentDigest = digest;
     r->m_AccessTime    = self->m_AccessTime;
   }
@@ -160,14 +398,62 @@ void DigestCacheSet(DigestCache* self, const char* filename, uint32_t hash, uint
   {
     DigestCacheRecord r;
     r.m_ContentDigest = digest;
-    r.m_Timestamp     = timestamp;
+    r.m_Stamp         = DigestFileStampFromInfo(info);
     r.m_AccessTime    = self->m_AccessTime;
     HashTableInsert(&self->m_Table, hash, StrDup(&self->m_Allocator, filename), r);
   }
 
+  AtomicIncrement(&self->m_Generation);
+
   ReadWriteUnlockWrite(&self->m_Lock);
 }
 
+bool DigestCacheGetOrBegin(DigestCache* self, const char* filename, uint32_t hash, const FileInfo& info, HashDigest* digest_out, DigestInFlight* claim)
+{
+  MutexLock(&self->m_InFlightLock);
+
+  for (;;)
+  {
+    if (DigestCacheGet(self, filename, hash, info, digest_out))
+    {
+      MutexUnlock(&self->m_InFlightLock);
+      AtomicIncrement(&g_Stats.m_DigestDuplicatesAvoided);
+      return true;
+    }
+
+    DigestInFlight* f = self->m_InFlight;
+    while (f && (f->m_Hash != hash || 0 != strcmp(f->m_Filename, filename)))
+      f = f->m_Next;
+
+    if (!f)
+      break;
+
+    // Someone else is on it. Whether they succeed or not, look again once they're done.
+    CondWait(&self->m_InFlightDone, &self->m_InFlightLock);
+  }
+
+  claim->m_Hash     = hash;
+  claim->m_Filename = filename;
+  claim->m_Next     = self->m_InFlight;
+  self->m_InFlight  = claim;
+
+  MutexUnlock(&self->m_InFlightLock);
+  return false;
+}
+
+void DigestCacheEnd(DigestCache* self, DigestInFlight* claim)
+{
+  MutexLock(&self->m_InFlightLock);
+
+  DigestInFlight** link = &self->m_InFlight;
+  while (*link != claim)
+    link = &(*link)->m_Next;
+  *link = claim->m_Next;
+
+  CondBroadcast(&self->m_InFlightDone);
+  MutexUnlock(&self->m_InFlightLock);
+}
+
 bool DigestCacheHasChanged(DigestCache* self, const char* filename, uint32_t hash)
 {
   if (self->m_State == NULL)
@@ -175,31 +461,21 @@ bool DigestCacheHasChanged(DigestCache* self, const char* filename, uint32_t has
       // No previous state, so we can't conclude that the hash changed
       return false;
   }
-    
-  const FrozenDigestRecord* prevDigest = nullptr;
-  for (const FrozenDigestRecord& frozenRecord : self->m_State->m_Records)
-  {
-    if (frozenRecord.m_FilenameHash != hash)
-      continue;
-
-    if (strcmp(frozenRecord.m_Filename, filename) != 0)
-      continue;
 
-    prevDigest = &frozenRecord;
-    break;
-  }
+  int frozen_index = LookupFrozen(self->m_State, filename, hash);
 
   ReadWriteLockRead(&self->m_Lock);
   DigestCacheRecord* r = (DigestCacheRecord*)HashTableLookup(&self->m_Table, hash, filename);
   ReadWriteUnlockRead(&self->m_Lock);
 
-  if (prevDigest == nullptr && r == nullptr)
+  // Nothing was digested this session, so whatever was there is still current.
+  if (r == nullptr)
     return false;
 
-  if (prevDigest == nullptr || r == nullptr)
+  if (frozen_index < 0)
     return true;
 
-  return prevDigest->m_ContentDigest != r->m_ContentDigest;
+  return self->m_State->m_Records[frozen_index].m_ContentDigest != r->m_ContentDigest;
 }
 
 }
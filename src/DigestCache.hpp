@@ -2,6 +2,7 @@
 #define TUNDRA_DIGESTCACHE_HPP
 
 #include "Common.hpp"
+#include "FileInfo.hpp"
 #include "BinaryData.hpp"
 #include "Hash.hpp"
 #include "HashTable.hpp"
@@ -9,43 +10,86 @@
 #include "MemAllocLinear.hpp"
 #include "MemAllocHeap.hpp"
 #include "ReadWriteLock.hpp"
+#include "Mutex.hpp"
+#include "ConditionVar.hpp"
 
 namespace t2
 {
   struct MemAllocHeap;
   struct MemAllocLinear;
   struct DigestCacheState;
+  struct HelperPool;
+
+  // What a cached digest was computed from. A digest is only reused if all of
+  // these still match, so same-second rewrites and files swapped in by rename
+  // are caught, not just changed mtimes.
+  struct DigestFileStamp
+  {
+    uint64_t                       m_MtimeNs;
+    uint64_t                       m_CtimeNs;
+    uint64_t                       m_Size;
+    uint64_t                       m_Inode;
+    uint64_t                       m_Device;
+
+    bool operator==(const DigestFileStamp& other) const
+    {
+      return m_MtimeNs == other.m_MtimeNs && m_CtimeNs == other.m_CtimeNs && m_Size == other.m_Size &&
+             m_Inode == other.m_Inode && m_Device == other.m_Device;
+    }
+  };
+
+  inline DigestFileStamp DigestFileStampFromInfo(const FileInfo& info)
+  {
+    DigestFileStamp stamp;
+    stamp.m_MtimeNs = info.m_MtimeNs;
+    stamp.m_CtimeNs = info.m_CtimeNs;
+    stamp.m_Size    = info.m_Size;
+    stamp.m_Inode   = info.m_Inode;
+    stamp.m_Device  = info.m_Device;
+    return stamp;
+  }
 
   struct FrozenDigestRecord
   {
-    uint64_t                       m_Timestamp;
+    DigestFileStamp                m_Stamp;
     uint64_t                       m_AccessTime;
     uint32_t                       m_FilenameHash;
     HashDigest                     m_ContentDigest;
     FrozenString                   m_Filename;
 #if ENABLED(USE_SHA1_HASH)
     uint32_t                       m_Padding;
-#elif ENABLED(USE_FAST_HASH)
-    uint32_t                       m_Padding[2];
 #endif
   };
-  static_assert(sizeof(FrozenDigestRecord) == 48, "struct size");
+  static_assert(sizeof(FrozenDigestRecord) == (ENABLED(USE_SHA1_HASH) ? 80 : 72), "struct size");
 
+  // The digest cache file is an open addressing hash table that is probed
+  // straight from the mapping. m_Hashes has a power-of-two number of slots,
+  // each holding a filename hash, and m_RecordIndices one more than the index
+  // of the record for that slot (or 0 if the slot is empty).
   struct DigestCacheState
   {
-    static const uint32_t           MagicNumber   = 0x12781fa7 ^ kTundraHashMagic;
+    static const uint32_t           MagicNumber   = 0x12781faa ^ kTundraHashMagic;
 
     uint32_t                        m_MagicNumber;
+    FrozenArray<uint32_t>           m_Hashes;
+    FrozenArray<uint32_t>           m_RecordIndices;
     FrozenArray<FrozenDigestRecord> m_Records;
   };
 
   struct DigestCacheRecord
   {
-    HashDigest m_ContentDigest;
-    uint64_t   m_Timestamp;
-    uint64_t   m_AccessTime;
+    HashDigest      m_ContentDigest;
+    DigestFileStamp m_Stamp;
+    uint64_t        m_AccessTime;
   };
 
+  // A digest some thread has claimed to compute, see DigestCacheGetOrBegin().
+  struct DigestInFlight
+  {
+    uint32_t        m_Hash;
+    const char*     m_Filename;
+    DigestInFlight* m_Next;
+  };
 
   struct DigestCache
   {
@@ -55,19 +99,49 @@ namespace t2
     MemAllocHeap            m_Heap;
     MemAllocLinear          m_Allocator;
     MemoryMappedFile        m_StateFile;
+    // Flags frozen records that were used, so they are kept on save.
+    uint8_t*                m_FrozenAccess;
+    // Records added or updated this session. These shadow frozen records.
     HashTable<DigestCacheRecord, kFlagPathStrings> m_Table;
     uint64_t                m_AccessTime;
+    // Bumped whenever something that is saved changes.
+    uint32_t                m_Generation;
+    Mutex                   m_InFlightLock;
+    ConditionVariable       m_InFlightDone;
+    DigestInFlight*         m_InFlight;
   };
 
   void DigestCacheInit(DigestCache* self, size_t heap_size, const char* filename);
 
   void DigestCacheDestroy(DigestCache* self);
 
-  bool DigestCacheSave(DigestCache* self, MemAllocHeap* serialization_heap, const char* filename, const char* tmp_filename);
+  // A write made while other threads use the cache only holds what it saw, so
+  // it is current as long as the generation is the same as before it started.
+  uint32_t DigestCacheGeneration(DigestCache* self);
+
+  // Writes the cache to tmp_filename, leaving it usable. Safe to call while
+  // other threads use the cache. Splits the work over helpers if there are any.
+  bool DigestCacheWrite(DigestCache* self, MemAllocHeap* serialization_heap, const char* tmp_filename, HelperPool* helpers);
+
+  // Moves a file from DigestCacheWrite() into place. The previous session's
+  // records are unmapped first, so the cache can't be used after this.
+  bool DigestCacheCommit(DigestCache* self, const char* filename, const char* tmp_filename);
+
+  // DigestCacheWrite() followed by DigestCacheCommit().
+  bool DigestCacheSave(DigestCache* self, MemAllocHeap* serialization_heap, const char* filename, const char* tmp_filename, HelperPool* helpers);
+
+  bool DigestCacheGet(DigestCache* self, const char* filename, uint32_t hash, const FileInfo& info, HashDigest* digest_out);
+
+  void DigestCacheSet(DigestCache* self, const char* filename, uint32_t hash, const FileInfo& info, const HashDigest& digest);
 
-  bool DigestCacheGet(DigestCache* self, const char* filename, uint32_t hash, uint64_t timestamp, HashDigest* digest_out);
+  // Call after DigestCacheGet() misses. If another thread is computing the
+  // digest of the same file, waits for it to finish and uses its result.
+  // Otherwise the caller has claimed the file and must compute the digest,
+  // store it with DigestCacheSet() and then call DigestCacheEnd(), even if it
+  // failed.
+  bool DigestCacheGetOrBegin(DigestCache* self, const char* filename, uint32_t hash, const FileInfo& info, HashDigest* digest_out, DigestInFlight* claim);
 
-  void DigestCacheSet(DigestCache* self, const char* filename, uint32_t hash, uint64_t timestamp, const HashDigest& digest);
+  void DigestCacheEnd(DigestCache* self, DigestInFlight* claim);
 
   bool DigestCacheHasChanged(DigestCache* self, const char* filename, uint32_t hash);
 }
@@ -0,0 +1,136 @@
+#include "DigestPrefetch.hpp"
+#include "DagData.hpp"
+#include "StateData.hpp"
+#include "NodeState.hpp"
+#include "FileSign.hpp"
+#include "Atomic.hpp"
+
+namespace t2
+{
+
+static void PrefetchIfContentSigned(DigestPrefetch* self, const char* filename, uint32_t fn_hash)
+{
+  if (!ShouldUseSHA1SignatureFor(filename, self->m_ShaExtensionHashes, self->m_ShaExtensionHashCount))
+    return;
+
+  // The stat cache must not see a file while it is being written.
+  if (HashSetLookup(&self->m_Outputs, fn_hash, filename))
+    return;
+
+  PrefetchFileDigest(self->m_StatCache, self->m_DigestCache, filename, fn_hash);
+}
+
+static ThreadRoutineReturnType TUNDRA_STDCALL PrefetchThreadRoutine(void* param)
+{
+  DigestPrefetch* self = static_cast<DigestPrefetch*>(param);
+
+  ThreadSetLowPriority();
+
+  // Nodes are claimed in build order, which is roughly the order the build
+  // threads will want the digests in.
+  while (!self->m_Yield)
+  {
+    uint32_t index = AtomicIncrement(&self->m_NextNode) - 1;
+    if (index >= self->m_NodeCount)
+      break;
+
+    const NodeState* node      = self->m_Nodes + index;
+    const NodeData*  node_data = node->m_MmapData;
+
+    if (node_data->m_Flags & NodeData::kFlagBanContentDigestForInputs)
+      continue;
+
+    for (const FrozenFileAndHash& input : DagPathList(self->m_Paths, node_data->m_InputFiles))
+    {
+      if (self->m_Yield)
+        break;
+      PrefetchIfContentSigned(self, input.m_Filename, input.m_FilenameHash);
+    }
+
+    if (const NodeStateData* prev_state = node->m_MmapState)
+    {
+      for (const StateFileData& input : StateImplicitInputs(self->m_ImplicitFiles, prev_state))
+      {
+        if (self->m_Yield)
+          break;
+        PrefetchIfContentSigned(self, input.m_Filename, input.m_FilenameHash);
+      }
+    }
+  }
+
+  return 0;
+}
+
+void DigestPrefetchInit(DigestPrefetch* self)
+{
+  self->m_ThreadCount = 0;
+  self->m_Yield       = false;
+  HashSetInit(&self->m_Outputs, nullptr);
+}
+
+void DigestPrefetchStart(
+    DigestPrefetch*   self,
+    StatCache*        stat_cache,
+    DigestCache*      digest_cache,
+    MemAllocHeap*     heap,
+    const DagData*    dag,
+    const NodeState*  nodes,
+    int               node_count,
+    const StateFileData* implicit_files,
+    int               thread_count)
+{
+  CHECK(0 == self->m_ThreadCount);
+
+  if (0 == dag->m_ShaExtensionHashes.GetCount() || 0 == node_count)
+    return;
+
+  self->m_StatCache             = stat_cache;
+  self->m_DigestCache           = digest_cache;
+  self->m_Nodes                 = nodes;
+  self->m_NodeCount             = uint32_t(node_count);
+  self->m_Paths                 = dag->m_Paths.GetArray();
+  self->m_ImplicitFiles         = implicit_files;
+  self->m_ShaExtensionHashes    = dag->m_ShaExtensionHashes.GetArray();
+  self->m_ShaExtensionHashCount = dag->m_ShaExtensionHashes.GetCount();
+  self->m_NextNode              = 0;
+  self->m_Yield                 = false;
+
+  HashSetInit(&self->m_Outputs, heap);
+
+  for (int i = 0, count = dag->m_NodeCount; i < count; ++i)
+  {
+    const NodeData* node_data = dag->m_NodeData + i;
+
+    for (const FrozenFileAndHash& output : DagPathList(self->m_Paths, node_data->m_OutputFiles))
+    {
+      if (!HashSetLookup(&self->m_Outputs, output.m_FilenameHash, output.m_Filename))
+        HashSetInsert(&self->m_Outputs, output.m_FilenameHash, output.m_Filename);
+    }
+
+    for (const FrozenFileAndHash& output : DagPathList(self->m_Paths, node_data->m_AuxOutputFiles))
+    {
+      if (!HashSetLookup(&self->m_Outputs, output.m_FilenameHash, output.m_Filename))
+        HashSetInsert(&self->m_Outputs, output.m_FilenameHash, output.m_Filename);
+    }
+  }
+
+  if (thread_count > DigestPrefetch::kMaxThreads)
+    thread_count = DigestPrefetch::kMaxThreads;
+
+  for (int i = 0; i < thread_count; ++i)
+    self->m_Threads[self->m_ThreadCount++] = ThreadStart(PrefetchThreadRoutine, self);
+}
+
+void DigestPrefetchDestroy(DigestPrefetch* self)
+{
+  DigestPrefetchYield(self);
+
+  for (int i = 0; i < self->m_ThreadCount; ++i)
+    ThreadJoin(self->m_Threads[i]);
+
+  self->m_ThreadCount = 0;
+
+  HashSetDestroy(&self->m_Outputs);
+}
+
+}
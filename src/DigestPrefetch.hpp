@@ -0,0 +1,72 @@
+#ifndef DIGESTPREFETCH_HPP
+#define DIGESTPREFETCH_HPP
+
+#include "Common.hpp"
+#include "Thread.hpp"
+#include "HashTable.hpp"
+
+namespace t2
+{
+
+struct StatCache;
+struct DigestCache;
+struct NodeState;
+struct FrozenFileAndHash;
+struct StateFileData;
+struct DagData;
+struct MemAllocHeap;
+
+// Low priority threads that digest the content-signed inputs of the selected
+// nodes ahead of the build threads, so their signature checks hit the digest
+// cache. Inputs recorded by the previous build are included. Outputs of DAG
+// nodes are left alone, as an action may be writing them. The threads stop
+// taking on new files as soon as the first action runs.
+struct DigestPrefetch
+{
+  enum
+  {
+    kMaxThreads = 4
+  };
+
+  StatCache*        m_StatCache;
+  DigestCache*      m_DigestCache;
+  const NodeState*  m_Nodes;
+  uint32_t          m_NodeCount;
+  const FrozenFileAndHash* m_Paths;
+  const StateFileData* m_ImplicitFiles;
+  const uint32_t*   m_ShaExtensionHashes;
+  int               m_ShaExtensionHashCount;
+  HashSet<kFlagPathStrings> m_Outputs;
+  uint32_t          m_NextNode;
+  volatile bool     m_Yield;
+  int               m_ThreadCount;
+  ThreadId          m_Threads[kMaxThreads];
+};
+
+void DigestPrefetchInit(DigestPrefetch* self);
+
+void DigestPrefetchStart(
+    DigestPrefetch*   self,
+    StatCache*        stat_cache,
+    DigestCache*      digest_cache,
+    MemAllocHeap*     heap,
+    const DagData*    dag,
+    const NodeState*  nodes,
+    int               node_count,
+    const StateFileData* implicit_files,
+    int               thread_count);
+
+// Tells the threads to stop after the file they're on. Cheap enough to call
+// for every action.
+inline void DigestPrefetchYield(DigestPrefetch* self)
+{
+  self->m_Yield = true;
+}
+
+// Stops the threads and waits for them. Must be called before the digest
+// cache is saved or destroyed.
+void DigestPrefetchDestroy(DigestPrefetch* self);
+
+}
+
+#endif
@@ -20,6 +20,9 @@
 #include "Profiler.hpp"
 #include "NodeResultPrinting.hpp"
 #include "FileSign.hpp"
+#include "Atomic.hpp"
+#include "StateJournal.hpp"
+#include "StateImplicitTable.hpp"
 
 #include <time.h>
 #include <stdio.h>
@@ -49,6 +52,10 @@ static const char* s_DagFileName;
 
 static bool DriverPrepareDag(Driver* self, const char* dag_fn);
 static bool DriverCheckDagSignatures(Driver* self, char* out_of_date_reason, int out_of_date_reason_maxlength);
+static void DriverReplayStateJournal(Driver* self);
+static void DriverJournalNode(void* context, const NodeState* node);
+static void DriverCacheSettled(void* context, BuildCache::Enum cache);
+static void DriverCacheWriteJoin(DriverCacheWrite* write);
 
 void DriverInitializeTundraFilePaths(DriverOptions* driverOptions)
 {
@@ -74,6 +81,7 @@ void DriverOptionsInit(DriverOptions* self)
   self->m_Rebuild           = false;
   self->m_IdeGen            = false;
   self->m_DebugSigning      = false;
+  self->m_DagJson           = false;
   self->m_ContinueOnError   = false;
   self->m_ThrottleOnHumanActivity = false;
   self->m_ThrottleInactivityPeriod = 30;
@@ -194,10 +202,9 @@ static void GetIncludesRecursive(const HashDigest& scannerGuid, const char* fn,
   HashDigest scan_key;
   ComputeScanCacheKey(&scan_key, fn, scannerGuid);
 
-  const int32_t count = scan_data->m_EntryCount;
-  if (const HashDigest* ptr = BinarySearch(scan_data->m_Keys.Get(), count, scan_key))
+  int index = ScanDataFind(scan_data, scan_key);
+  if (index >= 0)
   {
-    int index = int(ptr - scan_data->m_Keys.Get());
     const ScanCacheEntry *entry = scan_data->m_Data.Get() + index;
     int file_count = entry->m_IncludedFiles.GetCount();
     for (int i = 0; i < file_count; ++i)
@@ -242,8 +249,9 @@ bool DriverReportIncludes(Driver* self)
     const ScannerData* s = node.m_Scanner;
     if (s != nullptr && node.m_InputFiles.GetCount() > 0)
     {
-      const char* fn = node.m_InputFiles[0].m_Filename.Get();
-      uint32_t fnHash = node.m_InputFiles[0].m_FilenameHash;
+      const FrozenFileAndHash& input = DagPathList(dag->m_Paths.GetArray(), node.m_InputFiles)[0];
+      const char* fn = input.m_Filename.Get();
+      uint32_t fnHash = input.m_FilenameHash;
       GetIncludesRecursive(s->m_ScannerGuid, fn, fnHash, scan_data, 0, seen, direct);
     }
   }
@@ -263,11 +271,10 @@ bool DriverReportIncludes(Driver* self)
   HashTableWalk(&seen, [&](uint32_t index, uint32_t hash, const char* filename, const HashDigest& scannerguid) {
     HashDigest scan_key;
     ComputeScanCacheKey(&scan_key, filename, scannerguid);
-    const int32_t count = scan_data->m_EntryCount;
-    if (const HashDigest* ptr = BinarySearch(scan_data->m_Keys.Get(), count, scan_key))
+    int entry_index = ScanDataFind(scan_data, scan_key);
+    if (entry_index >= 0)
     {
-      int index = int(ptr - scan_data->m_Keys.Get());
-      const ScanCacheEntry *entry = scan_data->m_Data.Get() + index;
+      const ScanCacheEntry *entry = scan_data->m_Data.Get() + entry_index;
       int file_count = entry->m_IncludedFiles.GetCount();
       JsonWriteStartObject(&msg);
       JsonWriteKeyName(&msg, "file");
@@ -348,7 +355,14 @@ bool DriverInitData(Driver* self)
 
   DigestCacheInit(&self->m_DigestCache, MB(128), self->m_DagData->m_DigestCacheFileName);
 
-  LoadFrozenData<StateData>(self->m_DagData->m_StateFileName, &self->m_StateFile, &self->m_StateData);
+  {
+    TimingScope timing_scope(nullptr, &g_Stats.m_StateLoadTimeCycles);
+    if (LoadFrozenData<StateData>(self->m_DagData->m_StateFileName, &self->m_StateFile, &self->m_StateData))
+      g_Stats.m_StateLoadBytes = self->m_StateFile.m_Size;
+  }
+
+  StateJournalInit(&self->m_StateJournal, &self->m_Heap, self->m_DagData->m_StateFileName);
+  DriverReplayStateJournal(self);
 
   LoadFrozenData<ScanData>(self->m_DagData->m_ScanCacheFileName, &self->m_ScanFile, &self->m_ScanData);
 
@@ -413,7 +427,7 @@ static bool DriverPrepareDag(Driver* self, const char* dag_fn)
   // We need to generate the DAG data
   {
     ProfilerScope prof_scope("RunFrontend", 0);
-    if (!GenerateDag(s_BuildFile, dag_fn))
+    if (!GenerateDag(s_BuildFile, dag_fn, &self->m_HelperPool, self->m_Options.m_DagJson))
       return false;
   }
   PrintNonNodeActionResult(TimerDiffSeconds(time_exec_started, TimerGet()), 1, MessageStatusLevel::Success, out_of_date_reason);
@@ -436,6 +450,139 @@ static bool DriverPrepareDag(Driver* self, const char* dag_fn)
   return true;
 }
 
+// DAG signatures are checked on the helper pool. Workers claim signatures in
+// DAG order (file signatures, then globs) and stop claiming once one before
+// their next claim is known to be out of date. Every signature before the
+// earliest mismatch found has then been checked, so that mismatch is the one
+// a sequential check would have reported.
+struct DagSignatureWorker
+{
+  MemAllocLinear  m_Scratch;
+  uint32_t        m_Mismatch;
+  char            m_Reason[512];
+  char            m_LogMessage[1024];
+};
+
+struct DagSignatureCheck
+{
+  enum
+  {
+    // Below this, starting threads costs more than the checks themselves.
+    kMinParallelCount = 64
+  };
+
+  Driver*             m_Driver;
+  const DagData*      m_DagData;
+  uint64_t            m_RacyCutoff;
+  uint64_t*           m_Refreshed;      // New timestamp per file signature, or 0
+  uint32_t            m_FileCount;
+  uint32_t            m_TotalCount;
+  uint32_t            m_NextIndex;
+  volatile uint32_t   m_FirstMismatch;
+  Mutex               m_MismatchLock;
+  DagSignatureWorker* m_Workers;
+};
+
+// Returns false and fills in the worker's messages if signature `index` is out of date.
+static bool CheckDagSignature(DagSignatureCheck* check, uint32_t index, DagSignatureWorker* worker)
+{
+  const DagData* dag_data = check->m_DagData;
+
+  // Check timestamps, and if they moved contents, of frontend files used to produce the DAG
+  if (index < check->m_FileCount)
+  {
+    const DagFileSignature& sig = dag_data->m_FileSignatures[index];
+    const char* path = sig.m_Path;
+
+    uint64_t timestamp = sig.m_Timestamp;
+    FileInfo info      = GetFileInfo(path);
+
+    if (0 != timestamp && info.m_Timestamp == timestamp)
+      return true;
+
+    // Files that are missing have an all-zero digest.
+    HashDigest digest;
+    memset(&digest, 0, sizeof digest);
+
+    if ((!info.Exists() || DigestFile(nullptr, path, info, &digest)) && digest == sig.m_Digest)
+    {
+      Log(kDebug, "%s: contents unchanged", path);
+      if (info.Exists() && info.m_Timestamp < check->m_RacyCutoff)
+        check->m_Refreshed[index] = info.m_Timestamp;
+      return true;
+    }
+
+    snprintf(worker->m_Reason, sizeof worker->m_Reason, "Build frontend of %s ran (build file changed: %s)", s_DagFileName, sig.m_Path.Get());
+    snprintf(worker->m_LogMessage, sizeof worker->m_LogMessage, "DAG out of date: %s changed. timestamp was: %lu now: %lu", path, timestamp, info.m_Timestamp);
+    return false;
+  }
+
+  // Check directory listing fingerprints
+  // Note that the digest computation in here must match the one in DagGenerator
+  // The digests computed there are stored in the signature block.
+  const DagGlobSignature& sig = dag_data->m_GlobSignatures[index - check->m_FileCount];
+  MemAllocHeap* heap = &check->m_Driver->m_Heap;
+
+  // Globs over directories only relist the directories whose mtime moved.
+  if (sig.m_Directories.GetCount() > 0)
+  {
+    for (const DagGlobDirectory& dir : sig.m_Directories)
+    {
+      if (!GlobDirectoryChanged(dir.m_Path, dir.m_MtimeNs, dir.m_Digest, sig.m_Filter, sig.m_Recurse, heap, &worker->m_Scratch))
+        continue;
+
+      snprintf(worker->m_Reason, sizeof worker->m_Reason, "Build frontend of %s ran (folder contents changed: %s)", s_DagFileName, dir.m_Path.Get());
+      snprintf(worker->m_LogMessage, sizeof worker->m_LogMessage, "DAG out of date: file glob change for %s in %s", sig.m_Path.Get(), dir.m_Path.Get());
+      return false;
+    }
+
+    return true;
+  }
+
+  HashDigest digest = CalculateGlobSignatureFor(sig.m_Path, sig.m_Filter, sig.m_Recurse, heap, &worker->m_Scratch, nullptr, nullptr);
+
+  // Compare digest with the one stored in the signature block
+  if (0 != memcmp(&digest, &sig.m_Digest, sizeof digest))
+  {
+    char stored[kDigestStringSize], actual[kDigestStringSize];
+    DigestToString(stored, sig.m_Digest);
+    DigestToString(actual, digest);
+    snprintf(worker->m_Reason, sizeof worker->m_Reason, "Build frontend of %s ran (folder contents changed: %s)", s_DagFileName, sig.m_Path.Get());
+    snprintf(worker->m_LogMessage, sizeof worker->m_LogMessage, "DAG out of date: file glob change for %s (%s => %s)", sig.m_Path.Get(), stored, actual);
+    return false;
+  }
+
+  return true;
+}
+
+static void CheckDagSignatures(void* context, int worker_index)
+{
+  DagSignatureCheck*  check  = static_cast<DagSignatureCheck*>(context);
+  DagSignatureWorker* worker = &check->m_Workers[worker_index];
+
+  LinearAllocSetOwner(&worker->m_Scratch, ThreadCurrent());
+
+  for (;;)
+  {
+    uint32_t index = AtomicIncrement(&check->m_NextIndex) - 1;
+
+    if (index >= check->m_TotalCount || index > check->m_FirstMismatch)
+      break;
+
+    if (!CheckDagSignature(check, index, worker))
+    {
+      // Claims are increasing, so this is the worker's only mismatch.
+      worker->m_Mismatch = index;
+
+      MutexLock(&check->m_MismatchLock);
+      if (index < check->m_FirstMismatch)
+        check->m_FirstMismatch = index;
+      MutexUnlock(&check->m_MismatchLock);
+      break;
+    }
+  }
+}
+
 static bool DriverCheckDagSignatures(Driver* self, char* out_of_date_reason, int out_of_date_reason_maxlength)
 {
   const DagData* dag_data = self->m_DagData;
@@ -457,42 +604,75 @@ static bool DriverCheckDagSignatures(Driver* self, char* out_of_date_reason, int
     return false;
   }
 
-  // Check timestamps of frontend files used to produce the DAG
-  for (const DagFileSignature& sig : dag_data->m_FileSignatures)
+  DagSignatureCheck check;
+  check.m_Driver        = self;
+  check.m_DagData       = dag_data;
+  check.m_RacyCutoff    = uint64_t(time(nullptr)) - 2;  // As when the DAG is generated
+  check.m_FileCount     = dag_data->m_FileSignatures.GetCount();
+  check.m_TotalCount    = check.m_FileCount + dag_data->m_GlobSignatures.GetCount();
+  check.m_NextIndex     = 0;
+  check.m_FirstMismatch = ~0u;
+  MutexInit(&check.m_MismatchLock);
+
+  int worker_count = 1;
+  if (check.m_TotalCount >= DagSignatureCheck::kMinParallelCount)
+    worker_count = self->m_HelperPool.m_MaxThreadCount + 1;
+
+  check.m_Refreshed = HeapAllocateArray<uint64_t>(&self->m_Heap, check.m_FileCount);
+  memset(check.m_Refreshed, 0, sizeof(uint64_t) * check.m_FileCount);
+
+  check.m_Workers = HeapAllocateArray<DagSignatureWorker>(&self->m_Heap, worker_count);
+  for (int i = 0; i < worker_count; ++i)
   {
-    const char* path = sig.m_Path;
+    LinearAllocInit(&check.m_Workers[i].m_Scratch, &self->m_Heap, MB(4), "signature check scratch");
+    check.m_Workers[i].m_Mismatch = ~0u;
+  }
 
-    uint64_t timestamp = sig.m_Timestamp;
-    FileInfo info      = GetFileInfo(path);
+  if (worker_count > 1)
+    HelperPoolRun(&self->m_HelperPool, CheckDagSignatures, &check, worker_count);
+  else
+    CheckDagSignatures(&check, 0);
+
+  bool result = true;
 
-    if (info.m_Timestamp != timestamp)
+  for (int i = 0; i < worker_count; ++i)
+  {
+    const DagSignatureWorker& worker = check.m_Workers[i];
+    if (check.m_FirstMismatch != ~0u && worker.m_Mismatch == check.m_FirstMismatch)
     {
-      snprintf(out_of_date_reason, out_of_date_reason_maxlength, "Build frontend of %s ran (build file timestamp changed: %s)", s_DagFileName, sig.m_Path.Get());
-      Log(kInfo, "DAG out of date: timestamp change for %s. was: %lu now: %lu", path, timestamp, info.m_Timestamp);
-      return false;
+      size_t len = strlen(worker.m_Reason);
+      if (len >= size_t(out_of_date_reason_maxlength))
+        len = size_t(out_of_date_reason_maxlength) - 1;
+      memcpy(out_of_date_reason, worker.m_Reason, len);
+      out_of_date_reason[len] = '\0';
+      Log(kInfo, "%s", worker.m_LogMessage);
+      result = false;
     }
   }
 
-  // Check directory listing fingerprints
-  // Note that the digest computation in here must match the one in LuaListDirectory
-  // The digests computed there are stored in the signature block by frontend code.
-  for (const DagGlobSignature& sig : dag_data->m_GlobSignatures)
+  // Refreshing only pays off if this DAG is kept.
+  BufferClear(&self->m_DagStampRefreshes);
+  if (result)
   {
-    HashDigest digest = CalculateGlobSignatureFor(sig.m_Path, sig.m_Filter, sig.m_Recurse, &self->m_Heap, &self->m_Allocator);
-
-    // Compare digest with the one stored in the signature block
-    if (0 != memcmp(&digest, &sig.m_Digest, sizeof digest))
+    const char* base = static_cast<const char*>(self->m_DagFile.m_Address);
+    for (uint32_t i = 0; i < check.m_FileCount; ++i)
     {
-      char stored[kDigestStringSize], actual[kDigestStringSize];
-      DigestToString(stored, sig.m_Digest);
-      DigestToString(actual, digest);
-      snprintf(out_of_date_reason, out_of_date_reason_maxlength, "Build frontend of %s ran (folder contents changed: %s)", s_DagFileName, sig.m_Path.Get());
-      Log(kInfo, "DAG out of date: file glob change for %s (%s => %s)", sig.m_Path.Get(), stored, actual);
-      return false;
+      if (0 == check.m_Refreshed[i])
+        continue;
+
+      const char* stamp = reinterpret_cast<const char*>(&dag_data->m_FileSignatures[i].m_Timestamp);
+      DagStampRefresh refresh = { uint64_t(stamp - base), check.m_Refreshed[i] };
+      BufferAppendOne(&self->m_DagStampRefreshes, &self->m_Heap, refresh);
     }
   }
 
-  return true;
+  for (int i = 0; i < worker_count; ++i)
+    LinearAllocDestroy(&check.m_Workers[i].m_Scratch);
+  HeapFree(&self->m_Heap, check.m_Workers);
+  HeapFree(&self->m_Heap, check.m_Refreshed);
+  MutexDestroy(&check.m_MismatchLock);
+
+  return result;
 }
 
 static const BuildTupleData* FindBuildTuple(const DagData* dag, const TargetSpec spec)
@@ -587,7 +767,7 @@ static void FindNodesByName(
     for (int node_index=0; node_index!=dag->m_NodeCount; node_index++)
     {
       const NodeData& node = dag->m_NodeData[node_index];
-      for (const FrozenFileAndHash& output : node.m_OutputFiles)
+      for (const FrozenFileAndHash& output : DagPathList(dag->m_Paths.GetArray(), node.m_OutputFiles))
       {
         if (filename_hash == output.m_FilenameHash && 0 == PathCompare(output.m_Filename, cleaned_path))
         {
@@ -655,7 +835,7 @@ static void FindNodesByName(
           const NodeData* node = dag->m_NodeData + node_index;
 
 #if SUPPORT_SEARCHING_IN_INPUTS
-          for (const FrozenFileAndHash& input : node->m_InputFiles)
+          for (const FrozenFileAndHash& input : DagPathList(dag->m_Paths.GetArray(), node->m_InputFiles))
           {
             if (filename_hash == input.m_FilenameHash && 0 == PathCompare(input.m_Filename, filename))
             {
@@ -669,7 +849,7 @@ static void FindNodesByName(
           if (found)
             break;
 #endif
-          for (const FrozenFileAndHash& output : node->m_OutputFiles)
+          for (const FrozenFileAndHash& output : DagPathList(dag->m_Paths.GetArray(), node->m_OutputFiles))
           {
             if (filename_hash == output.m_FilenameHash && 0 == PathCompare(output.m_Filename, filename))
             {
@@ -860,6 +1040,22 @@ bool DriverPrepareNodes(Driver* self, const char** targets, int target_count)
   BufferDestroy(&node_stack, &self->m_Heap);
   BufferDestroy(&node_indices, &self->m_Heap);
 
+  // Start digesting content-signed inputs while stale outputs are removed and
+  // the build queue is set up. Pointless if we're only cleaning.
+  if (!self->m_Options.m_Clean || self->m_Options.m_Rebuild)
+  {
+    DigestPrefetchStart(
+        &self->m_DigestPrefetch,
+        &self->m_StatCache,
+        &self->m_DigestCache,
+        &self->m_Heap,
+        dag,
+        out_nodes,
+        node_count,
+        self->m_StateData ? self->m_StateData->m_ImplicitFiles.GetArray() : nullptr,
+        GetCpuCount());
+  }
+
   return true;
 }
 
@@ -883,6 +1079,7 @@ bool DriverInit(Driver* self, const DriverOptions* options)
 
   BufferInit(&self->m_NodeRemap);
   BufferInit(&self->m_Nodes);
+  BufferInit(&self->m_DagStampRefreshes);
 
   self->m_Options = *options;
 
@@ -894,19 +1091,63 @@ bool DriverInit(Driver* self, const DriverOptions* options)
   LinearAllocInit(&self->m_StatCacheAllocator, &self->m_Heap, MB(64), "stat cache");
   StatCacheInit(&self->m_StatCache, &self->m_StatCacheAllocator, &self->m_Heap);
 
+  // Helper threads are only started if a build digests a large file.
+  HelperPoolInit(&self->m_HelperPool, GetCpuCount());
+
+  DigestPrefetchInit(&self->m_DigestPrefetch);
+
+  self->m_ScanCacheWrite.m_Started   = false;
+  self->m_DigestCacheWrite.m_Started = false;
+
   memset(&self->m_PassNodeCount, 0, sizeof self->m_PassNodeCount);
 
   return true;
 }
 
+// Called once the DAG is unmapped, as it can't be written while mapped on
+// Windows. A failed write only means the contents are compared again.
+static void DriverRefreshDagStamps(Driver* self)
+{
+  if (0 == self->m_DagStampRefreshes.m_Size)
+    return;
+
+  FILE* f = fopen(s_DagFileName, "r+b");
+  if (!f)
+    return;
+
+  for (const DagStampRefresh& refresh : self->m_DagStampRefreshes)
+  {
+    if (0 != fseek(f, long(refresh.m_Offset), SEEK_SET) || 1 != fwrite(&refresh.m_Timestamp, sizeof refresh.m_Timestamp, 1, f))
+    {
+      Log(kWarning, "couldn't refresh timestamps in %s", s_DagFileName);
+      break;
+    }
+  }
+
+  fclose(f);
+}
+
 void DriverDestroy(Driver* self)
 {
+  StateJournalDestroy(&self->m_StateJournal);
+
+  DriverCacheWriteJoin(&self->m_ScanCacheWrite);
+  DriverCacheWriteJoin(&self->m_DigestCacheWrite);
+
+  DigestPrefetchDestroy(&self->m_DigestPrefetch);
+
   DigestCacheDestroy(&self->m_DigestCache);
 
+  HelperPoolDestroy(&self->m_HelperPool);
+
   StatCacheDestroy(&self->m_StatCache);
 
   ScanCacheDestroy(&self->m_ScanCache);
 
+  // Implicit inputs read from dependency files are owned by the node state.
+  for (NodeState& state : self->m_Nodes)
+    HeapFree(&self->m_Heap, state.m_ImplicitDeps);
+
   BufferDestroy(&self->m_Nodes, &self->m_Heap);
   BufferDestroy(&self->m_NodeRemap, &self->m_Heap);
 
@@ -914,6 +1155,9 @@ void DriverDestroy(Driver* self)
   MmapFileDestroy(&self->m_StateFile);
   MmapFileDestroy(&self->m_DagFile);
 
+  DriverRefreshDagStamps(self);
+  BufferDestroy(&self->m_DagStampRefreshes, &self->m_Heap);
+
   LinearAllocDestroy(&self->m_ScanCacheAllocator);
   LinearAllocDestroy(&self->m_StatCacheAllocator);
   LinearAllocDestroy(&self->m_Allocator);
@@ -963,12 +1207,16 @@ BuildResult::Enum DriverBuild(Driver* self)
   queue_config.m_Heap                    = &self->m_Heap;
   queue_config.m_ThreadCount             = (int) self->m_Options.m_ThreadCount;
   queue_config.m_NodeData                = self->m_DagData->m_NodeData;
+  queue_config.m_Paths                   = dag->m_Paths.GetArray();
+  queue_config.m_ImplicitFiles           = self->m_StateData ? self->m_StateData->m_ImplicitFiles.GetArray() : nullptr;
   queue_config.m_NodeState               = self->m_Nodes.m_Storage;
   queue_config.m_MaxNodes                = (int) self->m_Nodes.m_Size;
   queue_config.m_NodeRemappingTable      = self->m_NodeRemap.m_Storage;
   queue_config.m_ScanCache               = &self->m_ScanCache;
   queue_config.m_StatCache               = &self->m_StatCache;
   queue_config.m_DigestCache             = &self->m_DigestCache;
+  queue_config.m_HelperPool              = &self->m_HelperPool;
+  queue_config.m_DigestPrefetch          = &self->m_DigestPrefetch;
   queue_config.m_ShaDigestExtensionCount = dag->m_ShaExtensionHashes.GetCount();
   queue_config.m_ShaDigestExtensions     = dag->m_ShaExtensionHashes.GetArray();
   queue_config.m_MaxExpensiveCount       = max_expensive_count;
@@ -977,6 +1225,10 @@ BuildResult::Enum DriverBuild(Driver* self)
   queue_config.m_ThrottleInactivityPeriod = self->m_Options.m_ThrottleInactivityPeriod;
   queue_config.m_ThrottleOnHumanActivity  = self->m_Options.m_ThrottleOnHumanActivity;
   queue_config.m_ThrottledThreadsAmount  = self->m_Options.m_ThrottledThreadsAmount;
+  queue_config.m_NodeFinished            = nullptr;
+  queue_config.m_NodeFinishedContext     = nullptr;
+  queue_config.m_CacheSettled            = DriverCacheSettled;
+  queue_config.m_CacheSettledContext     = self;
 
   if (self->m_Options.m_Verbose)
   {
@@ -994,6 +1246,11 @@ BuildResult::Enum DriverBuild(Driver* self)
   {
     queue_config.m_Flags |= BuildQueueConfig::kFlagDryRun;
   }
+  else
+  {
+    queue_config.m_NodeFinished        = DriverJournalNode;
+    queue_config.m_NodeFinishedContext = self;
+  }
 
   if (self->m_Options.m_DebugSigning)
   {
@@ -1054,21 +1311,118 @@ BuildResult::Enum DriverBuild(Driver* self)
   // Shut down build queue
   BuildQueueDestroy(&build_queue);
 
+  // Nothing is left to prefetch for, and the digest cache is saved next.
+  DigestPrefetchDestroy(&self->m_DigestPrefetch);
+
   return build_result;
 }
 
+static ThreadRoutineReturnType TUNDRA_STDCALL WriteScanCacheThread(void* param)
+{
+  Driver* self = (Driver*) param;
+
+  self->m_ScanCacheWrite.m_Generation = ScanCacheGeneration(&self->m_ScanCache);
+  self->m_ScanCacheWrite.m_Success    = ScanCacheWrite(&self->m_ScanCache, self->m_DagData->m_ScanCacheFileNameTmp, &self->m_Heap, &self->m_HelperPool);
+
+  return 0;
+}
+
+static ThreadRoutineReturnType TUNDRA_STDCALL WriteDigestCacheThread(void* param)
+{
+  Driver* self = (Driver*) param;
+
+  self->m_DigestCacheWrite.m_Generation = DigestCacheGeneration(&self->m_DigestCache);
+  self->m_DigestCacheWrite.m_Success    = DigestCacheWrite(&self->m_DigestCache, &self->m_Heap, self->m_DagData->m_DigestCacheFileNameTmp, &self->m_HelperPool);
+
+  return 0;
+}
+
+static void DriverCacheWriteStart(DriverCacheWrite* write, ThreadRoutine routine, Driver* self)
+{
+  CHECK(!write->m_Started);
+
+  write->m_Started = true;
+  write->m_Success = false;
+  write->m_Thread  = ThreadStart(routine, self);
+}
+
+static void DriverCacheWriteJoin(DriverCacheWrite* write)
+{
+  if (!write->m_Started)
+    return;
+
+  ThreadJoin(write->m_Thread);
+  write->m_Started = false;
+}
+
+// The caches are written while the last actions run, so their writes don't
+// add to the end of the build. They are still used until then, so the files
+// are only moved into place by DriverSaveScanCache() and
+// DriverSaveDigestCache(), which write them again if they changed after all.
+static void DriverCacheSettled(void* context, BuildCache::Enum cache)
+{
+  Driver* self = (Driver*) context;
+
+  switch (cache)
+  {
+    case BuildCache::kScanCache:
+      if (ScanCacheDirty(&self->m_ScanCache))
+        DriverCacheWriteStart(&self->m_ScanCacheWrite, WriteScanCacheThread, self);
+      break;
+
+    case BuildCache::kDigestCache:
+      // Nothing is left to prefetch for.
+      DigestPrefetchDestroy(&self->m_DigestPrefetch);
+      DriverCacheWriteStart(&self->m_DigestCacheWrite, WriteDigestCacheThread, self);
+      break;
+  }
+}
+
+// Joins a background write and tells if its file can be used as it is.
+static bool DriverCacheWriteFinish(DriverCacheWrite* write, uint32_t generation)
+{
+  if (!write->m_Started)
+    return false;
+
+  DriverCacheWriteJoin(write);
+
+  if (!write->m_Success)
+    return false;
+
+  if (write->m_Generation != generation)
+  {
+    Log(kDebug, "cache changed after it was written; writing it again");
+    return false;
+  }
+
+  return true;
+}
+
 // Save scan cache
 bool DriverSaveScanCache(Driver* self)
 {
   ScanCache* scan_cache = &self->m_ScanCache;
 
+  bool written = DriverCacheWriteFinish(&self->m_ScanCacheWrite, ScanCacheGeneration(scan_cache));
+
   if (!ScanCacheDirty(scan_cache))
     return true;
 
   // This will be invalidated.
   self->m_ScanData = nullptr;
 
-  bool success = ScanCacheSave(scan_cache, self->m_DagData->m_ScanCacheFileNameTmp, &self->m_Heap);
+  bool success;
+
+  if (written)
+  {
+    ScanCacheSetCache(scan_cache, nullptr);
+    AtomicIncrement(&g_Stats.m_ScanCacheSavedEarly);
+    success = true;
+  }
+  else
+  {
+    success = ScanCacheSave(scan_cache, self->m_DagData->m_ScanCacheFileNameTmp, &self->m_Heap, &self->m_HelperPool);
+  }
 
   // Unmap the file so we can overwrite it (on Windows.)
   MmapFileDestroy(&self->m_ScanFile);
@@ -1088,8 +1442,17 @@ bool DriverSaveScanCache(Driver* self)
 // Save digest cache
 bool DriverSaveDigestCache(Driver* self)
 {
+  DigestCache*   digest_cache = &self->m_DigestCache;
+  const DagData* dag          = self->m_DagData;
+
+  if (DriverCacheWriteFinish(&self->m_DigestCacheWrite, DigestCacheGeneration(digest_cache)))
+  {
+    AtomicIncrement(&g_Stats.m_DigestCacheSavedEarly);
+    return DigestCacheCommit(digest_cache, dag->m_DigestCacheFileName, dag->m_DigestCacheFileNameTmp);
+  }
+
   // This will be invalidated.
-  return DigestCacheSave(&self->m_DigestCache, &self->m_Heap, self->m_DagData->m_DigestCacheFileName, self->m_DagData->m_DigestCacheFileNameTmp);
+  return DigestCacheSave(digest_cache, &self->m_Heap, dag->m_DigestCacheFileName, dag->m_DigestCacheFileNameTmp, &self->m_HelperPool);
 }
 
 
@@ -1100,8 +1463,31 @@ struct StateSavingSegments
   BinarySegment* state;
   BinarySegment* array;
   BinarySegment* string;
+  BinarySegment* file;
+  BinarySegment* index;
+  BinaryLocator  guid_start;
+  BinaryLocator  state_start;
 };
 
+static void StateSavingSegmentsInit(StateSavingSegments* self, BinaryWriter* writer)
+{
+  // A writer that is reused for journal records already has its segments.
+  while (writer->m_Segments.m_Size < 7)
+    BinaryWriterAddSegment(writer);
+
+  BinarySegment** segs = writer->m_Segments.m_Storage;
+  self->main   = segs[0];
+  self->guid   = segs[1];
+  self->state  = segs[2];
+  self->array  = segs[3];
+  self->string = segs[4];
+  self->file   = segs[5];
+  self->index  = segs[6];
+
+  self->guid_start  = BinarySegmentPosition(self->guid);
+  self->state_start = BinarySegmentPosition(self->state);
+}
+
 static const char* GetFileNameFrom(const FrozenFileAndHash& container)
 {
   return container.m_Filename;
@@ -1112,30 +1498,30 @@ static const char* GetFileNameFrom(const FrozenString& container)
   return container;
 }
 
-template<class TNodeType>
-static void save_node_sharedcode(int build_result, const HashDigest* input_signature, const TNodeType* src_node, const HashDigest* guid, const StateSavingSegments& segments)
+template<class TNodeType, class TFileList>
+static void save_node_sharedcode(int build_result, const HashDigest* input_signature, const TNodeType* src_node, const TFileList& outputs, const TFileList& aux_outputs, const HashDigest* guid, const StateSavingSegments& segments)
 {
   BinarySegmentWrite(segments.guid, (const char*) guid, sizeof(HashDigest));
 
   BinarySegmentWriteInt32(segments.state, build_result);
   BinarySegmentWrite(segments.state, (const char*) input_signature, sizeof(HashDigest));
 
-  int32_t file_count = src_node->m_OutputFiles.GetCount();
+  int32_t file_count = outputs.GetCount();
   BinarySegmentWriteInt32(segments.state, file_count);
   BinarySegmentWritePointer(segments.state, BinarySegmentPosition(segments.array));
   for (int32_t i = 0; i < file_count; ++i)
   {
     BinarySegmentWritePointer(segments.array, BinarySegmentPosition(segments.string));
-    BinarySegmentWriteStringData(segments.string, GetFileNameFrom(src_node->m_OutputFiles[i]));
+    BinarySegmentWriteStringData(segments.string, GetFileNameFrom(outputs[i]));
   }
 
-  file_count = src_node->m_AuxOutputFiles.GetCount();
+  file_count = aux_outputs.GetCount();
   BinarySegmentWriteInt32(segments.state, file_count);
   BinarySegmentWritePointer(segments.state, BinarySegmentPosition(segments.array));
   for (int32_t i = 0; i < file_count; ++i)
   {
     BinarySegmentWritePointer(segments.array, BinarySegmentPosition(segments.string));
-    BinarySegmentWriteStringData(segments.string, GetFileNameFrom(src_node->m_AuxOutputFiles[i]));
+    BinarySegmentWriteStringData(segments.string, GetFileNameFrom(aux_outputs[i]));
   }
 
   BinarySegmentWritePointer(segments.state, BinarySegmentPosition(segments.string));
@@ -1158,179 +1544,233 @@ static bool node_was_used_by_this_dag_previously(const NodeStateData* node_state
   return std::find(previous_dags.begin(), previous_dags.end(), current_dag_identifier) != previous_dags.end();
 }
 
-bool DriverSaveBuildState(Driver* self)
+// Writes the state of a node in the current DAG that has been checked or built
+// this session.
+static void SaveNodeState(
+    Driver*                    self,
+    MemAllocLinear*            scratch,
+    const StateSavingSegments& segments,
+    StateImplicitTable*        implicit,
+    const StateFileData*       old_implicit_files,
+    const NodeState*           node,
+    const HashDigest*          guid)
 {
-  TimingScope timing_scope(nullptr, &g_Stats.m_StateSaveTimeCycles);
-  ProfilerScope prof_scope("Tundra SaveState", 0);
+  const NodeData*          src_node        = node->m_MmapData;
+  const NodeStateData*     node_data_state = node->m_MmapState;
+  const FrozenFileAndHash* paths           = self->m_DagData->m_Paths.GetArray();
+  const uint32_t           this_dag_hashed_identifier = self->m_DagData->m_HashedIdentifier;
 
-  MemAllocLinearScope alloc_scope(&self->m_Allocator);
+  save_node_sharedcode(node->m_BuildResult, &node->m_InputSignature, src_node,
+      DagPathList(paths, src_node->m_OutputFiles), DagPathList(paths, src_node->m_AuxOutputFiles), guid, segments);
 
-  BinaryWriter writer;
-  BinaryWriterInit(&writer, &self->m_Heap);
+  HashSet<kFlagPathStrings> implicitDependencies;
+  if (src_node->m_Scanner)
+    HashSetInit(&implicitDependencies, &self->m_Heap);
 
-  StateSavingSegments segments;
-  BinarySegment *main_seg   = BinaryWriterAddSegment(&writer);
-  BinarySegment *guid_seg   = BinaryWriterAddSegment(&writer);
-  BinarySegment *state_seg  = BinaryWriterAddSegment(&writer);
-  BinarySegment *array_seg  = BinaryWriterAddSegment(&writer);
-  BinarySegment *string_seg = BinaryWriterAddSegment(&writer);
-
-  segments.main = main_seg;
-  segments.guid = guid_seg;
-  segments.state = state_seg;
-  segments.array = array_seg;
-  segments.string = string_seg;
-
-  BinaryLocator guid_ptr  = BinarySegmentPosition(guid_seg);
-  BinaryLocator state_ptr = BinarySegmentPosition(state_seg);
-
-  uint32_t             src_count       = self->m_DagData->m_NodeCount;
-  const HashDigest    *src_guids       = self->m_DagData->m_NodeGuids;
-  const NodeData      *src_data        = self->m_DagData->m_NodeData;
-  NodeState           *new_state       = self->m_Nodes.m_Storage;
-  const size_t         new_state_count = self->m_Nodes.m_Size;
-
-  std::sort(new_state, new_state + new_state_count, [=](const NodeState& l, const NodeState& r) {
-    // We know guids are sorted, so all we need to do is compare pointers into that table.
-    return l.m_MmapData < r.m_MmapData;
-  });
-
-  const HashDigest    *old_guids       = nullptr;
-  const NodeStateData *old_state       = nullptr;
-  uint32_t             old_count       = 0;
-
-  if (const StateData* state_data = self->m_StateData)
+  DagPathList inputs(paths, src_node->m_InputFiles);
+  int32_t file_count = inputs.GetCount();
+  BinarySegmentWriteInt32(segments.state, file_count);
+  BinarySegmentWritePointer(segments.state, BinarySegmentPosition(segments.array));
+  for (int32_t i = 0; i < file_count; ++i)
   {
-    old_guids      = state_data->m_NodeGuids;
-    old_state      = state_data->m_NodeStates;
-    old_count      = state_data->m_NodeCount;
-  }
+    uint64_t timestamp = 0;
+    FileInfo fileInfo = StatCacheStat(&self->m_StatCache, inputs[i].m_Filename, inputs[i].m_FilenameHash);
+    if (fileInfo.Exists())
+      timestamp = fileInfo.m_Timestamp;
 
-  int entry_count = 0;
-  uint32_t this_dag_hashed_identifier =  self->m_DagData->m_HashedIdentifier;
+    BinarySegmentWriteUint64(segments.array, timestamp);
 
-  auto save_node_state = [=](int build_result, const HashDigest* input_signature, const NodeData* src_node, const NodeStateData* node_data_state, const HashDigest* guid) -> void
-  {
-    MemAllocLinear* scratch = &self->m_Allocator;
-  
-    save_node_sharedcode(build_result, input_signature, src_node, guid, segments);
+    BinarySegmentWritePointer(segments.array, BinarySegmentPosition(segments.string));
+    BinarySegmentWriteStringData(segments.string, inputs[i].m_Filename);
 
-    HashSet<kFlagPathStrings> implicitDependencies;
     if (src_node->m_Scanner)
-      HashSetInit(&implicitDependencies, &self->m_Heap);
-
-    int32_t file_count = src_node->m_InputFiles.GetCount();
-    BinarySegmentWriteInt32(state_seg, file_count);
-    BinarySegmentWritePointer(state_seg, BinarySegmentPosition(array_seg));
-    for (int32_t i = 0; i < file_count; ++i)
     {
-      uint64_t timestamp = 0;
-      FileInfo fileInfo = StatCacheStat(&self->m_StatCache, src_node->m_InputFiles[i].m_Filename, src_node->m_InputFiles[i].m_FilenameHash);
-      if (fileInfo.Exists())
-        timestamp = fileInfo.m_Timestamp;
+      MemAllocLinearScope alloc_scope(scratch);
 
-      BinarySegmentWriteUint64(array_seg, timestamp);
+      ScanInput scan_input;
+      scan_input.m_ScannerConfig = src_node->m_Scanner;
+      scan_input.m_ScratchAlloc = scratch;
+      scan_input.m_ScratchHeap = &self->m_Heap;
+      scan_input.m_FileName = inputs[i].m_Filename;
+      scan_input.m_ScanCache = &self->m_ScanCache;
+      scan_input.m_ReadBuffer = nullptr;
 
-      BinarySegmentWritePointer(array_seg, BinarySegmentPosition(string_seg));
-      BinarySegmentWriteStringData(string_seg, src_node->m_InputFiles[i].m_Filename);
+      ScanOutput scan_output;
 
-      if (src_node->m_Scanner)
+      // It looks like we're re-running the scanner here, but the scan results should all be cached already, so it
+      // should be fast.
+      if (ScanImplicitDeps(&self->m_StatCache, &scan_input, &scan_output))
       {
-        MemAllocLinearScope alloc_scope(scratch);
-
-        ScanInput scan_input;
-        scan_input.m_ScannerConfig = src_node->m_Scanner;
-        scan_input.m_ScratchAlloc = scratch;
-        scan_input.m_ScratchHeap = &self->m_Heap;
-        scan_input.m_FileName = src_node->m_InputFiles[i].m_Filename;
-        scan_input.m_ScanCache = &self->m_ScanCache;
-
-        ScanOutput scan_output;
-
-        // It looks like we're re-running the scanner here, but the scan results should all be cached already, so it
-        // should be fast.
-        if (ScanImplicitDeps(&self->m_StatCache, &scan_input, &scan_output))
+        for (int i = 0, count = scan_output.m_IncludedFileCount; i < count; ++i)
         {
-          for (int i = 0, count = scan_output.m_IncludedFileCount; i < count; ++i)
-          {
-            const FileAndHash& path = scan_output.m_IncludedFiles[i];
-            if (!HashSetLookup(&implicitDependencies, path.m_FilenameHash, path.m_Filename))
-              HashSetInsert(&implicitDependencies, path.m_FilenameHash, path.m_Filename);
-          }
+          const FileAndHash& path = scan_output.m_IncludedFiles[i];
+          if (!HashSetLookup(&implicitDependencies, path.m_FilenameHash, path.m_Filename))
+            HashSetInsert(&implicitDependencies, path.m_FilenameHash, path.m_Filename);
         }
       }
     }
+  }
 
-    if (src_node->m_Scanner)
-    {
-      BinarySegmentWriteInt32(state_seg, implicitDependencies.m_RecordCount);
-      BinarySegmentWritePointer(state_seg, BinarySegmentPosition(array_seg));
-
-      HashSetWalk(&implicitDependencies, [=](uint32_t index, uint32_t hash, const char* filename) {
-        uint64_t timestamp = 0;
-        FileInfo fileInfo = StatCacheStat(&self->m_StatCache, filename, hash);
-        if (fileInfo.Exists())
-          timestamp = fileInfo.m_Timestamp;
-
-        BinarySegmentWriteUint64(array_seg, timestamp);
+  auto write_implicit_input = [=](const char* filename, uint32_t hash) {
+    uint64_t timestamp = 0;
+    FileInfo fileInfo = StatCacheStat(&self->m_StatCache, filename, hash);
+    if (fileInfo.Exists())
+      timestamp = fileInfo.m_Timestamp;
 
-        BinarySegmentWritePointer(array_seg, BinarySegmentPosition(string_seg));
-        BinarySegmentWriteStringData(string_seg, filename);
-      });
+    StateImplicitListAdd(implicit, filename, hash, timestamp);
+  };
 
-      HashSetDestroy(&implicitDependencies);
+  if (src_node->m_Flags & NodeData::kFlagHasDepFile)
+  {
+    // Keep what the dependency file reported: from this build if the action
+    // ran and succeeded, otherwise from the previous build.
+    if (const char* const* implicit_deps = node->m_ImplicitDeps)
+    {
+      StateImplicitListBegin(implicit, segments.state, node->m_ImplicitDepCount);
+      for (int32_t i = 0; i < node->m_ImplicitDepCount; ++i)
+        write_implicit_input(implicit_deps[i], Djb2HashPath(implicit_deps[i]));
+    }
+    else if (node_data_state)
+    {
+      StateImplicitListBegin(implicit, segments.state, node_data_state->m_ImplicitInputCount);
+      for (const StateFileData& input : StateImplicitInputs(old_implicit_files, node_data_state))
+        write_implicit_input(input.m_Filename, input.m_FilenameHash);
     }
     else
     {
-      BinarySegmentWriteInt32(state_seg, 0);
-      BinarySegmentWriteNullPointer(state_seg);
+      StateImplicitListBegin(implicit, segments.state, 0);
     }
+  }
+  else if (src_node->m_Scanner)
+  {
+    StateImplicitListBegin(implicit, segments.state, implicitDependencies.m_RecordCount);
+
+    HashSetWalk(&implicitDependencies, [=](uint32_t index, uint32_t hash, const char* filename) {
+      write_implicit_input(filename, hash);
+    });
+
+    HashSetDestroy(&implicitDependencies);
+  }
+  else
+  {
+    StateImplicitListBegin(implicit, segments.state, 0);
+  }
 
-    //we cast the empty_frozen_array below here to a FrozenArray<uint32_t> that is empty, so the code below gets a lot simpler.
-    const FrozenArray<uint32_t>& previous_dags = (node_data_state == nullptr) ? FrozenArray<uint32_t>::empty() : node_data_state->m_DagsWeHaveSeenThisNodeInPreviously;
+  //we cast the empty_frozen_array below here to a FrozenArray<uint32_t> that is empty, so the code below gets a lot simpler.
+  const FrozenArray<uint32_t>& previous_dags = (node_data_state == nullptr) ? FrozenArray<uint32_t>::empty() : node_data_state->m_DagsWeHaveSeenThisNodeInPreviously;
 
-    bool haveToAddOurselves = std::find(previous_dags.begin(), previous_dags.end(), this_dag_hashed_identifier) == previous_dags.end();
+  bool haveToAddOurselves = std::find(previous_dags.begin(), previous_dags.end(), this_dag_hashed_identifier) == previous_dags.end();
 
-    BinarySegmentWriteUint32(state_seg, previous_dags.GetCount() + (haveToAddOurselves ? 1 : 0));
-    BinarySegmentWritePointer(state_seg, BinarySegmentPosition(array_seg));
-    for(auto& identifier : previous_dags)
-      BinarySegmentWriteUint32(array_seg, identifier);
-    
-    if (haveToAddOurselves)
-      BinarySegmentWriteUint32(array_seg, this_dag_hashed_identifier);
-  };
+  BinarySegmentWriteUint32(segments.state, previous_dags.GetCount() + (haveToAddOurselves ? 1 : 0));
+  BinarySegmentWritePointer(segments.state, BinarySegmentPosition(segments.array));
+  for(auto& identifier : previous_dags)
+    BinarySegmentWriteUint32(segments.array, identifier);
+
+  if (haveToAddOurselves)
+    BinarySegmentWriteUint32(segments.array, this_dag_hashed_identifier);
+}
 
-  auto save_node_state_old = [=](int build_result, const HashDigest* input_signature, const NodeStateData* src_node, const HashDigest* guid) -> void
+// Copies a node state from a state file or journal record, whose implicit
+// inputs index implicit_files.
+static void SaveOldNodeState(
+    const StateSavingSegments& segments,
+    StateImplicitTable*        implicit,
+    const StateFileData*       implicit_files,
+    const NodeStateData*       src_node,
+    const HashDigest*          guid)
+{
+  save_node_sharedcode(src_node->m_BuildResult, &src_node->m_InputSignature, src_node, src_node->m_OutputFiles, src_node->m_AuxOutputFiles, guid, segments);
+
+  int32_t file_count = src_node->m_InputFiles.GetCount();
+  BinarySegmentWriteInt32(segments.state, file_count);
+  BinarySegmentWritePointer(segments.state, BinarySegmentPosition(segments.array));
+  for (int32_t i = 0; i < file_count; ++i)
   {
-    save_node_sharedcode(build_result, input_signature, src_node, guid, segments);
+    BinarySegmentWriteUint64(segments.array, src_node->m_InputFiles[i].m_Timestamp);
+    BinarySegmentWritePointer(segments.array, BinarySegmentPosition(segments.string));
+    BinarySegmentWriteStringData(segments.string, src_node->m_InputFiles[i].m_Filename);
+  }
 
-    int32_t file_count = src_node->m_InputFiles.GetCount();
-    BinarySegmentWriteInt32(state_seg, file_count);
-    BinarySegmentWritePointer(state_seg, BinarySegmentPosition(array_seg));
-    for (int32_t i = 0; i < file_count; ++i)
-    {
-      BinarySegmentWriteUint64(array_seg, src_node->m_InputFiles[i].m_Timestamp);
-      BinarySegmentWritePointer(array_seg, BinarySegmentPosition(string_seg));
-      BinarySegmentWriteStringData(string_seg, src_node->m_InputFiles[i].m_Filename);
-    }
+  StateImplicitListBegin(implicit, segments.state, src_node->m_ImplicitInputCount);
+  for (const StateFileData& input : StateImplicitInputs(implicit_files, src_node))
+    StateImplicitListAdd(implicit, input.m_Filename, input.m_FilenameHash, input.m_Timestamp);
 
-    file_count = src_node->m_ImplicitInputFiles.GetCount();
-    BinarySegmentWriteInt32(state_seg, file_count);
-    BinarySegmentWritePointer(state_seg, BinarySegmentPosition(array_seg));
-    for (int32_t i = 0; i < file_count; ++i)
-    {
-      BinarySegmentWriteUint64(array_seg, src_node->m_ImplicitInputFiles[i].m_Timestamp);
-      BinarySegmentWritePointer(array_seg, BinarySegmentPosition(string_seg));
-      BinarySegmentWriteStringData(string_seg, src_node->m_ImplicitInputFiles[i].m_Filename);
-    }
+  int32_t dag_count = src_node->m_DagsWeHaveSeenThisNodeInPreviously.GetCount();
+  BinarySegmentWriteInt32(segments.state, dag_count);
+  BinarySegmentWritePointer(segments.state, BinarySegmentPosition(segments.array));
+  BinarySegmentWrite(segments.array, src_node->m_DagsWeHaveSeenThisNodeInPreviously.GetArray(), dag_count * sizeof(uint32_t));
+}
 
-    int32_t dag_count = src_node->m_DagsWeHaveSeenThisNodeInPreviously.GetCount();
-    BinarySegmentWriteInt32(state_seg, dag_count);
-    BinarySegmentWritePointer(state_seg, BinarySegmentPosition(array_seg));
-    BinarySegmentWrite(array_seg, src_node->m_DagsWeHaveSeenThisNodeInPreviously.GetArray(), dag_count * sizeof(uint32_t));
+// Completes a StateData in the main segment, once all node states have been
+// written.
+static void StateWriteMain(const StateSavingSegments& segments, StateImplicitTable* implicit, int32_t entry_count)
+{
+  BinarySegmentWriteUint32(segments.main, StateData::MagicNumber);
+  BinarySegmentWriteInt32(segments.main, entry_count);
+  BinarySegmentWritePointer(segments.main, segments.guid_start);
+  BinarySegmentWritePointer(segments.main, segments.state_start);
+  StateImplicitTableWrite(implicit, segments.main, segments.file, segments.index, segments.string);
+  BinarySegmentWriteUint32(segments.main, StateData::MagicNumber);
+}
+
+// The state file is written in ranges of guids, on the helper pool. Each
+// chunk writes its nodes to its own segments and implicit input table, and the
+// chunks are joined in order once they are all done.
+struct StateSaveChunk
+{
+  size_t              m_NewBegin;
+  size_t              m_NewEnd;
+  size_t              m_OldBegin;
+  size_t              m_OldEnd;
+  StateSavingSegments m_Segments;
+  StateImplicitTable  m_Implicit;
+  int32_t             m_EntryCount;
+  uint32_t            m_SavedNew;
+  uint32_t            m_SavedOld;
+  uint32_t            m_Dropped;
+};
+
+struct StateSaver
+{
+  enum
+  {
+    kMinChunkSize    = 1024,
+    kChunksPerThread = 4
   };
 
-  auto save_new = [=, &entry_count](size_t index) {
+  Driver*              m_Driver;
+  const NodeState*     m_NewState;
+  const HashDigest*    m_OldGuids;
+  const NodeStateData* m_OldState;
+  uint32_t             m_OldCount;
+  const StateFileData* m_OldImplicitFiles;
+  // One per worker, for scanning and the names in the chunks' implicit tables.
+  MemAllocLinear*      m_Scratch;
+  StateSaveChunk*      m_Chunks;
+  uint32_t             m_ChunkCount;
+  uint32_t             m_NextChunk;
+};
+
+static void SaveStateChunk(StateSaver* saver, StateSaveChunk* chunk, MemAllocLinear* scratch)
+{
+  Driver*                    self               = saver->m_Driver;
+  const StateSavingSegments& segments           = chunk->m_Segments;
+  StateImplicitTable*        implicit           = &chunk->m_Implicit;
+  const StateFileData*       old_implicit_files = saver->m_OldImplicitFiles;
+
+  uint32_t             src_count  = self->m_DagData->m_NodeCount;
+  const HashDigest    *src_guids  = self->m_DagData->m_NodeGuids;
+  const NodeData      *src_data   = self->m_DagData->m_NodeData;
+  const NodeState     *new_state  = saver->m_NewState + chunk->m_NewBegin;
+  const HashDigest    *old_guids  = saver->m_OldGuids;
+  const NodeStateData *old_state  = saver->m_OldState;
+  uint32_t             old_count  = saver->m_OldCount;
+  const size_t         old_begin  = chunk->m_OldBegin;
+  uint32_t this_dag_hashed_identifier = self->m_DagData->m_HashedIdentifier;
+
+  StateImplicitTableInit(implicit, &self->m_Heap, scratch);
+
+  auto save_new = [=](size_t index) {
     const NodeState  *elem      = new_state + index;
     const NodeData   *src_elem  = elem->m_MmapData;
     const int         src_index = int(src_elem - src_data);
@@ -1344,36 +1784,36 @@ bool DriverSaveBuildState(Driver* self)
       {
         size_t old_index = old_guid - old_guids;
         const NodeStateData* old_state_data = old_state + old_index;
-        save_node_state_old(old_state_data->m_BuildResult, &old_state_data->m_InputSignature, old_state_data, guid);
-        ++entry_count;
-        ++g_Stats.m_StateSaveNew;
+        SaveOldNodeState(segments, implicit, old_implicit_files, old_state_data, guid);
+        ++chunk->m_EntryCount;
+        ++chunk->m_SavedNew;
       }
     }
     else
     {
-      save_node_state(elem->m_BuildResult, &elem->m_InputSignature, src_elem, elem->m_MmapState, guid);
-      ++entry_count;
-      ++g_Stats.m_StateSaveNew;
+      SaveNodeState(self, scratch, segments, implicit, old_implicit_files, elem, guid);
+      ++chunk->m_EntryCount;
+      ++chunk->m_SavedNew;
     }
   };
 
-  auto save_old = [=, &entry_count](size_t index) {
-    const HashDigest    *guid = old_guids + index;
-    const NodeStateData *data = old_state + index;
+  auto save_old = [=](size_t index) {
+    const HashDigest    *guid = old_guids + old_begin + index;
+    const NodeStateData *data = old_state + old_begin + index;
 
     // Make sure this node is still relevant before saving.
     bool node_is_in_dag = BinarySearch(src_guids, src_count, *guid) != nullptr;
  
     if (node_is_in_dag || !node_was_used_by_this_dag_previously(data, this_dag_hashed_identifier))
     {
-      save_node_state_old(data->m_BuildResult, &data->m_InputSignature, data, guid);
-      ++entry_count;
-      ++g_Stats.m_StateSaveOld;
+      SaveOldNodeState(segments, implicit, old_implicit_files, data, guid);
+      ++chunk->m_EntryCount;
+      ++chunk->m_SavedOld;
     }
     else 
       {
       // Drop this node.
-        ++g_Stats.m_StateSaveDropped;
+        ++chunk->m_Dropped;
       }
   };
 
@@ -1383,19 +1823,196 @@ bool DriverSaveBuildState(Driver* self)
   };
 
   auto key_old = [=](size_t index) {
-    return old_guids + index;
+    return old_guids + old_begin + index;
   };
 
   TraverseSortedArrays(
-      new_state_count, save_new, key_new,
-      old_count, save_old, key_old);
+      chunk->m_NewEnd - chunk->m_NewBegin, save_new, key_new,
+      chunk->m_OldEnd - chunk->m_OldBegin, save_old, key_old);
+}
+
+static void SaveStateChunks(void* context, int thread_index)
+{
+  StateSaver*     saver   = static_cast<StateSaver*>(context);
+  MemAllocLinear* scratch = &saver->m_Scratch[thread_index];
+
+  LinearAllocSetOwner(scratch, ThreadCurrent());
+
+  for (;;)
+  {
+    uint32_t index = AtomicIncrement(&saver->m_NextChunk) - 1;
+    if (index >= saver->m_ChunkCount)
+      break;
+
+    SaveStateChunk(saver, &saver->m_Chunks[index], scratch);
+  }
+}
+
+bool DriverSaveBuildState(Driver* self)
+{
+  TimingScope timing_scope(nullptr, &g_Stats.m_StateSaveTimeCycles);
+  ProfilerScope prof_scope("Tundra SaveState", 0);
+
+  MemAllocHeap* heap = &self->m_Heap;
+
+  BinaryWriter writer;
+  BinaryWriterInit(&writer, heap);
+
+  StateSavingSegments segments;
+  StateSavingSegmentsInit(&segments, &writer);
+
+  const HashDigest    *src_guids       = self->m_DagData->m_NodeGuids;
+  const NodeData      *src_data        = self->m_DagData->m_NodeData;
+  NodeState           *new_state       = self->m_Nodes.m_Storage;
+  const size_t         new_state_count = self->m_Nodes.m_Size;
+
+  std::sort(new_state, new_state + new_state_count, [=](const NodeState& l, const NodeState& r) {
+    // We know guids are sorted, so all we need to do is compare pointers into that table.
+    return l.m_MmapData < r.m_MmapData;
+  });
+
+  StateSaver saver;
+  saver.m_Driver           = self;
+  saver.m_NewState         = new_state;
+  saver.m_OldGuids         = nullptr;
+  saver.m_OldState         = nullptr;
+  saver.m_OldCount         = 0;
+  saver.m_OldImplicitFiles = nullptr;
+  saver.m_NextChunk        = 0;
+
+  if (const StateData* state_data = self->m_StateData)
+  {
+    saver.m_OldGuids         = state_data->m_NodeGuids;
+    saver.m_OldState         = state_data->m_NodeStates;
+    saver.m_OldCount         = state_data->m_NodeCount;
+    saver.m_OldImplicitFiles = state_data->m_ImplicitFiles.GetArray();
+  }
+
+  const HashDigest* old_guids = saver.m_OldGuids;
+  const size_t      old_count = saver.m_OldCount;
+
+  int thread_count = self->m_HelperPool.m_MaxThreadCount + 1;
+
+  size_t chunk_count = (new_state_count + old_count) / StateSaver::kMinChunkSize;
+  if (chunk_count > size_t(thread_count) * StateSaver::kChunksPerThread)
+    chunk_count = size_t(thread_count) * StateSaver::kChunksPerThread;
+  if (chunk_count < 1)
+    chunk_count = 1;
+  if (size_t(thread_count) > chunk_count)
+    thread_count = int(chunk_count);
+
+  saver.m_ChunkCount = uint32_t(chunk_count);
+  saver.m_Chunks     = HeapAllocateArray<StateSaveChunk>(heap, chunk_count);
+  saver.m_Scratch    = HeapAllocateArray<MemAllocLinear>(heap, thread_count);
+
+  for (int i = 0; i < thread_count; ++i)
+    LinearAllocInit(&saver.m_Scratch[i], heap, MB(32), "state save scratch");
+
+  auto new_guid = [=](const NodeState& node) -> const HashDigest& {
+    return src_guids[node.m_MmapData - src_data];
+  };
+
+  // Chunks split the larger of the two arrays evenly. A guid that is in both
+  // lands in the same chunk, so each chunk can merge on its own.
+  size_t new_begin = 0;
+  size_t old_begin = 0;
+
+  for (size_t ci = 0; ci < chunk_count; ++ci)
+  {
+    StateSaveChunk* chunk = &saver.m_Chunks[ci];
+    chunk->m_NewBegin   = new_begin;
+    chunk->m_OldBegin   = old_begin;
+    chunk->m_EntryCount = 0;
+    chunk->m_SavedNew   = 0;
+    chunk->m_SavedOld   = 0;
+    chunk->m_Dropped    = 0;
+
+    if (ci + 1 == chunk_count)
+    {
+      new_begin = new_state_count;
+      old_begin = old_count;
+    }
+    else
+    {
+      const HashDigest& split = new_state_count >= old_count ?
+        new_guid(new_state[(ci + 1) * new_state_count / chunk_count]) :
+        old_guids[(ci + 1) * old_count / chunk_count];
+
+      new_begin = std::lower_bound(new_state + new_begin, new_state + new_state_count, split, [=](const NodeState& node, const HashDigest& key) {
+        return new_guid(node) < key;
+      }) - new_state;
+
+      old_begin = std::lower_bound(old_guids + old_begin, old_guids + old_count, split) - old_guids;
+    }
+
+    chunk->m_NewEnd = new_begin;
+    chunk->m_OldEnd = old_begin;
+
+    if (0 == ci)
+    {
+      chunk->m_Segments = segments;
+    }
+    else
+    {
+      chunk->m_Segments        = StateSavingSegments();
+      chunk->m_Segments.guid   = BinaryWriterAddSegment(&writer);
+      chunk->m_Segments.state  = BinaryWriterAddSegment(&writer);
+      chunk->m_Segments.array  = BinaryWriterAddSegment(&writer);
+      chunk->m_Segments.string = BinaryWriterAddSegment(&writer);
+    }
+  }
 
-  // Complete main data structure.
-  BinarySegmentWriteUint32(main_seg, StateData::MagicNumber);
-  BinarySegmentWriteInt32(main_seg, entry_count);
-  BinarySegmentWritePointer(main_seg, guid_ptr);
-  BinarySegmentWritePointer(main_seg, state_ptr);
-  BinarySegmentWriteUint32(main_seg, StateData::MagicNumber);
+  if (thread_count > 1)
+    HelperPoolRun(&self->m_HelperPool, SaveStateChunks, &saver, thread_count);
+  else
+    SaveStateChunks(&saver, 0);
+
+  // The names stay in the chunks' scratch until the table is written.
+  StateImplicitTable implicit;
+  StateImplicitTableInit(&implicit, heap, nullptr);
+
+  int entry_count = 0;
+
+  for (size_t ci = 0; ci < chunk_count; ++ci)
+  {
+    const StateSaveChunk* chunk = &saver.m_Chunks[ci];
+    StateImplicitTableMerge(&implicit, &chunk->m_Implicit);
+    entry_count                += chunk->m_EntryCount;
+    g_Stats.m_StateSaveNew     += chunk->m_SavedNew;
+    g_Stats.m_StateSaveOld     += chunk->m_SavedOld;
+    g_Stats.m_StateSaveDropped += chunk->m_Dropped;
+  }
+
+  // Complete main data structure. This fills in the chunks' implicit input
+  // pointers, so it comes before their segments are joined.
+  StateWriteMain(segments, &implicit, entry_count);
+
+  g_Stats.m_StateImplicitFiles = uint32_t(implicit.m_Files.m_Size);
+  g_Stats.m_StateImplicitRefs  = uint32_t(implicit.m_Refs.m_Size);
+
+  StateImplicitTableDestroy(&implicit);
+
+  for (size_t ci = 0; ci < chunk_count; ++ci)
+  {
+    StateSaveChunk* chunk = &saver.m_Chunks[ci];
+
+    if (ci > 0)
+    {
+      BinarySegmentAlign(segments.array, 4);
+      BinarySegmentAppend(segments.guid, chunk->m_Segments.guid);
+      BinarySegmentAppend(segments.state, chunk->m_Segments.state);
+      BinarySegmentAppend(segments.array, chunk->m_Segments.array);
+      BinarySegmentAppend(segments.string, chunk->m_Segments.string);
+    }
+
+    StateImplicitTableDestroy(&chunk->m_Implicit);
+  }
+
+  for (int i = 0; i < thread_count; ++i)
+    LinearAllocDestroy(&saver.m_Scratch[i]);
+
+  HeapFree(heap, saver.m_Scratch);
+  HeapFree(heap, saver.m_Chunks);
 
   // Unmap old state data.
   MmapFileUnmap(&self->m_StateFile);
@@ -1407,6 +2024,11 @@ bool DriverSaveBuildState(Driver* self)
   {
     // Commit atomically with a file rename.
     success = RenameFile(self->m_DagData->m_StateFileNameTmp, self->m_DagData->m_StateFileName);
+    g_Stats.m_StateSaveBytes = GetFileInfo(self->m_DagData->m_StateFileName).m_Size;
+
+    // Everything the journal recorded is in the state file now.
+    if (success)
+      StateJournalRemove(&self->m_StateJournal);
   }
   else
   {
@@ -1418,6 +2040,167 @@ bool DriverSaveBuildState(Driver* self)
   return success;
 }
 
+// Called on a build thread when a node has run its action. Appends its state
+// to the journal as a StateData with just that node.
+static void DriverJournalNode(void* context, const NodeState* node)
+{
+  Driver*       self    = static_cast<Driver*>(context);
+  StateJournal* journal = &self->m_StateJournal;
+
+  TimingScope timing_scope(&g_Stats.m_StateJournalRecords, &g_Stats.m_StateJournalTimeCycles);
+
+  const int         src_index = int(node->m_MmapData - self->m_DagData->m_NodeData);
+  const HashDigest* guid      = self->m_DagData->m_NodeGuids + src_index;
+
+  MutexLock(&journal->m_Mutex);
+
+  LinearAllocSetOwner(&journal->m_Allocator, ThreadCurrent());
+  MemAllocLinearScope alloc_scope(&journal->m_Allocator);
+
+  StateSavingSegments segments;
+  StateSavingSegmentsInit(&segments, &journal->m_Writer);
+
+  StateImplicitTable implicit;
+  StateImplicitTableInit(&implicit, journal->m_Heap, &journal->m_Allocator);
+
+  const StateFileData* old_implicit_files = self->m_StateData ? self->m_StateData->m_ImplicitFiles.GetArray() : nullptr;
+
+  SaveNodeState(self, &journal->m_Allocator, segments, &implicit, old_implicit_files, node, guid);
+  StateWriteMain(segments, &implicit, 1);
+
+  StateImplicitTableDestroy(&implicit);
+
+  StateJournalAppend(journal);
+
+  MutexUnlock(&journal->m_Mutex);
+}
+
+// Folds a journal left behind by a build that didn't get to save its state
+// into the state file, and maps the result.
+static void DriverReplayStateJournal(Driver* self)
+{
+  StateJournal* journal  = &self->m_StateJournal;
+  const char*   state_fn = self->m_DagData->m_StateFileName;
+
+  Buffer<uint8_t>          data;
+  Buffer<size_t>           offsets;
+  Buffer<const StateData*> records;
+  BufferInit(&data);
+  BufferInit(&offsets);
+  BufferInit(&records);
+
+  if (StateJournalRead(journal->m_FileName, &self->m_Heap, &data, &offsets))
+  {
+    for (size_t offset : offsets)
+    {
+      // Records written by another version of tundra are of no use.
+      const StateData* record = reinterpret_cast<const StateData*>(data.m_Storage + offset);
+      if (StateData::MagicNumber == record->m_MagicNumber && StateData::MagicNumber == record->m_MagicNumberEnd && 1 == record->m_NodeCount)
+        BufferAppendOne(&records, &self->m_Heap, record);
+    }
+
+    if (0 == records.m_Size)
+      StateJournalRemove(journal);
+  }
+
+  if (records.m_Size > 0)
+  {
+    ProfilerScope prof_scope("Tundra ReplayStateJournal", 0);
+    MemAllocLinearScope alloc_scope(&self->m_Allocator);
+
+    // A node that ran more than once has a record for each time; the last one
+    // holds.
+    std::stable_sort(records.begin(), records.end(), [](const StateData* l, const StateData* r) {
+      return *l->m_NodeGuids.Get() < *r->m_NodeGuids.Get();
+    });
+
+    size_t record_count = 0;
+    for (size_t i = 0; i < records.m_Size; ++i)
+    {
+      if (i + 1 == records.m_Size || !(*records[i]->m_NodeGuids.Get() == *records[i + 1]->m_NodeGuids.Get()))
+        records[record_count++] = records[i];
+    }
+    records.m_Size = record_count;
+
+    const HashDigest    *old_guids          = nullptr;
+    const NodeStateData *old_state          = nullptr;
+    const StateFileData *old_implicit_files = nullptr;
+    uint32_t             old_count          = 0;
+
+    if (const StateData* state_data = self->m_StateData)
+    {
+      old_guids          = state_data->m_NodeGuids;
+      old_state          = state_data->m_NodeStates;
+      old_implicit_files = state_data->m_ImplicitFiles.GetArray();
+      old_count          = state_data->m_NodeCount;
+    }
+
+    BinaryWriter writer;
+    BinaryWriterInit(&writer, &self->m_Heap);
+
+    StateSavingSegments segments;
+    StateSavingSegmentsInit(&segments, &writer);
+
+    StateImplicitTable implicit;
+    StateImplicitTableInit(&implicit, &self->m_Heap, &self->m_Allocator);
+
+    int32_t entry_count = 0;
+
+    auto save_record = [&](size_t index) {
+      const StateData* record = records[index];
+      SaveOldNodeState(segments, &implicit, record->m_ImplicitFiles.GetArray(), record->m_NodeStates.Get(), record->m_NodeGuids.Get());
+      ++entry_count;
+    };
+
+    auto save_old = [&](size_t index) {
+      SaveOldNodeState(segments, &implicit, old_implicit_files, old_state + index, old_guids + index);
+      ++entry_count;
+    };
+
+    auto key_record = [&](size_t index) -> const HashDigest* {
+      return records[index]->m_NodeGuids.Get();
+    };
+
+    auto key_old = [=](size_t index) {
+      return old_guids + index;
+    };
+
+    TraverseSortedArrays(
+        records.m_Size, save_record, key_record,
+        old_count, save_old, key_old);
+
+    StateWriteMain(segments, &implicit, entry_count);
+    StateImplicitTableDestroy(&implicit);
+
+    MmapFileUnmap(&self->m_StateFile);
+    self->m_StateData = nullptr;
+
+    bool success = BinaryWriterFlush(&writer, self->m_DagData->m_StateFileNameTmp) &&
+                   RenameFile(self->m_DagData->m_StateFileNameTmp, state_fn);
+
+    BinaryWriterDestroy(&writer);
+
+    if (success)
+    {
+      Log(kInfo, "recovered the state of %d nodes from %s", int(records.m_Size), journal->m_FileName);
+      g_Stats.m_StateJournalReplayed = uint32_t(records.m_Size);
+      StateJournalRemove(journal);
+    }
+    else
+    {
+      Log(kWarning, "couldn't fold build state journal %s into %s", journal->m_FileName, state_fn);
+      remove(self->m_DagData->m_StateFileNameTmp);
+    }
+
+    if (LoadFrozenData<StateData>(state_fn, &self->m_StateFile, &self->m_StateData))
+      g_Stats.m_StateLoadBytes = self->m_StateFile.m_Size;
+  }
+
+  BufferDestroy(&records, &self->m_Heap);
+  BufferDestroy(&offsets, &self->m_Heap);
+  BufferDestroy(&data, &self->m_Heap);
+}
+
 void DriverRemoveStaleOutputs(Driver* self)
 {
   TimingScope timing_scope(nullptr, &g_Stats.m_StaleCheckTimeCycles);
@@ -1438,6 +2221,12 @@ void DriverRemoveStaleOutputs(Driver* self)
   HashSet<kFlagPathStrings> file_table;
   HashSetInit(&file_table, &self->m_Heap);
 
+  uint32_t output_count = 0;
+  for (int i = 0, node_count = dag->m_NodeCount; i < node_count; ++i)
+    output_count += dag->m_NodeData[i].m_OutputFiles.GetCount() + dag->m_NodeData[i].m_AuxOutputFiles.GetCount();
+
+  HashTablePrepareBulkInsert(&file_table, output_count);
+
   // Insert all current regular and aux output files into the hash table.
   auto add_file = [&file_table, scratch](const FrozenFileAndHash& p) -> void
   {
@@ -1453,12 +2242,12 @@ void DriverRemoveStaleOutputs(Driver* self)
   {
     const NodeData* node = dag->m_NodeData + i;
 
-    for (const FrozenFileAndHash& p : node->m_OutputFiles)
+    for (const FrozenFileAndHash& p : DagPathList(dag->m_Paths.GetArray(), node->m_OutputFiles))
     {
       add_file(p);
     }
 
-    for (const FrozenFileAndHash& p : node->m_AuxOutputFiles)
+    for (const FrozenFileAndHash& p : DagPathList(dag->m_Paths.GetArray(), node->m_AuxOutputFiles))
     {
       add_file(p);
     }
@@ -1555,7 +2344,7 @@ void DriverCleanOutputs(Driver* self)
   int count = 0;
   for (NodeState& state : self->m_Nodes)
   {
-    for (const FrozenFileAndHash& fh : state.m_MmapData->m_OutputFiles)
+    for (const FrozenFileAndHash& fh : DagPathList(self->m_DagData->m_Paths.GetArray(), state.m_MmapData->m_OutputFiles))
     {
       if (0 == RemoveFileOrDir(fh.m_Filename))
         ++count;
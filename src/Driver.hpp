@@ -10,6 +10,9 @@
 #include "ScanCache.hpp"
 #include "StatCache.hpp"
 #include "DigestCache.hpp"
+#include "HelperPool.hpp"
+#include "DigestPrefetch.hpp"
+#include "StateJournal.hpp"
 
 namespace t2
 {
@@ -35,6 +38,7 @@ struct DriverOptions
   bool        m_Clean;
   bool        m_Rebuild;
   bool        m_DebugSigning;
+  bool        m_DagJson;
   bool        m_ContinueOnError;
   bool        m_ThrottleOnHumanActivity;
   int         m_ThrottleInactivityPeriod;
@@ -51,6 +55,25 @@ struct DriverOptions
 
 void DriverOptionsInit(DriverOptions* self);
 
+// A DAG file signature whose file was touched but not changed. The new
+// timestamp is written over the stored one once the DAG is unmapped, so the
+// file isn't digested again on every run.
+struct DagStampRefresh
+{
+  uint64_t          m_Offset;     // Of DagFileSignature::m_Timestamp in the DAG file
+  uint64_t          m_Timestamp;
+};
+
+// A cache file written on a background thread as soon as the build stops
+// adding to the cache. It is only moved into place once the build is done.
+struct DriverCacheWrite
+{
+  ThreadId          m_Thread;
+  bool              m_Started;
+  bool              m_Success;
+  uint32_t          m_Generation;
+};
+
 struct Driver
 {
   enum
@@ -91,6 +114,17 @@ struct Driver
 
   DigestCache       m_DigestCache;
 
+  HelperPool        m_HelperPool;
+  DigestPrefetch    m_DigestPrefetch;
+
+  DriverCacheWrite  m_ScanCacheWrite;
+  DriverCacheWrite  m_DigestCacheWrite;
+
+  // Node states recorded as actions finish, until the state file is saved.
+  StateJournal      m_StateJournal;
+
+  Buffer<DagStampRefresh> m_DagStampRefreshes;
+
   int32_t           m_PassNodeCount[kMaxPasses];
 };
 
@@ -36,6 +36,32 @@ FileInfo GetFileInfo(const char* path)
   TimingScope timing_scope(&g_Stats.m_StatCount, &g_Stats.m_StatTimeCycles);
 
   FileInfo result;
+  memset(&result, 0, sizeof result);
+
+#if defined(TUNDRA_LINUX) && defined(STATX_BASIC_STATS)
+  struct statx stxbuf;
+  if (0 == statx(AT_FDCWD, path, 0, STATX_TYPE | STATX_MTIME | STATX_CTIME | STATX_INO | STATX_SIZE, &stxbuf))
+  {
+    uint32_t flags = FileInfo::kFlagExists;
+
+    if ((stxbuf.stx_mode & S_IFMT) == S_IFDIR)
+      flags |= FileInfo::kFlagDirectory;
+    else if ((stxbuf.stx_mode & S_IFMT) == S_IFREG)
+      flags |= FileInfo::kFlagFile;
+
+    result.m_Flags     = flags;
+    result.m_Timestamp = stxbuf.stx_mtime.tv_sec;
+    result.m_Size      = stxbuf.stx_size;
+    result.m_MtimeNs   = uint64_t(stxbuf.stx_mtime.tv_sec) * 1000000000ull + stxbuf.stx_mtime.tv_nsec;
+    result.m_CtimeNs   = uint64_t(stxbuf.stx_ctime.tv_sec) * 1000000000ull + stxbuf.stx_ctime.tv_nsec;
+    result.m_Inode     = stxbuf.stx_ino;
+    result.m_Device    = uint64_t(stxbuf.stx_dev_major) << 32 | stxbuf.stx_dev_minor;
+  }
+  else
+  {
+    result.m_Flags     = errno == ENOENT ? 0 : FileInfo::kFlagError;
+  }
+#else
 #if defined(TUNDRA_UNIX)
   struct stat stbuf;
 #elif defined(TUNDRA_WIN32)
@@ -60,13 +86,27 @@ FileInfo GetFileInfo(const char* path)
     result.m_Flags     = flags;
     result.m_Timestamp = stbuf.st_mtime;
     result.m_Size      = stbuf.st_size;
+#if defined(TUNDRA_APPLE)
+    result.m_MtimeNs   = uint64_t(stbuf.st_mtimespec.tv_sec) * 1000000000ull + stbuf.st_mtimespec.tv_nsec;
+    result.m_CtimeNs   = uint64_t(stbuf.st_ctimespec.tv_sec) * 1000000000ull + stbuf.st_ctimespec.tv_nsec;
+#elif defined(TUNDRA_UNIX)
+    result.m_MtimeNs   = uint64_t(stbuf.st_mtim.tv_sec) * 1000000000ull + stbuf.st_mtim.tv_nsec;
+    result.m_CtimeNs   = uint64_t(stbuf.st_ctim.tv_sec) * 1000000000ull + stbuf.st_ctim.tv_nsec;
+#else
+    // Windows only has whole seconds here, and st_ctime is the creation time.
+    result.m_MtimeNs   = uint64_t(stbuf.st_mtime) * 1000000000ull;
+    result.m_CtimeNs   = uint64_t(stbuf.st_ctime) * 1000000000ull;
+#endif
+#if defined(TUNDRA_UNIX)
+    result.m_Inode     = stbuf.st_ino;
+    result.m_Device    = stbuf.st_dev;
+#endif
   }
   else
   {
     result.m_Flags     = errno == ENOENT ? 0 : FileInfo::kFlagError;
-    result.m_Timestamp = 0;
-    result.m_Size      = 0;
   }
+#endif
 
   return result;
 }
@@ -103,6 +143,17 @@ bool ShouldFilter(const char* name, size_t len)
   return false;
 }
 
+bool FileNameMatchesFilter(const char* name, const char* filter)
+{
+  if (!filter)
+    return true;
+#if defined(TUNDRA_UNIX)
+  return 0 == fnmatch(filter, name, 0);
+#else
+  return FALSE != PathMatchSpec(name, filter);
+#endif
+}
+
 void ListDirectory(
     const char* path,
     const char* filter,
@@ -138,7 +189,7 @@ void ListDirectory(
     if (ShouldFilter(entry.d_name, len))
       continue;
         
-    bool matchesFilter = !filter || fnmatch(filter, entry.d_name, 0) == 0;
+    bool matchesFilter = FileNameMatchesFilter(entry.d_name, filter);
     
     // If we are recursing, we need to continue to find out whether this is a directory
     if (!matchesFilter && !recurse)
@@ -199,7 +250,7 @@ void ListDirectory(
 	{
     if (ShouldFilter(find_data.cFileName, strlen(find_data.cFileName)))
       continue;
-    bool matchesFilter = !filter || PathMatchSpec(find_data.cFileName, filter);
+    bool matchesFilter = FileNameMatchesFilter(find_data.cFileName, filter);
     if (!matchesFilter && !recurse)
       continue;
         
@@ -215,9 +266,11 @@ void ListDirectory(
     uint64_t ft = uint64_t(find_data.ftLastWriteTime.dwHighDateTime) << 32 | find_data.ftLastWriteTime.dwLowDateTime;
 
     FileInfo info;
+    memset(&info, 0, sizeof info);
     info.m_Flags     = FileInfo::kFlagExists;
     info.m_Size      = uint64_t(find_data.nFileSizeHigh) << 32 | find_data.nFileSizeLow;
     info.m_Timestamp = (ft - kEpochDiff) / kRateDiff;
+    info.m_MtimeNs   = (ft - kEpochDiff) * 100;
 
     if (FILE_ATTRIBUTE_DIRECTORY & find_data.dwFileAttributes)
       info.m_Flags |= FileInfo::kFlagDirectory;
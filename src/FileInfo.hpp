@@ -19,7 +19,14 @@ struct FileInfo
 
   uint32_t      m_Flags;
   uint64_t      m_Size;
-  uint64_t      m_Timestamp;
+  uint64_t      m_Timestamp;    // mtime, whole seconds
+
+  // Finer grained identity, used to decide whether cached content digests
+  // are still valid. Zero where the platform doesn't provide them.
+  uint64_t      m_MtimeNs;
+  uint64_t      m_CtimeNs;
+  uint64_t      m_Inode;
+  uint64_t      m_Device;
 
   bool Exists()      const { return 0 != (kFlagExists & m_Flags); }
   bool IsFile()      const { return 0 != (kFlagFile & m_Flags); }
@@ -31,6 +38,9 @@ FileInfo GetFileInfo(const char* path);
 bool ShouldFilter(const char* name);
 bool ShouldFilter(const char* name, size_t len);
 
+// Matches a file name against a glob style filter. A null filter matches anything.
+bool FileNameMatchesFilter(const char* name, const char* filter);
+
 void ListDirectory(
     const char* dir,
     const char* filter,
@@ -4,12 +4,140 @@
 #include "Stats.hpp"
 #include "DigestCache.hpp"
 #include "Buffer.hpp"
+#include "FileInfo.hpp"
+#include "MemAllocLinear.hpp"
+#include "HelperPool.hpp"
+#include "MemoryMappedFile.hpp"
 #include <stdio.h>
+#include <time.h>
 
 namespace t2
 {
 
-static void ComputeFileSignatureSha1(HashState* state, StatCache* stat_cache, DigestCache* digest_cache, const char* filename, uint32_t fn_hash)
+// Files at least this big are digested from a memory mapping, and by several
+// threads when the hash backend allows splitting the input.
+static const uint64_t kLargeFileDigestSize = 16 * 1024 * 1024;
+
+#if ENABLED(USE_BLAKE3_HASH)
+struct ParallelDigest
+{
+  const uint8_t* m_Data;
+  size_t         m_Size;
+  size_t         m_SubtreeSize;
+  uint32_t     (*m_Cvs)[8];
+
+  static void HashSubtree(void* context, int index)
+  {
+    ParallelDigest* self = static_cast<ParallelDigest*>(context);
+    size_t offset = size_t(index) * self->m_SubtreeSize;
+    size_t size = self->m_Size - offset < self->m_SubtreeSize ? self->m_Size - offset : self->m_SubtreeSize;
+    Blake3SubtreeCv(self->m_Data + offset, size, offset / kBlake3ChunkSize, self->m_Cvs[index]);
+  }
+};
+
+static void DigestParallel(HelperPool* helpers, const void* data, size_t size, HashDigest* digest)
+{
+  enum { kMaxSubtrees = 256 };
+
+  // Subtrees must be a power-of-two number of chunks. Start at 1 MB and grow
+  // them until there are few enough to keep the merge step trivial.
+  size_t subtree_size = 1024 * kBlake3ChunkSize;
+  while ((size + subtree_size - 1) / subtree_size > kMaxSubtrees)
+    subtree_size *= 2;
+
+  uint32_t cvs[kMaxSubtrees][8];
+  ParallelDigest job;
+  job.m_Data        = static_cast<const uint8_t*>(data);
+  job.m_Size        = size;
+  job.m_SubtreeSize = subtree_size;
+  job.m_Cvs         = cvs;
+
+  int count = int((size + subtree_size - 1) / subtree_size);
+  HelperPoolRun(helpers, ParallelDigest::HashSubtree, &job, count);
+  Blake3MergeSubtrees(cvs, count, digest->m_Data, sizeof digest->m_Data);
+}
+#endif
+
+static bool DigestFileMapped(HelperPool* helpers, const char* filename, HashDigest* digest)
+{
+  MemoryMappedFile file;
+  MmapFileInit(&file);
+  MmapFileMap(&file, filename);
+  if (!MmapFileValid(&file))
+    return false;
+
+  MmapFileAdviseSequential(&file);
+
+#if ENABLED(USE_BLAKE3_HASH)
+  if (helpers)
+  {
+    DigestParallel(helpers, file.m_Address, file.m_Size, digest);
+    MmapFileDestroy(&file);
+    return true;
+  }
+#endif
+
+  HashState h;
+  HashInit(&h);
+  HashUpdate(&h, file.m_Address, file.m_Size);
+  HashFinalize(&h, digest);
+
+  MmapFileDestroy(&file);
+  return true;
+}
+
+bool DigestFile(HelperPool* helpers, const char* filename, const FileInfo& file_info, HashDigest* digest)
+{
+  if (file_info.m_Size >= kLargeFileDigestSize && DigestFileMapped(helpers, filename, digest))
+    return true;
+
+  FILE* f = fopen(filename, "rb");
+  if (!f)
+    return false;
+
+  HashState h;
+  HashInit(&h);
+
+  char buffer[8192];
+  while (size_t nbytes = fread(buffer, 1, sizeof buffer, f))
+  {
+    HashUpdate(&h, buffer, nbytes);
+  }
+  fclose(f);
+
+  HashFinalize(&h, digest);
+  return true;
+}
+
+// Looks up or computes the digest of an existing file. Returns false if the
+// file couldn't be read.
+static bool GetFileDigest(DigestCache* digest_cache, HelperPool* helpers, const char* filename, uint32_t fn_hash, const FileInfo& file_info, HashDigest* digest, bool* computed)
+{
+  // If another thread is already digesting this file, wait for its result.
+  DigestInFlight claim;
+
+  *computed = false;
+
+  if (DigestCacheGet(digest_cache, filename, fn_hash, file_info, digest) ||
+      DigestCacheGetOrBegin(digest_cache, filename, fn_hash, file_info, digest, &claim))
+  {
+    return true;
+  }
+
+  TimingScope timing_scope(&g_Stats.m_FileDigestCount, &g_Stats.m_FileDigestTimeCycles);
+
+  bool success = DigestFile(helpers, filename, file_info, digest);
+
+  if (success)
+    DigestCacheSet(digest_cache, filename, fn_hash, file_info, *digest);
+
+  DigestCacheEnd(digest_cache, &claim);
+
+  *computed = true;
+  return success;
+}
+
+static void ComputeFileSignatureSha1(HashState* state, StatCache* stat_cache, DigestCache* digest_cache, HelperPool* helpers, const char* filename, uint32_t fn_hash)
 {
   FileInfo file_info = StatCacheStat(stat_cache, filename, fn_hash);
 
@@ -20,37 +148,35 @@ static void ComputeFileSignatureSha1(HashState* state, StatCache* stat_cache, Di
   }
 
   HashDigest digest;
+  bool       computed;
 
-  if (!DigestCacheGet(digest_cache, filename, fn_hash, file_info.m_Timestamp, &digest))
+  if (!GetFileDigest(digest_cache, helpers, filename, fn_hash, file_info, &digest, &computed))
   {
-    TimingScope timing_scope(&g_Stats.m_FileDigestCount, &g_Stats.m_FileDigestTimeCycles);
+    HashAddString(state, "<missing>");
+    return;
+  }
 
-    FILE* f = fopen(filename, "rb");
-    if (!f)
-    {
-      HashAddString(state, "<missing>");
-      return;
-    }
+  if (!computed)
+    AtomicIncrement(&g_Stats.m_DigestCacheHits);
 
-    HashState h;
-    HashInit(&h);
+  HashUpdate(state, &digest, sizeof(digest));
+}
 
-    char buffer[8192];
-    while (size_t nbytes = fread(buffer, 1, sizeof buffer, f))
-    {
-      HashUpdate(&h, buffer, nbytes);
-    }
-    fclose(f);
+void PrefetchFileDigest(StatCache* stat_cache, DigestCache* digest_cache, const char* filename, uint32_t fn_hash)
+{
+  FileInfo file_info = StatCacheStat(stat_cache, filename, fn_hash);
 
-    HashFinalize(&h, &digest);
-    DigestCacheSet(digest_cache, filename, fn_hash, file_info.m_Timestamp, digest);
-  }
-  else
-  {
-    AtomicIncrement(&g_Stats.m_DigestCacheHits);
-  }
+  if (!file_info.Exists() || file_info.IsDirectory())
+    return;
 
-  HashUpdate(state, &digest, sizeof(digest));
+  HashDigest digest;
+  bool       computed;
+
+  // No helpers, they run at normal priority.
+  GetFileDigest(digest_cache, nullptr, filename, fn_hash, file_info, &digest, &computed);
+
+  if (computed)
+    AtomicIncrement(&g_Stats.m_DigestsPrefetched);
 }
 
 static bool ComputeFileSignatureTimestamp(HashState* out, StatCache* stat_cache, const char* filename, uint32_t hash)
@@ -83,6 +209,7 @@ void ComputeFileSignature(
   HashState*          out,
   StatCache*          stat_cache,
   DigestCache*        digest_cache,
+  HelperPool*         helpers,
   const char*         filename,
   uint32_t            fn_hash,
   const uint32_t      sha_extension_hashes[],
@@ -90,102 +217,180 @@ void ComputeFileSignature(
   bool                force_use_timestamp)
 {
   if (!force_use_timestamp && ShouldUseSHA1SignatureFor(filename, sha_extension_hashes, sha_extension_hash_count))
-    ComputeFileSignatureSha1(out, stat_cache, digest_cache, filename, fn_hash);
+    ComputeFileSignatureSha1(out, stat_cache, digest_cache, helpers, filename, fn_hash);
   else
     ComputeFileSignatureTimestamp(out, stat_cache, filename, fn_hash);
 }
 
-t2::HashDigest CalculateGlobSignatureFor(const char* path, const char* filter, bool recurse, t2::MemAllocHeap* heap, t2::MemAllocLinear* scratch)
+// Directory mtimes this close to the time of listing are not trusted, as the
+// directory could still change within the same timestamp granule.
+static const uint64_t kGlobRacyMtimeSeconds = 2;
+
+struct GlobDirectoryEntry
+{
+  const char* m_Name;
+  bool        m_IsDirectory;
+  bool        m_Matches;
+};
+
+struct GlobDirectoryListing
 {
-    // Helper for directory iteration + memory allocation of strings.  We need to
-    // buffer the filenames as we need them in sorted order to ensure the results
-    // are consistent between runs.
-    struct IterContext
+  MemAllocHeap*              m_Heap;
+  MemAllocLinear*            m_Allocator;
+  const char*                m_Filter;
+  bool                       m_Recurse;
+  Buffer<GlobDirectoryEntry> m_Entries;
+
+  static void Callback(void* user_data, const FileInfo& info, const char* path)
+  {
+    GlobDirectoryListing* self = (GlobDirectoryListing*) user_data;
+
+    // Depending on the platform the path is either the bare name or the full path.
+    const char* name = path;
+    for (const char* p = path; *p; ++p)
     {
-      MemAllocLinear       *m_Allocator;
-      MemAllocHeap         *m_Heap;
-      Buffer<const char *>  m_Dirs;
-      Buffer<const char *>  m_Files;
-
-      void Init(MemAllocHeap* heap, MemAllocLinear* linear)
-      {
-        m_Allocator = linear;
-        m_Heap      = heap;
-        BufferInit(&m_Dirs);
-        BufferInit(&m_Files);
-      }
-
-      void Destroy()
-      {
-        BufferDestroy(&m_Files, m_Heap);
-        BufferDestroy(&m_Dirs, m_Heap);
-      }
-
-      static void Callback(void* user_data, const FileInfo& info, const char* path)
-      {
-        IterContext* self = (IterContext*) user_data;
-        char* data = StrDup(self->m_Allocator, path);
-        Buffer<const char*>* target = info.IsDirectory() ? &self->m_Dirs : &self->m_Files;
-        BufferAppendOne(target, self->m_Heap, data);
-      }
-
-      static int SortStringPtrs(const void* l, const void* r)
-      {
-        return strcmp(*(const char**)l, *(const char**)r);
-      }
-    };
-    
-    HashState h;
-    HashInit(&h);
-    
-    FileInfo pathInfo = GetFileInfo(path);
-    HashAddInteger(&h, pathInfo.Exists() ? 1 : 0);
-    HashAddInteger(&h, pathInfo.IsDirectory() ? 1 : 0);
+      if ('/' == *p || '\\' == *p)
+        name = p + 1;
+    }
+
+    GlobDirectoryEntry entry;
+    entry.m_Name        = StrDup(self->m_Allocator, name);
+    entry.m_IsDirectory = info.IsDirectory();
+    entry.m_Matches     = FileNameMatchesFilter(name, self->m_Filter);
+
+    // Directories that don't match still matter when recursing into them.
+    if (entry.m_Matches || (self->m_Recurse && entry.m_IsDirectory))
+      BufferAppendOne(&self->m_Entries, self->m_Heap, entry);
+  }
+
+  static int SortByName(const void* l, const void* r)
+  {
+    return strcmp(((const GlobDirectoryEntry*) l)->m_Name, ((const GlobDirectoryEntry*) r)->m_Name);
+  }
+};
+
+// Lists a single directory and digests its entries in sorted order. When
+// recursing, full paths of subdirectories are appended to `subdirs`.
+static HashDigest ListGlobDirectory(const char* path, const char* filter, bool recurse, MemAllocHeap* heap, MemAllocLinear* scratch, Buffer<const char*>* subdirs)
+{
+  GlobDirectoryListing listing;
+  listing.m_Heap      = heap;
+  listing.m_Allocator = scratch;
+  listing.m_Filter    = filter;
+  listing.m_Recurse   = recurse;
+  BufferInit(&listing.m_Entries);
+
+  ListDirectory(path, nullptr, false, &listing, GlobDirectoryListing::Callback);
+
+  qsort(listing.m_Entries.m_Storage, listing.m_Entries.m_Size, sizeof(GlobDirectoryEntry), GlobDirectoryListing::SortByName);
+
+  HashState h;
+  HashInit(&h);
+
+  for (const GlobDirectoryEntry& entry : listing.m_Entries)
+  {
+    HashAddPath(&h, entry.m_Name);
     HashAddSeparator(&h);
-    
-    if (pathInfo.Exists() && pathInfo.IsDirectory())
+    HashAddInteger(&h, (entry.m_IsDirectory ? 1 : 0) | (entry.m_Matches ? 2 : 0));
+
+    if (subdirs && recurse && entry.m_IsDirectory)
     {
-        // Set up to rewind allocator for each loop iteration
-        MemAllocLinearScope mem_scope(scratch);
-
-        // Set up context
-        IterContext ctx;
-        ctx.Init(heap, scratch);
-
-        // Get directory data
-        ListDirectory(path, filter, recurse, &ctx, IterContext::Callback);
-
-        // Sort data
-        qsort(ctx.m_Dirs.m_Storage, ctx.m_Dirs.m_Size, sizeof(const char*), IterContext::SortStringPtrs);
-        qsort(ctx.m_Files.m_Storage, ctx.m_Files.m_Size, sizeof(const char*), IterContext::SortStringPtrs);
-
-        // Compute digest
-        for (const char* p : ctx.m_Dirs)
-        {
-          HashAddPath(&h, p);
-          HashAddSeparator(&h);
-        }
-        
-        // Add an extra separator to catch a directory that turned into a file
-        HashAddSeparator(&h);
-
-        for (const char* p : ctx.m_Files)
-        {
-          HashAddPath(&h, p);
-          HashAddSeparator(&h);
-        }
-        
-        ctx.Destroy();
+      size_t path_len = strlen(path);
+      size_t name_len = strlen(entry.m_Name);
+      char* subdir = LinearAllocateArray<char>(scratch, path_len + name_len + 2);
+      memcpy(subdir, path, path_len);
+      subdir[path_len] = '/';
+      memcpy(subdir + path_len + 1, entry.m_Name, name_len + 1);
+      BufferAppendOne(subdirs, heap, (const char*) subdir);
     }
-    else if (pathInfo.IsFile())
+  }
+
+  BufferDestroy(&listing.m_Entries, heap);
+
+  HashDigest digest;
+  HashFinalize(&h, &digest);
+  return digest;
+}
+
+HashDigest CalculateGlobDirectorySignature(const char* path, const char* filter, bool recurse, MemAllocHeap* heap, MemAllocLinear* scratch)
+{
+  MemAllocLinearScope mem_scope(scratch);
+  return ListGlobDirectory(path, filter, recurse, heap, scratch, nullptr);
+}
+
+bool GlobDirectoryChanged(const char* path, uint64_t mtime_ns, const HashDigest& digest, const char* filter, bool recurse, MemAllocHeap* heap, MemAllocLinear* scratch)
+{
+  FileInfo info = GetFileInfo(path);
+
+  if (!info.IsDirectory())
+    return true;
+
+  if (0 != mtime_ns && info.m_MtimeNs == mtime_ns)
+    return false;
+
+  return CalculateGlobDirectorySignature(path, filter, recurse, heap, scratch) != digest;
+}
+
+HashDigest CalculateGlobSignatureFor(const char* path, const char* filter, bool recurse, MemAllocHeap* heap, MemAllocLinear* scratch,
+                                     void* user_data, GlobDirectoryCallback dir_callback)
+{
+  HashState h;
+  HashInit(&h);
+
+  FileInfo pathInfo = GetFileInfo(path);
+  HashAddInteger(&h, pathInfo.Exists() ? 1 : 0);
+  HashAddInteger(&h, pathInfo.IsDirectory() ? 1 : 0);
+  HashAddSeparator(&h);
+
+  if (pathInfo.Exists() && pathInfo.IsDirectory())
+  {
+    MemAllocLinearScope mem_scope(scratch);
+
+    const uint64_t racy_cutoff = (uint64_t(time(nullptr)) - kGlobRacyMtimeSeconds) * 1000000000ull;
+
+    // Walk depth first. The per-directory digests cover the names of their
+    // subdirectories, so together they determine the whole result.
+    Buffer<const char*> dirs;
+    BufferInit(&dirs);
+    BufferAppendOne(&dirs, heap, path);
+
+    Buffer<const char*> subdirs;
+    BufferInit(&subdirs);
+
+    while (dirs.m_Size > 0)
     {
-        HashAddInteger(&h, pathInfo.m_Timestamp);
+      const char* dir = BufferPopOne(&dirs);
+
+      // Stat before listing, so a change in between shows up as a stale mtime.
+      uint64_t mtime_ns = GetFileInfo(dir).m_MtimeNs;
+      if (mtime_ns >= racy_cutoff)
+        mtime_ns = 0;
+
+      BufferClear(&subdirs);
+      HashDigest digest = ListGlobDirectory(dir, filter, recurse, heap, scratch, &subdirs);
+
+      HashUpdate(&h, &digest, sizeof digest);
+
+      if (dir_callback)
+        dir_callback(user_data, dir, mtime_ns, digest);
+
+      // Push in reverse so they are visited in sorted order.
+      for (size_t i = subdirs.m_Size; i > 0; --i)
+        BufferAppendOne(&dirs, heap, subdirs[i - 1]);
     }
 
-    HashDigest digest;
-    HashFinalize(&h, &digest);
+    BufferDestroy(&subdirs, heap);
+    BufferDestroy(&dirs, heap);
+  }
+  else if (pathInfo.IsFile())
+  {
+    HashAddInteger(&h, pathInfo.m_Timestamp);
+  }
+
+  HashDigest digest;
+  HashFinalize(&h, &digest);
 
-    return digest;
+  return digest;
 }
 
 }
@@ -10,20 +10,45 @@ namespace t2
 struct HashState;
 struct StatCache;
 struct DigestCache;
+struct HelperPool;
 struct MemAllocHeap;
 struct MemAllocLinear;
+struct FileInfo;
 
 void ComputeFileSignature(
   HashState*          out,                  // out
   StatCache*          stat_cache,
   DigestCache*        digest_cache,
+  HelperPool*         helpers,              // optional, for large files
   const char*         filename,
   uint32_t            fn_hash,
   const uint32_t      sha_extension_hashes[],
   int                 sha_extension_hash_count,
   bool                force_use_timestamp);
 
-  HashDigest CalculateGlobSignatureFor(const char* path, const char* filter, bool recurse, MemAllocHeap* heap, MemAllocLinear* scratch);
+  // Makes sure the digest cache has the digest of a file, so a later
+  // ComputeFileSignature() of it is a cache hit.
+  void PrefetchFileDigest(StatCache* stat_cache, DigestCache* digest_cache, const char* filename, uint32_t fn_hash);
+
+  // Called for each directory a glob visits, with the directory's mtime from
+  // before it was listed (0 if it was too recent to be trusted) and the digest
+  // of its own entries, see CalculateGlobDirectorySignature().
+  typedef void (*GlobDirectoryCallback)(void* user_data, const char* path, uint64_t mtime_ns, const HashDigest& digest);
+
+  HashDigest CalculateGlobSignatureFor(const char* path, const char* filter, bool recurse, MemAllocHeap* heap, MemAllocLinear* scratch,
+                                       void* user_data, GlobDirectoryCallback dir_callback);
+
+  // Digest of the entries of a single directory a glob depends on. If the
+  // directory's mtime hasn't changed, neither has this.
+  HashDigest CalculateGlobDirectorySignature(const char* path, const char* filter, bool recurse, MemAllocHeap* heap, MemAllocLinear* scratch);
+
+  // Checks a directory recorded by CalculateGlobSignatureFor(). Only relists it
+  // if its mtime moved or wasn't trusted.
+  bool GlobDirectoryChanged(const char* path, uint64_t mtime_ns, const HashDigest& digest, const char* filter, bool recurse, MemAllocHeap* heap, MemAllocLinear* scratch);
+
+  // Digest of the contents of an existing file, bypassing the digest cache.
+  // Returns false if the file couldn't be read.
+  bool DigestFile(HelperPool* helpers, const char* filename, const FileInfo& file_info, HashDigest* digest);
 
   bool ShouldUseSHA1SignatureFor(const char* filename, const uint32_t sha_extension_hashes[], int sha_extension_hash_count);
 
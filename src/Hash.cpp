@@ -11,6 +11,7 @@ void HashInitImpl(HashStateImpl* impl);
 void HashBlock(const uint8_t* data, HashStateImpl* state, void* debug_file);
 void HashFinalizeImpl(HashStateImpl* self, HashDigest* digest);
 
+#if !ENABLED(USE_BLAKE3_HASH)
 void HashUpdate(HashState* self, const void *data_in, size_t size)
 {
   const uint8_t*       data   = static_cast<const uint8_t*>(data_in);
@@ -48,6 +49,7 @@ void HashUpdate(HashState* self, const void *data_in, size_t size)
   self->m_BufUsed  = used;
   self->m_MsgSize += size * 8;
 }
+#endif
 
 // Quickie to generate a hash digest from a single string
 void HashSingleString(HashDigest* digest_out, const char* string)
@@ -106,6 +108,7 @@ void HashInitDebug(HashState* self, void* fh)
   HashInitImpl(&self->m_StateImpl);
 }
 
+#if !ENABLED(USE_BLAKE3_HASH)
 void HashFinalize(HashState* self, HashDigest* digest)
 {
   uint8_t one_bit = 0x80;
@@ -140,6 +143,7 @@ void HashFinalize(HashState* self, HashDigest* digest)
 
   HashFinalizeImpl(&self->m_StateImpl, digest);
 }
+#endif
 
 void
 DigestToString(char (&buffer)[kDigestStringSize], const HashDigest& digest)
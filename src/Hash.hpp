@@ -91,13 +91,46 @@ struct ALIGN(16) HashStateImpl
 };
 #endif
 
-#if ENABLED(USE_FAST_HASH)
-
+// BLAKE3 hashing, see HashBlake3.cpp. The USE_BLAKE3_HASH backend is built
+// on this, and it is always available for benchmarking against the others.
 enum
 {
-  kTundraHashMagic = 0x7810221e
+  kBlake3ChunkSize = 1024,
+  kBlake3MaxDepth  = 54
+};
+
+struct ALIGN(16) Blake3State
+{
+  uint32_t m_ChunkCv[8];
+  uint64_t m_ChunkCounter;
+  uint64_t m_FirstChunk;
+  uint32_t m_BlocksCompressed;
+  uint32_t m_BufUsed;
+  uint8_t  m_Buffer[64];
+  uint32_t m_StackSize;
+  uint32_t m_Stack[kBlake3MaxDepth][8];
 };
 
+void Blake3Init(Blake3State* self);
+void Blake3Update(Blake3State* self, const void* data, size_t size);
+
+// Writes up to 64 bytes of output.
+void Blake3Finalize(Blake3State* self, uint8_t* out, size_t out_len);
+
+// Chaining value of a subtree of the input starting at chunk index
+// `first_chunk`. Used to hash large inputs on several threads: split the input
+// into pieces of the same power-of-two number of chunks (the last piece may be
+// shorter), hash each piece with this function and combine the results in order
+// with Blake3MergeSubtrees(). The result equals hashing all of it in one go.
+// There must be at least two pieces, as a lone subtree is the root itself.
+void Blake3SubtreeCv(const void* data, size_t size, uint64_t first_chunk, uint32_t cv_out[8]);
+void Blake3MergeSubtrees(const uint32_t (*cvs)[8], int count, uint8_t* out, size_t out_len);
+
+// Turns the SSE2/AVX2 chunk paths off, for testing and benchmarking.
+void Blake3SetSimdEnabled(bool enabled);
+
+#if ENABLED(USE_FAST_HASH) || ENABLED(USE_BLAKE3_HASH)
+
 #pragma pack(push, 4)
 union HashDigest
 {
@@ -145,6 +178,15 @@ inline bool operator<(const HashDigest& lhs, const HashDigest& rhs)
   return CompareHashDigests(lhs, rhs) < 0;
 }
 
+#endif
+
+#if ENABLED(USE_FAST_HASH)
+
+enum
+{
+  kTundraHashMagic = 0x7810221e
+};
+
 // 4*xxhash hashing state
 struct ALIGN(16) HashStateImpl
 {
@@ -152,6 +194,20 @@ struct ALIGN(16) HashStateImpl
 };
 #endif
 
+#if ENABLED(USE_BLAKE3_HASH)
+
+enum
+{
+  kTundraHashMagic = 0x3b1a4e07
+};
+
+// Digests are the first 16 bytes of the BLAKE3 output.
+struct ALIGN(16) HashStateImpl
+{
+  Blake3State   m_Blake3;
+};
+#endif
+
 struct ALIGN(16) HashState
 {
   HashStateImpl m_StateImpl;
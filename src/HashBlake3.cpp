@@ -0,0 +1,620 @@
+#include "Hash.hpp"
+
+#include <cstdio>
+#include <cstring>
+
+#if ENABLED(USE_SSE2)
+#include <emmintrin.h>
+#endif
+
+#if ENABLED(USE_AVX2)
+#include <immintrin.h>
+#endif
+
+// BLAKE3 - https://github.com/BLAKE3-team/BLAKE3
+//
+// Input is split into 1 KB chunks that are hashed independently and combined
+// in a binary tree. That gives two kinds of parallelism: runs of whole chunks
+// are compressed 4 or 8 at a time in SIMD lanes, and large inputs can be split
+// into subtrees that are hashed on different threads and merged at the end
+// (Blake3SubtreeCv/Blake3MergeSubtrees). The result is bit-compatible with
+// the reference implementation.
+
+namespace t2
+{
+
+enum
+{
+  kBlake3BlockSize = 64,
+
+  kChunkStart = 1 << 0,
+  kChunkEnd   = 1 << 1,
+  kParent     = 1 << 2,
+  kRoot       = 1 << 3
+};
+
+static const uint32_t kIV[8] =
+{
+  0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+};
+
+// Message word order for each of the 7 rounds.
+static const uint8_t kMsgSchedule[7][16] =
+{
+  {  0,  1,  2,  3,  4,  5,  6,  7,  8,  9, 10, 11, 12, 13, 14, 15 },
+  {  2,  6,  3, 10,  7,  0,  4, 13,  1, 11, 12,  5,  9, 14, 15,  8 },
+  {  3,  4, 10, 12, 13,  2,  7, 14,  6,  5,  9,  0, 11, 15,  8,  1 },
+  { 10,  7, 12,  9, 14,  3, 13, 15,  4,  0, 11,  2,  5,  8,  1,  6 },
+  { 12, 13,  9, 11, 15, 10, 14,  8,  7,  2,  5,  3,  0,  1,  6,  4 },
+  {  9, 14, 11,  5,  8, 12, 15,  1, 13,  3,  0, 10,  2,  6,  4,  7 },
+  { 11, 15,  5,  0,  1,  9,  8,  6, 14, 10,  2, 12,  3,  4,  7, 13 },
+};
+
+static inline uint32_t LoadLittleEndian32(const uint8_t* p)
+{
+  return uint32_t(p[0]) | (uint32_t(p[1]) << 8) | (uint32_t(p[2]) << 16) | (uint32_t(p[3]) << 24);
+}
+
+static inline void StoreLittleEndian32(uint8_t* p, uint32_t value)
+{
+  p[0] = uint8_t(value);
+  p[1] = uint8_t(value >> 8);
+  p[2] = uint8_t(value >> 16);
+  p[3] = uint8_t(value >> 24);
+}
+
+static inline uint32_t RotateRight(uint32_t value, int amount)
+{
+  return (value >> amount) | (value << (32 - amount));
+}
+
+static inline void G(uint32_t* v, int a, int b, int c, int d, uint32_t x, uint32_t y)
+{
+  v[a] = v[a] + v[b] + x;
+  v[d] = RotateRight(v[d] ^ v[a], 16);
+  v[c] = v[c] + v[d];
+  v[b] = RotateRight(v[b] ^ v[c], 12);
+  v[a] = v[a] + v[b] + y;
+  v[d] = RotateRight(v[d] ^ v[a], 8);
+  v[c] = v[c] + v[d];
+  v[b] = RotateRight(v[b] ^ v[c], 7);
+}
+
+static void Compress(const uint32_t cv[8], const uint8_t block[kBlake3BlockSize], uint64_t counter, uint32_t block_len, uint32_t flags, uint32_t out[16])
+{
+  uint32_t m[16];
+  for (int i = 0; i < 16; ++i)
+    m[i] = LoadLittleEndian32(block + 4 * i);
+
+  uint32_t v[16] =
+  {
+    cv[0], cv[1], cv[2], cv[3], cv[4], cv[5], cv[6], cv[7],
+    kIV[0], kIV[1], kIV[2], kIV[3],
+    uint32_t(counter), uint32_t(counter >> 32), block_len, flags
+  };
+
+  for (int r = 0; r < 7; ++r)
+  {
+    const uint8_t* s = kMsgSchedule[r];
+    G(v, 0, 4,  8, 12, m[s[ 0]], m[s[ 1]]);
+    G(v, 1, 5,  9, 13, m[s[ 2]], m[s[ 3]]);
+    G(v, 2, 6, 10, 14, m[s[ 4]], m[s[ 5]]);
+    G(v, 3, 7, 11, 15, m[s[ 6]], m[s[ 7]]);
+    G(v, 0, 5, 10, 15, m[s[ 8]], m[s[ 9]]);
+    G(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+    G(v, 2, 7,  8, 13, m[s[12]], m[s[13]]);
+    G(v, 3, 4,  9, 14, m[s[14]], m[s[15]]);
+  }
+
+  for (int i = 0; i < 8; ++i)
+  {
+    out[i]     = v[i] ^ v[i + 8];
+    out[i + 8] = v[i + 8] ^ cv[i];
+  }
+}
+
+static void CompressInPlace(uint32_t cv[8], const uint8_t block[kBlake3BlockSize], uint64_t counter, uint32_t block_len, uint32_t flags)
+{
+  uint32_t out[16];
+  Compress(cv, block, counter, block_len, flags, out);
+  memcpy(cv, out, 8 * sizeof(uint32_t));
+}
+
+static void ParentCv(const uint32_t left[8], const uint32_t right[8], uint32_t flags, uint32_t out_cv[8])
+{
+  uint8_t block[kBlake3BlockSize];
+  for (int i = 0; i < 8; ++i)
+  {
+    StoreLittleEndian32(block + 4 * i, left[i]);
+    StoreLittleEndian32(block + 32 + 4 * i, right[i]);
+  }
+
+  memcpy(out_cv, kIV, sizeof kIV);
+  CompressInPlace(out_cv, block, 0, kBlake3BlockSize, kParent | flags);
+}
+
+static void HashChunkScalar(const uint8_t* chunk, uint64_t counter, uint32_t cv[8])
+{
+  memcpy(cv, kIV, sizeof kIV);
+  for (int b = 0; b < 16; ++b)
+  {
+    uint32_t flags = (b == 0 ? kChunkStart : 0) | (b == 15 ? kChunkEnd : 0);
+    CompressInPlace(cv, chunk + b * kBlake3BlockSize, counter, kBlake3BlockSize, flags);
+  }
+}
+
+#if ENABLED(USE_SSE2)
+// Four chunks at once, one per 32-bit lane.
+
+static inline __m128i Rotr16_Sse2(__m128i x) { return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xb1), 0xb1); }
+static inline __m128i Rotr12_Sse2(__m128i x) { return _mm_or_si128(_mm_srli_epi32(x, 12), _mm_slli_epi32(x, 20)); }
+static inline __m128i Rotr8_Sse2(__m128i x)  { return _mm_or_si128(_mm_srli_epi32(x, 8), _mm_slli_epi32(x, 24)); }
+static inline __m128i Rotr7_Sse2(__m128i x)  { return _mm_or_si128(_mm_srli_epi32(x, 7), _mm_slli_epi32(x, 25)); }
+
+static inline void G_Sse2(__m128i* v, int a, int b, int c, int d, __m128i x, __m128i y)
+{
+  v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), x);
+  v[d] = Rotr16_Sse2(_mm_xor_si128(v[d], v[a]));
+  v[c] = _mm_add_epi32(v[c], v[d]);
+  v[b] = Rotr12_Sse2(_mm_xor_si128(v[b], v[c]));
+  v[a] = _mm_add_epi32(_mm_add_epi32(v[a], v[b]), y);
+  v[d] = Rotr8_Sse2(_mm_xor_si128(v[d], v[a]));
+  v[c] = _mm_add_epi32(v[c], v[d]);
+  v[b] = Rotr7_Sse2(_mm_xor_si128(v[b], v[c]));
+}
+
+static inline void Transpose4_Sse2(__m128i* r)
+{
+  __m128i ab_01 = _mm_unpacklo_epi32(r[0], r[1]);
+  __m128i ab_23 = _mm_unpackhi_epi32(r[0], r[1]);
+  __m128i cd_01 = _mm_unpacklo_epi32(r[2], r[3]);
+  __m128i cd_23 = _mm_unpackhi_epi32(r[2], r[3]);
+  r[0] = _mm_unpacklo_epi64(ab_01, cd_01);
+  r[1] = _mm_unpackhi_epi64(ab_01, cd_01);
+  r[2] = _mm_unpacklo_epi64(ab_23, cd_23);
+  r[3] = _mm_unpackhi_epi64(ab_23, cd_23);
+}
+
+static void HashChunks4_Sse2(const uint8_t* data, uint64_t counter, uint32_t (*cvs)[8])
+{
+  __m128i h[8];
+  for (int i = 0; i < 8; ++i)
+    h[i] = _mm_set1_epi32(int(kIV[i]));
+
+  const __m128i ctr_lo = _mm_setr_epi32(int(counter), int(counter + 1), int(counter + 2), int(counter + 3));
+  const __m128i ctr_hi = _mm_setr_epi32(int((counter) >> 32), int((counter + 1) >> 32), int((counter + 2) >> 32), int((counter + 3) >> 32));
+
+  for (int b = 0; b < 16; ++b)
+  {
+    __m128i m[16];
+    for (int g = 0; g < 4; ++g)
+    {
+      for (int lane = 0; lane < 4; ++lane)
+        m[4 * g + lane] = _mm_loadu_si128((const __m128i*) (data + lane * kBlake3ChunkSize + b * kBlake3BlockSize + g * 16));
+      Transpose4_Sse2(m + 4 * g);
+    }
+
+    uint32_t flags = (b == 0 ? kChunkStart : 0) | (b == 15 ? kChunkEnd : 0);
+
+    __m128i v[16] =
+    {
+      h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+      _mm_set1_epi32(int(kIV[0])), _mm_set1_epi32(int(kIV[1])), _mm_set1_epi32(int(kIV[2])), _mm_set1_epi32(int(kIV[3])),
+      ctr_lo, ctr_hi, _mm_set1_epi32(kBlake3BlockSize), _mm_set1_epi32(int(flags))
+    };
+
+    for (int r = 0; r < 7; ++r)
+    {
+      const uint8_t* s = kMsgSchedule[r];
+      G_Sse2(v, 0, 4,  8, 12, m[s[ 0]], m[s[ 1]]);
+      G_Sse2(v, 1, 5,  9, 13, m[s[ 2]], m[s[ 3]]);
+      G_Sse2(v, 2, 6, 10, 14, m[s[ 4]], m[s[ 5]]);
+      G_Sse2(v, 3, 7, 11, 15, m[s[ 6]], m[s[ 7]]);
+      G_Sse2(v, 0, 5, 10, 15, m[s[ 8]], m[s[ 9]]);
+      G_Sse2(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+      G_Sse2(v, 2, 7,  8, 13, m[s[12]], m[s[13]]);
+      G_Sse2(v, 3, 4,  9, 14, m[s[14]], m[s[15]]);
+    }
+
+    for (int i = 0; i < 8; ++i)
+      h[i] = _mm_xor_si128(v[i], v[i + 8]);
+  }
+
+  Transpose4_Sse2(h);
+  Transpose4_Sse2(h + 4);
+  for (int lane = 0; lane < 4; ++lane)
+  {
+    _mm_storeu_si128((__m128i*) &cvs[lane][0], h[lane]);
+    _mm_storeu_si128((__m128i*) &cvs[lane][4], h[4 + lane]);
+  }
+}
+#endif
+
+#if ENABLED(USE_AVX2)
+// Eight chunks at once. Selected at runtime with CpuHasAvx2().
+
+TARGET_AVX2 static inline __m256i Rotr16_Avx2(__m256i x)
+{
+  return _mm256_shuffle_epi8(x, _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                                 2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13));
+}
+
+TARGET_AVX2 static inline __m256i Rotr8_Avx2(__m256i x)
+{
+  return _mm256_shuffle_epi8(x, _mm256_setr_epi8(1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12,
+                                                 1, 2, 3, 0, 5, 6, 7, 4, 9, 10, 11, 8, 13, 14, 15, 12));
+}
+
+TARGET_AVX2 static inline __m256i Rotr12_Avx2(__m256i x) { return _mm256_or_si256(_mm256_srli_epi32(x, 12), _mm256_slli_epi32(x, 20)); }
+TARGET_AVX2 static inline __m256i Rotr7_Avx2(__m256i x)  { return _mm256_or_si256(_mm256_srli_epi32(x, 7), _mm256_slli_epi32(x, 25)); }
+
+TARGET_AVX2 static inline void G_Avx2(__m256i* v, int a, int b, int c, int d, __m256i x, __m256i y)
+{
+  v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), x);
+  v[d] = Rotr16_Avx2(_mm256_xor_si256(v[d], v[a]));
+  v[c] = _mm256_add_epi32(v[c], v[d]);
+  v[b] = Rotr12_Avx2(_mm256_xor_si256(v[b], v[c]));
+  v[a] = _mm256_add_epi32(_mm256_add_epi32(v[a], v[b]), y);
+  v[d] = Rotr8_Avx2(_mm256_xor_si256(v[d], v[a]));
+  v[c] = _mm256_add_epi32(v[c], v[d]);
+  v[b] = Rotr7_Avx2(_mm256_xor_si256(v[b], v[c]));
+}
+
+TARGET_AVX2 static inline void Transpose8_Avx2(__m256i* r)
+{
+  __m256i ab_0145 = _mm256_unpacklo_epi32(r[0], r[1]);
+  __m256i ab_2367 = _mm256_unpackhi_epi32(r[0], r[1]);
+  __m256i cd_0145 = _mm256_unpacklo_epi32(r[2], r[3]);
+  __m256i cd_2367 = _mm256_unpackhi_epi32(r[2], r[3]);
+  __m256i ef_0145 = _mm256_unpacklo_epi32(r[4], r[5]);
+  __m256i ef_2367 = _mm256_unpackhi_epi32(r[4], r[5]);
+  __m256i gh_0145 = _mm256_unpacklo_epi32(r[6], r[7]);
+  __m256i gh_2367 = _mm256_unpackhi_epi32(r[6], r[7]);
+
+  __m256i abcd_04 = _mm256_unpacklo_epi64(ab_0145, cd_0145);
+  __m256i abcd_15 = _mm256_unpackhi_epi64(ab_0145, cd_0145);
+  __m256i abcd_26 = _mm256_unpacklo_epi64(ab_2367, cd_2367);
+  __m256i abcd_37 = _mm256_unpackhi_epi64(ab_2367, cd_2367);
+  __m256i efgh_04 = _mm256_unpacklo_epi64(ef_0145, gh_0145);
+  __m256i efgh_15 = _mm256_unpackhi_epi64(ef_0145, gh_0145);
+  __m256i efgh_26 = _mm256_unpacklo_epi64(ef_2367, gh_2367);
+  __m256i efgh_37 = _mm256_unpackhi_epi64(ef_2367, gh_2367);
+
+  r[0] = _mm256_permute2x128_si256(abcd_04, efgh_04, 0x20);
+  r[1] = _mm256_permute2x128_si256(abcd_15, efgh_15, 0x20);
+  r[2] = _mm256_permute2x128_si256(abcd_26, efgh_26, 0x20);
+  r[3] = _mm256_permute2x128_si256(abcd_37, efgh_37, 0x20);
+  r[4] = _mm256_permute2x128_si256(abcd_04, efgh_04, 0x31);
+  r[5] = _mm256_permute2x128_si256(abcd_15, efgh_15, 0x31);
+  r[6] = _mm256_permute2x128_si256(abcd_26, efgh_26, 0x31);
+  r[7] = _mm256_permute2x128_si256(abcd_37, efgh_37, 0x31);
+}
+
+TARGET_AVX2 static void HashChunks8_Avx2(const uint8_t* data, uint64_t counter, uint32_t (*cvs)[8])
+{
+  __m256i h[8];
+  for (int i = 0; i < 8; ++i)
+    h[i] = _mm256_set1_epi32(int(kIV[i]));
+
+  int lo[8], hi[8];
+  for (int lane = 0; lane < 8; ++lane)
+  {
+    lo[lane] = int(counter + lane);
+    hi[lane] = int((counter + lane) >> 32);
+  }
+  const __m256i ctr_lo = _mm256_loadu_si256((const __m256i*) lo);
+  const __m256i ctr_hi = _mm256_loadu_si256((const __m256i*) hi);
+
+  for (int b = 0; b < 16; ++b)
+  {
+    __m256i m[16];
+    for (int g = 0; g < 2; ++g)
+    {
+      for (int lane = 0; lane < 8; ++lane)
+        m[8 * g + lane] = _mm256_loadu_si256((const __m256i*) (data + lane * kBlake3ChunkSize + b * kBlake3BlockSize + g * 32));
+      Transpose8_Avx2(m + 8 * g);
+    }
+
+    uint32_t flags = (b == 0 ? kChunkStart : 0) | (b == 15 ? kChunkEnd : 0);
+
+    __m256i v[16] =
+    {
+      h[0], h[1], h[2], h[3], h[4], h[5], h[6], h[7],
+      _mm256_set1_epi32(int(kIV[0])), _mm256_set1_epi32(int(kIV[1])), _mm256_set1_epi32(int(kIV[2])), _mm256_set1_epi32(int(kIV[3])),
+      ctr_lo, ctr_hi, _mm256_set1_epi32(kBlake3BlockSize), _mm256_set1_epi32(int(flags))
+    };
+
+    for (int r = 0; r < 7; ++r)
+    {
+      const uint8_t* s = kMsgSchedule[r];
+      G_Avx2(v, 0, 4,  8, 12, m[s[ 0]], m[s[ 1]]);
+      G_Avx2(v, 1, 5,  9, 13, m[s[ 2]], m[s[ 3]]);
+      G_Avx2(v, 2, 6, 10, 14, m[s[ 4]], m[s[ 5]]);
+      G_Avx2(v, 3, 7, 11, 15, m[s[ 6]], m[s[ 7]]);
+      G_Avx2(v, 0, 5, 10, 15, m[s[ 8]], m[s[ 9]]);
+      G_Avx2(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+      G_Avx2(v, 2, 7,  8, 13, m[s[12]], m[s[13]]);
+      G_Avx2(v, 3, 4,  9, 14, m[s[14]], m[s[15]]);
+    }
+
+    for (int i = 0; i < 8; ++i)
+      h[i] = _mm256_xor_si256(v[i], v[i + 8]);
+  }
+
+  Transpose8_Avx2(h);
+  for (int lane = 0; lane < 8; ++lane)
+    _mm256_storeu_si256((__m256i*) cvs[lane], h[lane]);
+}
+#endif
+
+// Chaining values for `count` whole chunks laid out back to back.
+static void HashChunks(const uint8_t* data, size_t count, uint64_t counter, uint32_t (*cvs)[8], bool allow_simd)
+{
+#if ENABLED(USE_AVX2)
+  if (allow_simd && CpuHasAvx2())
+  {
+    for (; count >= 8; count -= 8, counter += 8, cvs += 8, data += 8 * kBlake3ChunkSize)
+      HashChunks8_Avx2(data, counter, cvs);
+  }
+#endif
+
+#if ENABLED(USE_SSE2)
+  if (allow_simd)
+  {
+    for (; count >= 4; count -= 4, counter += 4, cvs += 4, data += 4 * kBlake3ChunkSize)
+      HashChunks4_Sse2(data, counter, cvs);
+  }
+#endif
+
+  for (; count > 0; --count, ++counter, ++cvs, data += kBlake3ChunkSize)
+    HashChunkScalar(data, counter, *cvs);
+}
+
+static bool s_Blake3Simd = true;
+
+void Blake3SetSimdEnabled(bool enabled)
+{
+  s_Blake3Simd = enabled;
+}
+
+// Adds the chaining value of a complete subtree. `total` is the number of
+// subtrees of this size added so far, including this one; every trailing zero
+// bit of it means a pair of siblings is now complete and can be merged.
+static void PushCv(Blake3State* self, const uint32_t cv_in[8], uint64_t total)
+{
+  uint32_t cv[8];
+  memcpy(cv, cv_in, sizeof cv);
+
+  while ((total & 1) == 0)
+  {
+    CHECK(self->m_StackSize > 0);
+    ParentCv(self->m_Stack[--self->m_StackSize], cv, 0, cv);
+    total >>= 1;
+  }
+
+  CHECK(self->m_StackSize < kBlake3MaxDepth);
+  memcpy(self->m_Stack[self->m_StackSize++], cv, sizeof cv);
+}
+
+static void ResetChunk(Blake3State* self)
+{
+  memcpy(self->m_ChunkCv, kIV, sizeof kIV);
+  self->m_BlocksCompressed = 0;
+  self->m_BufUsed = 0;
+}
+
+static size_t ChunkBytes(const Blake3State* self)
+{
+  return size_t(self->m_BlocksCompressed) * kBlake3BlockSize + self->m_BufUsed;
+}
+
+static uint32_t ChunkBlockFlags(const Blake3State* self)
+{
+  return self->m_BlocksCompressed == 0 ? kChunkStart : 0;
+}
+
+static void InitAt(Blake3State* self, uint64_t chunk_counter)
+{
+  self->m_ChunkCounter = chunk_counter;
+  self->m_FirstChunk = chunk_counter;
+  self->m_StackSize = 0;
+  ResetChunk(self);
+}
+
+void Blake3Init(Blake3State* self)
+{
+  InitAt(self, 0);
+}
+
+void Blake3Update(Blake3State* self, const void* data_in, size_t size)
+{
+  const uint8_t* data = static_cast<const uint8_t*>(data_in);
+
+  while (size > 0)
+  {
+    // A full chunk is only finished once more input shows it isn't the last one.
+    if (ChunkBytes(self) == kBlake3ChunkSize)
+    {
+      CompressInPlace(self->m_ChunkCv, self->m_Buffer, self->m_ChunkCounter, kBlake3BlockSize, kChunkEnd);
+      ++self->m_ChunkCounter;
+      PushCv(self, self->m_ChunkCv, self->m_ChunkCounter - self->m_FirstChunk);
+      ResetChunk(self);
+    }
+
+    // Whole chunks that aren't the last of the input go through the wide path.
+    if (ChunkBytes(self) == 0 && size > kBlake3ChunkSize)
+    {
+      enum { kBatch = 16 };
+      uint32_t cvs[kBatch][8];
+      size_t count = (size - 1) / kBlake3ChunkSize;
+      if (count > kBatch)
+        count = kBatch;
+
+      HashChunks(data, count, self->m_ChunkCounter, cvs, s_Blake3Simd);
+
+      for (size_t i = 0; i < count; ++i)
+      {
+        ++self->m_ChunkCounter;
+        PushCv(self, cvs[i], self->m_ChunkCounter - self->m_FirstChunk);
+      }
+
+      data += count * kBlake3ChunkSize;
+      size -= count * kBlake3ChunkSize;
+      continue;
+    }
+
+    if (self->m_BufUsed == kBlake3BlockSize)
+    {
+      CompressInPlace(self->m_ChunkCv, self->m_Buffer, self->m_ChunkCounter, kBlake3BlockSize, ChunkBlockFlags(self));
+      ++self->m_BlocksCompressed;
+      self->m_BufUsed = 0;
+    }
+
+    size_t space = kBlake3BlockSize - self->m_BufUsed;
+    size_t copy_size = size < space ? size : space;
+    memcpy(self->m_Buffer + self->m_BufUsed, data, copy_size);
+    self->m_BufUsed += uint32_t(copy_size);
+    data += copy_size;
+    size -= copy_size;
+  }
+}
+
+// The last compression of the input, held back so it can be run either as a
+// chaining value or with the root flag.
+struct Blake3Output
+{
+  uint32_t m_Cv[8];
+  uint8_t  m_Block[kBlake3BlockSize];
+  uint64_t m_Counter;
+  uint32_t m_BlockLen;
+  uint32_t m_Flags;
+};
+
+static void ParentOutput(const uint32_t left[8], const uint32_t right[8], Blake3Output* out)
+{
+  for (int i = 0; i < 8; ++i)
+  {
+    StoreLittleEndian32(out->m_Block + 4 * i, left[i]);
+    StoreLittleEndian32(out->m_Block + 32 + 4 * i, right[i]);
+  }
+  memcpy(out->m_Cv, kIV, sizeof kIV);
+  out->m_Counter = 0;
+  out->m_BlockLen = kBlake3BlockSize;
+  out->m_Flags = kParent;
+}
+
+static void OutputCv(const Blake3Output* output, uint32_t cv[8])
+{
+  memcpy(cv, output->m_Cv, sizeof output->m_Cv);
+  CompressInPlace(cv, output->m_Block, output->m_Counter, output->m_BlockLen, output->m_Flags);
+}
+
+static void FinalOutput(Blake3State* self, Blake3Output* output)
+{
+  memcpy(output->m_Cv, self->m_ChunkCv, sizeof output->m_Cv);
+  memset(output->m_Block, 0, sizeof output->m_Block);
+  memcpy(output->m_Block, self->m_Buffer, self->m_BufUsed);
+  output->m_Counter = self->m_ChunkCounter;
+  output->m_BlockLen = self->m_BufUsed;
+  output->m_Flags = ChunkBlockFlags(self) | kChunkEnd;
+
+  // Merge what is left on the stack from right to left.
+  for (uint32_t i = self->m_StackSize; i > 0; --i)
+  {
+    uint32_t cv[8];
+    OutputCv(output, cv);
+    ParentOutput(self->m_Stack[i - 1], cv, output);
+  }
+}
+
+static void RootBytes(const Blake3Output* output, uint8_t* out, size_t out_len)
+{
+  CHECK(out_len <= kBlake3BlockSize);
+
+  uint32_t words[16];
+  Compress(output->m_Cv, output->m_Block, 0, output->m_BlockLen, output->m_Flags | kRoot, words);
+
+  uint8_t bytes[kBlake3BlockSize];
+  for (int i = 0; i < 16; ++i)
+    StoreLittleEndian32(bytes + 4 * i, words[i]);
+  memcpy(out, bytes, out_len);
+}
+
+void Blake3Finalize(Blake3State* self, uint8_t* out, size_t out_len)
+{
+  Blake3Output output;
+  FinalOutput(self, &output);
+  RootBytes(&output, out, out_len);
+}
+
+void Blake3SubtreeCv(const void* data, size_t size, uint64_t first_chunk, uint32_t cv_out[8])
+{
+  Blake3State state;
+  InitAt(&state, first_chunk);
+  Blake3Update(&state, data, size);
+
+  Blake3Output output;
+  FinalOutput(&state, &output);
+  OutputCv(&output, cv_out);
+}
+
+void Blake3MergeSubtrees(const uint32_t (*cvs)[8], int count, uint8_t* out, size_t out_len)
+{
+  CHECK(count >= 2);
+
+  // All subtrees but the last are the same power-of-two size, so they merge
+  // like chunks do.
+  Blake3State state;
+  InitAt(&state, 0);
+  for (int i = 0; i < count - 1; ++i)
+    PushCv(&state, cvs[i], uint64_t(i) + 1);
+
+  Blake3Output output;
+  ParentOutput(state.m_Stack[state.m_StackSize - 1], cvs[count - 1], &output);
+  for (uint32_t i = state.m_StackSize - 1; i > 0; --i)
+  {
+    uint32_t cv[8];
+    OutputCv(&output, cv);
+    ParentOutput(state.m_Stack[i - 1], cv, &output);
+  }
+
+  RootBytes(&output, out, out_len);
+}
+
+#if ENABLED(USE_BLAKE3_HASH)
+
+static void DumpDebugBytes(FILE* debug_file, const uint8_t* data, size_t size)
+{
+  static const char hex[] = "0123456789ABCDEF";
+  for (size_t i = 0; i < size; ++i)
+  {
+    fputc(hex[data[i] >> 4], debug_file);
+    fputc(hex[data[i] & 0xf], debug_file);
+    fputc((i & 15) == 15 ? '\n' : ' ', debug_file);
+  }
+  if (size & 15)
+    fputc('\n', debug_file);
+}
+
+void HashInitImpl(HashStateImpl* self)
+{
+  Blake3Init(&self->m_Blake3);
+}
+
+void HashUpdate(HashState* self, const void* data, size_t size)
+{
+  if (FILE* debug_file = (FILE*) self->m_DebugFile)
+    DumpDebugBytes(debug_file, static_cast<const uint8_t*>(data), size);
+
+  Blake3Update(&self->m_StateImpl.m_Blake3, data, size);
+  self->m_MsgSize += size * 8;
+}
+
+void HashFinalize(HashState* self, HashDigest* digest)
+{
+  Blake3Finalize(&self->m_StateImpl.m_Blake3, digest->m_Data, sizeof digest->m_Data);
+}
+
+#endif
+
+}
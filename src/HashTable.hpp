@@ -5,6 +5,15 @@
 #include "MemAllocHeap.hpp"
 
 #include <algorithm>
+#include <string.h>
+
+#if ENABLED(USE_SSE2)
+#include <emmintrin.h>
+#endif
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
 namespace t2
 {
@@ -22,11 +31,37 @@ namespace t2
 #endif
   };
 
+  // String keyed open addressing tables. Slots are grouped 16 at a time, and
+  // each slot has a control byte which is either kHashCtrlEmpty or the low 7
+  // bits of the mixed hash. A lookup compares the control bytes of a whole
+  // group at once (with SSE2 where available) and only looks at the keys of
+  // slots whose control byte matches. Case-folding tables also skip string
+  // compares on keys of the wrong length. Groups are probed in triangular
+  // order, which visits every group of a power-of-two table.
+  //
+  // There is no removal, so a group with an empty slot ends a probe sequence.
+  // Callers must look up before inserting; inserting a key twice stores it
+  // twice.
+  enum
+  {
+    kHashGroupSize = 16,
+    kHashCtrlEmpty = 0x80,
+  };
+
+  // Everything a probe looks at past the control byte, in one cache line. The
+  // length fills what would otherwise be padding.
+  struct HashTableKey
+  {
+    uint32_t       m_Hash;
+    uint32_t       m_Length;
+    const char*    m_String;
+  };
+
   template <uint32_t kFlags>
   struct HashTableBase
   {
-    uint32_t*      m_Hashes;
-    const char**   m_Strings;
+    uint8_t*       m_Control;
+    HashTableKey*  m_Keys;
     uint32_t       m_TableSize;
     uint32_t       m_TableSizeShift;
     uint32_t       m_RecordCount;
@@ -44,11 +79,75 @@ namespace t2
   {
   };
 
+  // Djb2 hashes only mix upwards, so spread them before taking the group
+  // index from the top bits and the control byte from the low bits.
+  inline uint32_t HashTableMix(uint32_t hash)
+  {
+    return hash * 0x9e3779b1u;
+  }
+
+  inline uint32_t HashTableGroupIndex(uint32_t mixed, uint32_t table_size_shift)
+  {
+    // There are 1 << (shift - 4) groups of 16. Shifting a 32-bit value by 32
+    // is undefined, so take one bit less and drop it.
+    return (mixed >> (31 - (table_size_shift - 4))) >> 1;
+  }
+
+  inline uint8_t HashTableControlByte(uint32_t mixed)
+  {
+    return uint8_t(mixed & 0x7f);
+  }
+
+  // Keys go in this slot of their first group when it is free, which it
+  // usually is.
+  inline uint32_t HashTableHomeSlot(uint32_t mixed)
+  {
+    return (mixed >> 7) & (kHashGroupSize - 1);
+  }
+
+  // Bit i is set if control byte i of the group equals `ctrl`.
+  inline uint32_t HashGroupMatch(const uint8_t* group, uint8_t ctrl)
+  {
+#if ENABLED(USE_SSE2)
+    const __m128i bytes = _mm_loadu_si128((const __m128i*) group);
+    return uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(char(ctrl)))));
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < kHashGroupSize; ++i)
+      mask |= uint32_t(group[i] == ctrl) << i;
+    return mask;
+#endif
+  }
+
+  // Bit i is set if slot i of the group is empty.
+  inline uint32_t HashGroupMatchEmpty(const uint8_t* group)
+  {
+#if ENABLED(USE_SSE2)
+    // Full slots have the top bit clear.
+    return uint32_t(_mm_movemask_epi8(_mm_loadu_si128((const __m128i*) group)));
+#else
+    return HashGroupMatch(group, kHashCtrlEmpty);
+#endif
+  }
+
+  inline int HashGroupLowestBit(uint32_t mask)
+  {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return int(index);
+#elif defined(__GNUC__)
+    return __builtin_ctz(mask);
+#else
+    return CountTrailingZeroes(mask);
+#endif
+  }
+
   template <uint32_t kFlags>
   void HashTableBaseInit(HashTableBase<kFlags>* self, MemAllocHeap* heap)
   {
-    self->m_Hashes         = nullptr;
-    self->m_Strings        = nullptr;
+    self->m_Control        = nullptr;
+    self->m_Keys           = nullptr;
     self->m_TableSize      = 0;
     self->m_TableSizeShift = 0;
     self->m_RecordCount    = 0;
@@ -71,8 +170,8 @@ namespace t2
   template <uint32_t kFlags>
   void HashTableBaseDestroy(HashTableBase<kFlags>* self)
   {
-    HeapFree(self->m_Heap, self->m_Hashes);
-    HeapFree(self->m_Heap, self->m_Strings);
+    HeapFree(self->m_Heap, self->m_Control);
+    HeapFree(self->m_Heap, self->m_Keys);
   }
 
   template <typename T, uint32_t kFlags>
@@ -106,49 +205,90 @@ namespace t2
     }
   }
 
+  // Compares two strings of the same, known length.
+  inline bool FastEqualNoCase(const char* lhs, const char* rhs, size_t length)
+  {
+    for (size_t i = 0; i < length; ++i)
+    {
+      if (FoldCase(lhs[i]) != FoldCase(rhs[i]))
+        return false;
+    }
+    return true;
+  }
+
+  // `length` is the length of `string`, or ~0u if it hasn't been needed yet.
   template <uint32_t kFlags>
-  int HashTableBaseLookup(HashTableBase<kFlags>* self, uint32_t hash, const char* string)
+  bool HashTableKeyMatches(const HashTableKey& candidate, uint32_t hash, const char* string, uint32_t* length)
   {
-    uint32_t size = self->m_TableSize;
+    if (candidate.m_Hash != hash)
+      return false;
+
+    const char* candidate_string = candidate.m_String;
+    if (candidate_string == string)
+      return true;
+
+    // A plain strcmp reads both strings at once, which beats taking the
+    // length of a cold query string first. Folding case is a byte loop
+    // anyway, so the length check is worth it there.
+    if (0 == (kFlags & kFlagCaseInsensitive))
+      return 0 == strcmp(candidate_string, string);
 
-    if (0 == size)
+    if (~0u == *length)
+      *length = uint32_t(strlen(string));
+
+    if (candidate.m_Length != *length)
+      return false;
+
+    return FastEqualNoCase(candidate_string, string, *length);
+  }
+
+  template <uint32_t kFlags>
+  int HashTableBaseLookup(HashTableBase<kFlags>* self, uint32_t hash, const char* string)
+  {
+    if (0 == self->m_TableSize)
     {
       return -1;
     }
 
-    int (*compare_fn)(const char* l, const char* r);
+    const uint32_t      mixed      = HashTableMix(hash);
+    const uint8_t       ctrl       = HashTableControlByte(mixed);
+    const uint32_t      group_mask = (self->m_TableSize / kHashGroupSize) - 1;
+    const uint8_t*      control    = self->m_Control;
+    const HashTableKey* keys       = self->m_Keys;
 
-    if (kFlags & kFlagCaseInsensitive)
-    {
-      compare_fn = FastCompareNoCase;
-    }
-    else
-    {
-      compare_fn = strcmp;
-    }
+    // Taken when a case-folding compare first needs it.
+    uint32_t length = ~0u;
 
-    const uint32_t* hashes = self->m_Hashes;
-    const char* const* strings = self->m_Strings;
+    uint32_t group = HashTableGroupIndex(mixed, self->m_TableSizeShift);
 
-    uint32_t index = hash & (size - 1);
+    // Most keys sit in their home slot. Its control byte and key don't depend
+    // on each other, so checking it first lets both loads go out at once
+    // rather than finding the slot from the group's control bytes first.
+    const uint32_t home_slot = HashTableHomeSlot(mixed);
+    const uint32_t home      = group * kHashGroupSize + home_slot;
 
-    for (;;)
-    {
-      uint32_t candidate_hash = hashes[index];
+    if (ctrl == control[home] && HashTableKeyMatches<kFlags>(keys[home], hash, string, &length))
+      return int(home);
 
-      if (!candidate_hash)
-        return -1;
+    uint32_t skip = 1u << home_slot;
 
-      if (hash == candidate_hash)
+    for (uint32_t step = 1; ; ++step)
+    {
+      const uint32_t base = group * kHashGroupSize;
+
+      for (uint32_t match = HashGroupMatch(control + base, ctrl) & ~skip; match; match &= match - 1)
       {
-        const char* candidate_string = strings[index];
-        if (candidate_string == string || compare_fn(candidate_string, string) == 0)
-        {
-          return index;
-        }
+        const uint32_t index = base + HashGroupLowestBit(match);
+
+        if (HashTableKeyMatches<kFlags>(keys[index], hash, string, &length))
+          return int(index);
       }
 
-      index = (index + 1) & (size - 1);
+      if (HashGroupMatchEmpty(control + base))
+        return -1;
+
+      skip = 0;
+      group = (group + step) & group_mask;
     }
   }
 
@@ -170,126 +310,148 @@ namespace t2
     return -1 != index;
   }
 
-  template <typename T, uint32_t kFlags>
-  void HashTableGrow(HashTable<T, kFlags>* self)
+  // Finds the slot a new key goes in and claims its control byte.
+  inline uint32_t HashTableClaimSlot(uint8_t* control, uint32_t table_size, uint32_t table_size_shift, uint32_t hash)
   {
-    MemAllocHeap*  heap      = self->m_Heap;
+    const uint32_t mixed      = HashTableMix(hash);
+    const uint32_t group_mask = (table_size / kHashGroupSize) - 1;
 
-    const uint32_t old_size  = self->m_TableSize;
-    // start at 1<<7 (128), increase by 4x each time
-    const uint32_t new_shift = std::max(self->m_TableSizeShift + 2, 7u);
-    const uint32_t new_size  = 1 << new_shift;
-
-    uint32_t* old_hashes = self->m_Hashes;
-    const char** old_strings = self->m_Strings;
-    const T* old_payloads = self->m_Payloads;
-
-    uint32_t* new_hashes = HeapAllocateArrayZeroed<uint32_t>(heap, new_size);
-    const char** new_strings = HeapAllocateArrayZeroed<const char*>(heap, new_size);
-    T* new_payloads = HeapAllocateArrayZeroed<T>(heap, new_size);
+    uint32_t group = HashTableGroupIndex(mixed, table_size_shift);
 
-    const uint32_t new_mask = new_size - 1;
-
-    for (uint32_t i = 0; i < old_size; ++i)
+    const uint32_t home = group * kHashGroupSize + HashTableHomeSlot(mixed);
+    if (kHashCtrlEmpty == control[home])
     {
-      if (uint32_t h = old_hashes[i])
-      {
-        uint32_t index = h & new_mask;
+      control[home] = HashTableControlByte(mixed);
+      return home;
+    }
 
-        while (new_hashes[index] != 0)
-        {
-          index = (index + 1) & new_mask;
-        }
+    for (uint32_t step = 1; ; ++step)
+    {
+      const uint32_t base = group * kHashGroupSize;
 
-        new_hashes[index] = h;
-        new_strings[index] = old_strings[i];
-        new_payloads[index] = old_payloads[i];
+      if (uint32_t empty = HashGroupMatchEmpty(control + base))
+      {
+        const uint32_t index = base + HashGroupLowestBit(empty);
+        control[index] = HashTableControlByte(mixed);
+        return index;
       }
+
+      group = (group + step) & group_mask;
     }
+  }
 
-    HeapFree(heap, old_payloads);
-    HeapFree(heap, old_strings);
-    HeapFree(heap, old_hashes);
+  // Tables are kept at most 7/8 full, so every probe sequence ends.
+  inline uint32_t HashTableMaxRecords(uint32_t table_size)
+  {
+    return table_size - table_size / 8;
+  }
 
-    // Commit
-    self->m_Hashes         = new_hashes;
-    self->m_Strings        = new_strings;
-    self->m_Payloads       = new_payloads;
-    self->m_TableSize      = new_size;
-    self->m_TableSizeShift = new_shift;
+  // Smallest table size shift that holds `record_count` records, growing by 4x
+  // from a single group.
+  inline uint32_t HashTableShiftFor(uint32_t current_shift, uint32_t record_count)
+  {
+    uint32_t shift = current_shift ? current_shift + 2 : 4;
+    while (HashTableMaxRecords(1u << shift) < record_count)
+      shift += 2;
+    return shift;
   }
 
-  template <uint32_t kFlags>
-  void HashTableGrow(HashSet<kFlags>* self)
+  // Rehashes the base arrays into a table of 1 << new_shift slots. `move_extra`
+  // is called with (old_index, new_index) for every record so derived tables
+  // can move their payloads along.
+  template <uint32_t kFlags, typename MoveExtra>
+  void HashTableBaseRehash(HashTableBase<kFlags>* self, uint32_t new_shift, MoveExtra move_extra)
   {
     MemAllocHeap*  heap      = self->m_Heap;
 
     const uint32_t old_size  = self->m_TableSize;
-    // start at 1<<7 (128), increase by 4x each time
-    const uint32_t new_shift = std::max(self->m_TableSizeShift + 2, 7u);
     const uint32_t new_size  = 1 << new_shift;
 
-    uint32_t* old_hashes = self->m_Hashes;
-    const char** old_strings = self->m_Strings;
-
-    uint32_t* new_hashes = HeapAllocateArrayZeroed<uint32_t>(heap, new_size);
-    const char** new_strings = HeapAllocateArrayZeroed<const char*>(heap, new_size);
+    uint8_t* old_control = self->m_Control;
+    const HashTableKey* old_keys = self->m_Keys;
 
-    const uint32_t new_mask = new_size - 1;
+    // Only the control bytes need clearing; other slots are written before
+    // they are read.
+    uint8_t* new_control = HeapAllocateArray<uint8_t>(heap, new_size);
+    memset(new_control, kHashCtrlEmpty, new_size);
+    HashTableKey* new_keys = HeapAllocateArray<HashTableKey>(heap, new_size);
 
     for (uint32_t i = 0; i < old_size; ++i)
     {
-      if (uint32_t h = old_hashes[i])
+      if (old_control[i] != kHashCtrlEmpty)
       {
-        uint32_t index = h & new_mask;
-
-        while (new_hashes[index] != 0)
-        {
-          index = (index + 1) & new_mask;
-        }
+        uint32_t index = HashTableClaimSlot(new_control, new_size, new_shift, old_keys[i].m_Hash);
 
-        new_hashes[index] = h;
-        new_strings[index] = old_strings[i];
+        new_keys[index] = old_keys[i];
+        move_extra(i, index);
       }
     }
 
-    HeapFree(heap, old_strings);
-    HeapFree(heap, old_hashes);
+    HeapFree(heap, old_keys);
+    HeapFree(heap, old_control);
 
     // Commit
-    self->m_Hashes         = new_hashes;
-    self->m_Strings        = new_strings;
+    self->m_Control        = new_control;
+    self->m_Keys           = new_keys;
     self->m_TableSize      = new_size;
     self->m_TableSizeShift = new_shift;
   }
 
-  template <typename TableType>
-  int HashTableBaseInsert(TableType* self, uint32_t hash, const char* string)
+  template <typename T, uint32_t kFlags>
+  void HashTableGrow(HashTable<T, kFlags>* self, uint32_t record_count)
   {
-    uint32_t record_count = self->m_RecordCount;
-    uint32_t table_size = self->m_TableSize;
-    uint64_t load = 0x100 * uint64_t(record_count + 1) >> uint64_t(self->m_TableSizeShift);
+    const uint32_t new_shift = HashTableShiftFor(self->m_TableSizeShift, record_count);
+
+    const T* old_payloads = self->m_Payloads;
+    T* new_payloads = HeapAllocateArray<T>(self->m_Heap, size_t(1) << new_shift);
 
-    if (load > 0x050)
+    HashTableBaseRehash(self, new_shift, [=](uint32_t old_index, uint32_t new_index)
     {
-      HashTableGrow(self);
-      table_size = self->m_TableSize;
-    }
+      new_payloads[new_index] = old_payloads[old_index];
+    });
 
-    uint32_t index = hash & (table_size - 1);
+    HeapFree(self->m_Heap, old_payloads);
+    self->m_Payloads = new_payloads;
+  }
 
-    uint32_t* hashes = self->m_Hashes;
+  template <uint32_t kFlags>
+  void HashTableGrow(HashSet<kFlags>* self, uint32_t record_count)
+  {
+    const uint32_t new_shift = HashTableShiftFor(self->m_TableSizeShift, record_count);
+
+    HashTableBaseRehash(self, new_shift, [](uint32_t, uint32_t) {});
+  }
 
-    while (hashes[index] != 0)
+  // Makes room for `count` more records, so a known number of inserts doesn't
+  // rehash along the way.
+  template <typename TableType>
+  void HashTablePrepareBulkInsert(TableType* self, uint32_t count)
+  {
+    const uint32_t record_count = self->m_RecordCount + count;
+
+    if (record_count > HashTableMaxRecords(self->m_TableSize))
+      HashTableGrow(self, record_count);
+  }
+
+  template <typename TableType>
+  int HashTableBaseInsert(TableType* self, uint32_t hash, const char* string)
+  {
+    const uint32_t record_count = self->m_RecordCount;
+
+    if (record_count + 1 > HashTableMaxRecords(self->m_TableSize))
     {
-      index = (index + 1) & (table_size - 1);
+      HashTableGrow(self, record_count + 1);
     }
 
-    hashes[index] = hash;
-    self->m_Strings[index] = string;
+    uint32_t index = HashTableClaimSlot(self->m_Control, self->m_TableSize, self->m_TableSizeShift, hash);
+
+    HashTableKey& key = self->m_Keys[index];
+    key.m_Hash   = hash;
+    key.m_Length = uint32_t(strlen(string));
+    key.m_String = string;
     self->m_RecordCount = record_count + 1;
 
-    return index;
+    return int(index);
   }
 
   template <typename T, uint32_t kFlags>
@@ -308,16 +470,16 @@ namespace t2
   template <typename T, uint32_t kFlags, typename Callback>
   void HashTableWalk(HashTable<T, kFlags>* self, Callback callback)
   {
-    uint32_t* hashes = self->m_Hashes;
-    const char** strings = self->m_Strings;
+    const uint8_t* control = self->m_Control;
+    const HashTableKey* keys = self->m_Keys;
     const T* payloads = self->m_Payloads;
 
     uint32_t index = 0;
     for (uint32_t i = 0, count = self->m_TableSize; i < count; ++i)
     {
-      if (uint32_t hash = hashes[i])
+      if (control[i] != kHashCtrlEmpty)
       {
-        callback(index, hash, strings[i], payloads[i]);
+        callback(index, keys[i].m_Hash, keys[i].m_String, payloads[i]);
         ++index;
       }
     }
@@ -325,18 +487,34 @@ namespace t2
     CHECK(index == self->m_RecordCount);
   }
 
+  // Like HashTableWalk(), but only visits the slots in [begin, end), so pieces
+  // of a table can be walked on different threads.
+  template <typename T, uint32_t kFlags, typename Callback>
+  void HashTableWalkSlots(const HashTable<T, kFlags>* self, uint32_t begin, uint32_t end, Callback callback)
+  {
+    const uint8_t* control = self->m_Control;
+    const HashTableKey* keys = self->m_Keys;
+    const T* payloads = self->m_Payloads;
+
+    for (uint32_t i = begin; i < end; ++i)
+    {
+      if (control[i] != kHashCtrlEmpty)
+        callback(keys[i].m_Hash, keys[i].m_String, payloads[i]);
+    }
+  }
+
   template <uint32_t kFlags, typename Callback>
   void HashSetWalk(HashSet<kFlags>* self, Callback callback)
   {
-    uint32_t* hashes = self->m_Hashes;
-    const char** strings = self->m_Strings;
+    const uint8_t* control = self->m_Control;
+    const HashTableKey* keys = self->m_Keys;
 
     uint32_t index = 0;
     for (uint32_t i = 0, count = self->m_TableSize; i < count; ++i)
     {
-      if (uint32_t hash = hashes[i])
+      if (control[i] != kHashCtrlEmpty)
       {
-        callback(index, hash, strings[i]);
+        callback(index, keys[i].m_Hash, keys[i].m_String);
         ++index;
       }
     }
@@ -0,0 +1,120 @@
+#include "HelperPool.hpp"
+
+namespace t2
+{
+
+struct HelperBatch
+{
+  HelperFn      m_Fn;
+  void*         m_Context;
+  int           m_Count;
+  int           m_NextIndex;
+  int           m_Finished;
+  HelperBatch*  m_Next;
+};
+
+// Claims the next piece of any batch that has pieces left. Called with the lock held.
+static HelperBatch* ClaimWork(HelperPool* self, int* index_out)
+{
+  for (HelperBatch* batch = self->m_Batches; batch; batch = batch->m_Next)
+  {
+    if (batch->m_NextIndex < batch->m_Count)
+    {
+      *index_out = batch->m_NextIndex++;
+      return batch;
+    }
+  }
+  return nullptr;
+}
+
+// Runs a claimed piece with the lock released.
+static void RunPiece(HelperPool* self, HelperBatch* batch, int index)
+{
+  MutexUnlock(&self->m_Lock);
+  batch->m_Fn(batch->m_Context, index);
+  MutexLock(&self->m_Lock);
+
+  if (++batch->m_Finished == batch->m_Count)
+    CondBroadcast(&self->m_BatchDone);
+}
+
+static ThreadRoutineReturnType TUNDRA_STDCALL HelperThreadRoutine(void* param)
+{
+  HelperPool* self = static_cast<HelperPool*>(param);
+
+  MutexLock(&self->m_Lock);
+  while (!self->m_Quit)
+  {
+    int index;
+    if (HelperBatch* batch = ClaimWork(self, &index))
+      RunPiece(self, batch, index);
+    else
+      CondWait(&self->m_WorkAvailable, &self->m_Lock);
+  }
+  MutexUnlock(&self->m_Lock);
+
+  return 0;
+}
+
+void HelperPoolInit(HelperPool* self, int thread_count)
+{
+  MutexInit(&self->m_Lock);
+  CondInit(&self->m_WorkAvailable);
+  CondInit(&self->m_BatchDone);
+  self->m_Batches = nullptr;
+  self->m_Quit = false;
+  self->m_MaxThreadCount = thread_count < HelperPool::kMaxThreads ? thread_count : int(HelperPool::kMaxThreads);
+  self->m_ThreadCount = 0;
+}
+
+void HelperPoolDestroy(HelperPool* self)
+{
+  MutexLock(&self->m_Lock);
+  self->m_Quit = true;
+  CondBroadcast(&self->m_WorkAvailable);
+  MutexUnlock(&self->m_Lock);
+
+  for (int i = 0; i < self->m_ThreadCount; ++i)
+    ThreadJoin(self->m_Threads[i]);
+
+  CondDestroy(&self->m_BatchDone);
+  CondDestroy(&self->m_WorkAvailable);
+  MutexDestroy(&self->m_Lock);
+}
+
+void HelperPoolRun(HelperPool* self, HelperFn fn, void* context, int count)
+{
+  HelperBatch batch;
+  batch.m_Fn        = fn;
+  batch.m_Context   = context;
+  batch.m_Count     = count;
+  batch.m_NextIndex = 0;
+  batch.m_Finished  = 0;
+
+  MutexLock(&self->m_Lock);
+
+  while (self->m_ThreadCount < self->m_MaxThreadCount)
+    self->m_Threads[self->m_ThreadCount++] = ThreadStart(HelperThreadRoutine, self);
+
+  batch.m_Next = self->m_Batches;
+  self->m_Batches = &batch;
+  CondBroadcast(&self->m_WorkAvailable);
+
+  while (batch.m_NextIndex < batch.m_Count)
+  {
+    int index = batch.m_NextIndex++;
+    RunPiece(self, &batch, index);
+  }
+
+  while (batch.m_Finished < batch.m_Count)
+    CondWait(&self->m_BatchDone, &self->m_Lock);
+
+  HelperBatch** link = &self->m_Batches;
+  while (*link != &batch)
+    link = &(*link)->m_Next;
+  *link = batch.m_Next;
+
+  MutexUnlock(&self->m_Lock);
+}
+
+}
@@ -0,0 +1,48 @@
+#ifndef HELPERPOOL_HPP
+#define HELPERPOOL_HPP
+
+#include "Common.hpp"
+#include "Mutex.hpp"
+#include "ConditionVar.hpp"
+#include "Thread.hpp"
+
+namespace t2
+{
+
+// A small pool of threads that sit idle until a build thread has a large,
+// splittable piece of work (such as digesting a big file) and lend a hand.
+
+typedef void (*HelperFn)(void* context, int index);
+
+struct HelperBatch;
+
+struct HelperPool
+{
+  enum
+  {
+    kMaxThreads = 32
+  };
+
+  Mutex              m_Lock;
+  ConditionVariable  m_WorkAvailable;
+  ConditionVariable  m_BatchDone;
+  HelperBatch*       m_Batches;
+  bool               m_Quit;
+  int                m_MaxThreadCount;
+  int                m_ThreadCount;
+  ThreadId           m_Threads[kMaxThreads];
+};
+
+// Threads are started on first use, up to thread_count of them.
+void HelperPoolInit(HelperPool* self, int thread_count);
+
+void HelperPoolDestroy(HelperPool* self);
+
+// Calls fn(context, i) for every i in [0, count) and returns when all calls
+// have finished. The calling thread works on the batch too, so it completes
+// even if every helper is busy with another batch.
+void HelperPoolRun(HelperPool* self, HelperFn fn, void* context, int count);
+
+}
+
+#endif
@@ -6,35 +6,48 @@
 #include <stdint.h>
 
 #include "MemAllocLinear.hpp"
+#include "MemAllocHeap.hpp"
+#include "HashTable.hpp"
 #include "DagData.hpp"
 
+#include <algorithm>
+
+#if ENABLED(USE_SSE2)
+#include <emmintrin.h>
+#endif
+
+#if ENABLED(USE_AVX2)
+#include <immintrin.h>
+#endif
+
 namespace t2
 {
 
 static IncludeData*
-ScanCppLine(const char* start, MemAllocLinear* allocator)
+ScanCppLine(const char* start, const char* end, MemAllocLinear* allocator)
 {
-	while (isspace(*start))
+	while (start < end && isspace(*start))
 		++start;
 
-	if (*start++ != '#')
+	if (start == end || *start++ != '#')
 		return nullptr;
 
-	while (isspace(*start))
+	while (start < end && isspace(*start))
 		++start;
 	
-	if (0 != strncmp("include", start, 7))
+	if (end - start < 7 || 0 != memcmp("include", start, 7))
 		return nullptr;
 
 	start += 7;
 
-	if (!isspace(*start++))
+	if (start == end || !isspace(*start++))
 		return nullptr;
 
-	while (isspace(*start))
+	while (start < end && isspace(*start))
 		++start;
 
-  IncludeData* dest = LinearAllocate<IncludeData>(allocator);
+  if (start == end)
+    return nullptr;
 
   char closing_separator;
 
@@ -51,16 +64,13 @@ ScanCppLine(const char* start, MemAllocLinear* allocator)
   }
 
 	const char* str_start = start;
-	for (;;)
-	{
-		char ch = *start++;
-		if (ch == closing_separator)
-			break;
-		if (!ch)
-			return nullptr;
-	}
+	const char* str_end   = (const char*) memchr(start, closing_separator, size_t(end - start));
+	if (!str_end)
+		return nullptr;
+
+  IncludeData* dest = LinearAllocate<IncludeData>(allocator);
 
-	dest->m_StringLen       = (size_t) (start - str_start - 1);
+	dest->m_StringLen       = (size_t) (str_end - str_start);
 	dest->m_String          = StrDupN(allocator, str_start, dest->m_StringLen);
 	dest->m_IsSystemInclude = '>' == closing_separator;
 	dest->m_ShouldFollow    = true;
@@ -69,17 +79,30 @@ ScanCppLine(const char* start, MemAllocLinear* allocator)
   return dest;
 }
 
-static char*
-GetNextLine(char *p)
+// Scanning stops at the first NUL character, if any.
+static const char*
+ScanEnd(const char* data, size_t len)
 {
-  if (char *lf = strchr(p, '\n'))
+  if (const char* nul = (const char*) memchr(data, '\0', len))
+    return nul;
+  return data + len;
+}
+
+// Returns the end of the line starting at p, and advances p past the line feed.
+// p is set to nullptr after the last line.
+static const char*
+GetNextLine(const char** p, const char* end)
+{
+  const char* line = *p;
+  if (const char* lf = (const char*) memchr(line, '\n', size_t(end - line)))
   {
-    *lf = '\0';
-    return lf + 1;
+    *p = lf + 1;
+    return lf;
   }
   else
   {
-    return nullptr;
+    *p = nullptr;
+    return end;
   }
 }
 
@@ -110,19 +133,20 @@ struct IncludeDataList
   }
 };
 
-IncludeData*
-ScanIncludesCpp(char* buffer, MemAllocLinear* allocator)
+static IncludeData*
+ScanIncludesCppScalar(const char* data, size_t len, MemAllocLinear* allocator)
 {
   IncludeDataList list;
 
-  char *linep = buffer;
+  const char* end   = ScanEnd(data, len);
+  const char* linep = data;
 
   while (linep)
   {
-    char *line = linep;
-    linep = GetNextLine(linep);
+    const char* line     = linep;
+    const char* line_end = GetNextLine(&linep, end);
 
-    if (IncludeData* d = ScanCppLine(line, allocator))
+    if (IncludeData* d = ScanCppLine(line, line_end, allocator))
     {
       list.Add(d);
     }
@@ -131,8 +155,1045 @@ ScanIncludesCpp(char* buffer, MemAllocLinear* allocator)
   return list.m_Head;
 }
 
+// Block scanning. Rather than splitting every line, classify 64 bytes at a
+// time into bitmasks of '#' and '\n' positions. Only a '#' that is the first
+// non-blank character of its line can start an include, so all other lines
+// are skipped without being looked at individually.
+enum
+{
+  kScanBlockSize = 64
+};
+
+static inline int
+LowestBitIndex64(uint64_t v)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+  unsigned long index;
+  _BitScanForward64(&index, v);
+  return int(index);
+#elif defined(__GNUC__)
+  return __builtin_ctzll(v);
+#else
+  int index = 0;
+  while (0 == (v & 1))
+  {
+    v >>= 1;
+    ++index;
+  }
+  return index;
+#endif
+}
+
+static inline int
+HighestBitIndex64(uint64_t v)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+  unsigned long index;
+  _BitScanReverse64(&index, v);
+  return int(index);
+#elif defined(__GNUC__)
+  return 63 - __builtin_clzll(v);
+#else
+  int index = 0;
+  while (v >>= 1)
+    ++index;
+  return index;
+#endif
+}
+
+static void
+ClassifyBlockScalar(const char* p, size_t len, uint64_t* hashes, uint64_t* newlines, uint64_t* nuls)
+{
+  uint64_t h = 0, n = 0, z = 0;
+  for (size_t i = 0; i < len; ++i)
+  {
+    h |= uint64_t(p[i] == '#') << i;
+    n |= uint64_t(p[i] == '\n') << i;
+    z |= uint64_t(p[i] == '\0') << i;
+  }
+  *hashes   = h;
+  *newlines = n;
+  *nuls     = z;
+}
+
+#if ENABLED(USE_SSE2)
+struct ClassifySse2
+{
+  static void Classify(const char* p, uint64_t* hashes, uint64_t* newlines, uint64_t* nuls)
+  {
+    const __m128i hash = _mm_set1_epi8('#');
+    const __m128i lf   = _mm_set1_epi8('\n');
+    const __m128i zero = _mm_setzero_si128();
+    uint64_t h = 0, n = 0, z = 0;
+    for (int i = 0; i < 4; ++i)
+    {
+      __m128i v = _mm_loadu_si128((const __m128i*) (p + 16 * i));
+      h |= uint64_t(uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, hash)))) << (16 * i);
+      n |= uint64_t(uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf)))) << (16 * i);
+      z |= uint64_t(uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, zero)))) << (16 * i);
+    }
+    *hashes   = h;
+    *newlines = n;
+    *nuls     = z;
+  }
+};
+#endif
+
+#if ENABLED(USE_AVX2)
+struct ClassifyAvx2
+{
+  TARGET_AVX2 static void Classify(const char* p, uint64_t* hashes, uint64_t* newlines, uint64_t* nuls)
+  {
+    const __m256i hash = _mm256_set1_epi8('#');
+    const __m256i lf   = _mm256_set1_epi8('\n');
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i v0 = _mm256_loadu_si256((const __m256i*) p);
+    __m256i v1 = _mm256_loadu_si256((const __m256i*) (p + 32));
+    uint64_t h0 = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, hash)));
+    uint64_t h1 = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, hash)));
+    uint64_t n0 = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, lf)));
+    uint64_t n1 = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, lf)));
+    uint64_t z0 = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v0, zero)));
+    uint64_t z1 = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v1, zero)));
+    *hashes   = h0 | (h1 << 32);
+    *newlines = n0 | (n1 << 32);
+    *nuls     = z0 | (z1 << 32);
+  }
+};
+#endif
+
+// Calls handler->Directive() for every line whose first non-blank character is
+// '#' and that handler->WantDirective() accepts.
+template <typename Classifier, typename Handler>
+static void
+ScanDirectivesBlocks(const char* data, size_t len, Handler* handler)
+{
+  const char* end        = data + len;
+  const char* line_start = data;
+  const char* p          = data;
+
+  while (p < end)
+  {
+    uint64_t    hashes, newlines, nuls;
+    const char* next;
+
+    if (end - p >= kScanBlockSize)
+    {
+      Classifier::Classify(p, &hashes, &newlines, &nuls);
+      next = p + kScanBlockSize;
+    }
+    else
+    {
+      ClassifyBlockScalar(p, size_t(end - p), &hashes, &newlines, &nuls);
+      next = end;
+    }
+
+    // The scalar scanner stops at the first NUL, so we do the same.
+    if (nuls)
+    {
+      const int nul_bit = LowestBitIndex64(nuls);
+      const uint64_t keep = (uint64_t(1) << nul_bit) - 1;
+      hashes   &= keep;
+      newlines &= keep;
+      end       = p + nul_bit;
+      next      = end;
+    }
+
+    while (hashes)
+    {
+      const int bit   = LowestBitIndex64(hashes);
+      const char* pos = p + bit;
+      hashes &= hashes - 1;
+
+      // Find the start of the line containing this '#'.
+      if (uint64_t nl_before = newlines & ((uint64_t(1) << bit) - 1))
+        line_start = p + HighestBitIndex64(nl_before) + 1;
+
+      // Only consider the line if '#' is its first non-blank character.
+      const char* q = line_start;
+      while (q < pos && isspace(*q))
+        ++q;
+
+      if (q != pos || !handler->WantDirective(pos, end))
+        continue;
+
+      // The line may continue past this block, so find its end the slow way.
+      // A NUL before the line feed ends the scan, same as the scalar scanner.
+      const char* lf       = (const char*) memchr(pos, '\n', size_t(end - pos));
+      const char* line_end = lf ? lf : end;
+
+      if (const char* nul = (const char*) memchr(pos, '\0', size_t(line_end - pos)))
+      {
+        line_end = nul;
+        lf       = nullptr;
+      }
+
+      handler->Directive(line_start, line_end);
+
+      if (!lf)
+        return;
+
+      // Resume classification on the next line.
+      line_start = lf + 1;
+      newlines   = 0;
+      next       = lf + 1;
+      break;
+    }
+
+    if (newlines)
+      line_start = p + HighestBitIndex64(newlines) + 1;
+
+    p = next;
+  }
+}
+
+// Line-by-line equivalent of ScanDirectivesBlocks() for CPUs without SIMD.
+template <typename Handler>
+static void
+ScanDirectivesLines(const char* data, size_t len, Handler* handler)
+{
+  const char* end   = ScanEnd(data, len);
+  const char* linep = data;
+
+  while (linep)
+  {
+    const char* line     = linep;
+    const char* line_end = GetNextLine(&linep, end);
+
+    const char* q = line;
+    while (q < line_end && isspace(*q))
+      ++q;
+
+    if (q < line_end && '#' == *q && handler->WantDirective(q, end))
+      handler->Directive(line, line_end);
+  }
+}
+
+bool
+IncludeScanModeSupported(IncludeScanMode::Enum mode)
+{
+  switch (mode)
+  {
+    case IncludeScanMode::kAuto:
+    case IncludeScanMode::kScalar:
+      return true;
+#if ENABLED(USE_SSE2)
+    case IncludeScanMode::kSse2:
+      return true;
+#endif
+#if ENABLED(USE_AVX2)
+    case IncludeScanMode::kAvx2:
+      return CpuHasAvx2();
+#endif
+    default:
+      return false;
+  }
+}
+
+template <typename Handler>
+static void
+ScanDirectives(const char* data, size_t len, Handler* handler, IncludeScanMode::Enum mode)
+{
+  if (IncludeScanMode::kAuto == mode)
+  {
+    if (IncludeScanModeSupported(IncludeScanMode::kAvx2))
+      mode = IncludeScanMode::kAvx2;
+    else if (IncludeScanModeSupported(IncludeScanMode::kSse2))
+      mode = IncludeScanMode::kSse2;
+    else
+      mode = IncludeScanMode::kScalar;
+  }
+
+  switch (mode)
+  {
+#if ENABLED(USE_SSE2)
+    case IncludeScanMode::kSse2:
+      ScanDirectivesBlocks<ClassifySse2>(data, len, handler);
+      break;
+#endif
+#if ENABLED(USE_AVX2)
+    case IncludeScanMode::kAvx2:
+      if (!CpuHasAvx2())
+        Croak("AVX2 include scanning requested but not supported by this CPU");
+      ScanDirectivesBlocks<ClassifyAvx2>(data, len, handler);
+      break;
+#endif
+    default:
+      ScanDirectivesLines(data, len, handler);
+      break;
+  }
+}
+
+// Collects every #include line.
+struct CppIncludeHandler
+{
+  IncludeDataList  m_List;
+  MemAllocLinear  *m_Allocator;
+
+  bool WantDirective(const char* hash, const char* end)
+  {
+    // Cheap rejection of other directives (#if, #define, ...) so the block
+    // scanner can keep going. Skipping blanks here may run past the end of the
+    // line, which can only produce false positives that ScanCppLine rejects.
+    const char* q = hash + 1;
+    while (q < end && isspace(*q))
+      ++q;
+
+    return end - q >= 7 && 0 == memcmp("include", q, 7);
+  }
+
+  void Directive(const char* line, const char* line_end)
+  {
+    if (IncludeData* d = ScanCppLine(line, line_end, m_Allocator))
+      m_List.Add(d);
+  }
+};
+
+IncludeData*
+ScanIncludesCppWithMode(const char* data, size_t len, MemAllocLinear* allocator, IncludeScanMode::Enum mode)
+{
+  if (IncludeScanMode::kScalar == mode)
+    return ScanIncludesCppScalar(data, len, allocator);
+
+  CppIncludeHandler handler;
+  handler.m_Allocator = allocator;
+  ScanDirectives(data, len, &handler, mode);
+  return handler.m_List.m_Head;
+}
+
+IncludeData*
+ScanIncludesCpp(const char* data, size_t len, MemAllocLinear* allocator)
+{
+  return ScanIncludesCppWithMode(data, len, allocator, IncludeScanMode::kAuto);
+}
+
+//-----------------------------------------------------------------------------
+// Preprocessor-aware scanning
+//
+// Conditionals are evaluated with three-valued logic. Names listed in the
+// scanner defines, and names #defined or #undefined earlier in the same file,
+// are known. Anything else (macros from other headers, arithmetic we don't
+// evaluate, continuation lines) makes a condition unknown, and includes in an
+// unknown block are kept. The frontend takes the scanner defines from the
+// define lists the compile command passes, and as long as they match what the
+// compiler sees, the result only loses includes that the compiler would also
+// skip. CPPSCANNER_DEFS are added unchecked, so a wrong entry there can lose
+// a real include. Files are scanned and cached independently, so macros never
+// flow from one header into another. Since an included header can redefine
+// the file's own macros, they become unknown after each #include. Directives
+// inside block comments are ignored.
+//-----------------------------------------------------------------------------
+
+namespace PPTruth
+{
+  // Ordered so that min() combines nesting levels.
+  enum Enum
+  {
+    kFalse = 0,
+    kMaybe = 1,
+    kTrue  = 2
+  };
+}
+
+struct PPMacro
+{
+  enum
+  {
+    kDefined,
+    kUndefined,
+    kUnknown
+  };
+
+  int      m_State;
+  bool     m_HasValue;
+  bool     m_Local;     // Set by a directive in the file
+  int64_t  m_Value;
+};
+
+struct PPValue
+{
+  bool    m_Known;
+  int64_t m_Value;
+};
+
+struct PPFrame
+{
+  PPTruth::Enum m_Parent;     // Liveness of the enclosing block
+  PPTruth::Enum m_Branch;     // Truth of the current branch
+  bool          m_Taken;      // An earlier branch was definitely taken
+  bool          m_MaybeTaken; // An earlier branch might have been taken
+};
+
+enum
+{
+  kPPMaxDepth    = 64,
+  kPPMaxNameLen  = 128
+};
+
+static bool PPIsIdentStart(char ch)
+{
+  return isalpha((unsigned char) ch) || '_' == ch;
+}
+
+static bool PPIsIdentChar(char ch)
+{
+  return isalnum((unsigned char) ch) || '_' == ch;
+}
+
+// Parses an integer literal with optional u/l suffixes.
+static bool PPParseNumber(const char** pp, const char* end, int64_t* out)
+{
+  const char* p = *pp;
+  int base = 10;
+  int64_t value = 0;
+
+  if (end - p > 2 && '0' == p[0] && ('x' == p[1] || 'X' == p[1]))
+  {
+    base = 16;
+    p += 2;
+  }
+  else if (p < end && '0' == *p)
+  {
+    base = 8;
+  }
+
+  const char* digits = p;
+  for (; p < end; ++p)
+  {
+    int digit;
+    char ch = *p;
+    if (ch >= '0' && ch <= '9')
+      digit = ch - '0';
+    else if (16 == base && ch >= 'a' && ch <= 'f')
+      digit = ch - 'a' + 10;
+    else if (16 == base && ch >= 'A' && ch <= 'F')
+      digit = ch - 'A' + 10;
+    else
+      break;
+    if (digit >= base)
+      return false;
+    value = value * base + digit;
+  }
+
+  if (p == digits)
+    return false;
+
+  while (p < end && ('u' == *p || 'U' == *p || 'l' == *p || 'L' == *p))
+    ++p;
+
+  if (p < end && PPIsIdentChar(*p))
+    return false;
+
+  *pp  = p;
+  *out = value;
+  return true;
+}
+
+struct CppPreprocessorHandler;
+
+struct PPExpression
+{
+  const char             *m_Pos;
+  const char             *m_End;
+  bool                    m_Error;
+  CppPreprocessorHandler *m_Handler;
+
+  void SkipBlanks()
+  {
+    while (m_Pos < m_End && isspace(*m_Pos))
+      ++m_Pos;
+    // A comment ends the expression as far as we are concerned.
+    if (m_End - m_Pos >= 2 && '/' == m_Pos[0] && ('/' == m_Pos[1] || '*' == m_Pos[1]))
+      m_Pos = m_End;
+  }
+
+  bool Match(const char* op)
+  {
+    SkipBlanks();
+    size_t len = strlen(op);
+    if (size_t(m_End - m_Pos) >= len && 0 == memcmp(m_Pos, op, len))
+    {
+      // Don't match '<' against "<=" or "<<", '!' against "!=" and so on.
+      if (1 == len && m_Pos + 1 < m_End && '(' != op[0] && ')' != op[0])
+      {
+        if ('=' == m_Pos[1] || ('!' != op[0] && m_Pos[1] == op[0]))
+          return false;
+      }
+      m_Pos += len;
+      return true;
+    }
+    return false;
+  }
+
+  bool AtEnd()
+  {
+    SkipBlanks();
+    return m_Pos == m_End;
+  }
+
+  PPValue Or();
+  PPValue And();
+  PPValue Compare();
+  PPValue Unary();
+  PPValue Primary();
+};
+
+static PPValue PPKnown(int64_t v)
+{
+  PPValue r = { true, v };
+  return r;
+}
+
+static PPValue PPUnknown()
+{
+  PPValue r = { false, 0 };
+  return r;
+}
+
+// Handles every directive line, tracking conditional state and collecting
+// includes in blocks that are not known to be inactive.
+struct CppPreprocessorHandler
+{
+  IncludeDataList                        m_List;
+  MemAllocLinear                        *m_Allocator;
+  HashTable<PPMacro, kFlagCaseSensitive> m_Macros;
+
+  PPFrame                                m_Stack[kPPMaxDepth];
+  int                                    m_Depth;
+  int                                    m_OverflowDepth;
+
+  int                                    m_DirectiveCount;
+  // Include guard detection: the first directive being #ifndef X followed by
+  // #define X means the #ifndef is taken the first (and only) time we scan it.
+  char                                   m_GuardName[kPPMaxNameLen];
+  bool                                   m_GuardPending;
+
+  // Block comment state up to m_CommentPos.
+  const char                            *m_CommentPos;
+  bool                                   m_InComment;
+
+  // Some macro set by the file has a known state.
+  bool                                   m_LocalKnown;
+
+  PPTruth::Enum Live() const
+  {
+    PPTruth::Enum live = m_Depth ? std::min(m_Stack[m_Depth - 1].m_Parent, m_Stack[m_Depth - 1].m_Branch) : PPTruth::kTrue;
+    if (m_OverflowDepth && live > PPTruth::kMaybe)
+      live = PPTruth::kMaybe;
+    return live;
+  }
+
+  const PPMacro* Find(const char* name)
+  {
+    return HashTableLookup(&m_Macros, Djb2Hash(name), name);
+  }
+
+  void Set(const char* name, int state, bool has_value, int64_t value)
+  {
+    uint32_t hash = Djb2Hash(name);
+    PPMacro* m = HashTableLookup(&m_Macros, hash, name);
+    if (!m)
+    {
+      PPMacro init = { PPMacro::kUnknown, false, false, 0 };
+      HashTableInsert(&m_Macros, hash, StrDup(m_Allocator, name), init);
+      m = HashTableLookup(&m_Macros, hash, name);
+    }
+    m->m_State    = state;
+    m->m_HasValue = has_value;
+    m->m_Value    = value;
+  }
+
+  static bool ReadName(const char** pp, const char* end, char (&name)[kPPMaxNameLen])
+  {
+    const char* p = *pp;
+    while (p < end && isspace(*p))
+      ++p;
+    if (p == end || !PPIsIdentStart(*p))
+      return false;
+    const char* start = p;
+    while (p < end && PPIsIdentChar(*p))
+      ++p;
+    size_t len = size_t(p - start);
+    if (len >= kPPMaxNameLen)
+      return false;
+    memcpy(name, start, len);
+    name[len] = '\0';
+    *pp = p;
+    return true;
+  }
+
+  PPTruth::Enum IsDefined(const char* name)
+  {
+    if (const PPMacro* m = Find(name))
+    {
+      if (PPMacro::kDefined == m->m_State)
+        return PPTruth::kTrue;
+      if (PPMacro::kUndefined == m->m_State)
+        return PPTruth::kFalse;
+    }
+    return PPTruth::kMaybe;
+  }
+
+  PPTruth::Enum Evaluate(const char* p, const char* end)
+  {
+    PPExpression expr;
+    expr.m_Pos     = p;
+    expr.m_End     = end;
+    expr.m_Error   = false;
+    expr.m_Handler = this;
+
+    PPValue v = expr.Or();
+
+    if (expr.m_Error || !expr.AtEnd() || !v.m_Known)
+      return PPTruth::kMaybe;
+
+    return v.m_Value ? PPTruth::kTrue : PPTruth::kFalse;
+  }
+
+  void Push(PPTruth::Enum branch)
+  {
+    if (m_Depth == kPPMaxDepth)
+    {
+      ++m_OverflowDepth;
+      return;
+    }
+
+    PPFrame* f = &m_Stack[m_Depth];
+    f->m_Parent     = Live();
+    f->m_Branch     = branch;
+    f->m_Taken      = PPTruth::kTrue == branch;
+    f->m_MaybeTaken = PPTruth::kMaybe == branch;
+    ++m_Depth;
+  }
+
+  void Else(PPTruth::Enum branch)
+  {
+    if (m_OverflowDepth || !m_Depth)
+      return;
+
+    PPFrame* f = &m_Stack[m_Depth - 1];
+
+    if (f->m_Taken)
+      branch = PPTruth::kFalse;
+    else if (f->m_MaybeTaken && PPTruth::kTrue == branch)
+      branch = PPTruth::kMaybe;
+
+    f->m_Branch      = branch;
+    f->m_Taken      |= PPTruth::kTrue == branch;
+    f->m_MaybeTaken |= PPTruth::kMaybe == branch;
+  }
+
+  void Pop()
+  {
+    if (m_OverflowDepth)
+      --m_OverflowDepth;
+    else if (m_Depth)
+      --m_Depth;
+  }
+
+  void SetLocal(const char* name, int state, bool has_value, int64_t value)
+  {
+    Set(name, state, has_value, value);
+    HashTableLookup(&m_Macros, Djb2Hash(name), name)->m_Local = true;
+    m_LocalKnown |= PPMacro::kUnknown != state;
+  }
+
+  // The included file may #define or #undef anything the file has set itself.
+  void ForgetLocals()
+  {
+    if (!m_LocalKnown)
+      return;
+
+    HashTableWalk(&m_Macros, [&](uint32_t index, uint32_t hash, const char* name, const PPMacro& m) {
+      if (m.m_Local)
+        Set(name, PPMacro::kUnknown, false, 0);
+    });
+
+    m_LocalKnown = false;
+  }
+
+  // Follows block comments from m_CommentPos up to the start of a directive
+  // line, and returns true if the line starts inside one. Line comments and
+  // string and character literals are skipped so they can't open one.
+  bool InComment(const char* line)
+  {
+    const char* p          = m_CommentPos;
+    bool        in_comment = m_InComment;
+
+    while (p < line)
+    {
+      if (in_comment)
+      {
+        while (p < line && !('*' == p[0] && p + 1 < line && '/' == p[1]))
+          ++p;
+        if (p < line)
+        {
+          p += 2;
+          in_comment = false;
+        }
+        continue;
+      }
+
+      const char ch = *p++;
+
+      if ('/' == ch && p < line && '*' == *p)
+      {
+        ++p;
+        in_comment = true;
+      }
+      else if ('/' == ch && p < line && '/' == *p)
+      {
+        while (p < line && '\n' != *p)
+          ++p;
+      }
+      else if ('"' == ch || '\'' == ch)
+      {
+        while (p < line && ch != *p && '\n' != *p)
+        {
+          if ('\\' == *p && p + 1 < line)
+            ++p;
+          ++p;
+        }
+        if (p < line)
+          ++p;
+      }
+    }
+
+    m_CommentPos = line;
+    m_InComment  = in_comment;
+    return in_comment;
+  }
+
+  bool WantDirective(const char*, const char*)
+  {
+    return true;
+  }
+
+  void Directive(const char* line, const char* line_end)
+  {
+    if (InComment(line))
+      return;
+
+    const char* p = line;
+    while (p < line_end && isspace(*p))
+      ++p;
+    ++p; // '#'
+
+    char keyword[kPPMaxNameLen];
+    if (!ReadName(&p, line_end, keyword))
+      return;
+
+    const int directive_index = m_DirectiveCount++;
+
+    if (m_GuardPending)
+    {
+      // Undo the guess made for the #ifndef if this isn't a guard after all.
+      char name[kPPMaxNameLen];
+      const char* q = p;
+      m_GuardPending = false;
+      if (0 != strcmp(keyword, "define") || !ReadName(&q, line_end, name) || 0 != strcmp(name, m_GuardName))
+      {
+        PPTruth::Enum defined = IsDefined(m_GuardName);
+        m_Stack[0].m_Branch     = PPTruth::Enum(PPTruth::kTrue - defined);
+        m_Stack[0].m_Taken      = PPTruth::kTrue == m_Stack[0].m_Branch;
+        m_Stack[0].m_MaybeTaken = PPTruth::kMaybe == m_Stack[0].m_Branch;
+      }
+    }
+
+    if (0 == strcmp(keyword, "include"))
+    {
+      if (PPTruth::kFalse != Live())
+      {
+        if (IncludeData* d = ScanCppLine(line, line_end, m_Allocator))
+          m_List.Add(d);
+        ForgetLocals();
+      }
+    }
+    else if (0 == strcmp(keyword, "if"))
+    {
+      Push(PPTruth::kFalse == Live() ? PPTruth::kFalse : Evaluate(p, line_end));
+    }
+    else if (0 == strcmp(keyword, "ifdef") || 0 == strcmp(keyword, "ifndef"))
+    {
+      char name[kPPMaxNameLen];
+      PPTruth::Enum truth = PPTruth::kMaybe;
+      if (ReadName(&p, line_end, name))
+      {
+        truth = IsDefined(name);
+        if ('n' == keyword[2])
+        {
+          truth = PPTruth::Enum(PPTruth::kTrue - truth);
+
+          if (0 == directive_index && 0 == m_Depth)
+          {
+            strcpy(m_GuardName, name);
+            m_GuardPending = true;
+            truth = PPTruth::kTrue;
+          }
+        }
+      }
+      Push(PPTruth::kFalse == Live() ? PPTruth::kFalse : truth);
+    }
+    else if (0 == strcmp(keyword, "elif"))
+    {
+      Else(Evaluate(p, line_end));
+    }
+    else if (0 == strcmp(keyword, "else"))
+    {
+      Else(PPTruth::kTrue);
+    }
+    else if (0 == strcmp(keyword, "endif"))
+    {
+      Pop();
+    }
+    else if (0 == strcmp(keyword, "define") || 0 == strcmp(keyword, "undef"))
+    {
+      PPTruth::Enum live = Live();
+      char name[kPPMaxNameLen];
+      if (PPTruth::kFalse == live || !ReadName(&p, line_end, name))
+        return;
+
+      if (PPTruth::kMaybe == live)
+      {
+        SetLocal(name, PPMacro::kUnknown, false, 0);
+      }
+      else if ('u' == keyword[0])
+      {
+        SetLocal(name, PPMacro::kUndefined, false, 0);
+      }
+      else
+      {
+        // Only simple integer object-like macros get a value.
+        int64_t value = 0;
+        bool has_value = false;
+        if (p < line_end && isspace(*p))
+        {
+          PPExpression body;
+          body.m_Pos     = p;
+          body.m_End     = line_end;
+          body.m_Error   = false;
+          body.m_Handler = this;
+          body.SkipBlanks();
+          const char* num = body.m_Pos;
+          if (PPParseNumber(&num, line_end, &value))
+          {
+            body.m_Pos = num;
+            has_value = body.AtEnd();
+          }
+        }
+        SetLocal(name, PPMacro::kDefined, has_value, value);
+      }
+    }
+  }
+};
+
+PPValue PPExpression::Or()
+{
+  PPValue lhs = And();
+  while (!m_Error && Match("||"))
+  {
+    PPValue rhs = And();
+    if ((lhs.m_Known && lhs.m_Value) || (rhs.m_Known && rhs.m_Value))
+      lhs = PPKnown(1);
+    else if (lhs.m_Known && rhs.m_Known)
+      lhs = PPKnown(0);
+    else
+      lhs = PPUnknown();
+  }
+  return lhs;
+}
+
+PPValue PPExpression::And()
+{
+  PPValue lhs = Compare();
+  while (!m_Error && Match("&&"))
+  {
+    PPValue rhs = Compare();
+    if ((lhs.m_Known && !lhs.m_Value) || (rhs.m_Known && !rhs.m_Value))
+      lhs = PPKnown(0);
+    else if (lhs.m_Known && rhs.m_Known)
+      lhs = PPKnown(1);
+    else
+      lhs = PPUnknown();
+  }
+  return lhs;
+}
+
+PPValue PPExpression::Compare()
+{
+  PPValue lhs = Unary();
+
+  for (;;)
+  {
+    int op;
+    if (Match("=="))      op = 0;
+    else if (Match("!=")) op = 1;
+    else if (Match("<=")) op = 2;
+    else if (Match(">=")) op = 3;
+    else if (Match("<"))  op = 4;
+    else if (Match(">"))  op = 5;
+    else
+      return lhs;
+
+    PPValue rhs = Unary();
+    if (!lhs.m_Known || !rhs.m_Known)
+    {
+      lhs = PPUnknown();
+      continue;
+    }
+
+    int64_t a = lhs.m_Value, b = rhs.m_Value;
+    switch (op)
+    {
+      case 0: lhs = PPKnown(a == b); break;
+      case 1: lhs = PPKnown(a != b); break;
+      case 2: lhs = PPKnown(a <= b); break;
+      case 3: lhs = PPKnown(a >= b); break;
+      case 4: lhs = PPKnown(a < b); break;
+      default: lhs = PPKnown(a > b); break;
+    }
+  }
+}
+
+PPValue PPExpression::Unary()
+{
+  if (Match("!"))
+  {
+    PPValue v = Unary();
+    return v.m_Known ? PPKnown(!v.m_Value) : v;
+  }
+  if (Match("-"))
+  {
+    PPValue v = Unary();
+    return v.m_Known ? PPKnown(-v.m_Value) : v;
+  }
+  return Primary();
+}
+
+PPValue PPExpression::Primary()
+{
+  SkipBlanks();
+
+  if (m_Pos == m_End)
+  {
+    m_Error = true;
+    return PPUnknown();
+  }
+
+  if (Match("("))
+  {
+    PPValue v = Or();
+    if (!Match(")"))
+      m_Error = true;
+    return v;
+  }
+
+  if (*m_Pos >= '0' && *m_Pos <= '9')
+  {
+    int64_t value;
+    if (!PPParseNumber(&m_Pos, m_End, &value))
+    {
+      m_Error = true;
+      return PPUnknown();
+    }
+    return PPKnown(value);
+  }
+
+  char name[kPPMaxNameLen];
+  if (!CppPreprocessorHandler::ReadName(&m_Pos, m_End, name))
+  {
+    m_Error = true;
+    return PPUnknown();
+  }
+
+  if (0 == strcmp(name, "defined"))
+  {
+    bool paren = Match("(");
+    if (!CppPreprocessorHandler::ReadName(&m_Pos, m_End, name) || (paren && !Match(")")))
+    {
+      m_Error = true;
+      return PPUnknown();
+    }
+    PPTruth::Enum d = m_Handler->IsDefined(name);
+    return PPTruth::kMaybe == d ? PPUnknown() : PPKnown(PPTruth::kTrue == d);
+  }
+
+  // Function-like macro invocations are beyond us.
+  SkipBlanks();
+  if (m_Pos < m_End && '(' == *m_Pos)
+  {
+    m_Error = true;
+    return PPUnknown();
+  }
+
+  if (const PPMacro* m = m_Handler->Find(name))
+  {
+    if (PPMacro::kUndefined == m->m_State)
+      return PPKnown(0);
+    if (PPMacro::kDefined == m->m_State && m->m_HasValue)
+      return PPKnown(m->m_Value);
+  }
+
+  return PPUnknown();
+}
+
+IncludeData*
+ScanIncludesCppPreprocessor(
+    const char* data,
+    size_t len,
+    MemAllocLinear* allocator,
+    MemAllocHeap* heap,
+    const char* const* defines,
+    int define_count)
+{
+  CppPreprocessorHandler handler;
+  handler.m_Allocator      = allocator;
+  handler.m_Depth          = 0;
+  handler.m_OverflowDepth  = 0;
+  handler.m_DirectiveCount = 0;
+  handler.m_GuardPending   = false;
+  handler.m_CommentPos     = data;
+  handler.m_InComment      = false;
+  handler.m_LocalKnown     = false;
+  HashTableInit(&handler.m_Macros, heap);
+
+  for (int i = 0; i < define_count; ++i)
+  {
+    const char* def = defines[i];
+    char name[kPPMaxNameLen];
+
+    if ('!' == def[0])
+    {
+      const char* p = def + 1;
+      if (CppPreprocessorHandler::ReadName(&p, p + strlen(p), name))
+        handler.Set(name, PPMacro::kUndefined, false, 0);
+      continue;
+    }
+
+    const char* p   = def;
+    const char* end = def + strlen(def);
+    if (!CppPreprocessorHandler::ReadName(&p, end, name))
+      continue;
+
+    // -DFOO defines FOO to 1.
+    int64_t value = 1;
+    bool has_value = true;
+    if (p < end && '=' == *p)
+    {
+      ++p;
+      has_value = PPParseNumber(&p, end, &value) && p == end;
+    }
+    handler.Set(name, PPMacro::kDefined, has_value, value);
+  }
+
+  ScanDirectives(data, len, &handler, IncludeScanMode::kAuto);
+
+  HashTableDestroy(&handler.m_Macros);
+  return handler.m_List.m_Head;
+}
+
 static IncludeData*
-ScanLineGeneric(MemAllocLinear* allocator, const char *start_in, const GenericScannerData& config)
+ScanLineGeneric(MemAllocLinear* allocator, const char *start_in, const char* end, const GenericScannerData& config)
 {
 	const char *start = start_in;
 	const char *str_start;
@@ -141,7 +1202,7 @@ ScanLineGeneric(MemAllocLinear* allocator, const char *start_in, const GenericSc
   const bool use_separators = 0 != (config.m_Flags & GenericScannerData::kFlagUseSeparators);
   const bool bare_is_system = 0 != (config.m_Flags & GenericScannerData::kFlagBareMeansSystem);
 
-	while (isspace(*start))
+	while (start < end && isspace(*start))
 		++start;
 
 	if (require_ws && start == start_in)
@@ -151,7 +1212,7 @@ ScanLineGeneric(MemAllocLinear* allocator, const char *start_in, const GenericSc
 
   for (const KeywordData& kwdata : config.m_Keywords)
   {
-    if (0 == strncmp(kwdata.m_String, start, kwdata.m_StringLength))
+    if (end - start >= kwdata.m_StringLength && 0 == memcmp(kwdata.m_String, start, kwdata.m_StringLength))
     {
       keyword = &kwdata;
       break;
@@ -164,12 +1225,15 @@ ScanLineGeneric(MemAllocLinear* allocator, const char *start_in, const GenericSc
 	start += keyword->m_StringLength;
 	
   // TDDO: Should make this optional
-	if (!isspace(*start++))
+	if (start == end || !isspace(*start++))
 		return nullptr;
 
-	while (isspace(*start))
+	while (start < end && isspace(*start))
 		++start;
 
+	if (start == end)
+		return nullptr;
+
   IncludeData* dest = LinearAllocate<IncludeData>(allocator);
 
 	if (use_separators)
@@ -192,17 +1256,9 @@ ScanLineGeneric(MemAllocLinear* allocator, const char *start_in, const GenericSc
     }
 
 		str_start = start;
-		for (;;)
-		{
-			char ch = *start++;
-			if (ch == closing_separator)
-				break;
-			if (!ch)
-				return 0;
-		}
-
-    // start is pointing to the character after the closing separator, so wind it back one
-    start--;
+		start     = (const char*) memchr(start, closing_separator, size_t(end - start));
+		if (!start)
+			return 0;
 
     dest->m_IsSystemInclude = '>' == closing_separator;
 	}
@@ -211,12 +1267,9 @@ ScanLineGeneric(MemAllocLinear* allocator, const char *start_in, const GenericSc
 		str_start = start;
 
 		// just grab the next token 
-		while (*start && !isspace(*start))
+		while (start < end && !isspace(*start))
 			++start;
 
-		if (str_start == start)
-			return 0;
-
     dest->m_IsSystemInclude = bare_is_system;
 	}
 
@@ -227,17 +1280,18 @@ ScanLineGeneric(MemAllocLinear* allocator, const char *start_in, const GenericSc
 	return dest;
 }
 
-IncludeData* ScanIncludesGeneric(char* buffer, MemAllocLinear* allocator, const GenericScannerData& config)
+IncludeData* ScanIncludesGeneric(const char* data, size_t len, MemAllocLinear* allocator, const GenericScannerData& config)
 {
-  char* linep = buffer;
+  const char* end   = ScanEnd(data, len);
+  const char* linep = data;
   IncludeDataList includes;
 
   while (linep)
   {
-    char *line_data = linep;
-    linep = GetNextLine(linep);
+    const char *line_data = linep;
+    const char *line_end  = GetNextLine(&linep, end);
 
-    if (IncludeData* d = ScanLineGeneric(allocator, line_data, config))
+    if (IncludeData* d = ScanLineGeneric(allocator, line_data, line_end, config))
     {
       includes.Add(d);
     }
@@ -3,6 +3,8 @@
 
 #include "Common.hpp"
 
+#include <cstring>
+
 // Low-level scanning functions to grab dependencies from a file buffer.
 
 namespace t2
@@ -10,6 +12,7 @@ namespace t2
 
 struct GenericScannerData;
 struct MemAllocLinear;
+struct MemAllocHeap;
 
 struct IncludeData
 {
@@ -20,15 +23,56 @@ struct IncludeData
   IncludeData *m_Next;
 };
 
-// Scan C/C++ style #includes from buffer.
-// Buffer must be null-terminated and will be modified in place.
+namespace IncludeScanMode
+{
+  enum Enum
+  {
+    kAuto   = 0,  // Pick the fastest code path supported by the CPU
+    kScalar = 1,  // Line-by-line reference implementation
+    kSse2   = 2,  // 16 bytes per compare, 64 byte blocks
+    kAvx2   = 3   // 32 bytes per compare, 64 byte blocks
+  };
+}
+
+// Scan C/C++ style #includes from data. The data does not need to be
+// terminated and is not modified, so it can point straight into a memory
+// mapped file. Scanning stops at the end of data or at the first NUL.
+IncludeData*
+ScanIncludesCpp(const char* data, size_t len, MemAllocLinear* allocator);
+
+inline IncludeData*
+ScanIncludesCpp(const char* str, MemAllocLinear* allocator)
+{
+  return ScanIncludesCpp(str, strlen(str), allocator);
+}
+
+// As above, but forces a particular code path. All supported modes produce
+// identical results; this exists so tests and benchmarks can compare them.
 IncludeData*
-ScanIncludesCpp(char* buffer, MemAllocLinear* allocator);
+ScanIncludesCppWithMode(const char* data, size_t len, MemAllocLinear* allocator, IncludeScanMode::Enum mode);
 
-// Scan generic includes from buffer (slower, customizable).
-// Buffer must be null-terminated and will be modified in place.
+// Scan C/C++ style #includes, skipping those in conditional blocks that are
+// known to be inactive. Each define is "NAME", "NAME=VALUE" or "!NAME" for a
+// name known not to be defined. Conditions that depend on anything else are
+// treated as possibly true, so no include the compiler could see is dropped.
+// The heap is used for temporary storage only.
 IncludeData*
-ScanIncludesGeneric(char* buffer, MemAllocLinear* allocator, const GenericScannerData& config);
+ScanIncludesCppPreprocessor(
+    const char* data,
+    size_t len,
+    MemAllocLinear* allocator,
+    MemAllocHeap* heap,
+    const char* const* defines,
+    int define_count);
+
+// Scan generic includes from data (slower, customizable).
+// Same buffer requirements as ScanIncludesCpp().
+IncludeData*
+ScanIncludesGeneric(const char* data, size_t len, MemAllocLinear* allocator, const GenericScannerData& config);
+
+// Returns true if the code path for mode is compiled in and supported by the CPU.
+bool
+IncludeScanModeSupported(IncludeScanMode::Enum mode);
 
 }
 
@@ -17,6 +17,8 @@ static void DumpDag(const DagData* data)
   int node_count = data->m_NodeCount;
   printf("magic number: 0x%08x\n", data->m_MagicNumber);
   printf("node count: %u\n", node_count);
+  printf("path count: %d\n", data->m_Paths.GetCount());
+  const FrozenFileAndHash* paths = data->m_Paths.GetArray();
   for (int i = 0; i < node_count; ++i)
   {
     printf("node %d:\n", i);
@@ -30,6 +32,9 @@ static void DumpDag(const DagData* data)
     if (node.m_Flags & NodeData::kFlagPreciousOutputs) printf(" precious");
     if (node.m_Flags & NodeData::kFlagOverwriteOutputs) printf(" overwrite");
     if (node.m_Flags & NodeData::kFlagExpensive) printf(" expensive");
+    if (node.m_Flags & NodeData::kFlagHasDepFile) printf(" depfile");
+    if (node.m_Flags & NodeData::kFlagDepFileMsvc) printf(" depfile-msvc");
+    if (node.m_Flags & NodeData::kFlagTraceFileAccess) printf(" trace-file-access");
     printf("\n  action: %s\n", node.m_Action.Get());
     printf("  preaction: %s\n", node.m_PreAction.Get() ? node.m_PreAction.Get() : "(null)");
     printf("  annotation: %s\n", node.m_Annotation.Get());
@@ -46,15 +51,15 @@ static void DumpDag(const DagData* data)
     printf("\n");
 
     printf("  inputs:\n");
-    for (const FrozenFileAndHash& f : node.m_InputFiles)
+    for (const FrozenFileAndHash& f : DagPathList(paths, node.m_InputFiles))
       printf("    %s (0x%08x)\n", f.m_Filename.Get(), f.m_FilenameHash);
 
     printf("  outputs:\n");
-    for (const FrozenFileAndHash& f : node.m_OutputFiles)
+    for (const FrozenFileAndHash& f : DagPathList(paths, node.m_OutputFiles))
       printf("    %s (0x%08x)\n", f.m_Filename.Get(), f.m_FilenameHash);
 
     printf("  aux_outputs:\n");
-    for (const FrozenFileAndHash& f : node.m_AuxOutputFiles)
+    for (const FrozenFileAndHash& f : DagPathList(paths, node.m_AuxOutputFiles))
       printf("    %s (0x%08x)\n", f.m_Filename.Get(), f.m_FilenameHash);
 
     printf("  environment:\n");
@@ -63,6 +68,9 @@ static void DumpDag(const DagData* data)
       printf("    %s = %s\n", env.m_Name.Get(), env.m_Value.Get());
     }
 
+    if (const char* depfile = node.m_DepFile)
+      printf("  depfile: %s\n", depfile);
+
     if (const ScannerData* s = node.m_Scanner)
     {
       printf("  scanner:\n");
@@ -74,6 +82,9 @@ static void DumpDag(const DagData* data)
         case ScannerType::kGeneric:
           printf("    type: generic\n");
           break;
+        case ScannerType::kCppPreprocessor:
+          printf("    type: cpp-pp\n");
+          break;
         default:
           printf("    type: garbage!\n");
           break;
@@ -88,6 +99,16 @@ static void DumpDag(const DagData* data)
       printf("    scanner guid: %s\n", digest_str);
 
 
+      if (ScannerType::kCppPreprocessor == s->m_ScannerType)
+      {
+        const CppPreprocessorScannerData* ps = static_cast<const CppPreprocessorScannerData*>(s);
+        printf("    defines:\n");
+        for (const char* define : ps->m_Defines)
+        {
+          printf("      %s\n", define);
+        }
+      }
+
       if (ScannerType::kGeneric == s->m_ScannerType)
       {
         const GenericScannerData* gs = static_cast<const GenericScannerData*>(s);
@@ -163,8 +184,11 @@ static void DumpDag(const DagData* data)
   printf("\nfile signatures:\n");
   for (const DagFileSignature& sig : data->m_FileSignatures)
   {
+    char digest_str[kDigestStringSize];
+    DigestToString(digest_str, sig.m_Digest);
     printf("file            : %s\n", sig.m_Path.Get());
     printf("timestamp       : %u\n", (unsigned int) sig.m_Timestamp);
+    printf("digest          : %s\n", digest_str);
   }
   printf("\nglob signatures:\n");
   for (const DagGlobSignature& sig : data->m_GlobSignatures)
@@ -173,6 +197,11 @@ static void DumpDag(const DagData* data)
     DigestToString(digest_str, sig.m_Digest);
     printf("path            : %s\n", sig.m_Path.Get());
     printf("digest          : %s\n", digest_str);
+    for (const DagGlobDirectory& dir : sig.m_Directories)
+    {
+      DigestToString(digest_str, dir.m_Digest);
+      printf("  directory     : %s (mtime %llu ns, digest %s)\n", dir.m_Path.Get(), (unsigned long long) dir.m_MtimeNs, digest_str);
+    }
   }
 
   printf("m_StateFileName : %s\n", data->m_StateFileName.Get());
@@ -198,6 +227,7 @@ static void DumpState(const StateData* data)
   int node_count = data->m_NodeCount;
   printf("magic number: 0x%08x\n", data->m_MagicNumber);
   printf("node count: %u\n", node_count);
+  printf("implicit file count: %d\n", data->m_ImplicitFiles.GetCount());
   for (int i = 0; i < node_count; ++i)
   {
     printf("node %d:\n", i);
@@ -216,6 +246,9 @@ static void DumpState(const StateData* data)
     printf("  aux outputs:\n");
     for (const char* path : node.m_AuxOutputFiles)
       printf("    %s\n", path);
+    printf("  implicit inputs:\n");
+    for (const StateFileData& file : StateImplicitInputs(data->m_ImplicitFiles.GetArray(), &node))
+      printf("    %s (%llu)\n", file.m_Filename.Get(), (long long unsigned int) file.m_Timestamp);
     printf("\n");
   }
 }
@@ -225,6 +258,7 @@ static void DumpScanCache(const ScanData* data)
   int entry_count = data->m_EntryCount;
   printf("magic number: 0x%08x\n", data->m_MagicNumber);
   printf("entry count: %d\n", entry_count);
+  printf("bucket bits: %u\n", data->m_BucketBits);
   for (int i = 0; i < entry_count; ++i)
   {
     printf("entry %d:\n", i);
@@ -261,7 +295,10 @@ static void DumpDigestCache(const DigestCacheState* data)
     DigestToString(digest_str, r.m_ContentDigest);
     printf("  digest SHA1  : %s\n", digest_str);
     printf("  access time  : %s\n", FmtTime(r.m_AccessTime));
-    printf("  timestamp    : %s\n", FmtTime(r.m_Timestamp));
+    printf("  timestamp    : %s (+%09u ns)\n", FmtTime(r.m_Stamp.m_MtimeNs / 1000000000), unsigned(r.m_Stamp.m_MtimeNs % 1000000000));
+    printf("  ctime        : %s (+%09u ns)\n", FmtTime(r.m_Stamp.m_CtimeNs / 1000000000), unsigned(r.m_Stamp.m_CtimeNs % 1000000000));
+    printf("  size         : %llu\n", (unsigned long long) r.m_Stamp.m_Size);
+    printf("  inode        : %llu (device %llx)\n", (unsigned long long) r.m_Stamp.m_Inode, (unsigned long long) r.m_Stamp.m_Device);
     printf("\n");
   }
 }
@@ -1,5 +1,6 @@
 #include "JsonParse.hpp"
 #include "MemAllocLinear.hpp"
+#include "MemAllocHeap.hpp"
 #include "Stats.hpp"
 
 #include <ctype.h>
@@ -7,6 +8,14 @@
 #include <stdlib.h>
 #include <string.h>
 
+#if ENABLED(USE_SSE2)
+#include <emmintrin.h>
+#endif
+
+#if ENABLED(USE_AVX2)
+#include <immintrin.h>
+#endif
+
 #ifdef _MSC_VER
 #define snprintf _snprintf
 #endif
@@ -38,54 +47,221 @@ enum JsonLexemeType
 struct JsonLexeme
 {
   JsonLexemeType m_Type;
+  size_t         m_Offset;
+  size_t         m_Length;
   union
   {
-    bool    m_Boolean;
-    double  m_Number;
-    char   *m_String;
+    bool         m_Boolean;
+    double       m_Number;
+    const char  *m_String;
   };
 };
 
-static const JsonLexeme s_ValueSeparatorLexeme = { kJsonLexValueSeparator, { 0 } };
-static const JsonLexeme s_NameSeparatorLexeme  = { kJsonLexNameSeparator,  { 0 } };
-static const JsonLexeme s_BeginObjectLexeme    = { kJsonLexBeginObject,    { 0 } };
-static const JsonLexeme s_EndObjectLexeme      = { kJsonLexEndObject,      { 0 } };
-static const JsonLexeme s_BeginArrayLexeme     = { kJsonLexBeginArray,     { 0 } };
-static const JsonLexeme s_EndArrayLexeme       = { kJsonLexEndArray,       { 0 } };
-static const JsonLexeme s_NullLexeme           = { kJsonLexNull,           { 0 } };
-static const JsonLexeme s_EofLexeme            = { kJsonLexEof,            { 0 } };
-static const JsonLexeme s_ErrorLexeme          = { kJsonLexError,          { 0 } };
-static const JsonLexeme s_TrueLexeme           = { kJsonLexBoolean,        { true } };
-static const JsonLexeme s_FalseLexeme          = { kJsonLexBoolean,        { false } };
+// The lexer spends its time in runs of whitespace and string characters. With
+// a SIMD code path, the input is classified 64 bytes at a time into bit masks
+// where bit i describes p[i], and the masks of the current block are kept. A
+// run then ends at the lowest set bit past the cursor, and the tokens in a
+// block share one classification. Tokens themselves are short and are lexed a
+// byte at a time, as is the tail of the input.
+enum
+{
+  kJsonBlockSize = 64
+};
+
+struct JsonBlockMasks
+{
+  // Whitespace as IsSpace() sees it, and the newlines among it.
+  uint64_t m_Whitespace;
+  uint64_t m_Newlines;
+  // '"' and '\\', the bytes that end a run of plain string characters.
+  uint64_t m_StringSpecials;
+};
+
+typedef void (*JsonClassifyFn)(const char* p, JsonBlockMasks* out);
+
+static inline int LowestBitIndex64(uint64_t v)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+  unsigned long index;
+  _BitScanForward64(&index, v);
+  return int(index);
+#elif defined(__GNUC__)
+  return __builtin_ctzll(v);
+#else
+  int index = 0;
+  while (0 == (v & 1))
+  {
+    v >>= 1;
+    ++index;
+  }
+  return index;
+#endif
+}
+
+#if ENABLED(USE_SSE2)
+static void ClassifySse2(const char* p, JsonBlockMasks* out)
+{
+  // ' ' and '\t' through '\r'; the latter is a single unsigned range compare.
+  const __m128i space     = _mm_set1_epi8(' ');
+  const __m128i tab       = _mm_set1_epi8('\t');
+  const __m128i four      = _mm_set1_epi8(4);
+  const __m128i lf        = _mm_set1_epi8('\n');
+  const __m128i quote     = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  uint64_t ws = 0, nl = 0, sp = 0;
+  for (int i = 0; i < 4; ++i)
+  {
+    __m128i v   = _mm_loadu_si128((const __m128i*) (p + 16 * i));
+    __m128i ctl = _mm_sub_epi8(v, tab);
+    __m128i w   = _mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(_mm_min_epu8(ctl, four), ctl));
+    __m128i s   = _mm_or_si128(_mm_cmpeq_epi8(v, quote), _mm_cmpeq_epi8(v, backslash));
+    ws |= uint64_t(uint32_t(_mm_movemask_epi8(w))) << (16 * i);
+    nl |= uint64_t(uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(v, lf)))) << (16 * i);
+    sp |= uint64_t(uint32_t(_mm_movemask_epi8(s))) << (16 * i);
+  }
+  out->m_Whitespace     = ws;
+  out->m_Newlines       = nl;
+  out->m_StringSpecials = sp;
+}
+#endif
+
+#if ENABLED(USE_AVX2)
+TARGET_AVX2 static void ClassifyAvx2(const char* p, JsonBlockMasks* out)
+{
+  const __m256i space     = _mm256_set1_epi8(' ');
+  const __m256i tab       = _mm256_set1_epi8('\t');
+  const __m256i four      = _mm256_set1_epi8(4);
+  const __m256i lf        = _mm256_set1_epi8('\n');
+  const __m256i quote     = _mm256_set1_epi8('"');
+  const __m256i backslash = _mm256_set1_epi8('\\');
+  uint64_t ws = 0, nl = 0, sp = 0;
+  for (int i = 0; i < 2; ++i)
+  {
+    __m256i v   = _mm256_loadu_si256((const __m256i*) (p + 32 * i));
+    __m256i ctl = _mm256_sub_epi8(v, tab);
+    __m256i w   = _mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(_mm256_min_epu8(ctl, four), ctl));
+    __m256i s   = _mm256_or_si256(_mm256_cmpeq_epi8(v, quote), _mm256_cmpeq_epi8(v, backslash));
+    ws |= uint64_t(uint32_t(_mm256_movemask_epi8(w))) << (32 * i);
+    nl |= uint64_t(uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf)))) << (32 * i);
+    sp |= uint64_t(uint32_t(_mm256_movemask_epi8(s))) << (32 * i);
+  }
+  out->m_Whitespace     = ws;
+  out->m_Newlines       = nl;
+  out->m_StringSpecials = sp;
+}
+#endif
 
+// Strings are unescaped into a buffer owned by the lexer rather than in place,
+// so the input can be a read-only mapping. At most one string lexeme is live
+// at a time.
 struct JsonLexerState
 {
-  char       *m_Cursor;
-  int         m_LineNumber;
-  JsonLexeme  m_Lexeme;
-  char        m_Error[1024];
+  const char   *m_Start;
+  const char   *m_Cursor;
+  const char   *m_End;
+  int           m_LineNumber;
+  JsonLexeme    m_Lexeme;
+  MemAllocHeap *m_Heap;
+  Buffer<char>  m_StringBuffer;
+  const char   *m_Error;
+  // Null for the scalar lexer.
+  JsonClassifyFn m_Classify;
+  // The last classified block, if any.
+  const char   *m_Block;
+  JsonBlockMasks m_BlockMasks;
 };
 
-static void JsonLexerStateInit(JsonLexerState* self, char* buffer)
+static void JsonLexerStateInit(JsonLexerState* self, const char* data, size_t size, MemAllocHeap* heap, JsonClassifyFn classify)
 {
-  self->m_Cursor        = buffer;
+  self->m_Start         = data;
+  self->m_Cursor        = data;
+  self->m_End           = data + size;
   self->m_LineNumber    = 1;
   self->m_Lexeme.m_Type = kJsonLexInvalid;
-  self->m_Error[0]      = '\0';
+  self->m_Heap          = heap;
+  self->m_Error         = nullptr;
+  self->m_Classify      = classify;
+  self->m_Block         = nullptr;
+  BufferInit(&self->m_StringBuffer);
+}
+
+static void JsonLexerStateDestroy(JsonLexerState* self)
+{
+  BufferDestroy(&self->m_StringBuffer, self->m_Heap);
+}
+
+static JsonLexeme MakeLexeme(JsonLexerState* state, JsonLexemeType type, const char* start)
+{
+  JsonLexeme result;
+  result.m_Type   = type;
+  result.m_Offset = size_t(start - state->m_Start);
+  result.m_Length = 0;
+  result.m_Number = 0.0;
+  return result;
 }
 
-static char* SkipWhitespace(JsonLexerState* state)
+// isspace() in the C locale, without the call.
+static inline bool IsSpace(char ch)
 {
-  char* ptr = state->m_Cursor;
+  return ' ' == ch || uint8_t(ch - '\t') <= uint8_t('\r' - '\t');
+}
 
-  while (char ch = *ptr)
+// Returns the masks for the block holding ptr, shifted so bit 0 is ptr, or
+// null if there is no whole block left there.
+static const JsonBlockMasks* GetBlockMasks(JsonLexerState* state, const char* ptr, int* shift)
+{
+  if (!state->m_Block || ptr < state->m_Block || ptr >= state->m_Block + kJsonBlockSize)
   {
+    if (state->m_End - ptr < kJsonBlockSize)
+      return nullptr;
+
+    state->m_Classify(ptr, &state->m_BlockMasks);
+    state->m_Block = ptr;
+  }
+
+  *shift = int(ptr - state->m_Block);
+  return &state->m_BlockMasks;
+}
+
+static const char* SkipWhitespace(JsonLexerState* state)
+{
+  const char* ptr = state->m_Cursor;
+  const char* end = state->m_End;
+
+  if (state->m_Classify)
+  {
+    const JsonBlockMasks* masks;
+    int                   shift;
+
+    while (ptr < end && IsSpace(*ptr) && nullptr != (masks = GetBlockMasks(state, ptr, &shift)))
+    {
+      uint64_t stop     = ~masks->m_Whitespace >> shift;
+      uint64_t newlines = masks->m_Newlines >> shift;
+      int      skip     = kJsonBlockSize - shift;
+
+      if (stop)
+      {
+        skip      = LowestBitIndex64(stop);
+        newlines &= (uint64_t(1) << skip) - 1;
+      }
+
+      for (; newlines; newlines &= newlines - 1)
+        ++state->m_LineNumber;
+
+      ptr += skip;
+    }
+  }
+
+  while (ptr < end)
+  {
+    char ch = *ptr;
+
     if ('\n' == ch)
     {
       ++state->m_LineNumber;
     }
 
-    if (isspace(ch))
+    if (IsSpace(ch))
       ++ptr;
     else
       break;
@@ -97,127 +273,204 @@ static char* SkipWhitespace(JsonLexerState* state)
 
 static JsonLexeme JsonLexerError(JsonLexerState* state, const char* error)
 {
-  snprintf(state->m_Error, sizeof state->m_Error, "%d: %s", state->m_LineNumber, error);
-  return s_ErrorLexeme;
+  state->m_Error = error;
+  return MakeLexeme(state, kJsonLexError, state->m_Cursor);
+}
+
+static bool IsNumberChar(char ch)
+{
+  return (ch >= '0' && ch <= '9') || '-' == ch || '+' == ch || '.' == ch || 'e' == ch || 'E' == ch;
 }
 
 static JsonLexeme GetNumberLexeme(JsonLexerState* state)
 {
-  char *start = state->m_Cursor;
-  char *end   = nullptr;
+  const char *start = state->m_Cursor;
 
-  JsonLexeme result;
+  // Most numbers are node and array indices. Integers of up to 15 digits are
+  // exact as doubles, so those don't need strtod.
+  {
+    const char* p   = start;
+    const char* end = state->m_End;
+    bool negative   = p < end && '-' == *p;
+    if (negative)
+      ++p;
+
+    const char* digits = p;
+    uint64_t    value  = 0;
+    while (p < end && *p >= '0' && *p <= '9' && p - digits < 15)
+      value = value * 10 + uint64_t(*p++ - '0');
+
+    if (p > digits && (p == end || !IsNumberChar(*p)))
+    {
+      JsonLexeme result = MakeLexeme(state, kJsonLexNumber, start);
+      result.m_Number = negative ? -double(value) : double(value);
+      state->m_Cursor = p;
+      return result;
+    }
+  }
+
+  // The input isn't terminated, so copy the number out before handing it to
+  // strtod.
+  const char *ptr   = start;
+  char        text[64];
+  size_t      len   = 0;
 
-  result.m_Type   = kJsonLexNumber;
-  result.m_Number = strtod(start, &end);
-  state->m_Cursor = end;
-  return start != end ? result : JsonLexerError(state, "bad number");
+  while (ptr < state->m_End && IsNumberChar(*ptr))
+  {
+    if (len + 1 == sizeof text)
+      return JsonLexerError(state, "bad number");
+    text[len++] = *ptr++;
+  }
+
+  text[len] = '\0';
+
+  char* end = nullptr;
+  JsonLexeme result = MakeLexeme(state, kJsonLexNumber, start);
+  result.m_Number = strtod(text, &end);
+
+  if (end == text)
+    return JsonLexerError(state, "bad number");
+
+  state->m_Cursor = start + (end - text);
+  return result;
+}
+
+// Returns the first '"' or '\\' at or after ptr, or the end of the input.
+static const char* FindStringSpecial(JsonLexerState* state, const char* ptr)
+{
+  const char* end = state->m_End;
+
+  if (state->m_Classify)
+  {
+    const JsonBlockMasks* masks;
+    int                   shift;
+
+    while (nullptr != (masks = GetBlockMasks(state, ptr, &shift)))
+    {
+      if (uint64_t specials = masks->m_StringSpecials >> shift)
+        return ptr + LowestBitIndex64(specials);
+
+      ptr += kJsonBlockSize - shift;
+    }
+  }
+
+  while (ptr < end && '"' != *ptr && '\\' != *ptr)
+    ++ptr;
+
+  return ptr;
 }
 
 static JsonLexeme GetStringLexeme(JsonLexerState* state)
 {
-  JsonLexeme result;
+  MemAllocHeap *heap   = state->m_Heap;
+  Buffer<char> *buffer = &state->m_StringBuffer;
+  const char   *rptr   = state->m_Cursor;
+  const char   *end    = state->m_End;
+
+  JsonLexeme result = MakeLexeme(state, kJsonLexString, rptr);
 
-  char *rptr = state->m_Cursor;
-  char *wptr = rptr;
   ++rptr; // skip quote
 
-  result.m_Type   = kJsonLexString;
-  result.m_String = wptr;
+  BufferClear(buffer);
 
   for (;;)
   {
-    char ch = *rptr++;
-    if (0 == ch)
+    const char* run = rptr;
+    rptr = FindStringSpecial(state, rptr);
+
+    BufferAppend(buffer, heap, run, size_t(rptr - run));
+
+    if (rptr == end)
       return JsonLexerError(state, "end of file inside string");
 
-    if ('"' == ch)
-    {
-      *wptr = '\0';
+    if ('"' == *rptr++)
       break;
-    }
-    else if ('\\' == ch)
+
+    if (rptr == end)
+      return JsonLexerError(state, "end of file inside string");
+
+    char next = *rptr++;
+    switch (next)
     {
-      char next = *rptr++;
-      switch (next)
+      case '\\': BufferAppendOne(buffer, heap, '\\'); break;
+      case '"': BufferAppendOne(buffer, heap, '"'); break;
+      case '/': BufferAppendOne(buffer, heap, '/'); break;
+      case 'b': BufferAppendOne(buffer, heap, '\b'); break;
+      case 'f': BufferAppendOne(buffer, heap, '\f'); break;
+      case 'n': BufferAppendOne(buffer, heap, '\n'); break;
+      case 'r': BufferAppendOne(buffer, heap, '\r'); break;
+      case 't': BufferAppendOne(buffer, heap, '\t'); break;
+      case 'u':
       {
-        case '\\': *wptr++ = '\\'; break;
-        case '"': *wptr++ = '"'; break;
-        case '/': *wptr++ = '/'; break;
-        case 'b': *wptr++ = '\b'; break;
-        case 'f': *wptr++ = '\f'; break;
-        case 'n': *wptr++ = '\n'; break;
-        case 'r': *wptr++ = '\r'; break;
-        case 't': *wptr++ = '\t'; break;
-        case 'u':
+        uint32_t hex_code = 0;
+        for (int i = 0; i < 4; ++i)
         {
-          uint32_t hex_code = 0;
-          for (int i = 0; i < 4; ++i)
+          if (rptr == end)
+            return JsonLexerError(state, "end of file inside escape");
+
+          char code = *rptr++;
+          if (isxdigit(code))
           {
-            char code = *rptr++;
-            if (0 == code)
-            {
-              return JsonLexerError(state, "end of file inside escape");
-            }
-            else if (isxdigit(code))
-            {
-              int lc = tolower(code);
-              hex_code <<= 4;
-              if (lc >= 'a' && lc <= 'f')
-                hex_code |= lc - 'a' + 10;
-              else
-                hex_code |= lc - '0';
-            }
+            int lc = tolower(code);
+            hex_code <<= 4;
+            if (lc >= 'a' && lc <= 'f')
+              hex_code |= lc - 'a' + 10;
             else
-            {
-              return JsonLexerError(state, "expected hex number in \\u escape");
-            }
+              hex_code |= lc - '0';
+          }
+          else
+          {
+            return JsonLexerError(state, "expected hex number in \\u escape");
           }
-
-          if (hex_code > 127)
-            return JsonLexerError(state, "we currently only support ASCII");
-
-          *wptr++ = (char) hex_code;
-          break;
         }
 
-        default:
-          return JsonLexerError(state, "unsupported escape code");
+        if (hex_code > 127)
+          return JsonLexerError(state, "we currently only support ASCII");
+
+        BufferAppendOne(buffer, heap, (char) hex_code);
+        break;
       }
-    }
-    else
-    {
-      *wptr++ = ch;
+
+      default:
+        return JsonLexerError(state, "unsupported escape code");
     }
   }
 
+  result.m_Length = buffer->m_Size;
+  BufferAppendOne(buffer, heap, '\0');
+  result.m_String = buffer->m_Storage;
+
   state->m_Cursor = rptr;
   return result;
 }
 
 static JsonLexeme GetLiteralLexeme(JsonLexerState* state)
 {
-  char *rptr = state->m_Cursor;
-  char *eptr = rptr;
-  while (isalnum(*eptr))
+  const char *rptr = state->m_Cursor;
+  const char *eptr = rptr;
+  while (eptr < state->m_End && isalnum(*eptr))
   {
     eptr++;
   }
 
   size_t kwlen = (eptr - rptr);
 
+  JsonLexeme result = MakeLexeme(state, kJsonLexBoolean, rptr);
+
   if (4 == kwlen)
   {
     if (0 == strncmp("true", rptr, 4))
     {
-      state->m_Cursor = eptr;
-      return s_TrueLexeme;
+      state->m_Cursor  = eptr;
+      result.m_Boolean = true;
+      return result;
     }
 
     else if (0 == strncmp("null", rptr, 4))
     {
       state->m_Cursor = eptr;
-      return s_NullLexeme;
+      result.m_Type   = kJsonLexNull;
+      return result;
     }
   }
 
@@ -225,8 +478,9 @@ static JsonLexeme GetLiteralLexeme(JsonLexerState* state)
   {
     if (0 == strncmp("false", rptr, 5))
     {
-      state->m_Cursor = eptr;
-      return s_FalseLexeme;
+      state->m_Cursor  = eptr;
+      result.m_Boolean = false;
+      return result;
     }
   }
 
@@ -235,10 +489,14 @@ static JsonLexeme GetLiteralLexeme(JsonLexerState* state)
 
 static JsonLexeme JsonLexerFetchNext(JsonLexerState* state)
 {
-  char* p = SkipWhitespace(state);
-  char ch = *p;
+  const char* p = SkipWhitespace(state);
+
+  if (p == state->m_End)
+    return MakeLexeme(state, kJsonLexEof, p);
 
-  switch (ch)
+  JsonLexemeType type;
+
+  switch (*p)
   {
     case '-':
     case '0': case '1': case '2': case '3': case '4':
@@ -248,36 +506,23 @@ static JsonLexeme JsonLexerFetchNext(JsonLexerState* state)
     case '"':
       return GetStringLexeme(state);
 
-    case '{':
-      state->m_Cursor = p + 1;
-      return s_BeginObjectLexeme;
-
-    case '}':
-      state->m_Cursor = p + 1;
-      return s_EndObjectLexeme;
-  
-    case '[':
-      state->m_Cursor = p + 1;
-      return s_BeginArrayLexeme;
-
-    case ']':
-      state->m_Cursor = p + 1;
-      return s_EndArrayLexeme;
-
-    case ',':
-      state->m_Cursor = p + 1;
-      return s_ValueSeparatorLexeme;
-
-    case ':':
-      state->m_Cursor = p + 1;
-      return s_NameSeparatorLexeme;
+    case '{': type = kJsonLexBeginObject; break;
+    case '}': type = kJsonLexEndObject; break;
+    case '[': type = kJsonLexBeginArray; break;
+    case ']': type = kJsonLexEndArray; break;
+    case ',': type = kJsonLexValueSeparator; break;
+    case ':': type = kJsonLexNameSeparator; break;
 
+    // Documents used to be terminated strings; stop at the terminator.
     case '\0':
-      return s_EofLexeme;
+      return MakeLexeme(state, kJsonLexEof, p);
 
     default:
       return GetLiteralLexeme(state);
   }
+
+  state->m_Cursor = p + 1;
+  return MakeLexeme(state, type, p);
 }
 
 static JsonLexeme JsonLexerPeek(JsonLexerState* state)
@@ -328,89 +573,85 @@ static bool JsonLexerExpect(JsonLexerState* state, JsonLexemeType type, JsonLexe
 
 struct JsonState
 {
-  JsonLexerState m_Lexer;
-  char           m_ErrorMessage[1024];
-  MemAllocLinear *m_Allocator;
-  MemAllocLinear *m_Scratch;
+  JsonLexerState     m_Lexer;
+  char               m_ErrorMessage[1024];
+  int                m_Depth;
+  void              *m_UserData;
+  JsonEventCallback  m_Callback;
 };
 
-static void JsonStateInit(JsonState* state, MemAllocLinear* alloc, MemAllocLinear* scratch, char* buffer)
+static void JsonStateInit(JsonState* state, const char* data, size_t size, MemAllocHeap* heap, JsonClassifyFn classify, void* user_data, JsonEventCallback callback)
 {
-  JsonLexerStateInit(&state->m_Lexer, buffer);
+  JsonLexerStateInit(&state->m_Lexer, data, size, heap, classify);
   state->m_ErrorMessage[0] = '\0';
-  state->m_Allocator       = alloc;
-  state->m_Scratch         = scratch;
+  state->m_Depth           = 0;
+  state->m_UserData        = user_data;
+  state->m_Callback        = callback;
 }
 
-static JsonValue* JsonError(JsonState* state, const char* error)
+static bool JsonError(JsonState* state, const char* error)
 {
+  // Prefer what the lexer had to say about a bad token.
+  if (state->m_Lexer.m_Error)
+    error = state->m_Lexer.m_Error;
+
   snprintf(state->m_ErrorMessage, sizeof state->m_ErrorMessage, "line %d: %s", state->m_Lexer.m_LineNumber, error);
-  return nullptr;
+  return false;
 }
 
-static const JsonValue* JsonParseValue(JsonState* json_state);
-
-static const JsonValue* JsonParseObject(JsonState* json_state)
+static bool JsonEmit(JsonState* state, JsonEventType type, const JsonLexeme& l)
 {
-  JsonLexerState* lexer = &json_state->m_Lexer;
-
-  if (!JsonLexerExpect(lexer, kJsonLexBeginObject))
-    return JsonError(json_state, "expected '{'");
+  JsonEvent event;
+  event.m_Type    = type;
+  event.m_Depth   = state->m_Depth;
+  event.m_Offset  = l.m_Offset;
+  event.m_String  = nullptr;
+  event.m_Length  = 0;
+  event.m_Number  = 0.0;
+  event.m_Boolean = false;
+
+  switch (type)
+  {
+    case kJsonEventKey:
+    case kJsonEventString:
+      event.m_String = l.m_String;
+      event.m_Length = l.m_Length;
+      break;
+    case kJsonEventNumber:
+      event.m_Number = l.m_Number;
+      break;
+    case kJsonEventBoolean:
+      event.m_Boolean = l.m_Boolean;
+      break;
+    default:
+      break;
+  }
 
-  MemAllocLinearScope scratch_scope(json_state->m_Scratch);
+  if (!state->m_Callback(state->m_UserData, event))
+    return JsonError(state, "stopped by event handler");
 
-  bool seen_value = false;
-  bool seen_comma = false;
+  return true;
+}
 
-  struct KvPair
-  {
-    const char      *m_Key;
-    const JsonValue *m_Value;
-    KvPair          *m_Next;
-  };
+static bool JsonParseValue(JsonState* json_state);
 
-  struct KvPairList
-  {
-    MemAllocLinear *m_Scratch;
-    KvPair         *m_Head;
-    KvPair         *m_Tail;
-    size_t          m_Count;
+static bool JsonParseObject(JsonState* json_state)
+{
+  JsonLexerState* lexer = &json_state->m_Lexer;
 
-    void Init(MemAllocLinear* scratch)
-    {
-      m_Scratch = scratch;
-      m_Head    = nullptr;
-      m_Tail    = nullptr;
-      m_Count   = 0;
-    }
+  JsonLexeme begin;
+  if (!JsonLexerExpect(lexer, kJsonLexBeginObject, &begin))
+    return JsonError(json_state, "expected '{'");
 
-    void Add(const char* key, const JsonValue* value)
-    {
-      if (1 == ++m_Count)
-      {
-        m_Head = m_Tail = LinearAllocate<KvPair>(m_Scratch);
-        m_Head->m_Key   = key;
-        m_Head->m_Value = value;
-        m_Head->m_Next  = nullptr;
-      }
-      else
-      {
-        KvPair* tail = m_Tail;
-        m_Tail          = LinearAllocate<KvPair>(m_Scratch);
-        m_Tail->m_Key   = key;
-        m_Tail->m_Value = value;
-        m_Tail->m_Next  = nullptr;
-        tail->m_Next    = m_Tail;
-      }
-    }
-  };
+  if (!JsonEmit(json_state, kJsonEventBeginObject, begin))
+    return false;
 
-  KvPairList kv_pairs;
+  ++json_state->m_Depth;
 
-  kv_pairs.Init(json_state->m_Scratch);
+  bool seen_value = false;
+  bool seen_comma = false;
 
-  bool done = false;
-  while (!done)
+  for (;;)
   {
     JsonLexeme l = JsonLexerNext(lexer);
 
@@ -421,15 +662,16 @@ static const JsonValue* JsonParseObject(JsonState* json_state)
         if (seen_value && !seen_comma)
           return JsonError(json_state, "expected ','");
 
+        // The separator doesn't touch the string buffer, so the key is still
+        // valid here.
         if (!JsonLexerExpect(lexer, kJsonLexNameSeparator))
           return JsonError(json_state, "expected ':'");
 
-        const JsonValue* value = JsonParseValue(json_state);
+        if (!JsonEmit(json_state, kJsonEventKey, l))
+          return false;
 
-        if (value == nullptr)
-          return nullptr;
-
-        kv_pairs.Add(l.m_String, value);
+        if (!JsonParseValue(json_state))
+          return false;
 
         seen_value = true;
         seen_comma = false;
@@ -437,8 +679,8 @@ static const JsonValue* JsonParseObject(JsonState* json_state)
       break;
 
       case kJsonLexEndObject:
-        done = true;
-        break;
+        --json_state->m_Depth;
+        return JsonEmit(json_state, kJsonEventEndObject, l);
 
       case kJsonLexValueSeparator:
       {
@@ -452,187 +694,557 @@ static const JsonValue* JsonParseObject(JsonState* json_state)
         seen_comma = true;
         break;
       }
-      
+
       default:
         return JsonError(json_state, "expected object to continue");
     }
   }
-
-  MemAllocLinear* alloc = json_state->m_Allocator;
-
-  size_t       count  = kv_pairs.m_Count;
-  const char **names  = LinearAllocateArray<const char*>(alloc, kv_pairs.m_Count);
-  const JsonValue  **values = LinearAllocateArray<const JsonValue*>(alloc, kv_pairs.m_Count);
-
-  size_t index = 0;
-  for (KvPair* p = kv_pairs.m_Head; p; p = p->m_Next, ++index)
-  {
-    names[index]  = p->m_Key;
-    values[index] = p->m_Value;
-  }
-
-  JsonObjectValue* result = LinearAllocate<JsonObjectValue>(alloc);
-  result->m_Type = JsonValue::kObject;
-  result->m_Count  = count;
-  result->m_Names  = names;
-  result->m_Values = values;
-
-  return result;
 }
 
-static const JsonValue* JsonParseArray(JsonState* json_state)
+static bool JsonParseArray(JsonState* json_state)
 {
   JsonLexerState* lexer = &json_state->m_Lexer;
 
-  if (!JsonLexerExpect(lexer, kJsonLexBeginArray))
+  JsonLexeme begin;
+  if (!JsonLexerExpect(lexer, kJsonLexBeginArray, &begin))
     return JsonError(json_state, "expected '['");
 
-  MemAllocLinearScope scratch_scope(json_state->m_Scratch);
+  if (!JsonEmit(json_state, kJsonEventBeginArray, begin))
+    return false;
 
-  struct ListElem
-  {
-    const JsonValue *m_Value;
-    ListElem        *m_Next;
-  };
+  ++json_state->m_Depth;
 
-  struct ValueList
+  for (size_t count = 0; ; ++count)
   {
-    MemAllocLinear *m_Scratch;
-    ListElem       *m_Head;
-    ListElem       *m_Tail;
-    size_t          m_Count;
+    JsonLexeme l = JsonLexerPeek(lexer);
 
-    void Init(MemAllocLinear* scratch)
+    if (kJsonLexEndArray == l.m_Type)
     {
-      m_Scratch = scratch;
-      m_Head    = nullptr;
-      m_Tail    = nullptr;
-      m_Count   = 0;
+      JsonLexerSkip(lexer);
+      --json_state->m_Depth;
+      return JsonEmit(json_state, kJsonEventEndArray, l);
     }
 
-    void Add(const JsonValue* value)
+    if (count > 0)
     {
-      if (1 == ++m_Count)
-      {
-        m_Head = m_Tail = LinearAllocate<ListElem>(m_Scratch);
-        m_Head->m_Value = value;
-        m_Head->m_Next  = nullptr;
-      }
-      else
+      if (kJsonLexValueSeparator != l.m_Type)
       {
-        ListElem* tail = m_Tail;
-        m_Tail          = LinearAllocate<ListElem>(m_Scratch);
-        m_Tail->m_Value = value;
-        m_Tail->m_Next  = nullptr;
-        tail->m_Next    = m_Tail;
+        return JsonError(json_state, "expected ','");
       }
+
+      JsonLexerSkip(lexer);
     }
-  };
 
-  ValueList value_list;
+    if (!JsonParseValue(json_state))
+      return false;
+  }
+}
 
-  value_list.Init(json_state->m_Scratch);
+static bool JsonParseValue(JsonState* json_state)
+{
+  JsonLexerState  *lexer  = &json_state->m_Lexer;
+  JsonLexeme       l      = JsonLexerPeek(lexer);
 
-  for (;;)
+  switch (l.m_Type)
   {
-    JsonLexeme l = JsonLexerPeek(lexer);
+    case kJsonLexBeginObject:
+      return JsonParseObject(json_state);
 
-    if (kJsonLexEndArray == l.m_Type)
-    {
+    case kJsonLexBeginArray:
+      return JsonParseArray(json_state);
+
+    case kJsonLexString:
       JsonLexerSkip(lexer);
-      break;
-    }
+      return JsonEmit(json_state, kJsonEventString, l);
 
-    if (value_list.m_Count > 0)
-    {
-      if (kJsonLexValueSeparator != l.m_Type)
-      {
-        return JsonError(json_state, "expected ','");
-      }
+    case kJsonLexNumber:
+      JsonLexerSkip(lexer);
+      return JsonEmit(json_state, kJsonEventNumber, l);
 
+    case kJsonLexBoolean:
       JsonLexerSkip(lexer);
-    }
+      return JsonEmit(json_state, kJsonEventBoolean, l);
 
-    const JsonValue* value = JsonParseValue(json_state);
-    if (!value)
-      return nullptr;
+    case kJsonLexNull:
+      JsonLexerSkip(lexer);
+      return JsonEmit(json_state, kJsonEventNull, l);
 
-    value_list.Add(value);
+    default:
+      return JsonError(json_state, "invalid document");
   }
+}
 
-  MemAllocLinear* alloc = json_state->m_Allocator;
+bool JsonLexModeSupported(JsonLexMode::Enum mode)
+{
+  switch (mode)
+  {
+    case JsonLexMode::kAuto:
+    case JsonLexMode::kScalar:
+      return true;
+#if ENABLED(USE_SSE2)
+    case JsonLexMode::kSse2:
+      return true;
+#endif
+#if ENABLED(USE_AVX2)
+    case JsonLexMode::kAvx2:
+      return CpuHasAvx2();
+#endif
+    default:
+      return false;
+  }
+}
 
-  size_t            count  = value_list.m_Count;
-  const JsonValue **values = LinearAllocateArray<const JsonValue*>(alloc, count);
+static JsonClassifyFn GetBlockClassifier(JsonLexMode::Enum mode)
+{
+  if (JsonLexMode::kAuto == mode)
+  {
+    if (JsonLexModeSupported(JsonLexMode::kAvx2))
+      mode = JsonLexMode::kAvx2;
+    else if (JsonLexModeSupported(JsonLexMode::kSse2))
+      mode = JsonLexMode::kSse2;
+    else
+      mode = JsonLexMode::kScalar;
+  }
 
-  size_t index = 0;
-  for (ListElem* p = value_list.m_Head; p; p = p->m_Next, ++index)
+  switch (mode)
   {
-    values[index] = p->m_Value;
+#if ENABLED(USE_SSE2)
+    case JsonLexMode::kSse2:
+      return ClassifySse2;
+#endif
+#if ENABLED(USE_AVX2)
+    case JsonLexMode::kAvx2:
+      if (!CpuHasAvx2())
+        Croak("AVX2 JSON lexing requested but not supported by this CPU");
+      return ClassifyAvx2;
+#endif
+    default:
+      return nullptr;
   }
+}
 
-  JsonArrayValue* result = LinearAllocate<JsonArrayValue>(alloc);
-  result->m_Type   = JsonValue::kArray;
-  result->m_Count  = count;
-  result->m_Values = values;
+bool JsonSaxParse(
+    const char* data,
+    size_t size,
+    MemAllocHeap* heap,
+    void* user_data,
+    JsonEventCallback callback,
+    char (&error_message)[1024])
+{
+  return JsonSaxParseWithMode(data, size, heap, user_data, callback, error_message, JsonLexMode::kAuto);
+}
 
-  return result;
+bool JsonSaxParseWithMode(
+    const char* data,
+    size_t size,
+    MemAllocHeap* heap,
+    void* user_data,
+    JsonEventCallback callback,
+    char (&error_message)[1024],
+    JsonLexMode::Enum mode)
+{
+  TimingScope timing_scope(nullptr, &g_Stats.m_JsonParseTimeCycles);
+
+  JsonState json_state;
+  JsonStateInit(&json_state, data, size, heap, GetBlockClassifier(mode), user_data, callback);
+
+  bool success = JsonParseValue(&json_state);
+
+  if (success && !JsonLexerExpect(&json_state.m_Lexer, kJsonLexEof))
+  {
+    success = JsonError(&json_state, "data after document");
+  }
+
+  if (success)
+  {
+    error_message[0] = '\0';
+  }
+  else
+  {
+    strncpy(error_message, json_state.m_ErrorMessage, sizeof error_message);
+    error_message[sizeof(error_message)-1] = '\0';
+  }
+
+  JsonLexerStateDestroy(&json_state.m_Lexer);
+
+  return success;
 }
 
-static const JsonValue* JsonParseValue(JsonState* json_state)
+void JsonRecorderInit(JsonEventRecorder* self, MemAllocHeap* heap)
 {
-  MemAllocLinear  *alloc  = json_state->m_Allocator;
-  JsonLexerState  *lexer  = &json_state->m_Lexer;
-  JsonLexeme       l      = JsonLexerPeek(lexer);
+  self->m_Heap = heap;
+  BufferInit(&self->m_Data);
+}
 
-  const JsonValue *result = nullptr;
+void JsonRecorderDestroy(JsonEventRecorder* self)
+{
+  BufferDestroy(&self->m_Data, self->m_Heap);
+}
 
-  switch (l.m_Type)
+static void JsonRecordTag(JsonEventRecorder* self, JsonEventType type)
+{
+  BufferAppendOne(&self->m_Data, self->m_Heap, char(type));
+}
+
+static void JsonRecordText(JsonEventRecorder* self, JsonEventType type, const char* text, size_t length)
+{
+  JsonRecordTag(self, type);
+
+  // Length as a little-endian base 128 varint.
+  size_t v = length;
+  do
   {
-    case kJsonLexBeginObject:
-      result = JsonParseObject(json_state);
+    uint8_t byte = uint8_t(v & 0x7f);
+    v >>= 7;
+    BufferAppendOne(&self->m_Data, self->m_Heap, char(v ? byte | 0x80 : byte));
+  } while (v);
+
+  BufferAppend(&self->m_Data, self->m_Heap, text, length);
+  BufferAppendOne(&self->m_Data, self->m_Heap, '\0');
+}
+
+void JsonRecordBeginObject(JsonEventRecorder* self) { JsonRecordTag(self, kJsonEventBeginObject); }
+void JsonRecordEndObject(JsonEventRecorder* self)   { JsonRecordTag(self, kJsonEventEndObject); }
+void JsonRecordBeginArray(JsonEventRecorder* self)  { JsonRecordTag(self, kJsonEventBeginArray); }
+void JsonRecordEndArray(JsonEventRecorder* self)    { JsonRecordTag(self, kJsonEventEndArray); }
+void JsonRecordNull(JsonEventRecorder* self)        { JsonRecordTag(self, kJsonEventNull); }
+
+void JsonRecordKey(JsonEventRecorder* self, const char* key, size_t length)
+{
+  JsonRecordText(self, kJsonEventKey, key, length);
+}
+
+void JsonRecordString(JsonEventRecorder* self, const char* value, size_t length)
+{
+  JsonRecordText(self, kJsonEventString, value, length);
+}
+
+void JsonRecordNumber(JsonEventRecorder* self, double value)
+{
+  JsonRecordTag(self, kJsonEventNumber);
+  BufferAppend(&self->m_Data, self->m_Heap, (const char*) &value, sizeof value);
+}
+
+void JsonRecordBoolean(JsonEventRecorder* self, bool value)
+{
+  JsonRecordTag(self, kJsonEventBoolean);
+  BufferAppendOne(&self->m_Data, self->m_Heap, char(value ? 1 : 0));
+}
+
+// What the innermost open container expects next.
+enum JsonReplayExpect
+{
+  kJsonReplayKey,
+  kJsonReplayMemberValue,
+  kJsonReplayElement
+};
+
+static bool JsonReplayError(char (&error_message)[1024], size_t offset, const char* message)
+{
+  snprintf(error_message, sizeof error_message, "offset %llu: %s", (unsigned long long) offset, message);
+  error_message[sizeof(error_message)-1] = '\0';
+  return false;
+}
+
+bool JsonEventReplay(
+    const char* data,
+    size_t size,
+    MemAllocHeap* heap,
+    void* user_data,
+    JsonEventCallback callback,
+    char (&error_message)[1024])
+{
+  Buffer<uint8_t> stack;
+  BufferInit(&stack);
+
+  const char* error = nullptr;
+  size_t      pos   = 0;
+  size_t      start = 0;
+  bool        done  = false;
+
+  while (!error && pos < size)
+  {
+    start = pos;
+
+    if (done)
+    {
+      error = "data after document";
       break;
+    }
 
-    case kJsonLexBeginArray:
-      result = JsonParseArray(json_state);
+    JsonEvent event;
+    event.m_Type    = JsonEventType(uint8_t(data[pos++]));
+    event.m_Depth   = int(stack.m_Size);
+    event.m_Offset  = start;
+    event.m_String  = nullptr;
+    event.m_Length  = 0;
+    event.m_Number  = 0.0;
+    event.m_Boolean = false;
+
+    uint8_t* top = stack.m_Size ? &stack[stack.m_Size - 1] : nullptr;
+
+    switch (event.m_Type)
+    {
+      case kJsonEventKey:
+        if (!top || kJsonReplayKey != *top)
+          error = "key outside of object";
+        break;
+      case kJsonEventEndObject:
+        if (!top || kJsonReplayKey != *top)
+          error = "unbalanced end of object";
+        break;
+      case kJsonEventEndArray:
+        if (!top || kJsonReplayElement != *top)
+          error = "unbalanced end of array";
+        break;
+      case kJsonEventBeginObject:
+      case kJsonEventBeginArray:
+      case kJsonEventString:
+      case kJsonEventNumber:
+      case kJsonEventBoolean:
+      case kJsonEventNull:
+        if (top && kJsonReplayKey == *top)
+          error = "value without key in object";
+        break;
+      default:
+        error = "unknown event";
+        break;
+    }
+
+    if (error)
       break;
 
-    case kJsonLexString:
+    switch (event.m_Type)
+    {
+      case kJsonEventKey:
+      case kJsonEventString:
+        {
+          size_t length = 0;
+          int    shift  = 0;
+          uint8_t byte;
+          do
+          {
+            if (pos >= size || shift > 56)
+            {
+              error = "truncated string";
+              break;
+            }
+            byte = uint8_t(data[pos++]);
+            length |= size_t(byte & 0x7f) << shift;
+            shift += 7;
+          } while (byte & 0x80);
+
+          if (!error && (length >= size - pos || '\0' != data[pos + length]))
+            error = "truncated string";
+
+          if (!error)
+          {
+            event.m_String = data + pos;
+            event.m_Length = length;
+            pos += length + 1;
+          }
+        }
+        break;
+
+      case kJsonEventNumber:
+        if (size - pos < sizeof event.m_Number)
+        {
+          error = "truncated number";
+          break;
+        }
+        memcpy(&event.m_Number, data + pos, sizeof event.m_Number);
+        pos += sizeof event.m_Number;
+        break;
+
+      case kJsonEventBoolean:
+        if (pos >= size)
+        {
+          error = "truncated boolean";
+          break;
+        }
+        event.m_Boolean = 0 != data[pos++];
+        break;
+
+      default:
+        break;
+    }
+
+    if (error)
+      break;
+
+    // Update the expectations of the enclosing container.
+    switch (event.m_Type)
+    {
+      case kJsonEventKey:
+        *top = kJsonReplayMemberValue;
+        break;
+      case kJsonEventEndObject:
+      case kJsonEventEndArray:
+        --stack.m_Size;
+        event.m_Depth = int(stack.m_Size);
+        break;
+      default:
+        if (top && kJsonReplayMemberValue == *top)
+          *top = kJsonReplayKey;
+        break;
+    }
+
+    if (kJsonEventBeginObject == event.m_Type)
+      BufferAppendOne(&stack, heap, uint8_t(kJsonReplayKey));
+    else if (kJsonEventBeginArray == event.m_Type)
+      BufferAppendOne(&stack, heap, uint8_t(kJsonReplayElement));
+
+    done = 0 == stack.m_Size && kJsonEventKey != event.m_Type;
+
+    if (!callback(user_data, event))
+      error = "stopped by event handler";
+  }
+
+  if (!error && !done)
+  {
+    start = pos;
+    error = "unexpected end of recording";
+  }
+
+  BufferDestroy(&stack, heap);
+
+  if (error)
+    return JsonReplayError(error_message, start, error);
+
+  error_message[0] = '\0';
+  return true;
+}
+
+void JsonBuilderInit(JsonBuilder* self, MemAllocHeap* heap, MemAllocLinear* allocator)
+{
+  // Setup statics. Harmless to do multiple times.
+  s_TrueValue.m_Type = JsonValue::kBoolean;
+  s_TrueValue.m_Boolean = true;
+  s_FalseValue.m_Type = JsonValue::kBoolean;
+  s_FalseValue.m_Boolean = false;
+
+  self->m_Heap      = heap;
+  self->m_Allocator = allocator;
+  BufferInit(&self->m_Frames);
+  BufferInit(&self->m_Values);
+  BufferInit(&self->m_Keys);
+}
+
+void JsonBuilderDestroy(JsonBuilder* self)
+{
+  BufferDestroy(&self->m_Keys, self->m_Heap);
+  BufferDestroy(&self->m_Values, self->m_Heap);
+  BufferDestroy(&self->m_Frames, self->m_Heap);
+}
+
+const JsonValue* JsonBuilderAdd(JsonBuilder* self, const JsonEvent& event)
+{
+  MemAllocHeap    *heap  = self->m_Heap;
+  MemAllocLinear  *alloc = self->m_Allocator;
+  const JsonValue *value = nullptr;
+
+  switch (event.m_Type)
+  {
+    case kJsonEventBeginObject:
+    case kJsonEventBeginArray:
+    {
+      JsonBuilder::Frame frame = { self->m_Values.m_Size, self->m_Keys.m_Size };
+      BufferAppendOne(&self->m_Frames, heap, frame);
+      return nullptr;
+    }
+
+    case kJsonEventKey:
+      BufferAppendOne(&self->m_Keys, heap, StrDupN(alloc, event.m_String, event.m_Length));
+      return nullptr;
+
+    case kJsonEventString:
     {
       JsonStringValue* sv = LinearAllocate<JsonStringValue>(alloc);
       sv->m_Type   = JsonValue::kString;
-      sv->m_String = l.m_String;
-      result       = sv;
-      JsonLexerSkip(lexer);
+      sv->m_String = StrDupN(alloc, event.m_String, event.m_Length);
+      value        = sv;
       break;
     }
 
-    case kJsonLexNumber:
+    case kJsonEventNumber:
     {
       JsonNumberValue* nv = LinearAllocate<JsonNumberValue>(alloc);
       nv->m_Type   = JsonValue::kNumber;
-      nv->m_Number = l.m_Number;
-      result       = nv;
-      JsonLexerSkip(lexer);
+      nv->m_Number = event.m_Number;
+      value        = nv;
       break;
     }
 
-    case kJsonLexBoolean:
-      result = l.m_Boolean ? &s_TrueValue : &s_FalseValue;
-      JsonLexerSkip(lexer);
+    case kJsonEventBoolean:
+      value = event.m_Boolean ? &s_TrueValue : &s_FalseValue;
       break;
 
-    case kJsonLexNull:
-      result = &s_NullValue;
-      JsonLexerSkip(lexer);
+    case kJsonEventNull:
+      value = &s_NullValue;
       break;
 
-    default:
-      result = JsonError(json_state, "invalid document");
+    case kJsonEventEndObject:
+    {
+      JsonBuilder::Frame frame = BufferPopOne(&self->m_Frames);
+
+      size_t            count  = self->m_Values.m_Size - frame.m_FirstValue;
+      const char      **names  = LinearAllocateArray<const char*>(alloc, count);
+      const JsonValue **values = LinearAllocateArray<const JsonValue*>(alloc, count);
+
+      memcpy(names, self->m_Keys.m_Storage + frame.m_FirstKey, count * sizeof names[0]);
+      memcpy(values, self->m_Values.m_Storage + frame.m_FirstValue, count * sizeof values[0]);
+
+      self->m_Keys.m_Size   = frame.m_FirstKey;
+      self->m_Values.m_Size = frame.m_FirstValue;
+
+      JsonObjectValue* result = LinearAllocate<JsonObjectValue>(alloc);
+      result->m_Type   = JsonValue::kObject;
+      result->m_Count  = count;
+      result->m_Names  = names;
+      result->m_Values = values;
+      value            = result;
       break;
+    }
+
+    case kJsonEventEndArray:
+    {
+      JsonBuilder::Frame frame = BufferPopOne(&self->m_Frames);
+
+      size_t            count  = self->m_Values.m_Size - frame.m_FirstValue;
+      const JsonValue **values = LinearAllocateArray<const JsonValue*>(alloc, count);
+
+      memcpy(values, self->m_Values.m_Storage + frame.m_FirstValue, count * sizeof values[0]);
+
+      self->m_Values.m_Size = frame.m_FirstValue;
+
+      JsonArrayValue* result = LinearAllocate<JsonArrayValue>(alloc);
+      result->m_Type   = JsonValue::kArray;
+      result->m_Count  = count;
+      result->m_Values = values;
+      value            = result;
+      break;
+    }
   }
 
-  return result;
+  if (0 == self->m_Frames.m_Size)
+    return value;
+
+  BufferAppendOne(&self->m_Values, heap, value);
+  return nullptr;
+}
+
+struct JsonDomState
+{
+  JsonBuilder      m_Builder;
+  const JsonValue* m_Root;
+};
+
+static bool JsonDomCallback(void* user_data, const JsonEvent& event)
+{
+  JsonDomState* state = static_cast<JsonDomState*>(user_data);
+  if (const JsonValue* value = JsonBuilderAdd(&state->m_Builder, event))
+    state->m_Root = value;
+  return true;
 }
 
 const JsonValue* JsonParse(
@@ -641,35 +1253,17 @@ const JsonValue* JsonParse(
     MemAllocLinear* scratch,
     char (&error_message)[1024])
 {
-  TimingScope timing_scope(nullptr, &g_Stats.m_JsonParseTimeCycles);
-
-  // Setup statics. Harmless to do multiple times.
-  s_TrueValue.m_Type = JsonValue::kBoolean;
-  s_TrueValue.m_Boolean = true;
-  s_FalseValue.m_Type = JsonValue::kBoolean;
-  s_FalseValue.m_Boolean = false;
+  MemAllocHeap* heap = scratch->m_BackingHeap;
 
-  JsonState json_state;
-  JsonStateInit(&json_state, allocator, scratch, buffer);
+  JsonDomState state;
+  JsonBuilderInit(&state.m_Builder, heap, allocator);
+  state.m_Root = nullptr;
 
-  const JsonValue* root = JsonParseValue(&json_state);
+  bool success = JsonSaxParse(buffer, strlen(buffer), heap, &state, JsonDomCallback, error_message);
 
-  if (root && !JsonLexerExpect(&json_state.m_Lexer, kJsonLexEof))
-  {
-    root = JsonError(&json_state, "data after document");
-  }
+  JsonBuilderDestroy(&state.m_Builder);
 
-  if (root)
-  {
-    error_message[0] = '\0';
-  }
-  else
-  {
-    strncpy(error_message, json_state.m_ErrorMessage, sizeof error_message);
-    error_message[sizeof(error_message)-1] = '\0';
-  }
-  
-  return root;
+  return success ? state.m_Root : nullptr;
 }
 
 }
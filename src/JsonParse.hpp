@@ -2,12 +2,14 @@
 #define JSONPARSE_HPP
 
 #include "Common.hpp"
+#include "Buffer.hpp"
 #include <string.h>
 
 namespace t2
 {
 
 struct MemAllocLinear;
+struct MemAllocHeap;
 
 struct JsonValue
 {
@@ -145,12 +147,147 @@ inline bool JsonValue::GetBoolean() const
   return b->m_Boolean;
 }
 
+// Parses a NUL-terminated document into a tree of values allocated from
+// `allocator`. Returns null and fills in `error_message` on failure.
 const JsonValue* JsonParse(
     char *buffer,
     MemAllocLinear* allocator,
     MemAllocLinear* scratch,
     char (&error_message)[1024]);
 
+// Streaming interface. The parser reports the document as a sequence of events
+// in document order, without building anything, so a consumer can keep only
+// the parts it needs.
+
+enum JsonEventType
+{
+  kJsonEventBeginObject,
+  kJsonEventEndObject,
+  kJsonEventBeginArray,
+  kJsonEventEndArray,
+  kJsonEventKey,
+  kJsonEventString,
+  kJsonEventNumber,
+  kJsonEventBoolean,
+  kJsonEventNull
+};
+
+struct JsonEvent
+{
+  JsonEventType m_Type;
+  // Number of containers enclosing the token; 0 for the document itself.
+  int           m_Depth;
+  // Byte offset of the token in the input. For kJsonEventEndObject and
+  // kJsonEventEndArray this is the offset of the closing bracket.
+  size_t        m_Offset;
+  // Keys and strings, unescaped and NUL-terminated. Only valid during the
+  // callback.
+  const char*   m_String;
+  size_t        m_Length;
+  double        m_Number;
+  bool          m_Boolean;
+};
+
+// Return false to stop parsing.
+typedef bool (*JsonEventCallback)(void* user_data, const JsonEvent& event);
+
+// Parses `size` bytes of `data`, which need not be terminated or writable.
+// Returns false and fills in `error_message` if the document is malformed or
+// the callback stopped the parse.
+bool JsonSaxParse(
+    const char* data,
+    size_t size,
+    MemAllocHeap* heap,
+    void* user_data,
+    JsonEventCallback callback,
+    char (&error_message)[1024]);
+
+namespace JsonLexMode
+{
+  enum Enum
+  {
+    kAuto   = 0,  // Pick the fastest code path supported by the CPU
+    kScalar = 1,  // Byte at a time reference implementation
+    kSse2   = 2,  // 16 bytes per compare, 64 byte blocks
+    kAvx2   = 3   // 32 bytes per compare, 64 byte blocks
+  };
+}
+
+// Same as JsonSaxParse using a specific lexer code path. All modes produce
+// identical events; this exists so tests and benchmarks can compare them.
+bool JsonSaxParseWithMode(
+    const char* data,
+    size_t size,
+    MemAllocHeap* heap,
+    void* user_data,
+    JsonEventCallback callback,
+    char (&error_message)[1024],
+    JsonLexMode::Enum mode);
+
+// Returns true if the code path for mode is compiled in and supported by the CPU.
+bool JsonLexModeSupported(JsonLexMode::Enum mode);
+
+// Events can also be recorded in a compact binary form and replayed later, for
+// producers that would otherwise format JSON text only to have it parsed again.
+// Strings are stored with their terminators so replayed events point straight
+// into the recording, and the end of an object or array takes a single byte,
+// as in JSON text. Offsets in replayed events are offsets in the recording.
+struct JsonEventRecorder
+{
+  MemAllocHeap*    m_Heap;
+  Buffer<char>     m_Data;
+};
+
+void JsonRecorderInit(JsonEventRecorder* self, MemAllocHeap* heap);
+
+void JsonRecorderDestroy(JsonEventRecorder* self);
+
+void JsonRecordBeginObject(JsonEventRecorder* self);
+void JsonRecordEndObject(JsonEventRecorder* self);
+void JsonRecordBeginArray(JsonEventRecorder* self);
+void JsonRecordEndArray(JsonEventRecorder* self);
+void JsonRecordKey(JsonEventRecorder* self, const char* key, size_t length);
+void JsonRecordString(JsonEventRecorder* self, const char* value, size_t length);
+void JsonRecordNumber(JsonEventRecorder* self, double value);
+void JsonRecordBoolean(JsonEventRecorder* self, bool value);
+void JsonRecordNull(JsonEventRecorder* self);
+
+// Replays `size` bytes of a recording, which must hold a single value. Has the
+// same signature as JsonSaxParse and fails the same way, so either can feed a
+// consumer; recordings are checked to be well formed as they are replayed.
+bool JsonEventReplay(
+    const char* data,
+    size_t size,
+    MemAllocHeap* heap,
+    void* user_data,
+    JsonEventCallback callback,
+    char (&error_message)[1024]);
+
+// Builds values from a well-formed event sequence, for consumers that want a
+// tree for part of a streamed document. Values and strings are allocated from
+// `allocator`; the builder can be reused after a value is complete.
+struct JsonBuilder
+{
+  struct Frame
+  {
+    size_t m_FirstValue;
+    size_t m_FirstKey;
+  };
+
+  MemAllocHeap*             m_Heap;
+  MemAllocLinear*           m_Allocator;
+  Buffer<Frame>             m_Frames;
+  Buffer<const JsonValue*>  m_Values;
+  Buffer<const char*>       m_Keys;
+};
+
+void JsonBuilderInit(JsonBuilder* self, MemAllocHeap* heap, MemAllocLinear* allocator);
+
+void JsonBuilderDestroy(JsonBuilder* self);
+
+// Returns the value completed by `event`, or null if it is still being built.
+const JsonValue* JsonBuilderAdd(JsonBuilder* self, const JsonEvent& event);
+
 }
 
 
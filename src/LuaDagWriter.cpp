@@ -0,0 +1,304 @@
+#include "MemAllocHeap.hpp"
+#include "MemoryMappedFile.hpp"
+#include "JsonParse.hpp"
+#include "DagGenerator.hpp"
+#include "HelperPool.hpp"
+#include "PathUtil.hpp"
+#include <stdio.h>
+#include <string.h>
+
+#if defined(TUNDRA_LINUX)
+#include <malloc.h>
+#endif
+
+extern "C" {
+#include "lua.h"
+#include "lauxlib.h"
+}
+
+namespace t2
+{
+
+// Same interface as the JSON writer, but the events are recorded and compiled
+// to a binary DAG, without formatting or parsing any JSON text. The recording
+// is written out to a file next to the DAG as it grows, so it doesn't add to
+// the memory the Lua state needs, and compiled from there once the Lua state
+// is gone.
+struct LuaDagWriter
+{
+  enum
+  {
+    kFlushSize = 256 * 1024
+  };
+
+  bool              m_Open;
+  bool              m_Failed;
+  FILE*             m_File;
+  MemAllocHeap      m_Heap;
+  JsonEventRecorder m_Recorder;
+  char              m_Filename[kMaxPathLength];
+  char              m_EventsFilename[kMaxPathLength];
+};
+
+// The closed writer whose recording is waiting to be compiled.
+struct LuaDagFinished
+{
+  bool m_Pending;
+  char m_Filename[kMaxPathLength];
+  char m_EventsFilename[kMaxPathLength];
+};
+
+static LuaDagFinished s_Finished;
+
+static int LuaDagWriterNew(lua_State* L)
+{
+  size_t len;
+  const char* filename = luaL_checklstring(L, 1, &len);
+
+  if (len + sizeof ".events" > kMaxPathLength)
+    return luaL_error(L, "DAG filename too long: %s", filename);
+
+  LuaDagWriter* self = (LuaDagWriter*) lua_newuserdata(L, sizeof(LuaDagWriter));
+  self->m_Open = false;
+
+  luaL_getmetatable(L, "tundra_dagw");
+  lua_setmetatable(L, -2);
+
+  memcpy(self->m_Filename, filename, len + 1);
+  snprintf(self->m_EventsFilename, sizeof self->m_EventsFilename, "%s.events", filename);
+
+  self->m_File = fopen(self->m_EventsFilename, "wb");
+  if (!self->m_File)
+    return luaL_error(L, "couldn't open %s for writing", self->m_EventsFilename);
+
+  HeapInit(&self->m_Heap);
+  JsonRecorderInit(&self->m_Recorder, &self->m_Heap);
+  self->m_Failed = false;
+  self->m_Open = true;
+  return 1;
+}
+
+static LuaDagWriter* CheckOpenWriter(lua_State* L)
+{
+  LuaDagWriter* self = (LuaDagWriter*) luaL_checkudata(L, 1, "tundra_dagw");
+  if (!self->m_Open)
+    luaL_error(L, "DAG writer is closed");
+  return self;
+}
+
+// Writes out what has been recorded so far once there is enough of it.
+static void FlushEvents(LuaDagWriter* self, size_t min_size)
+{
+  Buffer<char>* data = &self->m_Recorder.m_Data;
+  if (data->m_Size < min_size)
+    return;
+
+  if (data->m_Size != fwrite(data->m_Storage, 1, data->m_Size, self->m_File))
+    self->m_Failed = true;
+
+  BufferClear(data);
+}
+
+static void LuaDagWriterDestroy(LuaDagWriter* self)
+{
+  if (self->m_Open)
+  {
+    fclose(self->m_File);
+    JsonRecorderDestroy(&self->m_Recorder);
+    HeapDestroy(&self->m_Heap);
+    self->m_Open = false;
+  }
+}
+
+static int LuaDagGc(lua_State* L)
+{
+  LuaDagWriter* self = (LuaDagWriter*) luaL_checkudata(L, 1, "tundra_dagw");
+  if (self->m_Open)
+  {
+    LuaDagWriterDestroy(self);
+    remove(self->m_EventsFilename);
+  }
+  return 0;
+}
+
+static int LuaDagClose(lua_State* L)
+{
+  LuaDagWriter* self = CheckOpenWriter(L);
+
+  // Compiling waits until the Lua state is gone, so the two don't add up to
+  // the peak memory use of the frontend.
+  if (s_Finished.m_Pending)
+    return luaL_error(L, "a DAG has already been written");
+
+  FlushEvents(self, 0);
+  bool failed = self->m_Failed || 0 != fflush(self->m_File);
+
+  LuaDagWriterDestroy(self);
+
+  if (failed)
+  {
+    remove(self->m_EventsFilename);
+    return luaL_error(L, "couldn't write %s", self->m_EventsFilename);
+  }
+
+  s_Finished.m_Pending = true;
+  strcpy(s_Finished.m_Filename, self->m_Filename);
+  strcpy(s_Finished.m_EventsFilename, self->m_EventsFilename);
+  return 0;
+}
+
+// Records the member name, if one is given at `name_index`.
+static void RecordName(lua_State* L, LuaDagWriter* self, int name_index)
+{
+  if (lua_gettop(L) >= name_index)
+  {
+    size_t len;
+    const char* name = luaL_checklstring(L, name_index, &len);
+    JsonRecordKey(&self->m_Recorder, name, len);
+  }
+}
+
+static int LuaDagWriteNumber(lua_State* L)
+{
+  LuaDagWriter* self = CheckOpenWriter(L);
+  lua_Number num = luaL_checknumber(L, 2);
+  RecordName(L, self, 3);
+  JsonRecordNumber(&self->m_Recorder, num);
+  FlushEvents(self, LuaDagWriter::kFlushSize);
+  return 0;
+}
+
+static int LuaDagWriteBool(lua_State* L)
+{
+  LuaDagWriter* self = CheckOpenWriter(L);
+  int value = lua_toboolean(L, 2);
+  RecordName(L, self, 3);
+  JsonRecordBoolean(&self->m_Recorder, value != 0);
+  FlushEvents(self, LuaDagWriter::kFlushSize);
+  return 0;
+}
+
+static int LuaDagWriteString(lua_State* L)
+{
+  LuaDagWriter* self = CheckOpenWriter(L);
+  size_t value_len;
+  const char* value = luaL_checklstring(L, 2, &value_len);
+  RecordName(L, self, 3);
+  JsonRecordString(&self->m_Recorder, value, value_len);
+  FlushEvents(self, LuaDagWriter::kFlushSize);
+  return 0;
+}
+
+static int LuaDagBeginObject(lua_State* L)
+{
+  LuaDagWriter* self = CheckOpenWriter(L);
+  RecordName(L, self, 2);
+  JsonRecordBeginObject(&self->m_Recorder);
+  return 0;
+}
+
+static int LuaDagEndObject(lua_State* L)
+{
+  LuaDagWriter* self = CheckOpenWriter(L);
+  JsonRecordEndObject(&self->m_Recorder);
+  FlushEvents(self, LuaDagWriter::kFlushSize);
+  return 0;
+}
+
+static int LuaDagBeginArray(lua_State* L)
+{
+  LuaDagWriter* self = CheckOpenWriter(L);
+  RecordName(L, self, 2);
+  JsonRecordBeginArray(&self->m_Recorder);
+  return 0;
+}
+
+static int LuaDagEndArray(lua_State* L)
+{
+  LuaDagWriter* self = CheckOpenWriter(L);
+  JsonRecordEndArray(&self->m_Recorder);
+  FlushEvents(self, LuaDagWriter::kFlushSize);
+  return 0;
+}
+
+void LuaDagNativeOpen(lua_State* L)
+{
+  static luaL_Reg functions[] =
+  {
+    { "new",                        LuaDagWriterNew },
+    { nullptr,                      nullptr }
+  };
+
+  static luaL_Reg meta_table[] =
+  {
+    { "write_number",               LuaDagWriteNumber },
+    { "write_string",               LuaDagWriteString },
+    { "write_bool",                 LuaDagWriteBool },
+    { "begin_object",               LuaDagBeginObject },
+    { "end_object",                 LuaDagEndObject },
+    { "begin_array",                LuaDagBeginArray },
+    { "end_array",                  LuaDagEndArray },
+    { "close",                      LuaDagClose },
+    { "__gc",                       LuaDagGc },
+    { nullptr,                      nullptr }
+  };
+
+  luaL_register(L, "tundra.native.dag", functions);
+  lua_pop(L, 1);
+
+  luaL_newmetatable(L, "tundra_dagw");
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");
+  luaL_register(L, nullptr, meta_table);
+  lua_pop(L, 1);
+}
+
+bool LuaDagCompileFinished()
+{
+  if (!s_Finished.m_Pending)
+    return true;
+
+  s_Finished.m_Pending = false;
+
+#if defined(TUNDRA_LINUX)
+  // Hand the freed Lua heap back, or it stays resident under the compiler's
+  // allocations and the peak is no better than keeping both around.
+  malloc_trim(0);
+#endif
+
+  // Errors are reported through the log, which is otherwise quiet here.
+  SetLogFlags(GetLogFlags() | kError | kWarning);
+
+  MemoryMappedFile events;
+  MmapFileInit(&events);
+  MmapFileMap(&events, s_Finished.m_EventsFilename);
+
+  bool success = false;
+
+  if (MmapFileValid(&events))
+  {
+    HelperPool helpers;
+    HelperPoolInit(&helpers, GetCpuCount());
+
+    success = CompileDagFromEvents((const char*) events.m_Address, events.m_Size, s_Finished.m_Filename, &helpers);
+
+    HelperPoolDestroy(&helpers);
+  }
+  else
+  {
+    Log(kError, "couldn't map %s", s_Finished.m_EventsFilename);
+  }
+
+  MmapFileDestroy(&events);
+  remove(s_Finished.m_EventsFilename);
+
+  if (!success)
+  {
+    Log(kError, "couldn't compile DAG to %s", s_Finished.m_Filename);
+    remove(s_Finished.m_Filename);
+  }
+
+  return success;
+}
+
+}
@@ -509,6 +509,7 @@ static const luaL_Reg s_LuaFunctions[] = {
 
 void LuaEnvNativeOpen(lua_State* L);
 void LuaJsonNativeOpen(lua_State* L);
+void LuaDagNativeOpen(lua_State* L);
 void LuaPathNativeOpen(lua_State* L);
 
 static bool s_IsProfiling;
@@ -543,6 +544,9 @@ lua_State* CreateLuaState(MemAllocHeap* lua_heap, bool profile)
   // Expose JSON writer module
   LuaJsonNativeOpen(L);
 
+  // Expose DAG writer module
+  LuaDagNativeOpen(L);
+
   luaL_register(L, "tundra.native", s_LuaFunctions);
   lua_pushstring(L, TUNDRA_PLATFORM_STRING);
   lua_setfield(L, -2, "host_platform");
@@ -14,6 +14,10 @@ void DestroyLuaState(lua_State* L);
 
 bool RunBuildScript(lua_State *L, const char** args, int argc_count);
 
+// Compiles the DAG recorded by a closed tundra.native.dag writer, if any.
+// Called once the Lua state has been destroyed.
+bool LuaDagCompileFinished();
+
 }
 
 #endif
@@ -108,6 +108,9 @@ int main(int argc, char** argv)
 
   DestroyLuaState(L);
 
+  if (success)
+    success = LuaDagCompileFinished();
+
   HeapDestroy(&heap);
 
 	return success ? 0 : 1;
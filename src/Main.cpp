@@ -69,6 +69,8 @@ static const struct OptionTemplate
     "Enable debug messages" },
   { 'S', "debug-signing", OptionType::kBool, offsetof(t2::DriverOptions, m_DebugSigning),
     "Generate an extensive log of signature generation" },
+  { '\0', "dag-json", OptionType::kBool, offsetof(t2::DriverOptions, m_DagJson),
+    "Have the frontend write the DAG as JSON (.json next to the DAG file) and compile it from that (for debugging)" },
 { 'r', "throttle", OptionType::kBool, offsetof(t2::DriverOptions, m_ThrottleOnHumanActivity),
     "Throttles down amount of simultaneous jobs when mouse or keyboard activity has been detected." },
   { '\0', "throttle-time", OptionType::kInt, offsetof(t2::DriverOptions, m_ThrottleInactivityPeriod),
@@ -535,12 +537,20 @@ leave:
     printf("  hits (frozen):   %10u\n", g_Stats.m_OldScanCacheHits);
     printf("  misses:          %10u\n", g_Stats.m_ScanCacheMisses);
     printf("  inserts:         %10u\n", g_Stats.m_ScanCacheInserts);
+    printf("  dupes avoided:   %10u\n", g_Stats.m_ScanDuplicatesAvoided);
     printf("  save time:       %10.2f ms\n", TimerToSeconds(g_Stats.m_ScanCacheSaveTime) * 1000.0);
+    printf("  saved early:     %10u\n", g_Stats.m_ScanCacheSavedEarly);
     printf("  entries dropped: %10u\n", g_Stats.m_ScanCacheEntriesDropped);
+    printf("  files scanned:   %10u\n", g_Stats.m_ScanFileCount);
+    printf("  bytes scanned:   %10.2f MB\n", double(g_Stats.m_ScanBytes) / (1024.0 * 1024.0));
+    printf("  scan time:       %10.2f ms\n", TimerToSeconds(g_Stats.m_ScanTimeCycles) * 1000.0);
     printf("file signing:\n");
     printf("  cache hits:      %10u\n", g_Stats.m_DigestCacheHits);
+    printf("  dupes avoided:   %10u\n", g_Stats.m_DigestDuplicatesAvoided);
+    printf("  prefetched:      %10u\n", g_Stats.m_DigestsPrefetched);
     printf("  cache get time:  %10.2f ms\n", TimerToSeconds(g_Stats.m_DigestCacheGetTimeCycles) * 1000.0);
     printf("  cache save time: %10.2f ms\n", TimerToSeconds(g_Stats.m_DigestCacheSaveTimeCycles) * 1000.0);
+    printf("  saved early:     %10u\n", g_Stats.m_DigestCacheSavedEarly);
     printf("  digests:         %10u\n", g_Stats.m_FileDigestCount);
     printf("  digest time:     %10.2f ms\n", TimerToSeconds(g_Stats.m_FileDigestTimeCycles) * 1000.0);
     printf("stat cache:\n");
@@ -552,6 +562,14 @@ leave:
     printf("  new records:     %10u\n", g_Stats.m_StateSaveNew);
     printf("  dropped records: %10u\n", g_Stats.m_StateSaveDropped);
     printf("  state save time: %10.2f ms\n", TimerToSeconds(g_Stats.m_StateSaveTimeCycles) * 1000.0);
+    printf("  state save size: %10.2f MB\n", double(g_Stats.m_StateSaveBytes) / (1024.0 * 1024.0));
+    printf("  state load time: %10.2f ms\n", TimerToSeconds(g_Stats.m_StateLoadTimeCycles) * 1000.0);
+    printf("  state load size: %10.2f MB\n", double(g_Stats.m_StateLoadBytes) / (1024.0 * 1024.0));
+    printf("  implicit files:  %10u\n", g_Stats.m_StateImplicitFiles);
+    printf("  implicit refs:   %10u\n", g_Stats.m_StateImplicitRefs);
+    printf("  journal records: %10u\n", g_Stats.m_StateJournalRecords);
+    printf("  journal time:    %10.2f ms\n", TimerToSeconds(g_Stats.m_StateJournalTimeCycles) * 1000.0);
+    printf("  journal replays: %10u\n", g_Stats.m_StateJournalReplayed);
     printf("  exec() count:    %10u\n", g_Stats.m_ExecCount);
     printf("  exec() time:     %10.2f s\n", TimerToSeconds(g_Stats.m_ExecTimeCycles));
     printf("low-level syscalls:\n");
@@ -55,7 +55,7 @@ void MmapFileMap(MemoryMappedFile* self, const char *fn)
   self->m_Size       = stbuf.st_size;
   self->m_SysData[0] = fd;
 
-  if (self->m_Address)
+  if (MAP_FAILED != self->m_Address)
     return;
 
 error:
@@ -80,6 +80,12 @@ void MmapFileUnmap(MemoryMappedFile* self)
 
   Clear(self);
 }
+
+void MmapFileAdviseSequential(MemoryMappedFile* self)
+{
+  if (self->m_Address)
+    madvise(self->m_Address, self->m_Size, MADV_SEQUENTIAL);
+}
 #endif
 
 #if defined(TUNDRA_WIN32)
@@ -154,6 +160,12 @@ void MmapFileUnmap(MemoryMappedFile* self)
 
   Clear(self);
 }
+
+void MmapFileAdviseSequential(MemoryMappedFile* self)
+{
+  // The file is opened without FILE_FLAG_SEQUENTIAL_SCAN, and there is no
+  // equivalent hint for an existing view.
+}
 #endif
 
 }
@@ -21,6 +21,10 @@ void MmapFileMap(MemoryMappedFile *file, const char* fn);
 
 void MmapFileUnmap(MemoryMappedFile *file);
 
+// Hint that the mapping will be read front to back once, so the OS can read
+// ahead aggressively and drop pages behind the reader.
+void MmapFileAdviseSequential(MemoryMappedFile *file);
+
 inline bool MmapFileValid(MemoryMappedFile *file)
 {
   return file->m_Address != nullptr;
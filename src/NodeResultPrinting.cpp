@@ -271,10 +271,11 @@ static void PrintNodeResult(const NodeResultPrintData* data, BuildQueue* queue)
     if (data->verbose)
     {
         PrintDiagnostic("CommandLine", data->cmd_line);
-        for (int i=0; i!= data->node_data->m_FrontendResponseFiles.GetCount(); i++)
+        DagPathList rsp_files(queue->m_Config.m_Paths, data->node_data->m_FrontendResponseFiles);
+        for (int i=0; i!= rsp_files.GetCount(); i++)
         {
             char titleBuffer[1024];
-            const char* file = data->node_data->m_FrontendResponseFiles[i].m_Filename;
+            const char* file = rsp_files[i].m_Filename;
             snprintf(titleBuffer, sizeof titleBuffer, "Contents of %s", file);
 
             char* content_buffer;
@@ -322,9 +323,10 @@ static void PrintNodeResult(const NodeResultPrintData* data, BuildQueue* queue)
           else if (data->validation_result == ValidationResult::UnwrittenOutputFileFail)
           {
             PrintDiagnosticPrefix("Failed because this command failed to write the following output files:", RED);
-            for (int i = 0; i < data->node_data->m_OutputFiles.GetCount(); i++)
+            DagPathList outputs(queue->m_Config.m_Paths, data->node_data->m_OutputFiles);
+            for (int i = 0; i < outputs.GetCount(); i++)
               if (data->untouched_outputs[i])
-                printf("%s\n", (const char*)data->node_data->m_OutputFiles[i].m_Filename);
+                printf("%s\n", (const char*)outputs[i].m_Filename);
           }
         }
         if (data->was_signalled)
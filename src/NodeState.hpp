@@ -43,6 +43,8 @@ struct NodeState
   int32_t                   m_FailedDependencyCount;
   int32_t                   m_BuildResult;
 
+  // Implicit inputs read from the node's dependency file after its action
+  // ran. A single heap block owned by the node state; null until then.
   int32_t                   m_ImplicitDepCount;
   const char**              m_ImplicitDeps;
 
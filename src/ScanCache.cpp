@@ -10,6 +10,7 @@
 #include "SortedArrayUtil.hpp"
 #include "HashTable.hpp"
 #include "Profiler.hpp"
+#include "HelperPool.hpp"
 
 #include <algorithm>
 #include <time.h>
@@ -53,8 +54,12 @@ void ScanCacheInit(ScanCache* self, MemAllocHeap* heap, MemAllocLinear* allocato
   self->m_TableSize        = 0;
   self->m_Table            = nullptr;
   self->m_FrozenAccess     = nullptr;
+  self->m_Generation       = 0;
+  self->m_InFlight         = nullptr;
 
   ReadWriteLockInit(&self->m_Lock);
+  MutexInit(&self->m_InFlightLock);
+  CondInit(&self->m_InFlightDone);
 }
 
 void ScanCacheDestroy(ScanCache* self)
@@ -63,6 +68,8 @@ void ScanCacheDestroy(ScanCache* self)
     return;
   HeapFree(self->m_Heap, self->m_FrozenAccess);
   HeapFree(self->m_Heap, self->m_Table);
+  CondDestroy(&self->m_InFlightDone);
+  MutexDestroy(&self->m_InFlightLock);
   ReadWriteLockDestroy(&self->m_Lock);
 }
 
@@ -95,7 +102,7 @@ static ScanCache::Record* LookupDynamic(ScanCache* self, const HashDigest& key)
   {
 #if ENABLED(USE_SHA1_HASH)
     const uint32_t hash = key.m_Words.m_C;
-#elif ENABLED(USE_FAST_HASH)
+#else
     const uint32_t hash = key.m_Words32[0];
 #endif
     uint32_t index = hash & (table_size - 1);
@@ -115,7 +122,32 @@ static ScanCache::Record* LookupDynamic(ScanCache* self, const HashDigest& key)
   return nullptr;
 }
 
-bool ScanCacheLookup(ScanCache* self, const HashDigest& key, uint64_t timestamp, ScanCacheLookupResult* result_out, MemAllocLinear* scratch)
+static bool LookupDynamicResult(ScanCache* self, const HashDigest& key, uint64_t timestamp, ScanCacheLookupResult* result_out)
+{
+  bool success = false;
+
+  result_out->m_IncludedFileCount   = 0;
+  result_out->m_IncludedFiles       = nullptr;
+  result_out->m_FrozenIncludedFiles = nullptr;
+
+  ReadWriteLockRead(&self->m_Lock);
+
+  if (ScanCache::Record* record = LookupDynamic(self, key))
+  {
+    if (record->m_FileTimestamp == timestamp)
+    {
+      result_out->m_IncludedFileCount = record->m_IncludeCount;
+      result_out->m_IncludedFiles     = record->m_Includes;
+      success                         = true;
+    }
+  }
+
+  ReadWriteUnlockRead(&self->m_Lock);
+
+  return success;
+}
+
+bool ScanCacheLookup(ScanCache* self, const HashDigest& key, uint64_t timestamp, ScanCacheLookupResult* result_out)
 {
   bool success = false;
 
@@ -126,33 +158,27 @@ bool ScanCacheLookup(ScanCache* self, const HashDigest& key, uint64_t timestamp,
 
   if (scan_data)
   {
-    const int32_t count = scan_data->m_EntryCount;
+    int index = ScanDataFind(scan_data, key);
 
-    if (const HashDigest* ptr = BinarySearch(scan_data->m_Keys.Get(), count, key))
+    if (index >= 0)
     {
-      int                   index      = int(ptr - scan_data->m_Keys.Get());
-      const ScanCacheEntry *entry      = scan_data->m_Data.Get() + index;
+      const ScanCacheEntry *entry = scan_data->m_Data.Get() + index;
 
       if (entry->m_FileTimestamp == timestamp)
       {
-        int                   file_count = entry->m_IncludedFiles.GetCount();
-
-        FileAndHash *output = LinearAllocateArray<FileAndHash>(scratch, file_count);
-
-        for (int i = 0; i < file_count; ++i)
-        {
-          output[i].m_Filename = entry->m_IncludedFiles[i].m_Filename;
-          output[i].m_FilenameHash = entry->m_IncludedFiles[i].m_FilenameHash;
-        }
-
-        result_out->m_IncludedFileCount = file_count;
-        result_out->m_IncludedFiles     = output;
-        success                         = true;
+        result_out->m_IncludedFileCount   = entry->m_IncludedFiles.GetCount();
+        result_out->m_IncludedFiles       = nullptr;
+        result_out->m_FrozenIncludedFiles = entry->m_IncludedFiles.GetArray();
+        success                           = true;
 
         // Flag this frozen record as having being accesses, so we don't throw it
         // away due to timing out. This is technically a race, but we trust CPUs
         // to sort out the cache line sharing via their cache coherency model.
-        self->m_FrozenAccess[index]     = 1;
+        if (!self->m_FrozenAccess[index])
+        {
+          self->m_FrozenAccess[index]   = 1;
+          AtomicIncrement(&self->m_Generation);
+        }
 
         AtomicIncrement(&g_Stats.m_OldScanCacheHits);
       }
@@ -162,22 +188,7 @@ bool ScanCacheLookup(ScanCache* self, const HashDigest& key, uint64_t timestamp,
   if (!success)
   {
     // Consult dynamic state for this session.
-    result_out->m_IncludedFileCount = 0;
-    result_out->m_IncludedFiles     = nullptr;
-
-    ReadWriteLockRead(&self->m_Lock);
-
-    if (ScanCache::Record* record = LookupDynamic(self, key))
-    {
-      if (record->m_FileTimestamp == timestamp)
-      {
-        result_out->m_IncludedFileCount = record->m_IncludeCount;
-        result_out->m_IncludedFiles     = record->m_Includes;
-        success                         = true;
-      }
-    }
-
-    ReadWriteUnlockRead(&self->m_Lock);
+    success = LookupDynamicResult(self, key, timestamp, result_out);
 
     if (success)
     {
@@ -222,7 +233,7 @@ static void ScanCachePrepareInsert(ScanCache* self)
       ScanCache::Record *next  = r->m_Next;
 #if ENABLED(USE_SHA1_HASH)
       uint32_t           hash  = r->m_Key.m_Words.m_C;
-#elif ENABLED(USE_FAST_HASH)
+#else
       uint32_t           hash  = r->m_Key.m_Words32[0];
 #endif
       uint32_t           index = hash &(new_size - 1);
@@ -262,7 +273,7 @@ void ScanCacheInsert(
     uint32_t table_size = self->m_TableSize;
 #if ENABLED(USE_SHA1_HASH)
     uint32_t hash       = key.m_Words.m_C;
-#elif ENABLED(USE_FAST_HASH)
+#else
     uint32_t hash       = key.m_Words32[0];
 #endif
     uint32_t index      = hash &(table_size - 1);
@@ -292,11 +303,59 @@ void ScanCacheInsert(
       self->m_Table[index] = record;
       self->m_RecordCount++;
     }
+
+    AtomicIncrement(&self->m_Generation);
   }
 
   ReadWriteUnlockWrite(&self->m_Lock);
 }
 
+bool ScanCacheLookupOrBegin(ScanCache* self, const HashDigest& key, uint64_t timestamp, ScanCacheLookupResult* result_out, ScanInFlight* claim)
+{
+  MutexLock(&self->m_InFlightLock);
+
+  for (;;)
+  {
+    // The frozen data can't have changed since the caller looked, only the
+    // dynamic table can have gained the record.
+    if (LookupDynamicResult(self, key, timestamp, result_out))
+    {
+      MutexUnlock(&self->m_InFlightLock);
+      AtomicIncrement(&g_Stats.m_ScanDuplicatesAvoided);
+      return true;
+    }
+
+    ScanInFlight* f = self->m_InFlight;
+    while (f && f->m_Key != key)
+      f = f->m_Next;
+
+    if (!f)
+      break;
+
+    CondWait(&self->m_InFlightDone, &self->m_InFlightLock);
+  }
+
+  claim->m_Key     = key;
+  claim->m_Next    = self->m_InFlight;
+  self->m_InFlight = claim;
+
+  MutexUnlock(&self->m_InFlightLock);
+  return false;
+}
+
+void ScanCacheEnd(ScanCache* self, ScanInFlight* claim)
+{
+  MutexLock(&self->m_InFlightLock);
+
+  ScanInFlight** link = &self->m_InFlight;
+  while (*link != claim)
+    link = &(*link)->m_Next;
+  *link = claim->m_Next;
+
+  CondBroadcast(&self->m_InFlightDone);
+  MutexUnlock(&self->m_InFlightLock);
+}
+
 bool ScanCacheDirty(ScanCache* self)
 {
   bool result;
@@ -310,6 +369,19 @@ bool ScanCacheDirty(ScanCache* self)
   return result;
 }
 
+uint32_t ScanCacheGeneration(ScanCache* self)
+{
+  uint32_t result;
+
+  ReadWriteLockRead(&self->m_Lock);
+
+  result = self->m_Generation;
+
+  ReadWriteUnlockRead(&self->m_Lock);
+
+  return result;
+}
+
 static bool SortRecordsByHash(const ScanCache::Record* l, const ScanCache::Record* r)
 {
   return l->m_Key < r->m_Key;
@@ -324,14 +396,17 @@ struct ScanCacheWriter
   BinarySegment *m_TimestampSeg;
   BinarySegment *m_ArraySeg;
   BinarySegment *m_StringSeg;
+  BinarySegment *m_BucketSeg;
   BinaryLocator  m_DigestPtr;
   BinaryLocator  m_EntryPtr;
   BinaryLocator  m_TimestampPtr;
+  BinaryLocator  m_BucketPtr;
   uint32_t       m_RecordsOut;
-
+  uint32_t       m_BucketBits;
+  uint32_t       m_BucketsOut;
 };
 
-static void ScanCacheWriterInit(ScanCacheWriter* self, MemAllocHeap* heap)
+static void ScanCacheWriterInit(ScanCacheWriter* self, MemAllocHeap* heap, uint32_t max_record_count)
 {
   BinaryWriterInit(&self->m_Writer, heap);
 
@@ -341,12 +416,31 @@ static void ScanCacheWriterInit(ScanCacheWriter* self, MemAllocHeap* heap)
   self->m_TimestampSeg = BinaryWriterAddSegment(&self->m_Writer);
   self->m_ArraySeg     = BinaryWriterAddSegment(&self->m_Writer);
   self->m_StringSeg    = BinaryWriterAddSegment(&self->m_Writer);
+  self->m_BucketSeg    = BinaryWriterAddSegment(&self->m_Writer);
 
   self->m_DigestPtr    = BinarySegmentPosition(self->m_DigestSeg);
   self->m_EntryPtr     = BinarySegmentPosition(self->m_DataSeg);
   self->m_TimestampPtr = BinarySegmentPosition(self->m_TimestampSeg);
+  self->m_BucketPtr    = BinarySegmentPosition(self->m_BucketSeg);
 
   self->m_RecordsOut   = 0;
+  self->m_BucketsOut   = 0;
+
+  // Aim for about one record per bucket.
+  self->m_BucketBits   = 1;
+  while (self->m_BucketBits < 24 && (1u << self->m_BucketBits) < max_record_count)
+    self->m_BucketBits++;
+}
+
+// Writes bucket start indices up to and including the given bucket. Records
+// must arrive in key order.
+static void ScanCacheWriterStartBucket(ScanCacheWriter* self, uint32_t bucket)
+{
+  while (self->m_BucketsOut <= bucket)
+  {
+    BinarySegmentWriteUint32(self->m_BucketSeg, self->m_RecordsOut);
+    self->m_BucketsOut++;
+  }
 }
 
 static void ScanCacheWriterDestroy(ScanCacheWriter* self)
@@ -356,35 +450,125 @@ static void ScanCacheWriterDestroy(ScanCacheWriter* self)
 
 static bool ScanCacheWriterFlush(ScanCacheWriter* self, const char* filename)
 {
+  // Close off the remaining buckets, plus the end marker of the last one.
+  const uint32_t bucket_count = 1u << self->m_BucketBits;
+  ScanCacheWriterStartBucket(self, bucket_count);
+
   BinarySegmentWriteUint32(self->m_MainSeg, ScanData::MagicNumber);
   BinarySegmentWriteUint32(self->m_MainSeg, self->m_RecordsOut);
   BinarySegmentWritePointer(self->m_MainSeg, self->m_DigestPtr);
   BinarySegmentWritePointer(self->m_MainSeg, self->m_EntryPtr);
   BinarySegmentWritePointer(self->m_MainSeg, self->m_TimestampPtr);
+  BinarySegmentWriteUint32(self->m_MainSeg, self->m_BucketBits);
+  BinarySegmentWriteInt32(self->m_MainSeg, int(bucket_count + 1));
+  BinarySegmentWritePointer(self->m_MainSeg, self->m_BucketPtr);
   BinarySegmentWriteUint32(self->m_MainSeg, ScanData::MagicNumber);
   return BinaryWriterFlush(&self->m_Writer, filename);
 }
 
-static void WriteUniqueStringPointer(HashTable<BinaryLocator, kFlagPathStrings>* atoms, BinarySegment* out_segment, BinarySegment* string_segment, uint32_t hash, const char* filename)
+// Records are written in ranges of keys, on the helper pool. Each chunk has its
+// own segments and notes the strings its includes point to and the bucket of
+// each record, so the shared string pool and the bucket index can be filled
+// in as the chunks are joined.
+struct ScanCacheStringRef
 {
-  if (const BinaryLocator* l = HashTableLookup(atoms, hash, filename))
+  uint32_t m_Pointer;           // Deferred pointer in the chunk's array segment
+  uint32_t m_String;            // Index into the chunk's strings
+};
+
+struct ScanCacheSaveChunk
+{
+  size_t                                m_DynamicBegin;
+  size_t                                m_DynamicEnd;
+  size_t                                m_FrozenBegin;
+  size_t                                m_FrozenEnd;
+  BinarySegment*                        m_DigestSeg;
+  BinarySegment*                        m_DataSeg;
+  BinarySegment*                        m_TimestampSeg;
+  BinarySegment*                        m_ArraySeg;
+  HashTable<uint32_t, kFlagPathStrings> m_StringIndex;
+  Buffer<const char*>                   m_Strings;
+  Buffer<uint32_t>                      m_StringHashes;
+  Buffer<ScanCacheStringRef>            m_StringRefs;
+  Buffer<uint32_t>                      m_Buckets;
+};
+
+struct ScanCacheSaver
+{
+  enum
   {
-    BinarySegmentWritePointer(out_segment, *l);
-    return;
+    kMinChunkSize    = 1024,
+    kChunksPerThread = 4
+  };
+
+  MemAllocHeap*             m_Heap;
+  ScanCache::Record* const* m_DynamicRecords;
+  const HashDigest*         m_FrozenDigests;
+  const ScanCacheEntry*     m_FrozenEntries;
+  const uint64_t*           m_FrozenTimes;
+  const uint8_t*            m_FrozenAccess;
+  uint64_t                  m_Now;
+  uint64_t                  m_TimestampCutoff;
+  uint32_t                  m_BucketBits;
+  ScanCacheSaveChunk*       m_Chunks;
+  uint32_t                  m_ChunkCount;
+  uint32_t                  m_NextChunk;
+};
+
+static void ScanCacheSaveChunkInit(ScanCacheSaveChunk* self, MemAllocHeap* heap)
+{
+  HashTableInit(&self->m_StringIndex, heap);
+  BufferInit(&self->m_Strings);
+  BufferInit(&self->m_StringHashes);
+  BufferInit(&self->m_StringRefs);
+  BufferInit(&self->m_Buckets);
+}
+
+static void ScanCacheSaveChunkDestroy(ScanCacheSaveChunk* self, MemAllocHeap* heap)
+{
+  BufferDestroy(&self->m_Buckets, heap);
+  BufferDestroy(&self->m_StringRefs, heap);
+  BufferDestroy(&self->m_StringHashes, heap);
+  BufferDestroy(&self->m_Strings, heap);
+  HashTableDestroy(&self->m_StringIndex);
+}
+
+static void WriteChunkStringPointer(ScanCacheSaveChunk* self, MemAllocHeap* heap, uint32_t hash, const char* filename)
+{
+  ScanCacheStringRef ref;
+  ref.m_Pointer = BinarySegmentWriteDeferredPointer(self->m_ArraySeg);
+
+  if (const uint32_t* index = HashTableLookup(&self->m_StringIndex, hash, filename))
+  {
+    ref.m_String = *index;
+  }
+  else
+  {
+    ref.m_String = uint32_t(self->m_Strings.m_Size);
+    HashTableInsert(&self->m_StringIndex, hash, filename, ref.m_String);
+    BufferAppendOne(&self->m_Strings, heap, filename);
+    BufferAppendOne(&self->m_StringHashes, heap, hash);
   }
 
+  BufferAppendOne(&self->m_StringRefs, heap, ref);
+}
+
+static BinaryLocator WriteUniqueString(HashTable<BinaryLocator, kFlagPathStrings>* atoms, BinarySegment* string_segment, uint32_t hash, const char* filename)
+{
+  if (const BinaryLocator* l = HashTableLookup(atoms, hash, filename))
+    return *l;
+
   BinaryLocator pos = BinarySegmentPosition(string_segment);
   HashTableInsert(atoms, hash, filename, pos);
-
-  BinarySegmentWritePointer(out_segment, pos);
   BinarySegmentWriteStringData(string_segment, filename);
+  return pos;
 }
 
 // Save frozen record unless timestamp is too old
 template <typename T>
 static void SaveRecord(
-    ScanCacheWriter*    self,
-    HashTable<BinaryLocator, kFlagPathStrings>* atoms,
+    const ScanCacheSaver* saver,
+    ScanCacheSaveChunk* self,
     const HashDigest*   digest,
     T*                  includes,
     int                 include_count,
@@ -395,14 +579,15 @@ static void SaveRecord(
   BinarySegment *digest_seg    = self->m_DigestSeg;
   BinarySegment *data_seg      = self->m_DataSeg;
   BinarySegment *timestamp_seg = self->m_TimestampSeg;
-  BinarySegment *string_seg    = self->m_StringSeg;
   BinarySegment *array_seg     = self->m_ArraySeg;
 
+  BufferAppendOne(&self->m_Buckets, saver->m_Heap, ScanDataBucketOf(*digest, saver->m_BucketBits));
+
   BinaryLocator string_ptrs = BinarySegmentPosition(array_seg);
 
   for (int i = 0; i < include_count; ++i)
   {
-    WriteUniqueStringPointer(atoms, array_seg, string_seg, includes[i].m_FilenameHash, includes[i].m_Filename);
+    WriteChunkStringPointer(self, saver->m_Heap, includes[i].m_FilenameHash, includes[i].m_Filename);
     BinarySegmentWriteUint32(array_seg, includes[i].m_FilenameHash);
   }
 
@@ -413,24 +598,90 @@ static void SaveRecord(
   BinarySegmentWritePointer(data_seg, string_ptrs);
 
   BinarySegmentWriteUint64(timestamp_seg, access_time);
+}
+
+static void SaveScanCacheChunk(const ScanCacheSaver* saver, ScanCacheSaveChunk* chunk)
+{
+  ScanCache::Record* const* dyn_records    = saver->m_DynamicRecords + chunk->m_DynamicBegin;
+  const size_t              frozen_begin   = chunk->m_FrozenBegin;
+  const HashDigest         *frozen_digests = saver->m_FrozenDigests;
+  const ScanCacheEntry     *frozen_entries = saver->m_FrozenEntries;
+  const uint64_t           *frozen_times   = saver->m_FrozenTimes;
+  const uint8_t            *frozen_access  = saver->m_FrozenAccess;
+  const uint64_t            now            = saver->m_Now;
+  const uint64_t            timestamp_cutoff = saver->m_TimestampCutoff;
+
+  auto key_dynamic = [=](size_t index) -> const HashDigest* { return &dyn_records[index]->m_Key; };
+  auto key_frozen = [=](size_t index) { return frozen_digests + frozen_begin + index; };
 
-  self->m_RecordsOut++;
+  auto save_dynamic = [=](size_t index)
+  {
+    SaveRecord(
+        saver,
+        chunk,
+        &dyn_records[index]->m_Key,
+        dyn_records[index]->m_Includes,
+        dyn_records[index]->m_IncludeCount,
+        dyn_records[index]->m_FileTimestamp,
+        now);
+  };
+
+  auto save_frozen = [=](size_t frozen_index)
+  {
+    size_t index = frozen_begin + frozen_index;
+
+    uint64_t timestamp = frozen_times[index];
+    if (frozen_access[index])
+      timestamp = now;
+
+    if (timestamp > timestamp_cutoff)
+    {
+      SaveRecord(
+          saver,
+          chunk,
+          frozen_digests + index, 
+          frozen_entries[index].m_IncludedFiles.GetArray(),
+          frozen_entries[index].m_IncludedFiles.GetCount(),
+          frozen_entries[index].m_FileTimestamp,
+          timestamp);
+    }
+  };
+
+  TraverseSortedArrays(
+      chunk->m_DynamicEnd - chunk->m_DynamicBegin, save_dynamic, key_dynamic,
+      chunk->m_FrozenEnd - chunk->m_FrozenBegin, save_frozen, key_frozen);
+}
+
+static void SaveScanCacheChunks(void* context, int thread_index)
+{
+  ScanCacheSaver* saver = static_cast<ScanCacheSaver*>(context);
+
+  for (;;)
+  {
+    uint32_t index = AtomicIncrement(&saver->m_NextChunk) - 1;
+    if (index >= saver->m_ChunkCount)
+      break;
+
+    SaveScanCacheChunk(saver, &saver->m_Chunks[index]);
+  }
 }
 
-bool ScanCacheSave(ScanCache* self, const char* fn, MemAllocHeap* heap)
+bool ScanCacheWrite(ScanCache* self, const char* fn, MemAllocHeap* heap, HelperPool* helpers)
 {
   TimingScope timing_scope(nullptr, &g_Stats.m_ScanCacheSaveTime);
   ProfilerScope prof_scope("Tundra SaveScanCache", 0);
 
-  MemAllocLinear* scratch = self->m_Allocator;
-
-  MemAllocLinearScope scratch_scope(scratch);
+  // Inserts wait until the records have been serialized. The linear allocator
+  // belongs to them, so nothing here is allocated from it.
+  ReadWriteLockRead(&self->m_Lock);
 
   HashTable<BinaryLocator, kFlagPathStrings> string_pool;
   HashTableInit(&string_pool, heap);
 
+  const uint32_t max_record_count = self->m_RecordCount + (self->m_FrozenData ? self->m_FrozenData->m_EntryCount : 0);
+
   ScanCacheWriter writer;
-  ScanCacheWriterInit(&writer, heap);
+  ScanCacheWriterInit(&writer, heap, max_record_count);
 
   // Save new view of the scan cache
   //
@@ -438,7 +689,7 @@ bool ScanCacheSave(ScanCache* self, const char* fn, MemAllocHeap* heap)
   // 
   // - Get all records from the dynamic table (stuff we put in this session)
   const uint32_t      record_count = self->m_RecordCount;
-  ScanCache::Record **dyn_records  = LinearAllocateArray<ScanCache::Record*>(scratch, record_count);
+  ScanCache::Record **dyn_records  = HeapAllocateArray<ScanCache::Record*>(heap, record_count);
 
   {
     uint32_t records_out = 0;
@@ -461,52 +712,126 @@ bool ScanCacheSave(ScanCache* self, const char* fn, MemAllocHeap* heap)
   const ScanData       *scan_data      = self->m_FrozenData;
   uint32_t              frozen_count   = scan_data ? scan_data->m_EntryCount : 0;
   const HashDigest     *frozen_digests = scan_data ? scan_data->m_Keys.Get() : nullptr;
-  const ScanCacheEntry *frozen_entries = scan_data ? scan_data->m_Data.Get() : nullptr;
-  const uint64_t       *frozen_times   = scan_data ? scan_data->m_AccessTimes.Get() : nullptr;
-  const uint8_t        *frozen_access  = self->m_FrozenAccess;
 
   const uint64_t now = time(nullptr);
 
+  ScanCacheSaver saver;
+  saver.m_Heap            = heap;
+  saver.m_DynamicRecords  = dyn_records;
+  saver.m_FrozenDigests   = frozen_digests;
+  saver.m_FrozenEntries   = scan_data ? scan_data->m_Data.Get() : nullptr;
+  saver.m_FrozenTimes     = scan_data ? scan_data->m_AccessTimes.Get() : nullptr;
+  saver.m_FrozenAccess    = self->m_FrozenAccess;
+  saver.m_Now             = now;
   // Keep old entries for a week.
-  const uint64_t timestamp_cutoff = now - 60 * 60 * 24 * 7;
+  saver.m_TimestampCutoff = now - 60 * 60 * 24 * 7;
+  saver.m_BucketBits      = writer.m_BucketBits;
+  saver.m_NextChunk       = 0;
 
-  auto key_dynamic = [=](size_t index) -> const HashDigest* { return &dyn_records[index]->m_Key; };
-  auto key_frozen = [=](size_t index) { return frozen_digests + index; };
+  // - Merge them with the frozen records in ranges of keys, split evenly over
+  //   the larger of the two.
+  int thread_count = helpers ? helpers->m_MaxThreadCount + 1 : 1;
+
+  size_t chunk_count = max_record_count / ScanCacheSaver::kMinChunkSize;
+  if (chunk_count > size_t(thread_count) * ScanCacheSaver::kChunksPerThread)
+    chunk_count = size_t(thread_count) * ScanCacheSaver::kChunksPerThread;
+  if (chunk_count < 1)
+    chunk_count = 1;
+  if (size_t(thread_count) > chunk_count)
+    thread_count = int(chunk_count);
+
+  saver.m_ChunkCount = uint32_t(chunk_count);
+  saver.m_Chunks     = HeapAllocateArray<ScanCacheSaveChunk>(heap, chunk_count);
 
-  auto save_dynamic = [&writer, dyn_records, now, &string_pool](size_t index)
+  size_t dyn_begin    = 0;
+  size_t frozen_begin = 0;
+
+  for (size_t ci = 0; ci < chunk_count; ++ci)
   {
-    SaveRecord(
-        &writer,
-        &string_pool,
-        &dyn_records[index]->m_Key,
-        dyn_records[index]->m_Includes,
-        dyn_records[index]->m_IncludeCount,
-        dyn_records[index]->m_FileTimestamp,
-        now);
-  };
+    ScanCacheSaveChunk* chunk = &saver.m_Chunks[ci];
+    ScanCacheSaveChunkInit(chunk, heap);
+    chunk->m_DynamicBegin = dyn_begin;
+    chunk->m_FrozenBegin  = frozen_begin;
+
+    if (ci + 1 == chunk_count)
+    {
+      dyn_begin    = record_count;
+      frozen_begin = frozen_count;
+    }
+    else
+    {
+      const HashDigest& split = record_count >= frozen_count ?
+        dyn_records[(ci + 1) * record_count / chunk_count]->m_Key :
+        frozen_digests[(ci + 1) * frozen_count / chunk_count];
+
+      dyn_begin = std::lower_bound(dyn_records + dyn_begin, dyn_records + record_count, split, [](const ScanCache::Record* r, const HashDigest& key) {
+        return r->m_Key < key;
+      }) - dyn_records;
+
+      frozen_begin = std::lower_bound(frozen_digests + frozen_begin, frozen_digests + frozen_count, split) - frozen_digests;
+    }
 
-  auto save_frozen = [&](size_t index)
+    chunk->m_DynamicEnd = dyn_begin;
+    chunk->m_FrozenEnd  = frozen_begin;
+
+    if (0 == ci)
+    {
+      chunk->m_DigestSeg    = writer.m_DigestSeg;
+      chunk->m_DataSeg      = writer.m_DataSeg;
+      chunk->m_TimestampSeg = writer.m_TimestampSeg;
+      chunk->m_ArraySeg     = writer.m_ArraySeg;
+    }
+    else
+    {
+      chunk->m_DigestSeg    = BinaryWriterAddSegment(&writer.m_Writer);
+      chunk->m_DataSeg      = BinaryWriterAddSegment(&writer.m_Writer);
+      chunk->m_TimestampSeg = BinaryWriterAddSegment(&writer.m_Writer);
+      chunk->m_ArraySeg     = BinaryWriterAddSegment(&writer.m_Writer);
+    }
+  }
+
+  if (thread_count > 1)
+    HelperPoolRun(helpers, SaveScanCacheChunks, &saver, thread_count);
+  else
+    SaveScanCacheChunks(&saver, 0);
+
+  // - Join the chunks in key order, sharing strings between all of them.
+  Buffer<BinaryLocator> string_ptrs;
+  BufferInit(&string_ptrs);
+
+  for (size_t ci = 0; ci < chunk_count; ++ci)
   {
-    uint64_t timestamp = frozen_times[index];
-    if (frozen_access[index])
-      timestamp = now;
+    ScanCacheSaveChunk* chunk = &saver.m_Chunks[ci];
 
-    if (timestamp > timestamp_cutoff)
+    BufferClear(&string_ptrs);
+    for (size_t si = 0, count = chunk->m_Strings.m_Size; si < count; ++si)
+      BufferAppendOne(&string_ptrs, heap, WriteUniqueString(&string_pool, writer.m_StringSeg, chunk->m_StringHashes[si], chunk->m_Strings[si]));
+
+    for (const ScanCacheStringRef& ref : chunk->m_StringRefs)
+      BinarySegmentSetPointer(chunk->m_ArraySeg, ref.m_Pointer, string_ptrs[ref.m_String]);
+
+    for (uint32_t bucket : chunk->m_Buckets)
     {
-      SaveRecord(
-          &writer,
-          &string_pool,
-          frozen_digests + index, 
-          frozen_entries[index].m_IncludedFiles.GetArray(),
-          frozen_entries[index].m_IncludedFiles.GetCount(),
-          frozen_entries[index].m_FileTimestamp,
-          timestamp);
+      ScanCacheWriterStartBucket(&writer, bucket);
+      writer.m_RecordsOut++;
+    }
+
+    if (ci > 0)
+    {
+      BinarySegmentAppend(writer.m_DigestSeg, chunk->m_DigestSeg);
+      BinarySegmentAppend(writer.m_DataSeg, chunk->m_DataSeg);
+      BinarySegmentAppend(writer.m_TimestampSeg, chunk->m_TimestampSeg);
+      BinarySegmentAppend(writer.m_ArraySeg, chunk->m_ArraySeg);
     }
-  };
 
-  TraverseSortedArrays(record_count, save_dynamic, key_dynamic, frozen_count, save_frozen, key_frozen);
+    ScanCacheSaveChunkDestroy(chunk, heap);
+  }
 
-  self->m_FrozenData = nullptr;
+  BufferDestroy(&string_ptrs, heap);
+  HeapFree(heap, saver.m_Chunks);
+  HeapFree(heap, dyn_records);
+
+  ReadWriteUnlockRead(&self->m_Lock);
 
   bool result = ScanCacheWriterFlush(&writer, fn);
 
@@ -517,4 +842,13 @@ bool ScanCacheSave(ScanCache* self, const char* fn, MemAllocHeap* heap)
   return result;
 }
 
+bool ScanCacheSave(ScanCache* self, const char* fn, MemAllocHeap* heap, HelperPool* helpers)
+{
+  bool result = ScanCacheWrite(self, fn, heap, helpers);
+
+  self->m_FrozenData = nullptr;
+
+  return result;
+}
+
 }
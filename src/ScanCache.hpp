@@ -4,6 +4,8 @@
 #include "Common.hpp"
 #include "Hash.hpp"
 #include "ReadWriteLock.hpp"
+#include "Mutex.hpp"
+#include "ConditionVar.hpp"
 
 namespace t2
 {
@@ -11,16 +13,29 @@ namespace t2
   struct MemAllocHeap;
   struct MemAllocLinear;
   struct MemoryMappedFile;
+  struct HelperPool;
 
   void ComputeScanCacheKey(
       HashDigest*        key_out,
       const char*        filename,
       const HashDigest&  scanner_hash);
 
+  struct FrozenFileAndHash;
+
+  // Hits on data from the previous session point straight into the mapped
+  // file through m_FrozenIncludedFiles; other hits use m_IncludedFiles.
   struct ScanCacheLookupResult
   {
-    int           m_IncludedFileCount;
-    FileAndHash*  m_IncludedFiles;
+    int                       m_IncludedFileCount;
+    FileAndHash*              m_IncludedFiles;
+    const FrozenFileAndHash*  m_FrozenIncludedFiles;
+  };
+
+  // A scan some thread has claimed to perform, see ScanCacheLookupOrBegin().
+  struct ScanInFlight
+  {
+    HashDigest    m_Key;
+    ScanInFlight* m_Next;
   };
 
   struct ScanCache
@@ -38,6 +53,14 @@ namespace t2
     bool            m_Initialized;
     // Table of bits to track whether frozen records have been accessed.
     uint8_t*        m_FrozenAccess;
+    // Bumped whenever something that is saved changes.
+    uint32_t        m_Generation;
+
+    // Scans in progress, so threads that want the same file can wait for the
+    // result instead of scanning it again.
+    Mutex             m_InFlightLock;
+    ConditionVariable m_InFlightDone;
+    ScanInFlight*     m_InFlight;
   };
     
   void ScanCacheInit(ScanCache* self, MemAllocHeap* heap, MemAllocLinear* allocator);
@@ -46,13 +69,30 @@ namespace t2
 
   void ScanCacheDestroy(ScanCache* self);
 
-  bool ScanCacheLookup(ScanCache* self, const HashDigest& key, uint64_t timestamp, ScanCacheLookupResult* result_out, MemAllocLinear* scratch);
+  bool ScanCacheLookup(ScanCache* self, const HashDigest& key, uint64_t timestamp, ScanCacheLookupResult* result_out);
 
   void ScanCacheInsert(ScanCache* self, const HashDigest& key, uint64_t timestamp, const char** included_files, int count);
 
+  // Call after ScanCacheLookup() misses. If another thread is scanning the same
+  // file, waits for it to finish and returns its result. Otherwise the caller
+  // has claimed the file and must scan it, ScanCacheInsert() the result and
+  // then call ScanCacheEnd(), even if the scan failed.
+  bool ScanCacheLookupOrBegin(ScanCache* self, const HashDigest& key, uint64_t timestamp, ScanCacheLookupResult* result_out, ScanInFlight* claim);
+
+  void ScanCacheEnd(ScanCache* self, ScanInFlight* claim);
+
   bool ScanCacheDirty(ScanCache* self);
 
-  bool ScanCacheSave(ScanCache* self, const char* fn, MemAllocHeap* heap);
+  // A write made while other threads use the cache only holds what it saw, so
+  // it is current as long as the generation is the same as before it started.
+  uint32_t ScanCacheGeneration(ScanCache* self);
+
+  // Writes the cache to fn, leaving it usable. Safe to call while other
+  // threads use the cache. Splits the work over helpers if there are any.
+  bool ScanCacheWrite(ScanCache* self, const char* fn, MemAllocHeap* heap, HelperPool* helpers);
+
+  // Writes the cache to fn and detaches the frozen data, so it can be unmapped.
+  bool ScanCacheSave(ScanCache* self, const char* fn, MemAllocHeap* heap, HelperPool* helpers);
 
 }
 
@@ -2,6 +2,7 @@
 #define SCANDATA_HPP
 
 #include "BinaryData.hpp"
+#include "Hash.hpp"
 
 namespace t2
 {
@@ -13,7 +14,7 @@ namespace t2
 
   struct ScanData
   {
-    static const uint32_t MagicNumber = 0x1517000f ^ kTundraHashMagic;
+    static const uint32_t MagicNumber = 0x15170010 ^ kTundraHashMagic;
 
     uint32_t                   m_MagicNumber;
 
@@ -22,9 +23,43 @@ namespace t2
     FrozenPtr<HashDigest>      m_Keys;
     FrozenPtr<ScanCacheEntry>  m_Data;
     FrozenPtr<uint64_t>        m_AccessTimes;
+
+    // Index into the sorted keys. Keys whose leading m_BucketBits bits equal b
+    // are the range [m_Buckets[b], m_Buckets[b + 1]).
+    uint32_t                   m_BucketBits;
+    FrozenArray<uint32_t>      m_Buckets;
     uint32_t                   m_MagicNumberEnd;
   };
 
+  // Bucket of a key, following the sort order of CompareHashDigests().
+  inline uint32_t ScanDataBucketOf(const HashDigest& key, uint32_t bucket_bits)
+  {
+#if ENABLED(USE_SHA1_HASH)
+    uint32_t leading = uint32_t(LoadBigEndian64(key.m_Words.m_A) >> 32);
+#else
+    uint32_t leading = uint32_t(key.m_Words64[0] >> 32);
+#endif
+    return leading >> (32 - bucket_bits);
+  }
+
+  // Returns the index of a key in the frozen data, or -1.
+  inline int ScanDataFind(const ScanData* self, const HashDigest& key)
+  {
+    uint32_t        bucket  = ScanDataBucketOf(key, self->m_BucketBits);
+    const uint32_t* buckets = self->m_Buckets.GetArray();
+
+    for (uint32_t i = buckets[bucket], end = buckets[bucket + 1]; i < end; ++i)
+    {
+      int cmp = CompareHashDigests(self->m_Keys[i], key);
+      if (0 == cmp)
+        return int(i);
+      if (cmp > 0)
+        break;
+    }
+
+    return -1;
+  }
+
 }
 
 #endif
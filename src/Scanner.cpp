@@ -10,9 +10,17 @@
 #include "ScanCache.hpp"
 #include "StatCache.hpp"
 #include "HashTable.hpp"
+#include "MemoryMappedFile.hpp"
+#include "Stats.hpp"
+#include "BinaryData.hpp"
 
 #include <stdio.h>
 
+#if defined(TUNDRA_UNIX)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 namespace t2
 {
 
@@ -59,6 +67,21 @@ static bool IncludeSetAddDuplicateString(IncludeSet* self, const char* string, u
   return true;
 }
 
+// Adds cached includes of a file to the set, queueing new ones for scanning.
+template <typename T>
+static void AddCachedIncludes(IncludeSet* incset, Buffer<const char*>* filename_stack, MemAllocHeap* heap, const T* files, int file_count)
+{
+  for (int i = 0; i < file_count; ++i)
+  {
+    const char* filename = files[i].m_Filename;
+    if (IncludeSetAddNoDuplicateString(incset, filename, files[i].m_FilenameHash))
+    {
+      // This was a new file, schedule it for scanning as well. 
+      BufferAppendOne(filename_stack, heap, filename);
+    }
+  }
+}
+
 static bool FindFile(
     StatCache* stat_cache, 
     PathBuffer* buffer,
@@ -103,7 +126,8 @@ static bool FindFile(
 static void ScanFile(
     StatCache* stat_cache,
     const char* filename,
-    char* file_data,
+    const char* file_data,
+    size_t file_size,
     const ScanInput* input,
     Buffer<const char*>* found_includes)
 {
@@ -115,10 +139,20 @@ static void ScanFile(
   switch (scanner_config->m_ScannerType)
   {
     case ScannerType::kGeneric:
-      includes = ScanIncludesGeneric(file_data, scratch, *static_cast<const GenericScannerData*>(scanner_config));
+      includes = ScanIncludesGeneric(file_data, file_size, scratch, *static_cast<const GenericScannerData*>(scanner_config));
       break;
     case ScannerType::kCpp:
-      includes = ScanIncludesCpp(file_data, scratch);
+      includes = ScanIncludesCpp(file_data, file_size, scratch);
+      break;
+    case ScannerType::kCppPreprocessor:
+      {
+        const CppPreprocessorScannerData* pp_config = static_cast<const CppPreprocessorScannerData*>(scanner_config);
+        int define_count = pp_config->m_Defines.GetCount();
+        const char** defines = LinearAllocateArray<const char*>(scratch, define_count);
+        for (int i = 0; i < define_count; ++i)
+          defines[i] = pp_config->m_Defines[i];
+        includes = ScanIncludesCppPreprocessor(file_data, file_size, scratch, heap, defines, define_count);
+      }
       break;
     default:
       Croak("Unsupported scanner type");
@@ -141,6 +175,55 @@ static void ScanFile(
   }
 }
 
+enum
+{
+  // Files smaller than this are read with a single read into a reusable
+  // buffer. Larger files are memory mapped and scanned in place.
+  kScanMmapThreshold = 64 * 1024
+};
+
+// Read the first size bytes of a file. Returns the number of bytes read, or -1.
+static int64_t ReadSmallFile(const char* fn, char* buffer, size_t size)
+{
+#if defined(TUNDRA_UNIX)
+  int fd = open(fn, O_RDONLY);
+  if (-1 == fd)
+    return -1;
+  ssize_t result = pread(fd, buffer, size, 0);
+  close(fd);
+  return result;
+#else
+  FILE* f = fopen(fn, "rb");
+  if (!f)
+    return -1;
+  size_t result = fread(buffer, 1, size, f);
+  int error = ferror(f);
+  fclose(f);
+  return error ? -1 : int64_t(result);
+#endif
+}
+
+static void ScanFileData(
+    StatCache* stat_cache,
+    const char* filename,
+    const char* data,
+    size_t size,
+    const ScanInput* input,
+    Buffer<const char*>* found_includes)
+{
+  AtomicAdd(&g_Stats.m_ScanBytes, size);
+
+  // Skip UTF-8 marker if present as it freaks out ctype functions
+  static const unsigned char utf8_mark[] = { 0xef, 0xbb, 0xbf };
+  if (size >= 3 && 0 == memcmp(data, utf8_mark, sizeof utf8_mark))
+  {
+    data += sizeof utf8_mark;
+    size -= sizeof utf8_mark;
+  }
+
+  ScanFile(stat_cache, filename, data, size, input, found_includes);
+}
+
 bool ScanImplicitDeps(StatCache* stat_cache, const ScanInput* input, ScanOutput* output)
 {
   MemAllocHeap      *scratch_heap   = input->m_ScratchHeap;
@@ -157,6 +240,16 @@ bool ScanImplicitDeps(StatCache* stat_cache, const ScanInput* input, ScanOutput*
   IncludeSet incset;
   IncludeSetInit(&incset, scratch_heap, scratch_alloc);
 
+  // Use the caller's buffer for small file reads if there is one, so it can
+  // be reused between scans.
+  Buffer<char>  local_read_buffer;
+  Buffer<char>* read_buffer = input->m_ReadBuffer;
+  if (!read_buffer)
+  {
+    BufferInit(&local_read_buffer);
+    read_buffer = &local_read_buffer;
+  }
+
   while (filename_stack.m_Size > 0)
   {
     const char* fn = BufferPopOne(&filename_stack);
@@ -174,64 +267,65 @@ bool ScanImplicitDeps(StatCache* stat_cache, const ScanInput* input, ScanOutput*
 
     ScanCacheLookupResult cache_result;
 
-    if (ScanCacheLookup(scan_cache, scan_key, info.m_Timestamp, &cache_result, scratch_alloc))
+    bool cached = ScanCacheLookup(scan_cache, scan_key, info.m_Timestamp, &cache_result);
+
+    // Zero-sized files are not cached, just like files we can't open.
+    if (!cached && (0 == info.m_Size || info.IsDirectory()))
+      continue;
+
+    // If another thread is already scanning this file, wait for its result.
+    ScanInFlight claim;
+
+    if (cached || ScanCacheLookupOrBegin(scan_cache, scan_key, info.m_Timestamp, &cache_result, &claim))
     {
-      int                 file_count = cache_result.m_IncludedFileCount;
-      const FileAndHash  *files      = cache_result.m_IncludedFiles;
+      int file_count = cache_result.m_IncludedFileCount;
 
-      for (int i = 0; i < file_count; ++i)
-      {
-        if (IncludeSetAddNoDuplicateString(&incset, files[i].m_Filename, files[i].m_FilenameHash))
-        {
-          // This was a new file, schedule it for scanning as well. 
-          BufferAppendOne(&filename_stack, scratch_heap, files[i].m_Filename);
-        }
-      }
+      if (cache_result.m_FrozenIncludedFiles)
+        AddCachedIncludes(&incset, &filename_stack, scratch_heap, cache_result.m_FrozenIncludedFiles, file_count);
+      else
+        AddCachedIncludes(&incset, &filename_stack, scratch_heap, cache_result.m_IncludedFiles, file_count);
     }
     else
     {
       // Reset buffer
       BufferClear(&found_includes);
 
-      // Read file into RAM, and add a terminating newline character.
-      FILE* f = fopen(fn, "rb");
-      if (!f)
-        continue;
-
-      if (0 != fseek(f, 0, SEEK_END))
-      {
-        fclose(f);
-        continue;
-      }
+      TimingScope timing_scope(&g_Stats.m_ScanFileCount, &g_Stats.m_ScanTimeCycles);
 
-      long file_size = ftell(f);
-      if (-1 == file_size || 0 == file_size)
+      if (info.m_Size < kScanMmapThreshold)
       {
-        fclose(f);
-        continue;
-      }
+        BufferClear(read_buffer);
+        BufferAlloc(read_buffer, scratch_heap, (size_t) info.m_Size);
 
-      rewind(f);
+        int64_t bytes_read = ReadSmallFile(fn, read_buffer->m_Storage, (size_t) info.m_Size);
+        if (-1 == bytes_read)
+        {
+          ScanCacheEnd(scan_cache, &claim);
+          continue;
+        }
 
-      char* buffer = (char*) HeapAllocate(scratch_heap, file_size + 2);
-      if (1 == (long) fread(buffer, file_size, 1, f))
+        ScanFileData(stat_cache, fn, read_buffer->m_Storage, (size_t) bytes_read, input, &found_includes);
+      }
+      else
       {
-        // Add an extra newline to sort out trailing #includes on last line
-        buffer[file_size + 0] = '\n';
-        buffer[file_size + 1] = '\0';
+        MemoryMappedFile mapping;
+        MmapFileInit(&mapping);
+        MmapFileMap(&mapping, fn);
 
-        char* scan_start = buffer;
+        if (!MmapFileValid(&mapping))
+        {
+          ScanCacheEnd(scan_cache, &claim);
+          continue;
+        }
 
-        // Skip UTF-8 marker if present as it freaks out ctype functions
-        static const unsigned char utf8_mark[] = { 0xef, 0xbb, 0xbf };
-        if (file_size >= 3 && 0 == memcmp(scan_start, utf8_mark, sizeof utf8_mark))
-          scan_start += sizeof utf8_mark;
+        ScanFileData(stat_cache, fn, (const char*) mapping.m_Address, mapping.m_Size, input, &found_includes);
 
-        ScanFile(stat_cache, fn, scan_start, input, &found_includes);
+        MmapFileDestroy(&mapping);
       }
 
       // Insert result into scan cache
       ScanCacheInsert(scan_cache, scan_key, info.m_Timestamp, found_includes.m_Storage, (int) found_includes.m_Size);
+      ScanCacheEnd(scan_cache, &claim);
 
       for (const char* file : found_includes)
       {
@@ -242,8 +336,6 @@ bool ScanImplicitDeps(StatCache* stat_cache, const ScanInput* input, ScanOutput*
         }
       }
 
-      HeapFree(scratch_heap, buffer);
-      fclose(f);
     }
   }
 
@@ -258,6 +350,9 @@ bool ScanImplicitDeps(StatCache* stat_cache, const ScanInput* input, ScanOutput*
   BufferDestroy(&filename_stack, scratch_heap);
   BufferDestroy(&found_includes, scratch_heap);
 
+  if (read_buffer == &local_read_buffer)
+    BufferDestroy(&local_read_buffer, scratch_heap);
+
   output->m_IncludedFileCount = include_count;
   output->m_IncludedFiles     = result;
 
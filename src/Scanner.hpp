@@ -13,6 +13,7 @@ struct MemAllocLinear;
 struct MemAllocHeap;
 struct ScanCache;
 struct StatCache;
+template <typename T> struct Buffer;
 
 struct ScanInput
 {
@@ -21,6 +22,9 @@ struct ScanInput
   MemAllocHeap      *m_ScratchHeap;
   const char        *m_FileName;
   ScanCache         *m_ScanCache;
+  // Optional buffer for reading small files, reused between calls. Allocated
+  // from m_ScratchHeap.
+  Buffer<char>      *m_ReadBuffer;
 };
 
 struct ScanOutput
@@ -3,6 +3,7 @@
 
 #include "Common.hpp"
 #include "BinaryData.hpp"
+#include "Hash.hpp"
 
 namespace t2
 {
@@ -17,6 +18,16 @@ struct NodeInputFileData
 
 static_assert(sizeof(NodeInputFileData) == 12, "struct layout");
 
+#pragma pack(push, 4)
+struct StateFileData
+{
+  uint64_t     m_Timestamp;
+  FrozenString m_Filename;
+  uint32_t     m_FilenameHash;
+};
+#pragma pack(pop)
+
+static_assert(sizeof(StateFileData) == 16, "struct layout");
 
 struct NodeStateData
 {
@@ -27,14 +38,83 @@ struct NodeStateData
   FrozenString                   m_Action;
   FrozenString                   m_PreAction;
   FrozenArray<NodeInputFileData> m_InputFiles;
-  FrozenArray<NodeInputFileData> m_ImplicitInputFiles;
+  // Ascending indices into StateData::m_ImplicitFiles, each stored as a
+  // varint delta from the one before. See StateImplicitInputs.
+  int32_t                        m_ImplicitInputCount;
+  FrozenPtr<uint8_t>             m_ImplicitInputIndices;
 
   FrozenArray<uint32_t>          m_DagsWeHaveSeenThisNodeInPreviously;
 };
 
+// The implicit inputs of a node, in the order of StateData::m_ImplicitFiles.
+class StateImplicitInputs
+{
+public:
+  class Iterator
+  {
+  public:
+    Iterator(const StateFileData* files, const uint8_t* pos, int32_t remaining)
+      : m_Files(files), m_Pos(pos), m_Remaining(remaining), m_Index(0)
+    {
+      if (m_Remaining > 0)
+        Decode();
+    }
+
+    const StateFileData& operator*() const { return m_Files[m_Index]; }
+    const StateFileData* operator->() const { return &m_Files[m_Index]; }
+
+    Iterator& operator++()
+    {
+      if (--m_Remaining > 0)
+        Decode();
+      return *this;
+    }
+
+    bool operator==(const Iterator& other) const { return m_Remaining == other.m_Remaining; }
+    bool operator!=(const Iterator& other) const { return m_Remaining != other.m_Remaining; }
+
+  private:
+    void Decode()
+    {
+      uint32_t delta = 0;
+      int shift = 0;
+      uint8_t byte;
+      do
+      {
+        byte = *m_Pos++;
+        delta |= uint32_t(byte & 0x7f) << shift;
+        shift += 7;
+      } while (byte & 0x80);
+      m_Index += delta;
+    }
+
+    const StateFileData* m_Files;
+    const uint8_t*       m_Pos;
+    int32_t              m_Remaining;
+    uint32_t             m_Index;
+  };
+
+  StateImplicitInputs(const StateFileData* files, const NodeStateData* state)
+    : m_Files(files), m_Indices(state->m_ImplicitInputIndices), m_Count(state->m_ImplicitInputCount)
+  {
+  }
+
+  int32_t GetCount() const { return m_Count; }
+
+  Iterator begin() const { return Iterator(m_Files, m_Indices, m_Count); }
+  Iterator end() const { return Iterator(m_Files, nullptr, 0); }
+
+private:
+  const StateFileData* m_Files;
+  const uint8_t*       m_Indices;
+  int32_t              m_Count;
+};
+
+// Also the layout of the records in the state journal, which hold one node
+// each.
 struct StateData
 {
-  static const uint32_t     MagicNumber = 0x1589A105 ^ kTundraHashMagic;
+  static const uint32_t     MagicNumber = 0x1589A106 ^ kTundraHashMagic;
 
   uint32_t                 m_MagicNumber;
 
@@ -42,6 +122,10 @@ struct StateData
   FrozenPtr<HashDigest>    m_NodeGuids;
   FrozenPtr<NodeStateData> m_NodeStates;
 
+  // Implicit inputs of all nodes, one per file and timestamp, sorted by hash
+  // and then name.
+  FrozenArray<StateFileData> m_ImplicitFiles;
+
   uint32_t                   m_MagicNumberEnd;
 };
 
@@ -0,0 +1,190 @@
+#include "StateImplicitTable.hpp"
+#include "MemAllocHeap.hpp"
+#include "MemAllocLinear.hpp"
+
+#include <algorithm>
+#include <string.h>
+
+namespace t2
+{
+
+void StateImplicitTableInit(StateImplicitTable* self, MemAllocHeap* heap, MemAllocLinear* alloc)
+{
+  self->m_Heap  = heap;
+  self->m_Alloc = alloc;
+  HashTableInit(&self->m_Index, heap);
+  BufferInit(&self->m_Files);
+  BufferInit(&self->m_Refs);
+  BufferInit(&self->m_Lists);
+}
+
+void StateImplicitTableDestroy(StateImplicitTable* self)
+{
+  BufferDestroy(&self->m_Lists, self->m_Heap);
+  BufferDestroy(&self->m_Refs, self->m_Heap);
+  BufferDestroy(&self->m_Files, self->m_Heap);
+  HashTableDestroy(&self->m_Index);
+}
+
+void StateImplicitListBegin(StateImplicitTable* self, BinarySegment* state_seg, int32_t count)
+{
+  BinarySegmentWriteInt32(state_seg, count);
+
+  if (0 == count)
+  {
+    BinarySegmentWriteNullPointer(state_seg);
+    return;
+  }
+
+  StateImplicitList list;
+  list.m_Seg     = state_seg;
+  list.m_Pointer = BinarySegmentWriteDeferredPointer(state_seg);
+  list.m_Start   = uint32_t(self->m_Refs.m_Size);
+  list.m_Count   = count;
+  BufferAppendOne(&self->m_Lists, self->m_Heap, list);
+}
+
+uint32_t StateImplicitFileIndex(StateImplicitTable* self, const char* filename, uint32_t hash, uint64_t timestamp)
+{
+  uint32_t index;
+  uint32_t* head = HashTableLookup(&self->m_Index, hash, filename);
+
+  if (head)
+  {
+    index = *head;
+    while (self->m_Files[index].m_Timestamp != timestamp && self->m_Files[index].m_Next != ~0u)
+      index = self->m_Files[index].m_Next;
+
+    if (self->m_Files[index].m_Timestamp == timestamp)
+      return index;
+  }
+
+  uint32_t new_index = uint32_t(self->m_Files.m_Size);
+
+  StateImplicitFile file;
+  file.m_Filename     = head ? self->m_Files[index].m_Filename : self->m_Alloc ? StrDup(self->m_Alloc, filename) : filename;
+  file.m_FilenameHash = hash;
+  file.m_Next         = ~0u;
+  file.m_Timestamp    = timestamp;
+
+  if (head)
+    self->m_Files[index].m_Next = new_index;
+  else
+    HashTableInsert(&self->m_Index, hash, file.m_Filename, new_index);
+
+  BufferAppendOne(&self->m_Files, self->m_Heap, file);
+  return new_index;
+}
+
+void StateImplicitListAdd(StateImplicitTable* self, const char* filename, uint32_t hash, uint64_t timestamp)
+{
+  BufferAppendOne(&self->m_Refs, self->m_Heap, StateImplicitFileIndex(self, filename, hash, timestamp));
+}
+
+void StateImplicitTableMerge(StateImplicitTable* self, const StateImplicitTable* src)
+{
+  Buffer<uint32_t> remap;
+  BufferInit(&remap);
+  uint32_t* out = BufferAlloc(&remap, self->m_Heap, src->m_Files.m_Size);
+
+  for (size_t i = 0, count = src->m_Files.m_Size; i < count; ++i)
+  {
+    const StateImplicitFile& file = src->m_Files[i];
+    out[i] = StateImplicitFileIndex(self, file.m_Filename, file.m_FilenameHash, file.m_Timestamp);
+  }
+
+  for (const StateImplicitList& src_list : src->m_Lists)
+  {
+    StateImplicitList list = src_list;
+    list.m_Start = uint32_t(self->m_Refs.m_Size);
+    BufferAppendOne(&self->m_Lists, self->m_Heap, list);
+
+    for (int32_t i = 0; i < list.m_Count; ++i)
+      BufferAppendOne(&self->m_Refs, self->m_Heap, out[src->m_Refs[src_list.m_Start + i]]);
+  }
+
+  BufferDestroy(&remap, self->m_Heap);
+}
+
+void StateImplicitTableWrite(
+    StateImplicitTable* self,
+    BinarySegment*      main_seg,
+    BinarySegment*      file_seg,
+    BinarySegment*      index_seg,
+    BinarySegment*      string_seg)
+{
+  MemAllocHeap*            heap       = self->m_Heap;
+  const StateImplicitFile* files      = self->m_Files.m_Storage;
+  uint32_t                 file_count = uint32_t(self->m_Files.m_Size);
+
+  Buffer<uint32_t> order;
+  BufferInit(&order);
+  uint32_t* sorted = BufferAlloc(&order, heap, file_count);
+  for (uint32_t i = 0; i < file_count; ++i)
+    sorted[i] = i;
+
+  std::sort(sorted, sorted + file_count, [=](uint32_t l, uint32_t r) {
+    const StateImplicitFile& a = files[l];
+    const StateImplicitFile& b = files[r];
+    if (a.m_FilenameHash != b.m_FilenameHash)
+      return a.m_FilenameHash < b.m_FilenameHash;
+    if (int diff = strcmp(a.m_Filename, b.m_Filename))
+      return diff < 0;
+    return a.m_Timestamp < b.m_Timestamp;
+  });
+
+  Buffer<uint32_t> remap;
+  BufferInit(&remap);
+  BufferAlloc(&remap, heap, file_count);
+
+  BinaryLocator files_ptr = BinarySegmentPosition(file_seg);
+  for (uint32_t i = 0; i < file_count; ++i)
+  {
+    const StateImplicitFile& file = files[sorted[i]];
+    remap[sorted[i]] = i;
+    BinarySegmentWriteUint64(file_seg, file.m_Timestamp);
+    BinarySegmentWritePointer(file_seg, BinarySegmentPosition(string_seg));
+    BinarySegmentWriteStringData(string_seg, file.m_Filename);
+    BinarySegmentWriteUint32(file_seg, file.m_FilenameHash);
+  }
+
+  BinarySegmentWriteInt32(main_seg, int32_t(file_count));
+  if (file_count > 0)
+    BinarySegmentWritePointer(main_seg, files_ptr);
+  else
+    BinarySegmentWriteNullPointer(main_seg);
+
+  Buffer<uint32_t> indices;
+  BufferInit(&indices);
+
+  for (const StateImplicitList& list : self->m_Lists)
+  {
+    BufferClear(&indices);
+    uint32_t* out = BufferAlloc(&indices, heap, list.m_Count);
+    for (int32_t i = 0; i < list.m_Count; ++i)
+      out[i] = remap[self->m_Refs[list.m_Start + i]];
+
+    std::sort(out, out + list.m_Count);
+
+    BinarySegmentSetPointer(list.m_Seg, list.m_Pointer, BinarySegmentPosition(index_seg));
+
+    uint32_t prev = 0;
+    for (int32_t i = 0; i < list.m_Count; ++i)
+    {
+      uint32_t delta = out[i] - prev;
+      prev = out[i];
+      while (delta >= 0x80)
+      {
+        BinarySegmentWriteUint8(index_seg, uint8_t(delta | 0x80));
+        delta >>= 7;
+      }
+      BinarySegmentWriteUint8(index_seg, uint8_t(delta));
+    }
+  }
+
+  BufferDestroy(&indices, heap);
+  BufferDestroy(&remap, heap);
+  BufferDestroy(&order, heap);
+}
+
+}
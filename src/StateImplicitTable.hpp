@@ -0,0 +1,73 @@
+#ifndef TUNDRA_STATEIMPLICITTABLE_HPP
+#define TUNDRA_STATEIMPLICITTABLE_HPP
+
+#include "Common.hpp"
+#include "Buffer.hpp"
+#include "BinaryWriter.hpp"
+#include "HashTable.hpp"
+
+namespace t2
+{
+  struct MemAllocHeap;
+  struct MemAllocLinear;
+
+  // The implicit inputs of all nodes are collected into one table while the
+  // node states are written. Each node's list is written at the end, as sorted
+  // indices into the table, since the final order is only known then.
+  struct StateImplicitFile
+  {
+    const char* m_Filename;
+    uint32_t    m_FilenameHash;
+    uint32_t    m_Next;           // Next file with the same name and another timestamp, or ~0u
+    uint64_t    m_Timestamp;
+  };
+
+  struct StateImplicitList
+  {
+    BinarySegment* m_Seg;         // State segment the node was written to
+    uint32_t m_Pointer;           // Deferred pointer in m_Seg
+    uint32_t m_Start;             // First entry in m_Refs
+    int32_t  m_Count;
+  };
+
+  struct StateImplicitTable
+  {
+    MemAllocHeap*                           m_Heap;
+    MemAllocLinear*                         m_Alloc;
+    HashTable<uint32_t, kFlagCaseSensitive> m_Index;
+    Buffer<StateImplicitFile>               m_Files;
+    Buffer<uint32_t>                        m_Refs;
+    Buffer<StateImplicitList>               m_Lists;
+  };
+
+  // Without an allocator, the table keeps the file names it is given instead of
+  // copying them.
+  void StateImplicitTableInit(StateImplicitTable* self, MemAllocHeap* heap, MemAllocLinear* alloc);
+
+  void StateImplicitTableDestroy(StateImplicitTable* self);
+
+  // Writes the count and a pointer to be filled in by StateImplicitTableWrite.
+  // The entries follow with StateImplicitListAdd.
+  void StateImplicitListBegin(StateImplicitTable* self, BinarySegment* state_seg, int32_t count);
+
+  // Index of a file at a timestamp in the table, which is added if it's new.
+  uint32_t StateImplicitFileIndex(StateImplicitTable* self, const char* filename, uint32_t hash, uint64_t timestamp);
+
+  void StateImplicitListAdd(StateImplicitTable* self, const char* filename, uint32_t hash, uint64_t timestamp);
+
+  // Adds the lists of src after those already in the table. The file names of
+  // src must outlive the table if it doesn't copy them.
+  void StateImplicitTableMerge(StateImplicitTable* self, const StateImplicitTable* src);
+
+  // Sorts the table, writes it as StateData::m_ImplicitFiles to the main
+  // segment and fills in the nodes' lists as varint deltas between ascending
+  // indices.
+  void StateImplicitTableWrite(
+      StateImplicitTable* self,
+      BinarySegment*      main_seg,
+      BinarySegment*      file_seg,
+      BinarySegment*      index_seg,
+      BinarySegment*      string_seg);
+}
+
+#endif
@@ -0,0 +1,158 @@
+#include "StateJournal.hpp"
+#include "FileInfo.hpp"
+#include "Hash.hpp"
+
+#include <stdio.h>
+#include <string.h>
+
+namespace t2
+{
+
+struct StateJournalHeader
+{
+  static const uint32_t MagicNumber = 0x5a7e1091 ^ kTundraHashMagic;
+
+  uint32_t m_MagicNumber;
+  uint32_t m_Size;
+  uint64_t m_Checksum;
+};
+
+static_assert(sizeof(StateJournalHeader) == 16, "records must stay 16 byte aligned");
+
+static uint64_t StateJournalChecksum(const void* data, size_t size)
+{
+  HashState h;
+  HashDigest digest;
+  HashInit(&h);
+  HashUpdate(&h, data, size);
+  HashFinalize(&h, &digest);
+  uint64_t result;
+  memcpy(&result, digest.m_Data, sizeof result);
+  return result;
+}
+
+void StateJournalInit(StateJournal* self, MemAllocHeap* heap, const char* state_filename)
+{
+  self->m_Initialized = true;
+  self->m_Heap        = heap;
+  self->m_File        = nullptr;
+  self->m_Failed      = false;
+  self->m_RecordCount = 0;
+
+  MutexInit(&self->m_Mutex);
+  LinearAllocInit(&self->m_Allocator, heap, MB(16), "state journal");
+  BinaryWriterInit(&self->m_Writer, heap);
+  BufferInit(&self->m_Record);
+
+  snprintf(self->m_FileName, sizeof self->m_FileName, "%s.journal", state_filename);
+}
+
+void StateJournalDestroy(StateJournal* self)
+{
+  if (!self->m_Initialized)
+    return;
+
+  if (self->m_File)
+    fclose((FILE*) self->m_File);
+
+  BufferDestroy(&self->m_Record, self->m_Heap);
+  BinaryWriterDestroy(&self->m_Writer);
+  LinearAllocDestroy(&self->m_Allocator);
+  MutexDestroy(&self->m_Mutex);
+  self->m_Initialized = false;
+}
+
+bool StateJournalAppend(StateJournal* self)
+{
+  BufferClear(&self->m_Record);
+  BinaryWriterFlushToBuffer(&self->m_Writer, &self->m_Record, self->m_Heap);
+  BinaryWriterReset(&self->m_Writer);
+
+  if (self->m_Failed)
+    return false;
+
+  if (!self->m_File)
+  {
+    self->m_File = fopen(self->m_FileName, "ab");
+    if (!self->m_File)
+    {
+      Log(kWarning, "couldn't open build state journal %s", self->m_FileName);
+      self->m_Failed = true;
+      return false;
+    }
+  }
+
+  FILE* f = (FILE*) self->m_File;
+
+  StateJournalHeader header;
+  header.m_MagicNumber = StateJournalHeader::MagicNumber;
+  header.m_Size        = uint32_t(self->m_Record.m_Size);
+  header.m_Checksum    = StateJournalChecksum(self->m_Record.m_Storage, self->m_Record.m_Size);
+
+  // Flushing hands the record to the OS, so it survives the process being
+  // killed. We don't sync to disk; the journal isn't worth that for each node.
+  if (1 != fwrite(&header, sizeof header, 1, f) ||
+      self->m_Record.m_Size != fwrite(self->m_Record.m_Storage, 1, self->m_Record.m_Size, f) ||
+      0 != fflush(f))
+  {
+    Log(kWarning, "couldn't write build state journal %s", self->m_FileName);
+    self->m_Failed = true;
+    return false;
+  }
+
+  ++self->m_RecordCount;
+  return true;
+}
+
+void StateJournalRemove(StateJournal* self)
+{
+  if (self->m_File)
+  {
+    fclose((FILE*) self->m_File);
+    self->m_File = nullptr;
+  }
+
+  remove(self->m_FileName);
+  self->m_RecordCount = 0;
+}
+
+bool StateJournalRead(const char* filename, MemAllocHeap* heap, Buffer<uint8_t>* data, Buffer<size_t>* offsets)
+{
+  FileInfo info = GetFileInfo(filename);
+  if (!info.IsFile())
+    return false;
+
+  FILE* f = fopen(filename, "rb");
+  if (!f)
+    return false;
+
+  size_t base = data->m_Size;
+  uint8_t* bytes = BufferAlloc(data, heap, size_t(info.m_Size));
+  size_t size = fread(bytes, 1, size_t(info.m_Size), f);
+  fclose(f);
+
+  size_t pos = 0;
+  while (size - pos >= sizeof(StateJournalHeader))
+  {
+    StateJournalHeader header;
+    memcpy(&header, bytes + pos, sizeof header);
+
+    size_t payload = pos + sizeof header;
+    if (header.m_MagicNumber != StateJournalHeader::MagicNumber || header.m_Size % 16 != 0 || header.m_Size > size - payload)
+      break;
+
+    if (header.m_Checksum != StateJournalChecksum(bytes + payload, header.m_Size))
+      break;
+
+    BufferAppendOne(offsets, heap, base + payload);
+    pos = payload + header.m_Size;
+  }
+
+  if (pos < size)
+    Log(kDebug, "ignoring %d bytes at the end of build state journal %s", int(size - pos), filename);
+
+  data->m_Size = base + pos;
+  return true;
+}
+
+}
@@ -0,0 +1,56 @@
+#ifndef TUNDRA_STATEJOURNAL_HPP
+#define TUNDRA_STATEJOURNAL_HPP
+
+#include "Common.hpp"
+#include "Buffer.hpp"
+#include "BinaryWriter.hpp"
+#include "MemAllocHeap.hpp"
+#include "MemAllocLinear.hpp"
+#include "Mutex.hpp"
+#include "PathUtil.hpp"
+
+namespace t2
+{
+  // Append-only log kept next to the build state file. The state of each node
+  // is appended as soon as its action has run, so that a build that is killed
+  // before it gets to save the state file doesn't forget the work it did. The
+  // next run folds the journal into the state file, as does every state save.
+  //
+  // Each record is a header with the size and checksum of the payload,
+  // followed by the payload. Records are flushed to the OS as they are
+  // appended, and a torn record at the end is ignored when the journal is read.
+  struct StateJournal
+  {
+    bool            m_Initialized;
+    Mutex           m_Mutex;
+    MemAllocHeap*   m_Heap;
+    // Scratch space for building a record. Only used with m_Mutex held.
+    MemAllocLinear  m_Allocator;
+    BinaryWriter    m_Writer;
+    Buffer<uint8_t> m_Record;
+    // Opened on the first append.
+    void*           m_File;
+    bool            m_Failed;
+    uint32_t        m_RecordCount;
+    char            m_FileName[kMaxPathLength];
+  };
+
+  void StateJournalInit(StateJournal* self, MemAllocHeap* heap, const char* state_filename);
+
+  void StateJournalDestroy(StateJournal* self);
+
+  // Appends the contents of m_Writer as a record and resets the writer for the
+  // next one. Call with m_Mutex held. After a write error, the journal stops
+  // taking records.
+  bool StateJournalAppend(StateJournal* self);
+
+  // Closes and deletes the journal, once its records are in the state file.
+  void StateJournalRemove(StateJournal* self);
+
+  // Reads the intact records of a journal file into data, and their offsets in
+  // data into offsets. Records are 16 byte aligned if data is. Returns false
+  // if there is no journal.
+  bool StateJournalRead(const char* filename, MemAllocHeap* heap, Buffer<uint8_t>* data, Buffer<size_t>* offsets);
+}
+
+#endif
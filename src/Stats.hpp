@@ -13,13 +13,26 @@ struct TundraStats
   uint32_t m_OldScanCacheHits;
   uint32_t m_ScanCacheMisses;
   uint32_t m_ScanCacheInserts;
+  uint32_t m_ScanDuplicatesAvoided;
   uint64_t m_ScanCacheSaveTime;
+  uint32_t m_ScanCacheSavedEarly;
   uint32_t m_ScanCacheEntriesDropped;
+  uint32_t m_ScanFileCount;
+  uint64_t m_ScanBytes;
+  uint64_t m_ScanTimeCycles;
 
   uint32_t m_StateSaveNew;
   uint32_t m_StateSaveOld;
   uint32_t m_StateSaveDropped;
   uint64_t m_StateSaveTimeCycles;
+  uint64_t m_StateSaveBytes;
+  uint64_t m_StateLoadTimeCycles;
+  uint64_t m_StateLoadBytes;
+  uint32_t m_StateImplicitFiles;
+  uint32_t m_StateImplicitRefs;
+  uint32_t m_StateJournalRecords;
+  uint64_t m_StateJournalTimeCycles;
+  uint32_t m_StateJournalReplayed;
 
   uint32_t m_MmapCalls;
   uint64_t m_MmapTimeCycles;
@@ -43,8 +56,11 @@ struct TundraStats
   uint64_t m_JsonParseTimeCycles;
 
   uint64_t m_DigestCacheSaveTimeCycles;
+  uint32_t m_DigestCacheSavedEarly;
   uint64_t m_DigestCacheGetTimeCycles;
   uint32_t m_DigestCacheHits;
+  uint32_t m_DigestDuplicatesAvoided;
+  uint32_t m_DigestsPrefetched;
   uint32_t m_FileDigestCount;
   uint64_t m_FileDigestTimeCycles;
 };
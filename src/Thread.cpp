@@ -4,6 +4,12 @@
 #include <pthread.h>
 #endif
 
+#if defined(TUNDRA_LINUX)
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
 #if defined(TUNDRA_WIN32)
 #include <windows.h>
 #include <process.h>
@@ -53,4 +59,16 @@ void ThreadJoin(ThreadId thread_id)
 #endif
 }
 
+void ThreadSetLowPriority()
+{
+#if defined(TUNDRA_LINUX)
+  // Nice values are per thread on Linux.
+  setpriority(PRIO_PROCESS, (id_t) syscall(SYS_gettid), 10);
+#elif defined(TUNDRA_APPLE)
+  pthread_set_qos_class_self_np(QOS_CLASS_UTILITY, 0);
+#elif defined(TUNDRA_WIN32)
+  SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_BELOW_NORMAL);
+#endif
+}
+
 }
@@ -21,6 +21,10 @@ namespace t2
   void ThreadJoin(ThreadId thread_id);
 
   ThreadId ThreadCurrent();
+
+  // Lowers the scheduling priority of the calling thread for background work.
+  // The thread still gets some CPU time when the machine is busy.
+  void ThreadSetLowPriority();
 }
 
 #endif
@@ -0,0 +1,302 @@
+/*
+ * t2-trace.so - LD_PRELOAD shim used for actions marked TraceFileAccess.
+ *
+ * Every open, stat or access of a path is appended to the file named by
+ * TUNDRA_TRACE_FILE as one line: "r <path>" for reads and probes, "w <path>"
+ * for files opened for writing or renamed into place, and "n <path>" for
+ * reads and probes that found nothing, such as a compiler or linker searching
+ * its -I and -L paths. Relative paths are made absolute so tundra can match
+ * them against the DAG. Child processes inherit the environment and append to
+ * the same file; each line is a single O_APPEND write so lines from different
+ * processes do not mix.
+ *
+ * Statically linked tools and anything that makes raw system calls are not
+ * seen.
+ */
+
+#define _GNU_SOURCE
+#undef _FORTIFY_SOURCE
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+struct stat;
+struct stat64;
+struct statx;
+
+#define TRACE_NOT_OPENED (-2)
+
+static int s_TraceFd = TRACE_NOT_OPENED;
+
+static int TraceFd(void)
+{
+  int fd = __atomic_load_n(&s_TraceFd, __ATOMIC_ACQUIRE);
+  if (fd != TRACE_NOT_OPENED)
+    return fd;
+
+  const char* fn = getenv("TUNDRA_TRACE_FILE");
+  fd = -1;
+  if (fn && *fn)
+    fd = (int) syscall(SYS_openat, AT_FDCWD, fn, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0666);
+
+  int expected = TRACE_NOT_OPENED;
+  if (!__atomic_compare_exchange_n(&s_TraceFd, &expected, fd, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+  {
+    // Another thread got there first.
+    if (fd >= 0)
+      close(fd);
+    fd = expected;
+  }
+  return fd;
+}
+
+static int IsPseudoPath(const char* path)
+{
+  return
+    0 == strncmp(path, "/proc/", 6) ||
+    0 == strncmp(path, "/sys/", 5) ||
+    0 == strncmp(path, "/dev/", 5);
+}
+
+static void Record(char kind, int dirfd, const char* path)
+{
+  int saved_errno = errno;
+  int fd = TraceFd();
+
+  if (fd >= 0 && path && path[0])
+  {
+    char line[PATH_MAX * 2 + 4];
+    size_t len = 0;
+
+    line[len++] = kind;
+    line[len++] = ' ';
+
+    int ok = 1;
+    if (path[0] != '/')
+    {
+      if (dirfd == AT_FDCWD)
+      {
+        ok = NULL != getcwd(line + len, PATH_MAX);
+      }
+      else
+      {
+        char proc_path[64];
+        snprintf(proc_path, sizeof proc_path, "/proc/self/fd/%d", dirfd);
+        ssize_t n = readlink(proc_path, line + len, PATH_MAX - 1);
+        ok = n > 0;
+        if (ok)
+          line[len + n] = '\0';
+      }
+
+      if (ok)
+      {
+        len += strlen(line + len);
+        line[len++] = '/';
+      }
+    }
+
+    size_t path_len = strlen(path);
+    if (ok && len + path_len + 1 <= sizeof line && !IsPseudoPath(path))
+    {
+      memcpy(line + len, path, path_len);
+      len += path_len;
+      line[len++] = '\n';
+      if (write(fd, line, len) < 0)
+      {
+        // Nothing sensible to do; the action must not fail because of us.
+      }
+    }
+  }
+
+  errno = saved_errno;
+}
+
+// Records a successful access, or a read that failed because the path doesn't
+// exist. Must be called before anything can change errno.
+static void RecordResult(int ok, char kind, int dirfd, const char* path)
+{
+  if (ok)
+    Record(kind, dirfd, path);
+  else if (kind == 'r' && (errno == ENOENT || errno == ENOTDIR))
+    Record('n', dirfd, path);
+}
+
+static char OpenKind(int flags)
+{
+  return ((flags & O_ACCMODE) != O_RDONLY || (flags & (O_CREAT | O_TRUNC))) ? 'w' : 'r';
+}
+
+static int NeedsMode(int flags)
+{
+#if defined(O_TMPFILE)
+  if ((flags & O_TMPFILE) == O_TMPFILE)
+    return 1;
+#endif
+  return 0 != (flags & O_CREAT);
+}
+
+#define REAL(name, type) \
+  static __typeof__(type) real_ ## name; \
+  if (!real_ ## name) \
+    real_ ## name = (type) dlsym(RTLD_NEXT, #name)
+
+#define DEFINE_OPEN(name) \
+  int name(const char* path, int flags, ...) \
+  { \
+    REAL(name, int (*)(const char*, int, ...)); \
+    mode_t mode = 0; \
+    if (NeedsMode(flags)) \
+    { \
+      va_list args; \
+      va_start(args, flags); \
+      mode = (mode_t) va_arg(args, int); \
+      va_end(args); \
+    } \
+    int result = real_ ## name(path, flags, mode); \
+    RecordResult(result >= 0, OpenKind(flags), AT_FDCWD, path); \
+    return result; \
+  }
+
+#define DEFINE_OPENAT(name) \
+  int name(int dirfd, const char* path, int flags, ...) \
+  { \
+    REAL(name, int (*)(int, const char*, int, ...)); \
+    mode_t mode = 0; \
+    if (NeedsMode(flags)) \
+    { \
+      va_list args; \
+      va_start(args, flags); \
+      mode = (mode_t) va_arg(args, int); \
+      va_end(args); \
+    } \
+    int result = real_ ## name(dirfd, path, flags, mode); \
+    RecordResult(result >= 0, OpenKind(flags), dirfd, path); \
+    return result; \
+  }
+
+#define DEFINE_CREAT(name) \
+  int name(const char* path, mode_t mode) \
+  { \
+    REAL(name, int (*)(const char*, mode_t)); \
+    int result = real_ ## name(path, mode); \
+    RecordResult(result >= 0, 'w', AT_FDCWD, path); \
+    return result; \
+  }
+
+#define DEFINE_FOPEN(name) \
+  FILE* name(const char* path, const char* mode) \
+  { \
+    REAL(name, FILE* (*)(const char*, const char*)); \
+    FILE* result = real_ ## name(path, mode); \
+    RecordResult(result != NULL, (mode[0] == 'r' && !strchr(mode, '+')) ? 'r' : 'w', AT_FDCWD, path); \
+    return result; \
+  }
+
+#define DEFINE_STAT(name, stat_type) \
+  int name(const char* path, stat_type* buf) \
+  { \
+    REAL(name, int (*)(const char*, stat_type*)); \
+    int result = real_ ## name(path, buf); \
+    RecordResult(result == 0, 'r', AT_FDCWD, path); \
+    return result; \
+  }
+
+#define DEFINE_XSTAT(name, stat_type) \
+  int name(int ver, const char* path, stat_type* buf) \
+  { \
+    REAL(name, int (*)(int, const char*, stat_type*)); \
+    int result = real_ ## name(ver, path, buf); \
+    RecordResult(result == 0, 'r', AT_FDCWD, path); \
+    return result; \
+  }
+
+#define DEFINE_FSTATAT(name, stat_type) \
+  int name(int dirfd, const char* path, stat_type* buf, int flags) \
+  { \
+    REAL(name, int (*)(int, const char*, stat_type*, int)); \
+    int result = real_ ## name(dirfd, path, buf, flags); \
+    RecordResult(result == 0, 'r', dirfd, path); \
+    return result; \
+  }
+
+#define DEFINE_FXSTATAT(name, stat_type) \
+  int name(int ver, int dirfd, const char* path, stat_type* buf, int flags) \
+  { \
+    REAL(name, int (*)(int, int, const char*, stat_type*, int)); \
+    int result = real_ ## name(ver, dirfd, path, buf, flags); \
+    RecordResult(result == 0, 'r', dirfd, path); \
+    return result; \
+  }
+
+DEFINE_OPEN(open)
+DEFINE_OPEN(open64)
+DEFINE_OPENAT(openat)
+DEFINE_OPENAT(openat64)
+DEFINE_CREAT(creat)
+DEFINE_CREAT(creat64)
+DEFINE_FOPEN(fopen)
+DEFINE_FOPEN(fopen64)
+
+DEFINE_STAT(stat, struct stat)
+DEFINE_STAT(lstat, struct stat)
+DEFINE_STAT(stat64, struct stat64)
+DEFINE_STAT(lstat64, struct stat64)
+DEFINE_FSTATAT(fstatat, struct stat)
+DEFINE_FSTATAT(fstatat64, struct stat64)
+
+// glibc before 2.33 routes stat() through these.
+DEFINE_XSTAT(__xstat, struct stat)
+DEFINE_XSTAT(__lxstat, struct stat)
+DEFINE_XSTAT(__xstat64, struct stat64)
+DEFINE_XSTAT(__lxstat64, struct stat64)
+DEFINE_FXSTATAT(__fxstatat, struct stat)
+DEFINE_FXSTATAT(__fxstatat64, struct stat64)
+
+int statx(int dirfd, const char* path, int flags, unsigned int mask, struct statx* buf)
+{
+  REAL(statx, int (*)(int, const char*, int, unsigned int, struct statx*));
+  int result = real_statx(dirfd, path, flags, mask, buf);
+  RecordResult(result == 0, 'r', dirfd, path);
+  return result;
+}
+
+int access(const char* path, int mode)
+{
+  REAL(access, int (*)(const char*, int));
+  int result = real_access(path, mode);
+  RecordResult(result == 0, 'r', AT_FDCWD, path);
+  return result;
+}
+
+int faccessat(int dirfd, const char* path, int mode, int flags)
+{
+  REAL(faccessat, int (*)(int, const char*, int, int));
+  int result = real_faccessat(dirfd, path, mode, flags);
+  RecordResult(result == 0, 'r', dirfd, path);
+  return result;
+}
+
+// Tools that write a temporary file and rename it over the real output.
+int rename(const char* old_path, const char* new_path)
+{
+  REAL(rename, int (*)(const char*, const char*));
+  int result = real_rename(old_path, new_path);
+  RecordResult(result == 0, 'w', AT_FDCWD, new_path);
+  return result;
+}
+
+int renameat(int old_dirfd, const char* old_path, int new_dirfd, const char* new_path)
+{
+  REAL(renameat, int (*)(int, const char*, int, const char*));
+  int result = real_renameat(old_dirfd, old_path, new_dirfd, new_path);
+  RecordResult(result == 0, 'w', new_dirfd, new_path);
+  return result;
+}
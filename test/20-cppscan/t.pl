@@ -22,6 +22,15 @@ Build {
 }
 END
 
+my $pp_build_file = $build_file;
+$pp_build_file =~ s/DefaultOnHost = \{ native.host_platform \},/DefaultOnHost = { native.host_platform },\n\t\t\tEnv = { CPPSCANNER_PREPROCESS = "1", CPPSCANNER_DEFS = { "!_WIN32" } },/;
+
+my $depfile_build_file = $build_file;
+$depfile_build_file =~ s/DefaultOnHost = \{ native.host_platform \},/DefaultOnHost = { native.host_platform },\n\t\t\tEnv = { CPPDEPFILE = "1" },/;
+
+my $trace_build_file = $build_file;
+$trace_build_file =~ s/DefaultOnHost = \{ native.host_platform \},/DefaultOnHost = { native.host_platform },\n\t\t\tEnv = { CPPDEPFILE = "trace" },/;
+
 my $foo_c = <<END;
 #include <stdio.h>
 #include "include1.h"
@@ -104,6 +113,42 @@ sub test5() {
 	});
 }
 
+sub test6() {
+	run_test({
+		'tundra.lua' => $pp_build_file,
+		'foo.c' => $foo_c,
+		'include1.h' => "#ifndef INC1\n#define INC1\n#ifdef _WIN32\n#include <windows.h>\n#else\n#include \"include2.h\"\n#endif\n#endif\n",
+		'include2.h' => "enum { X = 0 };\n"
+	}, sub {
+		update_file 'include2.h', "enum { X = 1 };\n";
+	});
+}
+
+sub test7() {
+	run_test({
+		'tundra.lua' => $depfile_build_file,
+		'foo.c' => $foo_c,
+		'include1.h' => "\n\n#include \"foo/include2.h\"\n",
+		'foo/include2.h' => "enum { X = 0 };\n"
+	}, sub {
+		update_file 'foo/include2.h', "enum { X = 1 };\n";
+	});
+}
+
+sub test8() {
+	# The tracing shim is only built on Linux.
+	return unless $^O eq 'linux';
+
+	run_test({
+		'tundra.lua' => $trace_build_file,
+		'foo.c' => $foo_c,
+		'include1.h' => "\n\n#include \"foo/include2.h\"\n",
+		'foo/include2.h' => "enum { X = 0 };\n"
+	}, sub {
+		update_file 'foo/include2.h', "enum { X = 1 };\n";
+	});
+}
+
 deftest {
 	name => "cpp include scanning",
 	procs => [
@@ -112,5 +157,8 @@ deftest {
 		"Parent directory" => \&test3,
 		"Sibling directory" => \&test4,
 		"Header cycle" => \&test5,
+		"Preprocessing scanner" => \&test6,
+		"Compiler dependency file" => \&test7,
+		"Traced file access" => \&test8,
 	],
 };
@@ -0,0 +1,93 @@
+
+sub make_build_file($) {
+	my $comment = shift;
+	<<END;
+-- $comment
+require 'tundra.syntax.testsupport'
+local native = require 'tundra.native'
+
+Build {
+	Configs = {
+		Config {
+			Name = "foo-bar",
+      SupportedHosts = { native.host_platform },
+		}
+	},
+	Units = function()
+		UpperCaseFile {
+			Name = "foo",
+			InputFile = "test.input",
+			OutputFile = "\$(OBJECTDIR)/test.output",
+		}
+		Default "foo"
+	end,
+}
+END
+}
+
+sub expect_frontend($$) {
+	my ($output, $expected) = @_;
+	my $ran = $output =~ /Build frontend of .* ran/;
+	fail "frontend didn't run" if $expected and not $ran;
+	fail "frontend ran" if $ran and not $expected;
+}
+
+sub expect_digested($$) {
+	my ($output, $expected) = @_;
+	my $digested = $output =~ /tundra\.lua: contents unchanged/;
+	fail "tundra.lua wasn't digested" if $expected and not $digested;
+	fail "tundra.lua was digested" if $digested and not $expected;
+}
+
+sub touched_build_file {
+	my $files = {
+		"tundra.lua" => make_build_file("first"),
+		"test.input" => "input",
+	};
+
+	with_sandbox($files, sub {
+		my $now = time();
+		set_timestamp 'tundra.lua', $now - 100;
+		expect_frontend run_tundra('foo-bar'), 1;
+
+		# A new timestamp alone only costs a digest, and only once.
+		set_timestamp 'tundra.lua', $now - 50;
+		my $output = run_tundra 'foo-bar';
+		expect_frontend $output, 0;
+		expect_digested $output, 1;
+
+		$output = run_tundra 'foo-bar';
+		expect_frontend $output, 0;
+		expect_digested $output, 0;
+
+		update_file 'tundra.lua', make_build_file("second");
+		set_timestamp 'tundra.lua', $now - 40;
+		expect_frontend run_tundra('foo-bar'), 1;
+	});
+}
+
+sub racy_build_file {
+	my $files = {
+		"tundra.lua" => make_build_file("first"),
+		"test.input" => "input",
+	};
+
+	with_sandbox($files, sub {
+		# Written just before the DAG, so its timestamp isn't trusted.
+		my $now = time();
+		set_timestamp 'tundra.lua', $now;
+		expect_frontend run_tundra('foo-bar'), 1;
+
+		update_file 'tundra.lua', make_build_file("second");
+		set_timestamp 'tundra.lua', $now;
+		expect_frontend run_tundra('foo-bar'), 1;
+	});
+}
+
+deftest {
+	name => "DAG signatures",
+	procs => [
+		"Touched build file" => \&touched_build_file,
+		"Racy build file" => \&racy_build_file,
+	]
+};
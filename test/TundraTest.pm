@@ -20,7 +20,7 @@ BEGIN {
     @EXPORT = qw(
     &deftest &run_tundra &expect_contents &expect_output_contents
     &output_file_exists
-    &update_file &with_sandbox &bump_timestamp
+    &update_file &with_sandbox &bump_timestamp &set_timestamp
     &md5_output_file
     &fail);
     @EXPORT_OK = qw(&load_tests &run_tests $objectroot);
@@ -105,6 +105,8 @@ sub run_tundra($;$) {
   # Store away config & output dir for convenience later when checking results.
   $curr_config = $config;
   $curr_output_dir = catdir($objectroot, $curr_config . '-debug-default');
+
+  return join("", @output);
 }
 
 sub expect_contents($$) {
@@ -166,6 +168,13 @@ sub bump_timestamp($) {
     or warn "couldn't touch $targfn: $!";
 }
 
+sub set_timestamp($$) {
+  my ($fn, $mtime) = @_;
+  my $targfn = sandbox_path($fn);
+  utime($mtime, $mtime, $targfn)
+    or warn "couldn't touch $targfn: $!";
+}
+
 sub wrap_script($$) {
   my ($pkgname, $script) = @_;
  <<END;
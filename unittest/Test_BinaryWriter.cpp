@@ -0,0 +1,105 @@
+#include "BinaryWriter.hpp"
+#include "MemAllocHeap.hpp"
+#include "TestHarness.hpp"
+#include <cstdio>
+#include <vector>
+
+using namespace t2;
+
+class BinaryWriterTest : public ::testing::Test
+{
+protected:
+  MemAllocHeap heap;
+  BinaryWriter writer;
+
+  static const char* OutputFile() { return "binarywriter-test.tmp"; }
+
+protected:
+  void SetUp() override
+  {
+    HeapInit(&heap);
+    BinaryWriterInit(&writer, &heap);
+  }
+
+  void TearDown() override
+  {
+    BinaryWriterDestroy(&writer);
+    remove(OutputFile());
+    HeapDestroy(&heap);
+  }
+
+  std::vector<uint8_t> Flush()
+  {
+    std::vector<uint8_t> data;
+    EXPECT_TRUE(BinaryWriterFlush(&writer, OutputFile()));
+    FILE* f = fopen(OutputFile(), "rb");
+    EXPECT_NE(nullptr, f);
+    if (!f)
+      return data;
+    uint8_t buffer[256];
+    while (size_t n = fread(buffer, 1, sizeof buffer, f))
+      data.insert(data.end(), buffer, buffer + n);
+    fclose(f);
+    return data;
+  }
+
+  // Resolves the relative pointer at `offset` to an offset in the file.
+  static int64_t Target(const std::vector<uint8_t>& data, size_t offset)
+  {
+    int32_t delta;
+    memcpy(&delta, &data[offset], sizeof delta);
+    return int64_t(offset) + delta;
+  }
+};
+
+TEST_F(BinaryWriterTest, AppendedSegmentKeepsPointers)
+{
+  BinarySegment* main_seg  = BinaryWriterAddSegment(&writer);
+  BinarySegment* data_seg  = BinaryWriterAddSegment(&writer);
+  BinarySegment* extra_seg = BinaryWriterAddSegment(&writer);
+
+  // Into the segment that gets appended, and out of it.
+  BinaryLocator main_start = BinarySegmentPosition(main_seg);
+  BinarySegmentWritePointer(main_seg, BinarySegmentPosition(extra_seg));
+  BinarySegmentWriteStringData(extra_seg, "hello");
+  BinarySegmentWritePointer(extra_seg, main_start);
+
+  BinarySegmentWriteStringData(data_seg, "abc");
+  BinarySegmentAppend(data_seg, extra_seg);
+
+  ASSERT_EQ(0u, BinarySegmentSize(extra_seg));
+  ASSERT_EQ(14u, BinarySegmentSize(data_seg));
+
+  std::vector<uint8_t> data = Flush();
+
+  // The main segment is padded to 16 bytes; the empty one takes no space.
+  ASSERT_EQ(32u, data.size());
+  EXPECT_STREQ("abc", (const char*) &data[16]);
+  EXPECT_STREQ("hello", (const char*) &data[20]);
+  EXPECT_EQ(20, Target(data, 0));
+  EXPECT_EQ(0, Target(data, 26));
+}
+
+TEST_F(BinaryWriterTest, DeferredPointer)
+{
+  BinarySegment* main_seg = BinaryWriterAddSegment(&writer);
+  BinarySegment* str_seg  = BinaryWriterAddSegment(&writer);
+
+  BinarySegmentWriteUint32(main_seg, 0x12345678);
+  uint32_t first  = BinarySegmentWriteDeferredPointer(main_seg);
+  uint32_t second = BinarySegmentWriteDeferredPointer(main_seg);
+
+  BinaryLocator foo = BinarySegmentPosition(str_seg);
+  BinarySegmentWriteStringData(str_seg, "foo");
+  BinaryLocator bar = BinarySegmentPosition(str_seg);
+  BinarySegmentWriteStringData(str_seg, "bar");
+
+  BinarySegmentSetPointer(main_seg, second, foo);
+  BinarySegmentSetPointer(main_seg, first, bar);
+
+  std::vector<uint8_t> data = Flush();
+
+  ASSERT_EQ(32u, data.size());
+  EXPECT_STREQ("bar", (const char*) &data[Target(data, 4)]);
+  EXPECT_STREQ("foo", (const char*) &data[Target(data, 8)]);
+}
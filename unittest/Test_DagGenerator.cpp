@@ -0,0 +1,191 @@
+#include "DagGenerator.hpp"
+#include "DagData.hpp"
+#include "JsonParse.hpp"
+#include "HelperPool.hpp"
+#include "MemAllocHeap.hpp"
+#include "MemoryMappedFile.hpp"
+#include "TestHarness.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+using namespace t2;
+
+namespace
+{
+  // Records the events of a parse, as the Lua frontend would write them.
+  bool RecordEvent(void* user_data, const JsonEvent& event)
+  {
+    JsonEventRecorder* rec = static_cast<JsonEventRecorder*>(user_data);
+    switch (event.m_Type)
+    {
+      case kJsonEventBeginObject: JsonRecordBeginObject(rec); break;
+      case kJsonEventEndObject:   JsonRecordEndObject(rec); break;
+      case kJsonEventBeginArray:  JsonRecordBeginArray(rec); break;
+      case kJsonEventEndArray:    JsonRecordEndArray(rec); break;
+      case kJsonEventKey:         JsonRecordKey(rec, event.m_String, event.m_Length); break;
+      case kJsonEventString:      JsonRecordString(rec, event.m_String, event.m_Length); break;
+      case kJsonEventNumber:      JsonRecordNumber(rec, event.m_Number); break;
+      case kJsonEventBoolean:     JsonRecordBoolean(rec, event.m_Boolean); break;
+      case kJsonEventNull:        JsonRecordNull(rec); break;
+    }
+    return true;
+  }
+
+  // Node i runs "cmd i", depends on node i - 1 and reads a source file and
+  // one of a few headers shared with other nodes.
+  std::string MakeDagJson(int node_count)
+  {
+    std::string json =
+      "{\"Setup\":{\"Configs\":[\"c\"],\"Variants\":[\"v\"],\"SubVariants\":[\"s\"],"
+      "\"BuildTuples\":[{\"ConfigIndex\":0,\"VariantIndex\":0,\"SubVariantIndex\":0,"
+      "\"AlwaysNodes\":[],\"DefaultNodes\":[0],\"NamedNodes\":{\"first\":0}}],"
+      "\"DefaultBuildTuple\":{\"ConfigIndex\":0,\"VariantIndex\":0,\"SubVariantIndex\":0}},"
+      "\"Passes\":[\"Default\"],\"Scanners\":[],\"Nodes\":[";
+
+    char node[512];
+    for (int i = 0; i < node_count; ++i)
+    {
+      snprintf(node, sizeof node,
+          "%s{\"Action\":\"cmd %d\",\"Annotation\":\"Step %d\",\"PassIndex\":0,"
+          "\"Inputs\":[\"src/file%d.c\",\"include/common%d.h\"],\"Outputs\":[\"out/file%d.o\"]",
+          i ? "," : "", i, i % 7, i, i % 13, i);
+      json += node;
+      if (i > 0)
+      {
+        snprintf(node, sizeof node, ",\"Deps\":[%d]", i - 1);
+        json += node;
+      }
+      json += "}";
+    }
+
+    json += "],\"FileSignatures\":[],\"GlobSignatures\":[]}";
+    return json;
+  }
+
+  int ActionNumber(const NodeData& node)
+  {
+    int number = -1;
+    sscanf(node.m_Action.Get(), "cmd %d", &number);
+    return number;
+  }
+}
+
+class DagGeneratorTest : public ::testing::Test
+{
+protected:
+  MemAllocHeap      heap;
+  JsonEventRecorder rec;
+  MemoryMappedFile  serial_dag;
+  MemoryMappedFile  parallel_dag;
+
+  static const char* SerialFile() { return "dag-serial-test.tmp"; }
+  static const char* ParallelFile() { return "dag-parallel-test.tmp"; }
+
+protected:
+  void SetUp() override
+  {
+    HeapInit(&heap);
+    JsonRecorderInit(&rec, &heap);
+    MmapFileInit(&serial_dag);
+    MmapFileInit(&parallel_dag);
+  }
+
+  void TearDown() override
+  {
+    MmapFileDestroy(&parallel_dag);
+    MmapFileDestroy(&serial_dag);
+    remove(ParallelFile());
+    remove(SerialFile());
+    JsonRecorderDestroy(&rec);
+    HeapDestroy(&heap);
+  }
+
+  void Record(const std::string& json)
+  {
+    char error_msg[1024];
+    ASSERT_TRUE(JsonSaxParse(json.data(), json.size(), &heap, &rec, RecordEvent, error_msg)) << error_msg;
+  }
+
+  bool Compile(const char* dag_fn, HelperPool* helpers)
+  {
+    return CompileDagFromEvents(rec.m_Data.m_Storage, rec.m_Data.m_Size, dag_fn, helpers);
+  }
+};
+
+TEST_F(DagGeneratorTest, ChunkCountDoesNotChangeOutput)
+{
+  // Written as one chunk without helpers, and as four with them.
+  const int kNodeCount = 5000;
+  Record(MakeDagJson(kNodeCount));
+
+  ASSERT_TRUE(Compile(SerialFile(), nullptr));
+
+  HelperPool helpers;
+  HelperPoolInit(&helpers, 4);
+  bool parallel_ok = Compile(ParallelFile(), &helpers);
+  HelperPoolDestroy(&helpers);
+  ASSERT_TRUE(parallel_ok);
+
+  MmapFileMap(&serial_dag, SerialFile());
+  MmapFileMap(&parallel_dag, ParallelFile());
+  ASSERT_TRUE(MmapFileValid(&serial_dag));
+  ASSERT_TRUE(MmapFileValid(&parallel_dag));
+
+  ASSERT_EQ(serial_dag.m_Size, parallel_dag.m_Size);
+  EXPECT_EQ(0, memcmp(serial_dag.m_Address, parallel_dag.m_Address, serial_dag.m_Size));
+
+  // Nodes are stored in GUID order; check that every reference was remapped
+  // to the node and path it named in the frontend's order.
+  const DagData* dag = static_cast<const DagData*>(parallel_dag.m_Address);
+  ASSERT_TRUE(DagData::MagicNumber == dag->m_MagicNumber);
+  ASSERT_EQ(kNodeCount, dag->m_NodeCount);
+
+  // Every source and object file, and the shared headers.
+  EXPECT_EQ(2 * kNodeCount + 13, dag->m_Paths.GetCount());
+
+  const FrozenFileAndHash* paths = dag->m_Paths.GetArray();
+  int in_order = 0;
+  char expected[64];
+
+  for (int i = 0; i < kNodeCount; ++i)
+  {
+    const NodeData& node = dag->m_NodeData[i];
+    int number = ActionNumber(node);
+    ASSERT_LE(0, number);
+
+    if (number == i)
+      ++in_order;
+
+    EXPECT_EQ(uint32_t(number), node.m_OriginalIndex);
+
+    DagPathList inputs(paths, node.m_InputFiles);
+    ASSERT_EQ(2, inputs.GetCount());
+    snprintf(expected, sizeof expected, "src/file%d.c", number);
+    EXPECT_STREQ(expected, inputs[0].m_Filename.Get());
+    snprintf(expected, sizeof expected, "include/common%d.h", number % 13);
+    EXPECT_STREQ(expected, inputs[1].m_Filename.Get());
+
+    DagPathList outputs(paths, node.m_OutputFiles);
+    ASSERT_EQ(1, outputs.GetCount());
+    snprintf(expected, sizeof expected, "out/file%d.o", number);
+    EXPECT_STREQ(expected, outputs[0].m_Filename.Get());
+
+    snprintf(expected, sizeof expected, "Step %d", number % 7);
+    EXPECT_STREQ(expected, node.m_Annotation.Get());
+
+    if (number > 0)
+    {
+      ASSERT_EQ(1, node.m_Dependencies.GetCount());
+      EXPECT_EQ(number - 1, ActionNumber(dag->m_NodeData[node.m_Dependencies[0]]));
+    }
+    else
+    {
+      EXPECT_EQ(0, node.m_Dependencies.GetCount());
+    }
+  }
+
+  // Otherwise the remapping isn't exercised.
+  EXPECT_GT(kNodeCount / 2, in_order);
+}
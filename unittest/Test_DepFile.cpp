@@ -0,0 +1,153 @@
+#include "DepFile.hpp"
+#include "MemAllocLinear.hpp"
+#include "MemAllocHeap.hpp"
+#include "TestHarness.hpp"
+
+#include <cstring>
+#include <string>
+#include <vector>
+
+using namespace t2;
+
+class DepFileTest : public ::testing::Test
+{
+protected:
+  MemAllocHeap heap;
+  MemAllocLinear alloc;
+
+protected:
+  void SetUp() override
+  {
+    HeapInit(&heap);
+    LinearAllocInit(&alloc, &heap, 1024 * 1024, "Test Allocator");
+  }
+
+  void TearDown() override
+  {
+    LinearAllocDestroy(&alloc);
+    HeapDestroy(&heap);
+  }
+
+  std::vector<std::string> ParseMake(const char* text)
+  {
+    return ToVector(ParseMakeDepFile(text, strlen(text), &alloc));
+  }
+
+  std::vector<std::string> ParseMsvc(const char* text)
+  {
+    return ToVector(ParseMsvcIncludes(text, strlen(text), &alloc));
+  }
+
+  std::vector<std::string> ParseTrace(const char* text, std::vector<std::string>* writes, std::vector<std::string>* misses = nullptr)
+  {
+    DepFileEntry* written = nullptr;
+    DepFileEntry* missed = nullptr;
+    std::vector<std::string> result = ToVector(ParseFileTrace(text, strlen(text), &alloc, &written, &missed));
+    *writes = ToVector(written);
+    if (misses)
+      *misses = ToVector(missed);
+    return result;
+  }
+
+  static std::vector<std::string> ToVector(const DepFileEntry* entry)
+  {
+    std::vector<std::string> result;
+    for (; entry; entry = entry->m_Next)
+      result.push_back(entry->m_Path);
+    return result;
+  }
+};
+
+typedef std::vector<std::string> Paths;
+
+TEST_F(DepFileTest, Empty)
+{
+  ASSERT_EQ(Paths(), ParseMake(""));
+  ASSERT_EQ(Paths(), ParseMake("foo.o:\n"));
+}
+
+TEST_F(DepFileTest, SingleLine)
+{
+  ASSERT_EQ(Paths({ "foo.c", "foo.h", "bar.h" }), ParseMake("foo.o: foo.c foo.h bar.h\n"));
+}
+
+TEST_F(DepFileTest, Continuations)
+{
+  ASSERT_EQ(Paths({ "foo.c", "a.h", "b.h" }), ParseMake("foo.o: foo.c \\\n  a.h \\\r\n  b.h"));
+}
+
+TEST_F(DepFileTest, Escapes)
+{
+  ASSERT_EQ(Paths({ "dir with space/a.h", "hash#.h", "dollar$.h" }),
+      ParseMake("foo.o: dir\\ with\\ space/a.h hash\\#.h dollar$$.h\n"));
+}
+
+TEST_F(DepFileTest, PhonyTargetsAreSkipped)
+{
+  // As written by gcc -MP
+  ASSERT_EQ(Paths({ "foo.c", "foo.h" }), ParseMake("foo.o: foo.c foo.h\n\nfoo.h:\n"));
+  ASSERT_EQ(Paths({ "a.h" }), ParseMake("foo.o bar.o : a.h\nx.h:\n"));
+}
+
+TEST_F(DepFileTest, WindowsPaths)
+{
+  ASSERT_EQ(Paths({ "c:\\src\\foo.c", "C:/include/a.h" }), ParseMake("c:\\obj\\foo.o: c:\\src\\foo.c C:/include/a.h\n"));
+}
+
+TEST_F(DepFileTest, MsvcIncludes)
+{
+  const char* output =
+    "foo.cpp\r\n"
+    "Note: including file: c:\\src\\a.h\r\n"
+    "Note: including file:  c:\\src\\nested b.h\r\n"
+    "c:\\src\\foo.cpp(3): warning C4100: unused\r\n";
+
+  ASSERT_EQ(Paths({ "c:\\src\\a.h", "c:\\src\\nested b.h" }), ParseMsvc(output));
+}
+
+TEST_F(DepFileTest, StripMsvcIncludes)
+{
+  char output[] =
+    "foo.cpp\n"
+    "Note: including file: a.h\n"
+    "Note: including file:  b.h\n"
+    "warning\n"
+    "Note: including file: c.h";
+
+  size_t len = StripMsvcIncludes(output, strlen(output));
+  ASSERT_EQ(std::string("foo.cpp\nwarning\n"), std::string(output, len));
+}
+
+TEST_F(DepFileTest, FileTrace)
+{
+  const char* trace =
+    "r /src/a.c\n"
+    "r /src/a.h\n"
+    "r /src/a.c\n"
+    "w /tmp/cc1.s\n"
+    "r /tmp/cc1.s\n"
+    "w /out/a.o\n"
+    "w /out/a.o\n"
+    "r /src/partial";
+
+  Paths writes;
+  ASSERT_EQ(Paths({ "/src/a.c", "/src/a.h" }), ParseTrace(trace, &writes));
+  ASSERT_EQ(Paths({ "/tmp/cc1.s", "/out/a.o" }), writes);
+}
+
+TEST_F(DepFileTest, FileTraceMisses)
+{
+  const char* trace =
+    "n /inc1/a.h\n"
+    "r /inc2/a.h\n"
+    "n /inc1/b.h\n"
+    "n /inc1/b.h\n"
+    "n /lib1/libfoo.a\n"
+    "n /tmp/cc1.s\n"
+    "w /tmp/cc1.s\n"
+    "n /inc2/a.h\n";
+
+  Paths writes, misses;
+  ASSERT_EQ(Paths({ "/inc2/a.h" }), ParseTrace(trace, &writes, &misses));
+  ASSERT_EQ(Paths({ "/inc1/a.h", "/inc1/b.h", "/lib1/libfoo.a" }), misses);
+}
@@ -0,0 +1,408 @@
+#include "DigestCache.hpp"
+#include "Thread.hpp"
+#include "HelperPool.hpp"
+#include "TestHarness.hpp"
+#include <cstdio>
+#include <cstring>
+
+using namespace t2;
+
+namespace
+{
+  FileInfo MakeInfo(uint64_t mtime_ns)
+  {
+    FileInfo info;
+    memset(&info, 0, sizeof info);
+    info.m_Flags     = FileInfo::kFlagExists | FileInfo::kFlagFile;
+    info.m_Size      = 100;
+    info.m_Timestamp = mtime_ns / 1000000000;
+    info.m_MtimeNs   = mtime_ns;
+    info.m_CtimeNs   = mtime_ns;
+    info.m_Inode     = 17;
+    info.m_Device    = 3;
+    return info;
+  }
+
+  struct Waiter
+  {
+    DigestCache*  m_Cache;
+    volatile bool m_Started;
+    bool          m_Hit;
+    HashDigest    m_Digest;
+  };
+
+  ThreadRoutineReturnType TUNDRA_STDCALL WaiterRoutine(void* param)
+  {
+    Waiter* w = static_cast<Waiter*>(param);
+    DigestInFlight claim;
+    w->m_Started = true;
+    w->m_Hit = DigestCacheGetOrBegin(w->m_Cache, "foo.dat", 1234, MakeInfo(1), &w->m_Digest, &claim);
+    if (!w->m_Hit)
+      DigestCacheEnd(w->m_Cache, &claim);
+    return 0;
+  }
+}
+
+TEST(DigestCache, ConcurrentMissWaitsForFirst)
+{
+  DigestCache cache;
+  DigestCacheInit(&cache, MB(1), "this-file-does-not-exist");
+
+  HashDigest digest;
+  DigestInFlight claim;
+  ASSERT_FALSE(DigestCacheGetOrBegin(&cache, "foo.dat", 1234, MakeInfo(1), &digest, &claim));
+
+  Waiter w;
+  w.m_Cache = &cache;
+  w.m_Started = false;
+  w.m_Hit = false;
+  ThreadId thread = ThreadStart(WaiterRoutine, &w);
+
+  while (!w.m_Started)
+    ;
+
+  memset(&digest, 0x5a, sizeof digest);
+  DigestCacheSet(&cache, "foo.dat", 1234, MakeInfo(1), digest);
+  DigestCacheEnd(&cache, &claim);
+
+  ThreadJoin(thread);
+
+  EXPECT_TRUE(w.m_Hit);
+  EXPECT_TRUE(w.m_Digest == digest);
+
+  DigestCacheDestroy(&cache);
+}
+
+TEST(DigestCache, FailedClaimPassesOn)
+{
+  DigestCache cache;
+  DigestCacheInit(&cache, MB(1), "this-file-does-not-exist");
+
+  // Nothing was stored, so the next thread to look claims the file itself.
+  HashDigest digest;
+  DigestInFlight claim;
+  ASSERT_FALSE(DigestCacheGetOrBegin(&cache, "foo.dat", 1234, MakeInfo(1), &digest, &claim));
+  DigestCacheEnd(&cache, &claim);
+
+  ASSERT_FALSE(DigestCacheGetOrBegin(&cache, "foo.dat", 1234, MakeInfo(1), &digest, &claim));
+  DigestCacheEnd(&cache, &claim);
+
+  DigestCacheDestroy(&cache);
+}
+
+TEST(DigestCache, StampMustMatch)
+{
+  DigestCache cache;
+  DigestCacheInit(&cache, MB(1), "this-file-does-not-exist");
+
+  const FileInfo info = MakeInfo(1500000000123456789ull);
+  HashDigest digest, result;
+  memset(&digest, 0x5a, sizeof digest);
+  DigestCacheSet(&cache, "foo.dat", 1234, info, digest);
+
+  EXPECT_TRUE(DigestCacheGet(&cache, "foo.dat", 1234, info, &result));
+  EXPECT_TRUE(result == digest);
+
+  // Rewritten within the same second.
+  FileInfo changed = info;
+  changed.m_MtimeNs += 1000;
+  EXPECT_FALSE(DigestCacheGet(&cache, "foo.dat", 1234, changed, &result));
+
+  // Contents changed and mtime restored.
+  changed = info;
+  changed.m_CtimeNs += 1000;
+  EXPECT_FALSE(DigestCacheGet(&cache, "foo.dat", 1234, changed, &result));
+
+  // A different file renamed into place.
+  changed = info;
+  changed.m_Inode += 1;
+  EXPECT_FALSE(DigestCacheGet(&cache, "foo.dat", 1234, changed, &result));
+
+  changed = info;
+  changed.m_Size += 1;
+  EXPECT_FALSE(DigestCacheGet(&cache, "foo.dat", 1234, changed, &result));
+
+  DigestCacheDestroy(&cache);
+}
+
+TEST(DigestCache, SaveAndLoad)
+{
+  const char* fn     = "digestcache-test.tmp";
+  const char* tmp_fn = "digestcache-test.tmp.tmp";
+
+  MemAllocHeap heap;
+  HeapInit(&heap);
+
+  const FileInfo info = MakeInfo(1500000000123456789ull);
+  HashDigest digest, result;
+  memset(&digest, 0x5a, sizeof digest);
+
+  {
+    DigestCache cache;
+    DigestCacheInit(&cache, MB(1), fn);
+    DigestCacheSet(&cache, "foo.dat", 1234, info, digest);
+    ASSERT_TRUE(DigestCacheSave(&cache, &heap, fn, tmp_fn, nullptr));
+    DigestCacheDestroy(&cache);
+  }
+
+  {
+    DigestCache cache;
+    DigestCacheInit(&cache, MB(1), fn);
+    EXPECT_TRUE(DigestCacheGet(&cache, "foo.dat", 1234, info, &result));
+    EXPECT_TRUE(result == digest);
+
+    FileInfo changed = info;
+    changed.m_MtimeNs += 1;
+    EXPECT_FALSE(DigestCacheGet(&cache, "foo.dat", 1234, changed, &result));
+    DigestCacheDestroy(&cache);
+  }
+
+  remove(fn);
+  HeapDestroy(&heap);
+}
+
+TEST(DigestCache, ParallelSave)
+{
+  const char* fn     = "digestcache-parallel-test.tmp";
+  const char* tmp_fn = "digestcache-parallel-test.tmp.tmp";
+
+  // Enough records for several chunks.
+  const int kCount = 10000;
+
+  MemAllocHeap heap;
+  HeapInit(&heap);
+
+  HelperPool helpers;
+  HelperPoolInit(&helpers, 4);
+
+  const FileInfo info = MakeInfo(1500000000123456789ull);
+
+  char names[kCount][32];
+  HashDigest digests[kCount];
+  for (int i = 0; i < kCount; ++i)
+  {
+    snprintf(names[i], sizeof names[i], "file%d.dat", i);
+    memset(&digests[i], i & 0xff, sizeof digests[i]);
+  }
+
+  {
+    DigestCache cache;
+    DigestCacheInit(&cache, MB(4), fn);
+    for (int i = 0; i < kCount; i += 2)
+      DigestCacheSet(&cache, names[i], Djb2HashPath(names[i]), info, digests[i]);
+    ASSERT_TRUE(DigestCacheSave(&cache, &heap, fn, tmp_fn, &helpers));
+    DigestCacheDestroy(&cache);
+  }
+
+  // Add the other half and replace some of the frozen records.
+  {
+    DigestCache cache;
+    DigestCacheInit(&cache, MB(4), fn);
+    for (int i = 0; i < kCount; ++i)
+    {
+      if ((i & 1) || 0 == i % 10)
+      {
+        memset(&digests[i], ~i & 0xff, sizeof digests[i]);
+        DigestCacheSet(&cache, names[i], Djb2HashPath(names[i]), info, digests[i]);
+      }
+    }
+    ASSERT_TRUE(DigestCacheSave(&cache, &heap, fn, tmp_fn, &helpers));
+    DigestCacheDestroy(&cache);
+  }
+
+  {
+    DigestCache cache;
+    DigestCacheInit(&cache, MB(4), fn);
+    ASSERT_NE(nullptr, cache.m_State);
+    EXPECT_EQ(kCount, cache.m_State->m_Records.GetCount());
+
+    for (int i = 0; i < kCount; ++i)
+    {
+      HashDigest result;
+      ASSERT_TRUE(DigestCacheGet(&cache, names[i], Djb2HashPath(names[i]), info, &result));
+      EXPECT_TRUE(result == digests[i]);
+    }
+    DigestCacheDestroy(&cache);
+  }
+
+  remove(fn);
+  HelperPoolDestroy(&helpers);
+  HeapDestroy(&heap);
+}
+
+TEST(DigestCache, WriteThenCommit)
+{
+  const char* fn     = "digestcache-commit-test.tmp";
+  const char* tmp_fn = "digestcache-commit-test.tmp.tmp";
+
+  MemAllocHeap heap;
+  HeapInit(&heap);
+
+  const FileInfo info = MakeInfo(1500000000123456789ull);
+  HashDigest digest, result;
+  memset(&digest, 0x5a, sizeof digest);
+
+  {
+    DigestCache cache;
+    DigestCacheInit(&cache, MB(1), fn);
+    DigestCacheSet(&cache, "foo.dat", 1234, info, digest);
+    ASSERT_TRUE(DigestCacheSave(&cache, &heap, fn, tmp_fn, nullptr));
+    DigestCacheDestroy(&cache);
+  }
+
+  {
+    DigestCache cache;
+    DigestCacheInit(&cache, MB(1), fn);
+
+    // The first hit on a frozen record changes what is saved, later ones don't.
+    uint32_t generation = DigestCacheGeneration(&cache);
+    EXPECT_TRUE(DigestCacheGet(&cache, "foo.dat", 1234, info, &result));
+    EXPECT_NE(generation, DigestCacheGeneration(&cache));
+
+    generation = DigestCacheGeneration(&cache);
+    ASSERT_TRUE(DigestCacheWrite(&cache, &heap, tmp_fn, nullptr));
+    EXPECT_TRUE(DigestCacheGet(&cache, "foo.dat", 1234, info, &result));
+    EXPECT_EQ(generation, DigestCacheGeneration(&cache));
+
+    // The cache is still usable after a write.
+    DigestCacheSet(&cache, "bar.dat", 5678, info, digest);
+    EXPECT_NE(generation, DigestCacheGeneration(&cache));
+    EXPECT_TRUE(DigestCacheGet(&cache, "bar.dat", 5678, info, &result));
+
+    // Only what was there when the file was written is committed.
+    ASSERT_TRUE(DigestCacheCommit(&cache, fn, tmp_fn));
+    DigestCacheDestroy(&cache);
+  }
+
+  {
+    DigestCache cache;
+    DigestCacheInit(&cache, MB(1), fn);
+    EXPECT_TRUE(DigestCacheGet(&cache, "foo.dat", 1234, info, &result));
+    EXPECT_FALSE(DigestCacheGet(&cache, "bar.dat", 5678, info, &result));
+    DigestCacheDestroy(&cache);
+  }
+
+  remove(fn);
+  HeapDestroy(&heap);
+}
+
+TEST(DigestCache, FrozenLookupsAndOverrides)
+{
+  const char* fn     = "digestcache-frozen-test.tmp";
+  const char* tmp_fn = "digestcache-frozen-test.tmp.tmp";
+
+  MemAllocHeap heap;
+  HeapInit(&heap);
+
+  const FileInfo info = MakeInfo(1500000000123456789ull);
+  HashDigest d1, d2, d3, result;
+  memset(&d1, 0x11, sizeof d1);
+  memset(&d2, 0x22, sizeof d2);
+  memset(&d3, 0x33, sizeof d3);
+
+  // A hash of 0, and names that share a hash and so a probe sequence.
+  {
+    DigestCache cache;
+    DigestCacheInit(&cache, MB(1), fn);
+    DigestCacheSet(&cache, "zero.dat", 0, info, d1);
+    DigestCacheSet(&cache, "a.dat", 77, info, d2);
+    DigestCacheSet(&cache, "b.dat", 77, info, d3);
+    ASSERT_TRUE(DigestCacheSave(&cache, &heap, fn, tmp_fn, nullptr));
+    DigestCacheDestroy(&cache);
+  }
+
+  {
+    DigestCache cache;
+    DigestCacheInit(&cache, MB(1), fn);
+    ASSERT_TRUE(DigestCacheGet(&cache, "zero.dat", 0, info, &result));
+    EXPECT_TRUE(result == d1);
+    ASSERT_TRUE(DigestCacheGet(&cache, "a.dat", 77, info, &result));
+    EXPECT_TRUE(result == d2);
+    ASSERT_TRUE(DigestCacheGet(&cache, "b.dat", 77, info, &result));
+    EXPECT_TRUE(result == d3);
+    EXPECT_FALSE(DigestCacheGet(&cache, "c.dat", 77, info, &result));
+    EXPECT_FALSE(DigestCacheGet(&cache, "c.dat", 0, info, &result));
+
+    // A record from this session shadows the frozen one.
+    FileInfo changed = info;
+    changed.m_MtimeNs += 1;
+    DigestCacheSet(&cache, "a.dat", 77, changed, d1);
+    EXPECT_FALSE(DigestCacheGet(&cache, "a.dat", 77, info, &result));
+    ASSERT_TRUE(DigestCacheGet(&cache, "a.dat", 77, changed, &result));
+    EXPECT_TRUE(result == d1);
+    EXPECT_TRUE(DigestCacheHasChanged(&cache, "a.dat", 77));
+    EXPECT_FALSE(DigestCacheHasChanged(&cache, "b.dat", 77));
+
+    ASSERT_TRUE(DigestCacheSave(&cache, &heap, fn, tmp_fn, nullptr));
+    DigestCacheDestroy(&cache);
+  }
+
+  {
+    DigestCache cache;
+    DigestCacheInit(&cache, MB(1), fn);
+    EXPECT_EQ(3, cache.m_State->m_Records.GetCount());
+    FileInfo changed = info;
+    changed.m_MtimeNs += 1;
+    ASSERT_TRUE(DigestCacheGet(&cache, "a.dat", 77, changed, &result));
+    EXPECT_TRUE(result == d1);
+    ASSERT_TRUE(DigestCacheGet(&cache, "zero.dat", 0, info, &result));
+    EXPECT_TRUE(result == d1);
+    DigestCacheDestroy(&cache);
+  }
+
+  remove(fn);
+  HeapDestroy(&heap);
+}
+
+TEST(DigestCache, UnusedRecordsExpire)
+{
+  const char* fn     = "digestcache-expiry-test.tmp";
+  const char* tmp_fn = "digestcache-expiry-test.tmp.tmp";
+
+  MemAllocHeap heap;
+  HeapInit(&heap);
+
+  const FileInfo info = MakeInfo(1500000000123456789ull);
+  HashDigest digest, result;
+  memset(&digest, 0x5a, sizeof digest);
+
+  const uint64_t day = 24 * 60 * 60;
+
+  {
+    DigestCache cache;
+    DigestCacheInit(&cache, MB(1), fn);
+    const uint64_t now = cache.m_AccessTime;
+    cache.m_AccessTime = now - 8 * day;
+    DigestCacheSet(&cache, "old.dat", 1, info, digest);
+    DigestCacheSet(&cache, "used.dat", 2, info, digest);
+    cache.m_AccessTime = now - day;
+    DigestCacheSet(&cache, "recent.dat", 3, info, digest);
+    cache.m_AccessTime = now;
+    ASSERT_TRUE(DigestCacheSave(&cache, &heap, fn, tmp_fn, nullptr));
+    DigestCacheDestroy(&cache);
+  }
+
+  // Records that haven't been used for a week are dropped unless this
+  // session used them.
+  {
+    DigestCache cache;
+    DigestCacheInit(&cache, MB(1), fn);
+    EXPECT_EQ(3, cache.m_State->m_Records.GetCount());
+    EXPECT_TRUE(DigestCacheGet(&cache, "used.dat", 2, info, &result));
+    ASSERT_TRUE(DigestCacheSave(&cache, &heap, fn, tmp_fn, nullptr));
+    DigestCacheDestroy(&cache);
+  }
+
+  {
+    DigestCache cache;
+    DigestCacheInit(&cache, MB(1), fn);
+    EXPECT_EQ(2, cache.m_State->m_Records.GetCount());
+    EXPECT_FALSE(DigestCacheGet(&cache, "old.dat", 1, info, &result));
+    EXPECT_TRUE(DigestCacheGet(&cache, "used.dat", 2, info, &result));
+    EXPECT_TRUE(DigestCacheGet(&cache, "recent.dat", 3, info, &result));
+    DigestCacheDestroy(&cache);
+  }
+
+  remove(fn);
+  HeapDestroy(&heap);
+}
@@ -0,0 +1,223 @@
+#include "FileSign.hpp"
+#include "FileInfo.hpp"
+#include "MemAllocLinear.hpp"
+#include "MemAllocHeap.hpp"
+#include "TestHarness.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <vector>
+
+#if defined(TUNDRA_UNIX)
+#include <sys/time.h>
+#else
+#include <sys/utime.h>
+#endif
+
+using namespace t2;
+
+namespace
+{
+  struct GlobDirRecord
+  {
+    std::string m_Path;
+    uint64_t    m_MtimeNs;
+    HashDigest  m_Digest;
+  };
+
+  struct GlobRecord
+  {
+    std::vector<GlobDirRecord> m_Dirs;
+    HashDigest                 m_Digest;
+  };
+
+  void RecordDirectory(void* user_data, const char* path, uint64_t mtime_ns, const HashDigest& digest)
+  {
+    GlobRecord* record = static_cast<GlobRecord*>(user_data);
+    record->m_Dirs.push_back(GlobDirRecord { path, mtime_ns, digest });
+  }
+
+  void SetMtime(const char* path, time_t seconds)
+  {
+#if defined(TUNDRA_UNIX)
+    struct timeval times[2];
+    times[0].tv_sec  = seconds;
+    times[0].tv_usec = 0;
+    times[1]         = times[0];
+    utimes(path, times);
+#else
+    struct _utimbuf times;
+    times.actime  = seconds;
+    times.modtime = seconds;
+    _utime(path, &times);
+#endif
+  }
+}
+
+class GlobSignatureTest : public ::testing::Test
+{
+protected:
+  MemAllocHeap heap;
+  MemAllocLinear alloc;
+  std::vector<std::string> created;
+  time_t now;
+
+protected:
+  void SetUp() override
+  {
+    HeapInit(&heap);
+    LinearAllocInit(&alloc, &heap, 10 * 1024 * 1024, "Test Allocator");
+    now = time(nullptr);
+    MakeDir("globsign-test.tmp");
+  }
+
+  void TearDown() override
+  {
+    for (size_t i = created.size(); i > 0; --i)
+      RemoveFileOrDir(created[i - 1].c_str());
+
+    LinearAllocDestroy(&alloc);
+    HeapDestroy(&heap);
+  }
+
+  void MakeDir(const char* path)
+  {
+    ASSERT_TRUE(MakeDirectory(path));
+    created.push_back(path);
+  }
+
+  void MakeFile(const char* path)
+  {
+    FILE* f = fopen(path, "w");
+    ASSERT_NE(nullptr, f);
+    fclose(f);
+    created.push_back(path);
+  }
+
+  GlobRecord Record(bool recurse)
+  {
+    GlobRecord record;
+    record.m_Digest = CalculateGlobSignatureFor("globsign-test.tmp", "*.c", recurse, &heap, &alloc, &record, RecordDirectory);
+    return record;
+  }
+
+  bool Changed(const GlobRecord& record, size_t index, bool recurse)
+  {
+    const GlobDirRecord& dir = record.m_Dirs[index];
+    return GlobDirectoryChanged(dir.m_Path.c_str(), dir.m_MtimeNs, dir.m_Digest, "*.c", recurse, &heap, &alloc);
+  }
+};
+
+TEST_F(GlobSignatureTest, RecursedSubdirectoryFileAdded)
+{
+  MakeDir("globsign-test.tmp/sub");
+  MakeFile("globsign-test.tmp/a.c");
+  MakeFile("globsign-test.tmp/sub/b.c");
+  SetMtime("globsign-test.tmp", now - 100);
+  SetMtime("globsign-test.tmp/sub", now - 100);
+
+  GlobRecord before = Record(true);
+  ASSERT_EQ(2u, before.m_Dirs.size());
+  EXPECT_NE(0u, before.m_Dirs[0].m_MtimeNs);
+  EXPECT_NE(0u, before.m_Dirs[1].m_MtimeNs);
+  EXPECT_FALSE(Changed(before, 0, true));
+  EXPECT_FALSE(Changed(before, 1, true));
+
+  MakeFile("globsign-test.tmp/sub/c.c");
+  SetMtime("globsign-test.tmp/sub", now - 50);
+
+  // Only the subdirectory's own record notices.
+  EXPECT_FALSE(Changed(before, 0, true));
+  EXPECT_TRUE(Changed(before, 1, true));
+  EXPECT_NE(before.m_Digest, Record(true).m_Digest);
+}
+
+TEST_F(GlobSignatureTest, RecursedSubdirectoryFileRemoved)
+{
+  MakeDir("globsign-test.tmp/sub");
+  MakeFile("globsign-test.tmp/sub/b.c");
+  MakeFile("globsign-test.tmp/sub/c.c");
+  SetMtime("globsign-test.tmp", now - 100);
+  SetMtime("globsign-test.tmp/sub", now - 100);
+
+  GlobRecord before = Record(true);
+  ASSERT_EQ(2u, before.m_Dirs.size());
+
+  ASSERT_TRUE(RemoveFileOrDir("globsign-test.tmp/sub/c.c"));
+  SetMtime("globsign-test.tmp/sub", now - 50);
+
+  EXPECT_FALSE(Changed(before, 0, true));
+  EXPECT_TRUE(Changed(before, 1, true));
+  EXPECT_NE(before.m_Digest, Record(true).m_Digest);
+}
+
+TEST_F(GlobSignatureTest, NewSubdirectory)
+{
+  MakeFile("globsign-test.tmp/a.c");
+  SetMtime("globsign-test.tmp", now - 100);
+
+  GlobRecord before = Record(true);
+  ASSERT_EQ(1u, before.m_Dirs.size());
+
+  // The new directory doesn't match the filter, but is recursed into.
+  MakeDir("globsign-test.tmp/new");
+  SetMtime("globsign-test.tmp", now - 50);
+
+  EXPECT_TRUE(Changed(before, 0, true));
+
+  GlobRecord after = Record(true);
+  EXPECT_NE(before.m_Digest, after.m_Digest);
+  ASSERT_EQ(2u, after.m_Dirs.size());
+  EXPECT_EQ("globsign-test.tmp/new", after.m_Dirs[1].m_Path);
+}
+
+TEST_F(GlobSignatureTest, RacyMtimeForcesRelist)
+{
+  MakeFile("globsign-test.tmp/a.c");
+  SetMtime("globsign-test.tmp", now);
+
+  GlobRecord before = Record(true);
+  ASSERT_EQ(1u, before.m_Dirs.size());
+  EXPECT_EQ(0u, before.m_Dirs[0].m_MtimeNs);
+
+  // Same mtime as when it was listed, but the listing is redone anyway.
+  MakeFile("globsign-test.tmp/b.c");
+  SetMtime("globsign-test.tmp", now);
+
+  EXPECT_TRUE(Changed(before, 0, true));
+}
+
+TEST_F(GlobSignatureTest, SettledMtimeIsTrusted)
+{
+  MakeFile("globsign-test.tmp/a.c");
+  SetMtime("globsign-test.tmp", now - 100);
+
+  GlobRecord before = Record(true);
+  ASSERT_EQ(1u, before.m_Dirs.size());
+  EXPECT_NE(0u, before.m_Dirs[0].m_MtimeNs);
+
+  // A change that hides behind an unchanged mtime is not relisted.
+  MakeFile("globsign-test.tmp/b.c");
+  SetMtime("globsign-test.tmp", now - 100);
+
+  EXPECT_FALSE(Changed(before, 0, true));
+}
+
+TEST_F(GlobSignatureTest, FilterMissDoesNotInvalidate)
+{
+  MakeFile("globsign-test.tmp/a.c");
+  SetMtime("globsign-test.tmp", now - 100);
+
+  GlobRecord before = Record(false);
+  ASSERT_EQ(1u, before.m_Dirs.size());
+
+  // Neither is part of a non-recursive *.c glob.
+  MakeFile("globsign-test.tmp/readme.txt");
+  MakeDir("globsign-test.tmp/sub");
+  SetMtime("globsign-test.tmp", now - 50);
+
+  EXPECT_FALSE(Changed(before, 0, false));
+  EXPECT_EQ(before.m_Digest, Record(false).m_Digest);
+}
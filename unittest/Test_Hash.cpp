@@ -1,6 +1,12 @@
 #include "Hash.hpp"
+#include "HelperPool.hpp"
 #include "TestHarness.hpp"
+#include <algorithm>
 #include <cstring>
+#include <cstdio>
+#include <functional>
+#include <string>
+#include <vector>
 
 using namespace t2;
 
@@ -103,3 +109,199 @@ TEST(HashTest, CompareLess)
 #endif
 }
 
+
+static std::string ToHex(const uint8_t* data, size_t size)
+{
+  static const char hex[] = "0123456789abcdef";
+  std::string result;
+  for (size_t i = 0; i < size; ++i)
+  {
+    result += hex[data[i] >> 4];
+    result += hex[data[i] & 0xf];
+  }
+  return result;
+}
+
+static std::string Blake3Hex(const void* data, size_t size, size_t out_len)
+{
+  Blake3State s;
+  Blake3Init(&s);
+  Blake3Update(&s, data, size);
+  uint8_t out[64];
+  Blake3Finalize(&s, out, out_len);
+  return ToHex(out, out_len);
+}
+
+static std::vector<uint8_t> Blake3TestInput(size_t size)
+{
+  std::vector<uint8_t> input(size);
+  for (size_t i = 0; i < size; ++i)
+    input[i] = uint8_t(i % 251);
+  return input;
+}
+
+TEST(Blake3Test, KnownVectors)
+{
+  EXPECT_EQ("af1349b9f5f9a1a6a0404dea36dcc9499bcb25c9adc112b7cc9a93cae41f3262", Blake3Hex("", 0, 32));
+  EXPECT_EQ("6437b3ac38465133ffb63b75273a8db548c558465d79db03fd359c6cd5bd9d85", Blake3Hex("abc", 3, 32));
+
+  static const struct { size_t m_Size; const char* m_Hex; } vectors[] =
+  {
+    {    1023, "10108970eeda3eb932baac1428c7a216" },
+    {    1024, "42214739f095a406f3fc83deb889744a" },
+    {    1025, "d00278ae47eb27b34faecf67b4fe263f" },
+    {    2048, "e776b6028c7cd22a4d0ba182a8bf6220" },
+    {    2049, "5f4d72f40d7a5f82b15ca2b2e44b1de3" },
+    {    3072, "b98cb0ff3623be03326b373de6b90952" },
+    {    3073, "7124b49501012f81cc7f11ca069ec922" },
+    {    4096, "015094013f57a5277b59d8475c050104" },
+    {    4097, "9b4052b38f1c5fc8b1f9ff7ac7b27cd2" },
+    {    5120, "9cadc15fed8b5d854562b26a9536d970" },
+    {    8193, "bab6c09cb8ce8cf459261398d2e7aef3" },
+    {   16385, "1dabe216be2578830263b049de1639f3" },
+    {   31751, "c40b37349bf136062d9b600390005e60" },
+    {  102400, "bc3e3d41a1146b069abffad3c0d44860" },
+    { 1000000, "5e82c663d164c54e4fcdfcd70e3ca464" },
+  };
+
+  // The SIMD paths must agree with the scalar one.
+  for (bool simd : { false, true })
+  {
+    Blake3SetSimdEnabled(simd);
+    for (const auto& v : vectors)
+    {
+      std::vector<uint8_t> input = Blake3TestInput(v.m_Size);
+      EXPECT_EQ(v.m_Hex, Blake3Hex(input.data(), input.size(), 16)) << "size " << v.m_Size << " simd " << simd;
+    }
+  }
+  Blake3SetSimdEnabled(true);
+}
+
+TEST(Blake3Test, Streaming)
+{
+  std::vector<uint8_t> input = Blake3TestInput(100000);
+  std::string expected = Blake3Hex(input.data(), input.size(), 32);
+
+  // Piece sizes that straddle block and chunk boundaries.
+  static const size_t pieces[] = { 1, 63, 64, 65, 1023, 1024, 1025, 7000, 16384 };
+  for (size_t piece : pieces)
+  {
+    Blake3State s;
+    Blake3Init(&s);
+    for (size_t pos = 0; pos < input.size(); pos += piece)
+      Blake3Update(&s, input.data() + pos, std::min(piece, input.size() - pos));
+    uint8_t out[32];
+    Blake3Finalize(&s, out, sizeof out);
+    EXPECT_EQ(expected, ToHex(out, sizeof out)) << "piece " << piece;
+  }
+}
+
+struct Blake3SubtreeJob
+{
+  const uint8_t* m_Data;
+  size_t         m_Size;
+  size_t         m_SubtreeSize;
+  uint32_t       m_Cvs[256][8];
+
+  static void Run(void* context, int index)
+  {
+    Blake3SubtreeJob* self = static_cast<Blake3SubtreeJob*>(context);
+    size_t offset = size_t(index) * self->m_SubtreeSize;
+    size_t size = std::min(self->m_SubtreeSize, self->m_Size - offset);
+    Blake3SubtreeCv(self->m_Data + offset, size, offset / kBlake3ChunkSize, self->m_Cvs[index]);
+  }
+
+  int Count() const
+  {
+    return int((m_Size + m_SubtreeSize - 1) / m_SubtreeSize);
+  }
+};
+
+TEST(Blake3Test, Subtrees)
+{
+  static const size_t sizes[] = { 2048, 65536, 65537, 1000000 };
+  static const size_t subtree_chunks[] = { 1, 2, 64, 1024 };
+
+  HelperPool pool;
+  HelperPoolInit(&pool, 4);
+
+  for (size_t size : sizes)
+  {
+    std::vector<uint8_t> input = Blake3TestInput(size);
+    std::string expected = Blake3Hex(input.data(), input.size(), 32);
+
+    for (size_t chunks : subtree_chunks)
+    {
+      Blake3SubtreeJob job;
+      job.m_Data = input.data();
+      job.m_Size = input.size();
+      job.m_SubtreeSize = chunks * kBlake3ChunkSize;
+      if (job.Count() < 2 || job.Count() > 256)
+        continue;
+
+      uint8_t out[32];
+
+      for (int i = 0, count = job.Count(); i < count; ++i)
+        Blake3SubtreeJob::Run(&job, i);
+      Blake3MergeSubtrees(job.m_Cvs, job.Count(), out, sizeof out);
+      EXPECT_EQ(expected, ToHex(out, sizeof out)) << "size " << size << " chunks " << chunks;
+
+      memset(job.m_Cvs, 0, sizeof job.m_Cvs);
+      HelperPoolRun(&pool, Blake3SubtreeJob::Run, &job, job.Count());
+      Blake3MergeSubtrees(job.m_Cvs, job.Count(), out, sizeof out);
+      EXPECT_EQ(expected, ToHex(out, sizeof out)) << "pool, size " << size << " chunks " << chunks;
+    }
+  }
+
+  HelperPoolDestroy(&pool);
+}
+
+TEST(Blake3Test, DISABLED_Throughput)
+{
+  const size_t size = 256 * 1024 * 1024;
+  std::vector<uint8_t> input = Blake3TestInput(size);
+
+  auto measure = [&](const char* name, std::function<void()> fn)
+  {
+    double best = 1e30;
+    for (int rep = 0; rep < 3; ++rep)
+    {
+      uint64_t t0 = TimerGet();
+      fn();
+      double elapsed = TimerDiffSeconds(t0, TimerGet());
+      if (elapsed < best)
+        best = elapsed;
+    }
+    printf("%-16s %8.0f MB/s\n", name, double(size) / best / 1e6);
+  };
+
+  measure("HashUpdate", [&]()
+  {
+    HashState h;
+    HashInit(&h);
+    HashUpdate(&h, input.data(), input.size());
+    HashDigest digest;
+    HashFinalize(&h, &digest);
+  });
+
+  uint8_t out[32];
+
+  Blake3SetSimdEnabled(false);
+  measure("blake3 scalar", [&]() { Blake3Hex(input.data(), input.size(), 16); });
+  Blake3SetSimdEnabled(true);
+  measure("blake3 simd", [&]() { Blake3Hex(input.data(), input.size(), 16); });
+
+  HelperPool pool;
+  HelperPoolInit(&pool, GetCpuCount());
+  Blake3SubtreeJob* job = new Blake3SubtreeJob;
+  job->m_Data = input.data();
+  job->m_Size = input.size();
+  job->m_SubtreeSize = 1024 * kBlake3ChunkSize;
+  measure("blake3 parallel", [&]()
+  {
+    HelperPoolRun(&pool, Blake3SubtreeJob::Run, job, job->Count());
+    Blake3MergeSubtrees(job->m_Cvs, job->Count(), out, sizeof out);
+  });
+  delete job;
+  HelperPoolDestroy(&pool);
+}
@@ -174,3 +174,226 @@ TEST_F(HashSetTest, MultiDistinctCaseFolded)
   }
   HashSetDestroy(&tbl);
 }
+
+TEST_F(HashTableTest, ZeroHash)
+{
+  HashTable<int, kFlagCaseSensitive> tbl;
+  HashTableInit(&tbl, &heap);
+  HashTableInsert(&tbl, 0, "zero", 7);
+  int* ptr = HashTableLookup(&tbl, 0, "zero");
+  ASSERT_NE(nullptr, ptr);
+  EXPECT_EQ(7, *ptr);
+  EXPECT_EQ(nullptr, HashTableLookup(&tbl, 0, "zerO"));
+  HashTableDestroy(&tbl);
+}
+
+TEST_F(HashTableTest, CollidingHashes)
+{
+  HashTable<int, kFlagCaseSensitive> tbl;
+  HashTableInit(&tbl, &heap);
+
+  // Every key has the same hash, and many have the same length, so lookups
+  // have to walk the whole probe sequence and compare the strings.
+  for (int i = 0; i < 500; ++i)
+  {
+    char str[128];
+    sprintf(str, "bar%03d", i);
+    HashTableInsert(&tbl, 12345, StrDup(&alloc, str), i);
+  }
+  ASSERT_EQ(500, tbl.m_RecordCount);
+
+  for (int i = 0; i < 500; ++i)
+  {
+    char str[128];
+    sprintf(str, "bar%03d", i);
+    int* ptr = HashTableLookup(&tbl, 12345, str);
+    ASSERT_NE(nullptr, ptr);
+    EXPECT_EQ(i, *ptr);
+  }
+
+  EXPECT_EQ(nullptr, HashTableLookup(&tbl, 12345, "bar500"));
+  EXPECT_EQ(nullptr, HashTableLookup(&tbl, 12345, "bar00"));
+  EXPECT_EQ(nullptr, HashTableLookup(&tbl, 12345, "bar0000"));
+  HashTableDestroy(&tbl);
+}
+
+TEST_F(HashTableTest, PrepareBulkInsert)
+{
+  HashTable<int, kFlagCaseSensitive> tbl;
+  HashTableInit(&tbl, &heap);
+
+  HashTablePrepareBulkInsert(&tbl, 3000);
+  const uint32_t table_size = tbl.m_TableSize;
+  EXPECT_LE(3000u, table_size);
+
+  for (int i = 0; i < 3000; ++i)
+  {
+    char str[128];
+    sprintf(str, "foo%d", i);
+    HashTableInsert(&tbl, Djb2Hash(str), StrDup(&alloc, str), i);
+  }
+
+  // No rehashing along the way.
+  EXPECT_EQ(table_size, tbl.m_TableSize);
+
+  // Reserving room that is already there is a no-op.
+  HashTablePrepareBulkInsert(&tbl, 0);
+  EXPECT_EQ(table_size, tbl.m_TableSize);
+
+  for (int i = 0; i < 3000; ++i)
+  {
+    char str[128];
+    sprintf(str, "foo%d", i);
+    int* ptr = HashTableLookup(&tbl, Djb2Hash(str), str);
+    ASSERT_NE(nullptr, ptr);
+    EXPECT_EQ(i, *ptr);
+  }
+
+  // Growing a populated table keeps its records.
+  HashTablePrepareBulkInsert(&tbl, 10000);
+  EXPECT_LT(table_size, tbl.m_TableSize);
+
+  for (int i = 0; i < 3000; ++i)
+  {
+    char str[128];
+    sprintf(str, "foo%d", i);
+    int* ptr = HashTableLookup(&tbl, Djb2Hash(str), str);
+    ASSERT_NE(nullptr, ptr);
+    EXPECT_EQ(i, *ptr);
+  }
+  HashTableDestroy(&tbl);
+}
+
+TEST_F(HashTableTest, Walk)
+{
+  HashTable<int, kFlagCaseSensitive> tbl;
+  HashTableInit(&tbl, &heap);
+
+  const int kCount = 1000;
+  for (int i = 0; i < kCount; ++i)
+  {
+    char str[128];
+    sprintf(str, "foo%d", i);
+    HashTableInsert(&tbl, Djb2Hash(str), StrDup(&alloc, str), i);
+  }
+
+  int seen[kCount] = { 0 };
+  uint32_t next_index = 0;
+  HashTableWalk(&tbl, [&](uint32_t index, uint32_t hash, const char* str, int value)
+  {
+    EXPECT_EQ(next_index++, index);
+    EXPECT_EQ(Djb2Hash(str), hash);
+    ASSERT_TRUE(value >= 0 && value < kCount);
+    seen[value]++;
+  });
+
+  for (int i = 0; i < kCount; ++i)
+    EXPECT_EQ(1, seen[i]);
+
+  HashTableDestroy(&tbl);
+}
+
+TEST_F(HashSetTest, MissesCaseFolded)
+{
+  HashSet<kFlagCaseInsensitive> tbl;
+  HashSetInit(&tbl, &heap);
+  HashSetInsert(&tbl, 1, "Foo/Bar.h");
+  HashSetInsert(&tbl, 1, "Foo/Baz.h");
+
+  EXPECT_TRUE(HashSetLookup(&tbl, 1, "FOO/BAR.H"));
+  EXPECT_TRUE(HashSetLookup(&tbl, 1, "foo/baz.h"));
+  EXPECT_FALSE(HashSetLookup(&tbl, 1, "foo/bar.hh"));
+  EXPECT_FALSE(HashSetLookup(&tbl, 1, "foo/bax.h"));
+  EXPECT_FALSE(HashSetLookup(&tbl, 2, "foo/bar.h"));
+  HashSetDestroy(&tbl);
+}
+
+// Throughput benchmark. Run with --gtest_also_run_disabled_tests.
+TEST_F(HashTableTest, DISABLED_Throughput)
+{
+  const int kCount = 1 << 20;
+
+  MemAllocLinear bench_alloc;
+  LinearAllocInit(&bench_alloc, &heap, 256 * 1024 * 1024, "Benchmark Allocator");
+
+  // Paths of the kind the stat and digest caches see. Lookups use copies of
+  // the keys so the pointer shortcut doesn't kick in.
+  const char** keys = HeapAllocateArray<const char*>(&heap, kCount);
+  const char** copies = HeapAllocateArray<const char*>(&heap, kCount);
+  const char** misses = HeapAllocateArray<const char*>(&heap, kCount);
+  uint32_t* hashes = HeapAllocateArray<uint32_t>(&heap, kCount);
+  uint32_t* miss_hashes = HeapAllocateArray<uint32_t>(&heap, kCount);
+  int* order = HeapAllocateArray<int>(&heap, kCount);
+
+  for (int i = 0; i < kCount; ++i)
+  {
+    char str[128];
+    sprintf(str, "t2-output/linux-gcc-debug/src/module%d/source_file_%d.o", i % 97, i);
+    keys[i] = StrDup(&bench_alloc, str);
+    copies[i] = StrDup(&bench_alloc, str);
+    hashes[i] = Djb2HashPath(str);
+    sprintf(str, "t2-output/linux-gcc-debug/src/module%d/source_file_%d.d", i % 97, i);
+    misses[i] = StrDup(&bench_alloc, str);
+    miss_hashes[i] = Djb2HashPath(str);
+    order[i] = i;
+  }
+
+  // Look keys up in a different order than they were inserted in. Consecutive
+  // keys have nearby hashes, which would flatter tables indexed by the low
+  // hash bits.
+  for (int i = kCount - 1; i > 0; --i)
+    std::swap(order[i], order[(uint64_t(i) * 2654435761u + 12345) % uint64_t(i + 1)]);
+
+  double best_insert = 1e30, best_bulk = 1e30, best_hit = 1e30, best_miss = 1e30;
+
+  for (int rep = 0; rep < 5; ++rep)
+  {
+    HashTable<int, kFlagPathStrings> tbl;
+
+    HashTableInit(&tbl, &heap);
+    uint64_t t0 = TimerGet();
+    for (int i = 0; i < kCount; ++i)
+      HashTableInsert(&tbl, hashes[i], keys[i], i);
+    best_insert = std::min(best_insert, TimerDiffSeconds(t0, TimerGet()));
+    HashTableDestroy(&tbl);
+
+    HashTableInit(&tbl, &heap);
+    t0 = TimerGet();
+    HashTablePrepareBulkInsert(&tbl, kCount);
+    for (int i = 0; i < kCount; ++i)
+      HashTableInsert(&tbl, hashes[i], keys[i], i);
+    best_bulk = std::min(best_bulk, TimerDiffSeconds(t0, TimerGet()));
+
+    int found = 0;
+    t0 = TimerGet();
+    for (int i = 0; i < kCount; ++i)
+    {
+      if (int* value = HashTableLookup(&tbl, hashes[order[i]], copies[order[i]]))
+        found += *value == order[i];
+    }
+    best_hit = std::min(best_hit, TimerDiffSeconds(t0, TimerGet()));
+    EXPECT_EQ(kCount, found);
+
+    found = 0;
+    t0 = TimerGet();
+    for (int i = 0; i < kCount; ++i)
+      found += nullptr != HashTableLookup(&tbl, miss_hashes[order[i]], misses[order[i]]);
+    best_miss = std::min(best_miss, TimerDiffSeconds(t0, TimerGet()));
+    EXPECT_EQ(0, found);
+
+    HashTableDestroy(&tbl);
+  }
+
+  printf("insert       %8.1f ns\n", best_insert * 1e9 / kCount);
+  printf("bulk insert  %8.1f ns\n", best_bulk * 1e9 / kCount);
+  printf("lookup hit   %8.1f ns\n", best_hit * 1e9 / kCount);
+  printf("lookup miss  %8.1f ns\n", best_miss * 1e9 / kCount);
+
+  HeapFree(&heap, order);
+  HeapFree(&heap, miss_hashes);
+  HeapFree(&heap, hashes);
+  HeapFree(&heap, misses);
+  HeapFree(&heap, copies);
+  HeapFree(&heap, keys);
+  LinearAllocDestroy(&bench_alloc);
+}
@@ -1,8 +1,15 @@
 #include "IncludeScanner.hpp"
 #include "MemAllocLinear.hpp"
 #include "MemAllocHeap.hpp"
+#include "Buffer.hpp"
 #include "TestHarness.hpp"
 
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
 using namespace t2;
 
 class IncludeScannerTest : public ::testing::Test
@@ -114,3 +121,392 @@ TEST_F(IncludeScannerTest, MultiIncludes)
   ASSERT_EQ(true, incs->m_ShouldFollow);
   ASSERT_EQ(nullptr, incs->m_Next);
 }
+
+TEST_F(IncludeScannerTest, RespectsLength)
+{
+  // Data from memory mapped files is not terminated; nothing past len may be read.
+  const char data[] = "#include <a.h>\n#include <b.h>";
+
+  IncludeData* incs = ScanIncludesCpp(data, 15, &alloc);
+  ASSERT_NE(nullptr, incs);
+  ASSERT_STREQ("a.h", incs->m_String);
+  ASSERT_EQ(nullptr, incs->m_Next);
+
+  incs = ScanIncludesCpp(data, 13, &alloc);
+  ASSERT_EQ(nullptr, incs);
+}
+
+static const IncludeScanMode::Enum s_ScanModes[] =
+{
+  IncludeScanMode::kScalar,
+  IncludeScanMode::kSse2,
+  IncludeScanMode::kAvx2,
+};
+
+static const char* s_ScanModeNames[] = { "auto", "scalar", "sse2", "avx2" };
+
+// Scan data with every supported code path and check that they all agree with
+// the scalar reference scanner.
+static void ExpectModesAgree(MemAllocLinear* alloc, const char* data, size_t len)
+{
+  IncludeData* ref = ScanIncludesCppWithMode(data, len, alloc, IncludeScanMode::kScalar);
+
+  for (IncludeScanMode::Enum mode : s_ScanModes)
+  {
+    if (!IncludeScanModeSupported(mode))
+      continue;
+
+    SCOPED_TRACE(s_ScanModeNames[mode]);
+
+    IncludeData* a = ref;
+    IncludeData* b = ScanIncludesCppWithMode(data, len, alloc, mode);
+
+    while (a && b)
+    {
+      ASSERT_EQ(a->m_StringLen, b->m_StringLen);
+      ASSERT_STREQ(a->m_String, b->m_String);
+      ASSERT_EQ(a->m_IsSystemInclude, b->m_IsSystemInclude);
+      ASSERT_EQ(a->m_ShouldFollow, b->m_ShouldFollow);
+      a = a->m_Next;
+      b = b->m_Next;
+    }
+
+    ASSERT_EQ(nullptr, a);
+    ASSERT_EQ(nullptr, b);
+  }
+}
+
+TEST_F(IncludeScannerTest, ModesAgreeOnBlockBoundaries)
+{
+  // Slide an include across the 64 byte block boundaries used by the SIMD paths.
+  char data[512];
+  for (int pad = 0; pad < 200; ++pad)
+  {
+    int len = 0;
+    for (int i = 0; i < pad; ++i)
+      data[len++] = (i % 17) == 16 ? '\n' : ' ';
+    len += snprintf(data + len, sizeof data - len, "#include <x%d.h>\nint a; # b\n  #include \"y.h\"", pad);
+    ExpectModesAgree(&alloc, data, len);
+  }
+}
+
+TEST_F(IncludeScannerTest, ModesAgreeOnRandomInput)
+{
+  static const char* fragments[] =
+  {
+    "#include <a.h>",
+    "  #  include \"b/c.h\"",
+    "\t#include<nospace.h>",
+    "#include <unterminated.h",
+    "#include \"unterminated.h",
+    "# include\t<tab.h>  // trailing",
+    "int x = a # b;",
+    "#define FOO(x) #x",
+    "// #include <commented.h>",
+    "#",
+    "##",
+    "",
+    "\r",
+    " \f\v ",
+    "#include <crlf.h>\r",
+    "static const char* s = \"################################################################\";",
+    "#include <over/a/block/boundary/with/a/really/long/path/name/that/keeps/going/and/going.h>",
+    "#if defined(FOO) && defined(BAR) && defined(BAZ) && defined(QUUX) && defined(FROB) && 1",
+  };
+
+  const int fragment_count = int(sizeof fragments / sizeof fragments[0]);
+  uint32_t seed = 0x1234567;
+  Buffer<char> text;
+  BufferInit(&text);
+
+  for (int iter = 0; iter < 500; ++iter)
+  {
+    BufferClear(&text);
+    seed = seed * 1103515245 + 12345;
+    int line_count = (seed >> 16) % 64;
+
+    for (int i = 0; i < line_count; ++i)
+    {
+      seed = seed * 1103515245 + 12345;
+      const char* frag = fragments[(seed >> 16) % fragment_count];
+      BufferAppend(&text, &heap, frag, strlen(frag));
+      if (i + 1 < line_count || (seed & 0x100))
+        BufferAppendOne(&text, &heap, '\n');
+    }
+    BufferAppendOne(&text, &heap, '\0');
+
+    ExpectModesAgree(&alloc, text.m_Storage, text.m_Size - 1);
+    LinearAllocReset(&alloc);
+  }
+
+  BufferDestroy(&text, &heap);
+}
+
+TEST_F(IncludeScannerTest, ModesStopAtEmbeddedNul)
+{
+  char data[] = "#include <a.h>\n#include <b.h>\0\n#include <c.h>\n";
+  ExpectModesAgree(&alloc, data, sizeof data - 1);
+
+  IncludeData* incs = ScanIncludesCpp(data, sizeof data - 1, &alloc);
+  ASSERT_NE(nullptr, incs);
+  ASSERT_NE(nullptr, incs->m_Next);
+  ASSERT_EQ(nullptr, incs->m_Next->m_Next);
+}
+
+// Throughput benchmark. Run with --gtest_also_run_disabled_tests.
+TEST_F(IncludeScannerTest, DISABLED_Throughput)
+{
+  // A typical translation unit: a block of includes followed by code.
+  static const char* header[] =
+  {
+    "#include <stdio.h>",
+    "#include <string.h>",
+    "#include \"Common.hpp\"",
+    "#include \"MemAllocHeap.hpp\"",
+  };
+
+  static const char* body[] =
+  {
+    "static int Frobnicate(const char* name, int count)",
+    "{",
+    "  for (int i = 0; i < count; ++i)",
+    "    printf(\"%s %d\\n\", name, i);",
+    "  return count * 2; // trailing comment with a # in it",
+    "}",
+    "",
+    "#if defined(FOO)",
+    "  int long_variable_name_for_testing_purposes = some_function_call(argument_one, argument_two);",
+    "#endif",
+  };
+
+  const size_t target_size = 64 * 1024 * 1024;
+  Buffer<char> text;
+  BufferInitWithCapacity(&text, &heap, target_size + 4096);
+
+  while (text.m_Size < target_size)
+  {
+    for (const char* line : header)
+    {
+      BufferAppend(&text, &heap, line, strlen(line));
+      BufferAppendOne(&text, &heap, '\n');
+    }
+
+    for (int i = 0; i < 20; ++i)
+    {
+      for (const char* line : body)
+      {
+        BufferAppend(&text, &heap, line, strlen(line));
+        BufferAppendOne(&text, &heap, '\n');
+      }
+    }
+  }
+  BufferAppendOne(&text, &heap, '\0');
+
+  MemAllocLinear bench_alloc;
+  LinearAllocInit(&bench_alloc, &heap, 256 * 1024 * 1024, "Benchmark Allocator");
+
+  for (int m = IncludeScanMode::kScalar; m <= IncludeScanMode::kAvx2; ++m)
+  {
+    IncludeScanMode::Enum mode = IncludeScanMode::Enum(m);
+    if (!IncludeScanModeSupported(mode))
+      continue;
+
+    double best = 1e30;
+    for (int rep = 0; rep < 5; ++rep)
+    {
+      LinearAllocReset(&bench_alloc);
+      uint64_t t0 = TimerGet();
+      ScanIncludesCppWithMode(text.m_Storage, text.m_Size - 1, &bench_alloc, mode);
+      double elapsed = TimerDiffSeconds(t0, TimerGet());
+      if (elapsed < best)
+        best = elapsed;
+    }
+
+    printf("%-8s %8.2f GB/s\n", s_ScanModeNames[mode], double(text.m_Size) / best / 1e9);
+  }
+
+  LinearAllocDestroy(&bench_alloc);
+  BufferDestroy(&text, &heap);
+}
+
+// Run the preprocessing scanner and return the included names separated by spaces.
+static std::string ScanPreprocessed(MemAllocLinear* alloc, MemAllocHeap* heap, const char* data, std::initializer_list<const char*> defines = {})
+{
+  std::vector<const char*> defs(defines);
+  IncludeData* incs = ScanIncludesCppPreprocessor(data, strlen(data), alloc, heap, defs.data(), (int) defs.size());
+
+  std::string result;
+  for (; incs; incs = incs->m_Next)
+  {
+    if (!result.empty())
+      result += ' ';
+    result += incs->m_String;
+  }
+  return result;
+}
+
+TEST_F(IncludeScannerTest, PreprocessorIfZero)
+{
+  ASSERT_EQ("b.h", ScanPreprocessed(&alloc, &heap,
+    "#if 0\n"
+    "#include <a.h>\n"
+    "#endif\n"
+    "#include <b.h>\n"));
+}
+
+TEST_F(IncludeScannerTest, PreprocessorUnknownIsKept)
+{
+  ASSERT_EQ("a.h b.h", ScanPreprocessed(&alloc, &heap,
+    "#ifdef FOO\n"
+    "#include <a.h>\n"
+    "#else\n"
+    "#include <b.h>\n"
+    "#endif\n"));
+}
+
+TEST_F(IncludeScannerTest, PreprocessorKnownUndefined)
+{
+  ASSERT_EQ("unistd.h", ScanPreprocessed(&alloc, &heap,
+    "#ifdef _WIN32\n"
+    "#include <windows.h>\n"
+    "#else\n"
+    "#include <unistd.h>\n"
+    "#endif\n", { "!_WIN32" }));
+}
+
+TEST_F(IncludeScannerTest, PreprocessorValuesAndElif)
+{
+  const char* data =
+    "#if VER >= 4\n"
+    "#include <new.h>\n"
+    "#elif VER == 3\n"
+    "#include <three.h>\n"
+    "#else\n"
+    "#include <old.h>\n"
+    "#endif\n";
+
+  ASSERT_EQ("three.h", ScanPreprocessed(&alloc, &heap, data, { "VER=3" }));
+  ASSERT_EQ("new.h", ScanPreprocessed(&alloc, &heap, data, { "VER=0x10" }));
+  ASSERT_EQ("new.h three.h old.h", ScanPreprocessed(&alloc, &heap, data, { "VER=abc" }));
+  ASSERT_EQ("new.h three.h old.h", ScanPreprocessed(&alloc, &heap, data));
+}
+
+TEST_F(IncludeScannerTest, PreprocessorDefinedExpressions)
+{
+  ASSERT_EQ("ab.h bc.h", ScanPreprocessed(&alloc, &heap,
+    "#if defined(A) && !defined(B)\n"
+    "#include <ab.h>\n"
+    "#endif\n"
+    "#if defined B || defined(C)\n"
+    "#include <bc.h>\n"
+    "#endif\n"
+    "#if defined(B) && defined(C)\n"
+    "#include <none.h>\n"
+    "#endif\n", { "A", "!B" }));
+}
+
+TEST_F(IncludeScannerTest, PreprocessorNestedInactive)
+{
+  ASSERT_EQ("", ScanPreprocessed(&alloc, &heap,
+    "#if 0\n"
+    "#ifdef X\n"
+    "#include <a.h>\n"
+    "#else\n"
+    "#include <b.h>\n"
+    "#endif\n"
+    "#endif\n"));
+}
+
+TEST_F(IncludeScannerTest, PreprocessorIncludeGuardKeepsLocalDefines)
+{
+  // Without guard detection the #ifndef would be unknown, making USE_X unknown too.
+  ASSERT_EQ("y.h", ScanPreprocessed(&alloc, &heap,
+    "#ifndef GUARD_H\n"
+    "#define GUARD_H\n"
+    "#define USE_X 0\n"
+    "#if USE_X\n"
+    "#include <x.h>\n"
+    "#endif\n"
+    "#include <y.h>\n"
+    "#endif\n"));
+}
+
+TEST_F(IncludeScannerTest, PreprocessorLeadingIfndefThatIsNotAGuard)
+{
+  ASSERT_EQ("", ScanPreprocessed(&alloc, &heap,
+    "#ifndef FOO\n"
+    "#include <a.h>\n"
+    "#endif\n", { "FOO" }));
+}
+
+TEST_F(IncludeScannerTest, PreprocessorUnsupportedExpressionIsKept)
+{
+  // Arithmetic, function-like macros and continuation lines all count as unknown.
+  ASSERT_EQ("a.h b.h c.h", ScanPreprocessed(&alloc, &heap,
+    "#if A + 1\n"
+    "#include <a.h>\n"
+    "#endif\n"
+    "#if CHECK(1)\n"
+    "#include <b.h>\n"
+    "#endif\n"
+    "#if defined(A) && \\\n"
+    "    defined(B)\n"
+    "#include <c.h>\n"
+    "#endif\n", { "!A", "!B" }));
+}
+
+TEST_F(IncludeScannerTest, PreprocessorIncludeForgetsLocalDefines)
+{
+  // cfg.h may redefine FOO, so only the scanner defines are still known after it.
+  ASSERT_EQ("cfg.h x.h", ScanPreprocessed(&alloc, &heap,
+    "#define FOO 0\n"
+    "#include \"cfg.h\"\n"
+    "#if FOO\n"
+    "#include \"x.h\"\n"
+    "#endif\n"
+    "#if BAR\n"
+    "#include \"y.h\"\n"
+    "#endif\n", { "BAR=0" }));
+
+  ASSERT_EQ("cfg.h x.h", ScanPreprocessed(&alloc, &heap,
+    "#undef FOO\n"
+    "#include \"cfg.h\"\n"
+    "#ifdef FOO\n"
+    "#include \"x.h\"\n"
+    "#endif\n"));
+
+  // An include that is known to be skipped can't change anything.
+  ASSERT_EQ("", ScanPreprocessed(&alloc, &heap,
+    "#define FOO 0\n"
+    "#if FOO\n"
+    "#include \"cfg.h\"\n"
+    "#endif\n"
+    "#if FOO\n"
+    "#include \"x.h\"\n"
+    "#endif\n"));
+}
+
+TEST_F(IncludeScannerTest, PreprocessorSkipsBlockComments)
+{
+  ASSERT_EQ("a.h b.h d.h", ScanPreprocessed(&alloc, &heap,
+    "/*\n"
+    "#if 0\n"
+    "*/\n"
+    "#include <a.h>\n"
+    "/* #endif */\n"
+    "#include <b.h> /* starts here\n"
+    "#if 0\n"
+    "#include <c.h>\n"
+    " and ends here */\n"
+    "#include <d.h>\n"));
+
+  // Comment markers in line comments and literals don't count.
+  ASSERT_EQ("a.h", ScanPreprocessed(&alloc, &heap,
+    "// not a comment /*\n"
+    "const char* s = \"/*\";\n"
+    "char c = '\"';\n"
+    "#if 0\n"
+    "#include <b.h>\n"
+    "#endif\n"
+    "#include <a.h>\n"));
+}
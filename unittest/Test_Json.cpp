@@ -3,6 +3,8 @@
 #include "MemAllocLinear.hpp"
 #include "MemAllocHeap.hpp"
 
+#include <string>
+
 using namespace t2;
 
 class JsonTest : public ::testing::Test
@@ -150,3 +152,383 @@ TEST_F(JsonTest, Doubles)
   ASSERT_DOUBLE_EQ(array->m_Values[2]->AsNumber()->m_Number, -1.0e10);
   ASSERT_DOUBLE_EQ(array->m_Values[3]->AsNumber()->m_Number, 5e7);
 }
+
+struct JsonEventLog
+{
+  char m_Text[1024];
+  int  m_StopAfter;
+
+  static bool Callback(void* user_data, const JsonEvent& event)
+  {
+    JsonEventLog* self = static_cast<JsonEventLog*>(user_data);
+    char line[128];
+
+    switch (event.m_Type)
+    {
+      case kJsonEventBeginObject: snprintf(line, sizeof line, "%d@%d {", event.m_Depth, (int) event.m_Offset); break;
+      case kJsonEventEndObject:   snprintf(line, sizeof line, "%d@%d }", event.m_Depth, (int) event.m_Offset); break;
+      case kJsonEventBeginArray:  snprintf(line, sizeof line, "%d@%d [", event.m_Depth, (int) event.m_Offset); break;
+      case kJsonEventEndArray:    snprintf(line, sizeof line, "%d@%d ]", event.m_Depth, (int) event.m_Offset); break;
+      case kJsonEventKey:         snprintf(line, sizeof line, "%d@%d key:%s", event.m_Depth, (int) event.m_Offset, event.m_String); break;
+      case kJsonEventString:      snprintf(line, sizeof line, "%d@%d str:%s", event.m_Depth, (int) event.m_Offset, event.m_String); break;
+      case kJsonEventNumber:      snprintf(line, sizeof line, "%d@%d num:%g", event.m_Depth, (int) event.m_Offset, event.m_Number); break;
+      case kJsonEventBoolean:     snprintf(line, sizeof line, "%d@%d bool:%d", event.m_Depth, (int) event.m_Offset, event.m_Boolean); break;
+      case kJsonEventNull:        snprintf(line, sizeof line, "%d@%d null", event.m_Depth, (int) event.m_Offset); break;
+    }
+
+    strncat(self->m_Text, line, sizeof(self->m_Text) - strlen(self->m_Text) - 2);
+    strcat(self->m_Text, "\n");
+
+    return --self->m_StopAfter != 0;
+  }
+};
+
+TEST_F(JsonTest, SaxEvents)
+{
+  const char input[] = "{\"a\": [1, \"x\"], \"b\": {\"c\": null}, \"d\": false}";
+  JsonEventLog log = { "", -1 };
+
+  ASSERT_TRUE(JsonSaxParse(input, strlen(input), &heap, &log, JsonEventLog::Callback, error_msg));
+  ASSERT_STREQ("", error_msg);
+  ASSERT_STREQ(
+      "0@0 {\n"
+      "1@1 key:a\n"
+      "1@6 [\n"
+      "2@7 num:1\n"
+      "2@10 str:x\n"
+      "1@13 ]\n"
+      "1@16 key:b\n"
+      "1@21 {\n"
+      "2@22 key:c\n"
+      "2@27 null\n"
+      "1@31 }\n"
+      "1@34 key:d\n"
+      "1@39 bool:0\n"
+      "0@44 }\n",
+      log.m_Text);
+}
+
+TEST_F(JsonTest, SaxUnterminatedInput)
+{
+  // Only the first value is part of the input; the parser must not look past
+  // the given size.
+  const char input[] = "[\"a\\tb\", 12.5]garbage";
+  JsonEventLog log = { "", -1 };
+
+  ASSERT_TRUE(JsonSaxParse(input, 14, &heap, &log, JsonEventLog::Callback, error_msg));
+  ASSERT_STREQ("0@0 [\n1@1 str:a\tb\n1@9 num:12.5\n0@13 ]\n", log.m_Text);
+
+  // A number or string running into the end of the input.
+  JsonEventLog log2 = { "", -1 };
+  ASSERT_TRUE(JsonSaxParse("123456", 3, &heap, &log2, JsonEventLog::Callback, error_msg));
+  ASSERT_STREQ("0@0 num:123\n", log2.m_Text);
+
+  JsonEventLog log3 = { "", -1 };
+  ASSERT_FALSE(JsonSaxParse("\"abc\"", 4, &heap, &log3, JsonEventLog::Callback, error_msg));
+  ASSERT_STREQ("line 1: end of file inside string", error_msg);
+}
+
+TEST_F(JsonTest, SaxErrors)
+{
+  JsonEventLog log = { "", -1 };
+  const char input[] = "{\"a\": 1\n \"b\": 2}";
+  ASSERT_FALSE(JsonSaxParse(input, strlen(input), &heap, &log, JsonEventLog::Callback, error_msg));
+  ASSERT_STREQ("line 2: expected ','", error_msg);
+
+  JsonEventLog log2 = { "", -1 };
+  ASSERT_FALSE(JsonSaxParse("[tru]", 5, &heap, &log2, JsonEventLog::Callback, error_msg));
+  ASSERT_STREQ("line 1: invalid literal, expected one of false, true or null", error_msg);
+
+  JsonEventLog log3 = { "", -1 };
+  ASSERT_FALSE(JsonSaxParse("[1] 2", 5, &heap, &log3, JsonEventLog::Callback, error_msg));
+  ASSERT_STREQ("line 1: data after document", error_msg);
+}
+
+TEST_F(JsonTest, SaxStoppedByCallback)
+{
+  const char input[] = "[1, 2, 3]";
+  JsonEventLog log = { "", 2 };
+
+  ASSERT_FALSE(JsonSaxParse(input, strlen(input), &heap, &log, JsonEventLog::Callback, error_msg));
+  ASSERT_STREQ("0@0 [\n1@1 num:1\n", log.m_Text);
+  ASSERT_STREQ("line 1: stopped by event handler", error_msg);
+}
+
+TEST_F(JsonTest, BuilderReuse)
+{
+  struct Collector
+  {
+    JsonBuilder      m_Builder;
+    const JsonValue* m_Values[4];
+    int              m_Count;
+
+    static bool Callback(void* user_data, const JsonEvent& event)
+    {
+      Collector* self = static_cast<Collector*>(user_data);
+      // Build each element of the top-level array on its own.
+      if (event.m_Depth == 0)
+        return true;
+      if (const JsonValue* v = JsonBuilderAdd(&self->m_Builder, event))
+        self->m_Values[self->m_Count++] = v;
+      return true;
+    }
+  };
+
+  const char input[] = "[{\"k\": [\"v\"]}, 7, {}, [[]]]";
+
+  Collector c;
+  JsonBuilderInit(&c.m_Builder, &heap, &alloc);
+  c.m_Count = 0;
+
+  ASSERT_TRUE(JsonSaxParse(input, strlen(input), &heap, &c, Collector::Callback, error_msg));
+  JsonBuilderDestroy(&c.m_Builder);
+
+  ASSERT_EQ(4, c.m_Count);
+  ASSERT_EQ(JsonValue::kObject, c.m_Values[0]->m_Type);
+  ASSERT_STREQ("v", c.m_Values[0]->Find("k")->Elem(0)->GetString());
+  ASSERT_EQ(7, int(c.m_Values[1]->GetNumber()));
+  ASSERT_EQ(0, c.m_Values[2]->AsObject()->m_Count);
+  ASSERT_EQ(1, c.m_Values[3]->AsArray()->m_Count);
+  ASSERT_EQ(0, c.m_Values[3]->Elem(0)->AsArray()->m_Count);
+}
+
+static const char* s_LexModeNames[] = { "auto", "scalar", "sse2", "avx2" };
+
+// Records every event as text, with its depth and offset.
+static bool AppendEventText(void* user_data, const JsonEvent& event)
+{
+  std::string* text = static_cast<std::string*>(user_data);
+  char line[64];
+  snprintf(line, sizeof line, "%d %d %d %g %d:", int(event.m_Type), event.m_Depth, int(event.m_Offset), event.m_Number, int(event.m_Boolean));
+  *text += line;
+  if (event.m_String)
+    text->append(event.m_String, event.m_Length);
+  *text += '\n';
+  return true;
+}
+
+// Parse data with every supported lexer and check that they all agree with
+// the scalar reference lexer, including on errors.
+static void ExpectLexModesAgree(MemAllocHeap* heap, const char* data, size_t len)
+{
+  std::string ref_events;
+  char        ref_error[1024];
+  bool        ref_ok = JsonSaxParseWithMode(data, len, heap, &ref_events, AppendEventText, ref_error, JsonLexMode::kScalar);
+
+  for (int m = JsonLexMode::kSse2; m <= JsonLexMode::kAvx2; ++m)
+  {
+    JsonLexMode::Enum mode = JsonLexMode::Enum(m);
+    if (!JsonLexModeSupported(mode))
+      continue;
+
+    SCOPED_TRACE(s_LexModeNames[mode]);
+
+    std::string events;
+    char        error[1024];
+    bool        ok = JsonSaxParseWithMode(data, len, heap, &events, AppendEventText, error, mode);
+
+    ASSERT_EQ(ref_ok, ok);
+    ASSERT_STREQ(ref_error, error);
+    ASSERT_EQ(ref_events, events);
+  }
+}
+
+// Strings and whitespace runs of every length around the block size, with
+// escapes and newlines at every position in them.
+static std::string BlockBoundaryDocument()
+{
+  std::string doc = "{\"a\": [";
+
+  for (int len = 0; len < 140; ++len)
+  {
+    if (len > 0)
+      doc += ",";
+
+    for (int i = 0; i < len; ++i)
+      doc += (i % 37 == 5) ? "\n" : " ";
+
+    doc += "\"";
+    for (int i = 0; i < len; ++i)
+    {
+      if (i % 29 == len % 29)
+        doc += "\\\"";
+      else if (i % 53 == 7)
+        doc += "\\u0041";
+      else
+        doc += char('a' + i % 26);
+    }
+    doc += "\"";
+  }
+
+  doc += "\t\r\n], \"b\": {\"x\" : -1.5e3, \"y\":true, \"z\"\n:null}}";
+  return doc;
+}
+
+TEST_F(JsonTest, LexModesAgree)
+{
+  std::string doc = BlockBoundaryDocument();
+  ExpectLexModesAgree(&heap, doc.data(), doc.size());
+
+  // Every other place the document can end, which hits the end of the input
+  // inside strings, whitespace and tokens.
+  for (size_t len = 0; len < doc.size(); len += 3)
+  {
+    SCOPED_TRACE(len);
+    ExpectLexModesAgree(&heap, doc.data(), len);
+  }
+}
+
+TEST_F(JsonTest, LexModesCountLines)
+{
+  // The error is reported on the line the whitespace skip ends on.
+  std::string doc = "[1,";
+  for (int i = 0; i < 300; ++i)
+    doc += (i % 3) ? "  " : " \n";
+  doc += "x]";
+
+  for (int m = JsonLexMode::kScalar; m <= JsonLexMode::kAvx2; ++m)
+  {
+    JsonLexMode::Enum mode = JsonLexMode::Enum(m);
+    if (!JsonLexModeSupported(mode))
+      continue;
+
+    SCOPED_TRACE(s_LexModeNames[mode]);
+
+    std::string events;
+    ASSERT_FALSE(JsonSaxParseWithMode(doc.data(), doc.size(), &heap, &events, AppendEventText, error_msg, mode));
+    ASSERT_STREQ("line 101: invalid literal, expected one of false, true or null", error_msg);
+  }
+}
+
+// Records the events of a parse, as the Lua frontend would write them.
+static bool RecordEvent(void* user_data, const JsonEvent& event)
+{
+  JsonEventRecorder* rec = static_cast<JsonEventRecorder*>(user_data);
+  switch (event.m_Type)
+  {
+    case kJsonEventBeginObject: JsonRecordBeginObject(rec); break;
+    case kJsonEventEndObject:   JsonRecordEndObject(rec); break;
+    case kJsonEventBeginArray:  JsonRecordBeginArray(rec); break;
+    case kJsonEventEndArray:    JsonRecordEndArray(rec); break;
+    case kJsonEventKey:         JsonRecordKey(rec, event.m_String, event.m_Length); break;
+    case kJsonEventString:      JsonRecordString(rec, event.m_String, event.m_Length); break;
+    case kJsonEventNumber:      JsonRecordNumber(rec, event.m_Number); break;
+    case kJsonEventBoolean:     JsonRecordBoolean(rec, event.m_Boolean); break;
+    case kJsonEventNull:        JsonRecordNull(rec); break;
+  }
+  return true;
+}
+
+// Like AppendEventText, without the offsets, which are positions in the
+// recording on replay.
+static bool AppendEventTextNoOffset(void* user_data, const JsonEvent& event)
+{
+  JsonEvent copy = event;
+  copy.m_Offset = 0;
+  return AppendEventText(user_data, copy);
+}
+
+TEST_F(JsonTest, ReplayMatchesParse)
+{
+  std::string doc = BlockBoundaryDocument();
+
+  std::string parsed;
+  ASSERT_TRUE(JsonSaxParse(doc.data(), doc.size(), &heap, &parsed, AppendEventTextNoOffset, error_msg));
+
+  JsonEventRecorder rec;
+  JsonRecorderInit(&rec, &heap);
+  ASSERT_TRUE(JsonSaxParse(doc.data(), doc.size(), &heap, &rec, RecordEvent, error_msg));
+
+  std::string replayed;
+  ASSERT_TRUE(JsonEventReplay(rec.m_Data.m_Storage, rec.m_Data.m_Size, &heap, &replayed, AppendEventTextNoOffset, error_msg));
+  ASSERT_STREQ("", error_msg);
+  ASSERT_EQ(parsed, replayed);
+
+  JsonRecorderDestroy(&rec);
+}
+
+TEST_F(JsonTest, ReplayErrors)
+{
+  JsonEventRecorder rec;
+  JsonRecorderInit(&rec, &heap);
+  JsonRecordBeginObject(&rec);
+  JsonRecordKey(&rec, "abc", 3);
+  JsonRecordString(&rec, "x", 1);
+  JsonRecordString(&rec, "y", 1);
+  JsonRecordEndObject(&rec);
+
+  std::string events;
+  ASSERT_FALSE(JsonEventReplay(rec.m_Data.m_Storage, rec.m_Data.m_Size, &heap, &events, AppendEventText, error_msg));
+  ASSERT_STREQ("offset 11: value without key in object", error_msg);
+
+  // Cut off inside the key.
+  ASSERT_FALSE(JsonEventReplay(rec.m_Data.m_Storage, 4, &heap, &events, AppendEventText, error_msg));
+  ASSERT_STREQ("offset 1: truncated string", error_msg);
+
+  // Cut off after the first member.
+  ASSERT_FALSE(JsonEventReplay(rec.m_Data.m_Storage, 11, &heap, &events, AppendEventText, error_msg));
+  ASSERT_STREQ("offset 11: unexpected end of recording", error_msg);
+
+  JsonRecorderDestroy(&rec);
+  JsonRecorderInit(&rec, &heap);
+  JsonRecordBeginArray(&rec);
+  JsonRecordEndObject(&rec);
+  ASSERT_FALSE(JsonEventReplay(rec.m_Data.m_Storage, rec.m_Data.m_Size, &heap, &events, AppendEventText, error_msg));
+  ASSERT_STREQ("offset 1: unbalanced end of object", error_msg);
+  JsonRecorderDestroy(&rec);
+}
+
+static bool IgnoreEvent(void*, const JsonEvent&)
+{
+  return true;
+}
+
+// Throughput benchmark. Run with --gtest_also_run_disabled_tests.
+TEST_F(JsonTest, DISABLED_Throughput)
+{
+  // Shaped like the frontend's DAG output: indented node objects with long
+  // command lines, file lists and dependency indices.
+  const size_t target_size = 64 * 1024 * 1024;
+  std::string doc;
+  doc.reserve(target_size + 4096);
+  doc += "{\n \"Nodes\": [\n";
+
+  char node[2048];
+  for (int i = 0; doc.size() < target_size; ++i)
+  {
+    snprintf(node, sizeof node,
+        "  {\n"
+        "   \"Action\": \"gcc -c -g -O2 -Wall -DTUNDRA_VERSION=\\\"2.0\\\" -Isrc -Ilua/src -o t2-output/linux-gcc-debug/obj%d.o src/module%d/file%d.cpp\",\n"
+        "   \"Annotation\": \"Cc t2-output/linux-gcc-debug/obj%d.o\",\n"
+        "   \"PassIndex\": 0,\n"
+        "   \"Deps\": [\n    %d,\n    %d\n   ],\n"
+        "   \"Inputs\": [\n    \"src/module%d/file%d.cpp\"\n   ],\n"
+        "   \"Outputs\": [\n    \"t2-output/linux-gcc-debug/obj%d.o\"\n   ],\n"
+        "   \"ScannerIndex\": 0,\n"
+        "   \"OverwriteOutputs\": true\n"
+        "  },\n",
+        i, i % 64, i, i, i / 2, i / 3, i % 64, i, i);
+    doc += node;
+  }
+
+  doc += "  {}\n ]\n}\n";
+
+  for (int m = JsonLexMode::kScalar; m <= JsonLexMode::kAvx2; ++m)
+  {
+    JsonLexMode::Enum mode = JsonLexMode::Enum(m);
+    if (!JsonLexModeSupported(mode))
+      continue;
+
+    double best = 1e30;
+    for (int rep = 0; rep < 5; ++rep)
+    {
+      uint64_t t0 = TimerGet();
+      ASSERT_TRUE(JsonSaxParseWithMode(doc.data(), doc.size(), &heap, nullptr, IgnoreEvent, error_msg, mode));
+      double elapsed = TimerDiffSeconds(t0, TimerGet());
+      if (elapsed < best)
+        best = elapsed;
+    }
+
+    printf("%-8s %8.0f MB/s\n", s_LexModeNames[mode], double(doc.size()) / best / 1e6);
+  }
+}
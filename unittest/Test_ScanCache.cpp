@@ -0,0 +1,221 @@
+#include "ScanCache.hpp"
+#include "ScanData.hpp"
+#include "MemAllocHeap.hpp"
+#include "MemAllocLinear.hpp"
+#include "MemoryMappedFile.hpp"
+#include "HelperPool.hpp"
+#include "TestHarness.hpp"
+#include <cstdio>
+
+using namespace t2;
+
+class ScanCacheTest : public ::testing::Test
+{
+protected:
+  MemAllocHeap     heap;
+  MemAllocLinear   alloc;
+  MemAllocLinear   scratch;
+  MemoryMappedFile mapping;
+  HashDigest       scanner_guid;
+
+  static const char* CacheFile() { return "scancache-test.tmp"; }
+
+protected:
+  void SetUp() override
+  {
+    HeapInit(&heap);
+    LinearAllocInit(&alloc, &heap, MB(4), "scan cache alloc");
+    LinearAllocInit(&scratch, &heap, MB(4), "scan cache save alloc");
+    MmapFileInit(&mapping);
+    HashSingleString(&scanner_guid, "scanner");
+  }
+
+  void TearDown() override
+  {
+    MmapFileDestroy(&mapping);
+    remove(CacheFile());
+    LinearAllocDestroy(&scratch);
+    LinearAllocDestroy(&alloc);
+    HeapDestroy(&heap);
+  }
+
+  HashDigest KeyFor(int i)
+  {
+    char fn[64];
+    snprintf(fn, sizeof fn, "file%d.h", i);
+    HashDigest key;
+    ComputeScanCacheKey(&key, fn, scanner_guid);
+    return key;
+  }
+
+  // Saves the cache and maps the result back in as frozen data.
+  const ScanData* SaveAndLoad(ScanCache* cache, HelperPool* helpers = nullptr)
+  {
+    EXPECT_TRUE(ScanCacheSave(cache, CacheFile(), &heap, helpers));
+    MmapFileMap(&mapping, CacheFile());
+    EXPECT_TRUE(MmapFileValid(&mapping));
+    const ScanData* data = (const ScanData*) mapping.m_Address;
+    EXPECT_TRUE(ScanData::MagicNumber == data->m_MagicNumber);
+    return data;
+  }
+};
+
+TEST_F(ScanCacheTest, FrozenLookup)
+{
+  const int kCount = 1000;
+
+  ScanCache cache;
+  ScanCacheInit(&cache, &heap, &scratch);
+
+  for (int i = 0; i < kCount; ++i)
+  {
+    char inc[64];
+    snprintf(inc, sizeof inc, "include%d.h", i);
+    const char* includes[] = { inc, "common.h" };
+    ScanCacheInsert(&cache, KeyFor(i), i, includes, 1 + (i & 1));
+  }
+
+  const ScanData* data = SaveAndLoad(&cache);
+  ScanCacheDestroy(&cache);
+
+  ASSERT_EQ(kCount, data->m_EntryCount);
+  ASSERT_EQ((1 << data->m_BucketBits) + 1, data->m_Buckets.GetCount());
+
+  ScanCache frozen;
+  ScanCacheInit(&frozen, &heap, &alloc);
+  ScanCacheSetCache(&frozen, data);
+
+  for (int i = 0; i < kCount; ++i)
+  {
+    ScanCacheLookupResult result;
+    ASSERT_TRUE(ScanCacheLookup(&frozen, KeyFor(i), i, &result));
+    ASSERT_NE(nullptr, result.m_FrozenIncludedFiles);
+    ASSERT_EQ(1 + (i & 1), result.m_IncludedFileCount);
+
+    char inc[64];
+    snprintf(inc, sizeof inc, "include%d.h", i);
+    EXPECT_STREQ(inc, result.m_FrozenIncludedFiles[0].m_Filename.Get());
+    EXPECT_EQ(Djb2HashPath(inc), result.m_FrozenIncludedFiles[0].m_FilenameHash);
+
+    // Stale timestamp.
+    EXPECT_FALSE(ScanCacheLookup(&frozen, KeyFor(i), i + 1, &result));
+  }
+
+  ScanCacheLookupResult result;
+  EXPECT_FALSE(ScanCacheLookup(&frozen, KeyFor(kCount), 0, &result));
+
+  ScanCacheDestroy(&frozen);
+}
+
+TEST_F(ScanCacheTest, NewRecordsShadowFrozen)
+{
+  ScanCache cache;
+  ScanCacheInit(&cache, &heap, &scratch);
+  const char* old_includes[] = { "old.h" };
+  ScanCacheInsert(&cache, KeyFor(1), 1, old_includes, 1);
+  const ScanData* data = SaveAndLoad(&cache);
+  ScanCacheDestroy(&cache);
+
+  ScanCache frozen;
+  ScanCacheInit(&frozen, &heap, &alloc);
+  ScanCacheSetCache(&frozen, data);
+
+  // The file changed since the cache was saved.
+  const char* new_includes[] = { "new.h" };
+  ScanCacheInsert(&frozen, KeyFor(1), 2, new_includes, 1);
+
+  ScanCacheLookupResult result;
+  ASSERT_TRUE(ScanCacheLookup(&frozen, KeyFor(1), 2, &result));
+  ASSERT_EQ(nullptr, result.m_FrozenIncludedFiles);
+  ASSERT_EQ(1, result.m_IncludedFileCount);
+  EXPECT_STREQ("new.h", result.m_IncludedFiles[0].m_Filename);
+
+  ScanCacheDestroy(&frozen);
+}
+
+TEST_F(ScanCacheTest, EmptyCache)
+{
+  ScanCache cache;
+  ScanCacheInit(&cache, &heap, &scratch);
+  const ScanData* data = SaveAndLoad(&cache);
+  ScanCacheDestroy(&cache);
+
+  ASSERT_EQ(0, data->m_EntryCount);
+
+  ScanCache frozen;
+  ScanCacheInit(&frozen, &heap, &alloc);
+  ScanCacheSetCache(&frozen, data);
+
+  ScanCacheLookupResult result;
+  EXPECT_FALSE(ScanCacheLookup(&frozen, KeyFor(0), 0, &result));
+
+  ScanCacheDestroy(&frozen);
+}
+
+TEST_F(ScanCacheTest, ParallelSave)
+{
+  // Enough records for several chunks.
+  const int kCount = 20000;
+
+  HelperPool helpers;
+  HelperPoolInit(&helpers, 4);
+
+  ScanCache cache;
+  ScanCacheInit(&cache, &heap, &scratch);
+
+  for (int i = 0; i < kCount; i += 2)
+  {
+    char inc[64];
+    snprintf(inc, sizeof inc, "include%d.h", i % 100);
+    const char* includes[] = { inc, "common.h" };
+    ScanCacheInsert(&cache, KeyFor(i), i, includes, 2);
+  }
+
+  const ScanData* data = SaveAndLoad(&cache, &helpers);
+  ScanCacheDestroy(&cache);
+
+  // Merge the other half with the frozen records.
+  ScanCache merged;
+  ScanCacheInit(&merged, &heap, &scratch);
+  ScanCacheSetCache(&merged, data);
+
+  for (int i = 1; i < kCount; i += 2)
+  {
+    const char* includes[] = { "common.h" };
+    ScanCacheInsert(&merged, KeyFor(i), i, includes, 1);
+  }
+
+  MemoryMappedFile old_mapping = mapping;
+  MmapFileInit(&mapping);
+  data = SaveAndLoad(&merged, &helpers);
+  MmapFileDestroy(&old_mapping);
+  ScanCacheDestroy(&merged);
+
+  ASSERT_EQ(kCount, data->m_EntryCount);
+
+  for (int i = 1; i < kCount; ++i)
+    ASSERT_TRUE(data->m_Keys[i - 1] < data->m_Keys[i]);
+
+  ScanCache frozen;
+  ScanCacheInit(&frozen, &heap, &alloc);
+  ScanCacheSetCache(&frozen, data);
+
+  for (int i = 0; i < kCount; ++i)
+  {
+    ScanCacheLookupResult result;
+    ASSERT_TRUE(ScanCacheLookup(&frozen, KeyFor(i), i, &result));
+    ASSERT_EQ(2 - (i & 1), result.m_IncludedFileCount);
+
+    const char* last = result.m_FrozenIncludedFiles[result.m_IncludedFileCount - 1].m_Filename;
+    EXPECT_STREQ("common.h", last);
+  }
+
+  // Strings are shared across chunks, so there is one copy of each name.
+  ScanCacheLookupResult first, second;
+  ASSERT_TRUE(ScanCacheLookup(&frozen, KeyFor(0), 0, &first));
+  ASSERT_TRUE(ScanCacheLookup(&frozen, KeyFor(kCount - 1), kCount - 1, &second));
+  EXPECT_EQ(first.m_FrozenIncludedFiles[1].m_Filename.Get(), second.m_FrozenIncludedFiles[0].m_Filename.Get());
+
+  ScanCacheDestroy(&frozen);
+  HelperPoolDestroy(&helpers);
+}
@@ -0,0 +1,190 @@
+#include "StateImplicitTable.hpp"
+#include "StateData.hpp"
+#include "BinaryWriter.hpp"
+#include "MemAllocLinear.hpp"
+#include "MemAllocHeap.hpp"
+#include "TestHarness.hpp"
+
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+using namespace t2;
+
+namespace
+{
+  // Just the parts of NodeStateData and StateData the table writes.
+  struct TestNode
+  {
+    int32_t            m_ImplicitInputCount;
+    FrozenPtr<uint8_t> m_ImplicitInputIndices;
+  };
+
+  struct TestState
+  {
+    FrozenPtr<TestNode>        m_Nodes;
+    FrozenArray<StateFileData> m_ImplicitFiles;
+  };
+}
+
+class StateImplicitTableTest : public ::testing::Test
+{
+protected:
+  MemAllocHeap       heap;
+  MemAllocLinear     alloc;
+  BinaryWriter       writer;
+  StateImplicitTable table;
+  Buffer<uint8_t>    data;
+  BinarySegment*     main_seg;
+  BinarySegment*     state_seg;
+  BinarySegment*     file_seg;
+  BinarySegment*     index_seg;
+  BinarySegment*     string_seg;
+
+protected:
+  void SetUp() override
+  {
+    HeapInit(&heap);
+    LinearAllocInit(&alloc, &heap, 10 * 1024 * 1024, "Test Allocator");
+    BinaryWriterInit(&writer, &heap);
+    main_seg   = BinaryWriterAddSegment(&writer);
+    state_seg  = BinaryWriterAddSegment(&writer);
+    file_seg   = BinaryWriterAddSegment(&writer);
+    index_seg  = BinaryWriterAddSegment(&writer);
+    string_seg = BinaryWriterAddSegment(&writer);
+    BinarySegmentWritePointer(main_seg, BinarySegmentPosition(state_seg));
+    StateImplicitTableInit(&table, &heap, &alloc);
+    BufferInit(&data);
+  }
+
+  void TearDown() override
+  {
+    BufferDestroy(&data, &heap);
+    StateImplicitTableDestroy(&table);
+    BinaryWriterDestroy(&writer);
+    LinearAllocDestroy(&alloc);
+    HeapDestroy(&heap);
+  }
+
+  const TestState* Write()
+  {
+    StateImplicitTableWrite(&table, main_seg, file_seg, index_seg, string_seg);
+    BinaryWriterFlushToBuffer(&writer, &data, &heap);
+    return reinterpret_cast<const TestState*>(data.m_Storage);
+  }
+
+  static std::vector<const StateFileData*> Inputs(const TestState* state, int node_index)
+  {
+    const TestNode& node = state->m_Nodes[node_index];
+    const StateFileData* files = state->m_ImplicitFiles.GetArray();
+
+    std::vector<const StateFileData*> result;
+    StateImplicitInputs::Iterator it(files, node.m_ImplicitInputIndices, node.m_ImplicitInputCount);
+    StateImplicitInputs::Iterator end(files, nullptr, 0);
+    for (; it != end; ++it)
+      result.push_back(&*it);
+    return result;
+  }
+};
+
+TEST_F(StateImplicitTableTest, MultiByteDeltas)
+{
+  // Hashes in insertion order, so the table isn't reordered.
+  char name[32];
+  for (uint32_t i = 0; i < 20000; ++i)
+  {
+    snprintf(name, sizeof name, "file%05u.h", i);
+    if (i == 0)
+      StateImplicitListBegin(&table, state_seg, 5);
+    if (i == 0 || i == 5 || i == 133 || i == 16517 || i == 19999)
+      StateImplicitListAdd(&table, name, i, 1);
+    else
+      StateImplicitFileIndex(&table, name, i, 1);
+  }
+
+  const TestState* state = Write();
+  ASSERT_EQ(20000, state->m_ImplicitFiles.GetCount());
+
+  std::vector<const StateFileData*> inputs = Inputs(state, 0);
+  ASSERT_EQ(5u, inputs.size());
+  EXPECT_STREQ("file00000.h", inputs[0]->m_Filename);
+  EXPECT_STREQ("file00005.h", inputs[1]->m_Filename);
+  EXPECT_STREQ("file00133.h", inputs[2]->m_Filename);
+  EXPECT_STREQ("file16517.h", inputs[3]->m_Filename);
+  EXPECT_STREQ("file19999.h", inputs[4]->m_Filename);
+
+  // Deltas 0, 5, 128, 16384 and 3482 take 1, 1, 2, 3 and 2 bytes.
+  const uint8_t* bytes = state->m_Nodes[0].m_ImplicitInputIndices;
+  const uint8_t expected[] = { 0x00, 0x05, 0x80, 0x01, 0x80, 0x80, 0x01, 0x9a, 0x1b };
+  EXPECT_EQ(0, memcmp(expected, bytes, sizeof expected));
+}
+
+TEST_F(StateImplicitTableTest, DuplicateIndices)
+{
+  StateImplicitListBegin(&table, state_seg, 3);
+  StateImplicitListAdd(&table, "b.h", 2, 7);
+  StateImplicitListAdd(&table, "a.h", 1, 7);
+  StateImplicitListAdd(&table, "b.h", 2, 7);
+
+  const TestState* state = Write();
+  ASSERT_EQ(2, state->m_ImplicitFiles.GetCount());
+
+  std::vector<const StateFileData*> inputs = Inputs(state, 0);
+  ASSERT_EQ(3u, inputs.size());
+  EXPECT_STREQ("a.h", inputs[0]->m_Filename);
+  EXPECT_STREQ("b.h", inputs[1]->m_Filename);
+  EXPECT_EQ(inputs[1], inputs[2]);
+}
+
+TEST_F(StateImplicitTableTest, EmptyList)
+{
+  StateImplicitListBegin(&table, state_seg, 0);
+  StateImplicitListBegin(&table, state_seg, 1);
+  StateImplicitListAdd(&table, "a.h", 1, 7);
+  StateImplicitListBegin(&table, state_seg, 0);
+
+  const TestState* state = Write();
+  ASSERT_EQ(1, state->m_ImplicitFiles.GetCount());
+
+  EXPECT_EQ(nullptr, state->m_Nodes[0].m_ImplicitInputIndices.Get());
+  EXPECT_EQ(0u, Inputs(state, 0).size());
+  EXPECT_EQ(1u, Inputs(state, 1).size());
+  EXPECT_EQ(0u, Inputs(state, 2).size());
+}
+
+TEST_F(StateImplicitTableTest, NoFiles)
+{
+  StateImplicitListBegin(&table, state_seg, 0);
+
+  const TestState* state = Write();
+  EXPECT_EQ(0, state->m_ImplicitFiles.GetCount());
+  EXPECT_EQ(nullptr, state->m_ImplicitFiles.GetArray());
+  EXPECT_EQ(0u, Inputs(state, 0).size());
+}
+
+TEST_F(StateImplicitTableTest, SameFileAtTwoTimestamps)
+{
+  StateImplicitListBegin(&table, state_seg, 2);
+  StateImplicitListAdd(&table, "common.h", 5, 200);
+  StateImplicitListAdd(&table, "a.h", 1, 7);
+  StateImplicitListBegin(&table, state_seg, 2);
+  StateImplicitListAdd(&table, "common.h", 5, 100);
+  StateImplicitListAdd(&table, "a.h", 1, 7);
+
+  const TestState* state = Write();
+  ASSERT_EQ(3, state->m_ImplicitFiles.GetCount());
+
+  std::vector<const StateFileData*> first = Inputs(state, 0);
+  std::vector<const StateFileData*> second = Inputs(state, 1);
+  ASSERT_EQ(2u, first.size());
+  ASSERT_EQ(2u, second.size());
+
+  EXPECT_EQ(first[0], second[0]);
+  EXPECT_STREQ("a.h", first[0]->m_Filename);
+
+  EXPECT_STREQ("common.h", first[1]->m_Filename);
+  EXPECT_EQ(200u, first[1]->m_Timestamp);
+  EXPECT_STREQ("common.h", second[1]->m_Filename);
+  EXPECT_EQ(100u, second[1]->m_Timestamp);
+  EXPECT_EQ(5u, second[1]->m_FilenameHash);
+}
@@ -0,0 +1,175 @@
+#include "StateJournal.hpp"
+#include "BinaryData.hpp"
+#include "MemAllocHeap.hpp"
+#include "TestHarness.hpp"
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+using namespace t2;
+
+namespace
+{
+  struct TestRecord
+  {
+    uint32_t     m_Value;
+    FrozenString m_Name;
+  };
+}
+
+class StateJournalTest : public ::testing::Test
+{
+protected:
+  MemAllocHeap    heap;
+  StateJournal    journal;
+  Buffer<uint8_t> data;
+  Buffer<size_t>  offsets;
+
+  // The journal goes next to this.
+  static const char* StateFile() { return "statejournal-test.state"; }
+
+protected:
+  void SetUp() override
+  {
+    HeapInit(&heap);
+    StateJournalInit(&journal, &heap, StateFile());
+    BufferInit(&data);
+    BufferInit(&offsets);
+    remove(journal.m_FileName);
+  }
+
+  void TearDown() override
+  {
+    StateJournalRemove(&journal);
+    BufferDestroy(&offsets, &heap);
+    BufferDestroy(&data, &heap);
+    StateJournalDestroy(&journal);
+    HeapDestroy(&heap);
+  }
+
+  // Appends a record whose name is in a second segment, like the driver's.
+  void AppendRecord(uint32_t value, const char* name)
+  {
+    BinaryWriter* writer = &journal.m_Writer;
+    if (0 == writer->m_Segments.m_Size)
+    {
+      BinaryWriterAddSegment(writer);
+      BinaryWriterAddSegment(writer);
+    }
+
+    BinarySegment* main_seg   = writer->m_Segments[0];
+    BinarySegment* string_seg = writer->m_Segments[1];
+
+    BinarySegmentWriteUint32(main_seg, value);
+    BinarySegmentWritePointer(main_seg, BinarySegmentPosition(string_seg));
+    BinarySegmentWriteStringData(string_seg, name);
+
+    MutexLock(&journal.m_Mutex);
+    EXPECT_TRUE(StateJournalAppend(&journal));
+    MutexUnlock(&journal.m_Mutex);
+  }
+
+  const TestRecord* Record(size_t index)
+  {
+    return reinterpret_cast<const TestRecord*>(data.m_Storage + offsets[index]);
+  }
+
+  std::vector<uint8_t> ReadFile()
+  {
+    std::vector<uint8_t> bytes;
+    FILE* f = fopen(journal.m_FileName, "rb");
+    if (!f)
+      return bytes;
+    uint8_t buffer[256];
+    while (size_t n = fread(buffer, 1, sizeof buffer, f))
+      bytes.insert(bytes.end(), buffer, buffer + n);
+    fclose(f);
+    return bytes;
+  }
+
+  void WriteFile(const std::vector<uint8_t>& bytes)
+  {
+    FILE* f = fopen(journal.m_FileName, "wb");
+    ASSERT_NE(nullptr, f);
+    fwrite(bytes.data(), 1, bytes.size(), f);
+    fclose(f);
+  }
+};
+
+TEST_F(StateJournalTest, NoJournal)
+{
+  ASSERT_FALSE(StateJournalRead(journal.m_FileName, &heap, &data, &offsets));
+  ASSERT_EQ(0u, offsets.m_Size);
+}
+
+TEST_F(StateJournalTest, FileNameFollowsStateFile)
+{
+  ASSERT_STREQ("statejournal-test.state.journal", journal.m_FileName);
+}
+
+TEST_F(StateJournalTest, RecordsReadBack)
+{
+  AppendRecord(1, "first");
+  AppendRecord(2, "second");
+  ASSERT_EQ(2u, journal.m_RecordCount);
+
+  ASSERT_TRUE(StateJournalRead(journal.m_FileName, &heap, &data, &offsets));
+  ASSERT_EQ(2u, offsets.m_Size);
+
+  ASSERT_EQ(0u, offsets[0] % 16);
+  ASSERT_EQ(0u, offsets[1] % 16);
+  ASSERT_EQ(1u, Record(0)->m_Value);
+  ASSERT_STREQ("first", Record(0)->m_Name);
+  ASSERT_EQ(2u, Record(1)->m_Value);
+  ASSERT_STREQ("second", Record(1)->m_Name);
+}
+
+TEST_F(StateJournalTest, TornRecordIsIgnored)
+{
+  AppendRecord(1, "first");
+  AppendRecord(2, "second");
+
+  std::vector<uint8_t> bytes = ReadFile();
+  bytes.resize(bytes.size() - 5);
+  WriteFile(bytes);
+
+  ASSERT_TRUE(StateJournalRead(journal.m_FileName, &heap, &data, &offsets));
+  ASSERT_EQ(1u, offsets.m_Size);
+  ASSERT_EQ(1u, Record(0)->m_Value);
+  ASSERT_STREQ("first", Record(0)->m_Name);
+}
+
+TEST_F(StateJournalTest, CorruptRecordEndsJournal)
+{
+  AppendRecord(1, "first");
+  AppendRecord(2, "second");
+  AppendRecord(3, "third");
+
+  ASSERT_TRUE(StateJournalRead(journal.m_FileName, &heap, &data, &offsets));
+  ASSERT_EQ(3u, offsets.m_Size);
+
+  // Flip a bit in the second record's payload.
+  std::vector<uint8_t> bytes = ReadFile();
+  bytes[offsets[1]] ^= 0x10;
+  WriteFile(bytes);
+
+  BufferClear(&data);
+  BufferClear(&offsets);
+  ASSERT_TRUE(StateJournalRead(journal.m_FileName, &heap, &data, &offsets));
+  ASSERT_EQ(1u, offsets.m_Size);
+  ASSERT_EQ(1u, Record(0)->m_Value);
+}
+
+TEST_F(StateJournalTest, RemoveDeletesJournal)
+{
+  AppendRecord(1, "first");
+  StateJournalRemove(&journal);
+  ASSERT_EQ(0u, journal.m_RecordCount);
+  ASSERT_FALSE(StateJournalRead(journal.m_FileName, &heap, &data, &offsets));
+
+  // Appending again starts a new journal.
+  AppendRecord(2, "second");
+  ASSERT_TRUE(StateJournalRead(journal.m_FileName, &heap, &data, &offsets));
+  ASSERT_EQ(1u, offsets.m_Size);
+  ASSERT_EQ(2u, Record(0)->m_Value);
+}